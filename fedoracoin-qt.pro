@@ -207,16 +207,20 @@ HEADERS += src/qt/bitcoingui.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
+    src/sha256.h \
     src/uint256.h \
     src/serialize.h \
     src/main.h \
     src/net.h \
     src/key.h \
+    src/secp256k1.h \
     src/db.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
     src/bloom.h \
+    src/blockencodings.h \
+    src/blocktimings.h \
     src/mruset.h \
     src/checkqueue.h \
     src/json/json_spirit_writer_template.h \
@@ -291,13 +295,17 @@ SOURCES += src/qt/bitcoin.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/sha256.cpp \
     src/netbase.cpp \
     src/key.cpp \
+    src/secp256k1.cpp \
     src/script.cpp \
     src/main.cpp \
     src/init.cpp \
     src/net.cpp \
     src/bloom.cpp \
+    src/blockencodings.cpp \
+    src/blocktimings.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
     src/db.cpp \
@@ -388,6 +396,26 @@ QMAKE_EXTRA_COMPILERS += gccsse2
 SOURCES_SSE2 += src/scrypt-sse2.cpp
 }
 
+# SHA-256 kernels for x86, chosen at runtime; pass USE_SHA256_X86=0 to leave them out
+isEmpty(USE_SHA256_X86):contains(QMAKE_HOST.arch, "x86|x86_64|i.86"):USE_SHA256_X86=1
+contains(USE_SHA256_X86, 1) {
+DEFINES += USE_SHA256_X86
+HEADERS += src/sha256_lanes.h
+gccsse41.input  = SOURCES_SSE41
+gccsse41.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccsse41.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -msse4.1 -mstackrealign
+gccavx2.input  = SOURCES_AVX2
+gccavx2.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccavx2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -mavx -mavx2 -mstackrealign
+gccshani.input  = SOURCES_SHANI
+gccshani.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccshani.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -msse4.1 -msha -mstackrealign
+QMAKE_EXTRA_COMPILERS += gccsse41 gccavx2 gccshani
+SOURCES_SSE41 += src/sha256-sse41.cpp
+SOURCES_AVX2 += src/sha256-avx2.cpp
+SOURCES_SHANI += src/sha256-shani.cpp
+}
+
 # Todo: Remove this line when switching to Qt5, as that option was removed
 CODECFORTR = UTF-8
 
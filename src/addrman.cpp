@@ -310,7 +310,7 @@ void CAddrMan::Good_(const CService &addr, int64 nTime)
     MakeTried(info, nId, nUBucket);
 }
 
-bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty)
+bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty, int nUBucket)
 {
     if (!addr.IsRoutable())
         return false;
@@ -356,7 +356,8 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePen
         fNew = true;
     }
 
-    int nUBucket = pinfo->GetNewBucket(nKey, source);
+    if (nUBucket == -1)
+        nUBucket = pinfo->GetNewBucket(nKey, source);
     std::set<int> &vNew = vvNew[nUBucket];
     if (!vNew.count(nId))
     {
@@ -387,9 +388,9 @@ void CAddrMan::Attempt_(const CService &addr, int64 nTime)
     info.nAttempts++;
 }
 
-CAddress CAddrMan::Select_(int nUnkBias)
+CAddress CAddrMan::Select_(int nUnkBias) const
 {
-    if (size() == 0)
+    if (vRandom.size() == 0)
         return CAddress();
 
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
@@ -401,11 +402,12 @@ CAddress CAddrMan::Select_(int nUnkBias)
         while(1)
         {
             int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
+            const std::vector<int> &vTried = vvTried[nKBucket];
             if (vTried.size() == 0) continue;
             int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
+            std::map<int, CAddrInfo>::const_iterator mi = mapInfo.find(vTried[nPos]);
+            assert(mi != mapInfo.end());
+            const CAddrInfo &info = (*mi).second;
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -416,14 +418,15 @@ CAddress CAddrMan::Select_(int nUnkBias)
         while(1)
         {
             int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
+            const std::set<int> &vNew = vvNew[nUBucket];
             if (vNew.size() == 0) continue;
             int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
+            std::set<int>::const_iterator it = vNew.begin();
             while (nPos--)
                 it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
+            std::map<int, CAddrInfo>::const_iterator mi = mapInfo.find(*it);
+            assert(mi != mapInfo.end());
+            const CAddrInfo &info = (*mi).second;
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -491,19 +494,28 @@ int CAddrMan::Check_()
 }
 #endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
+void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr) const
 {
     int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
     if (nNodes > ADDRMAN_GETADDR_MAX)
         nNodes = ADDRMAN_GETADDR_MAX;
 
-    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
+    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all).
+    // vRandom itself stays untouched, so that concurrent readers can share it:
+    // mapSwapped holds the positions the shuffle has moved things into.
+    std::map<int, int> mapSwapped;
+    vAddr.reserve(nNodes);
     for (int n = 0; n<nNodes; n++)
     {
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        std::map<int, int>::iterator itRnd = mapSwapped.find(nRndPos);
+        int nId = (itRnd != mapSwapped.end()) ? (*itRnd).second : vRandom[nRndPos];
+        // position n is never drawn again, so only nRndPos needs to remember what was at n
+        std::map<int, int>::iterator itN = mapSwapped.find(n);
+        mapSwapped[nRndPos] = (itN != mapSwapped.end()) ? (*itN).second : vRandom[n];
+        std::map<int, CAddrInfo>::const_iterator mi = mapInfo.find(nId);
+        assert(mi != mapInfo.end());
+        vAddr.push_back((*mi).second);
     }
 }
 
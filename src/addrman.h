@@ -161,12 +161,17 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// how many addresses Add takes the lock for at a time
+#define ADDRMAN_ADD_BATCH 64
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
 private:
-    // critical section to protect the inner data structures
-    mutable CCriticalSection cs;
+    // lock to protect the inner data structures: Select, GetAddr, size and
+    // serialization only read them and share it, so they do not wait for each
+    // other, only for writers
+    mutable CSharedCriticalSection cs;
 
     // secret key to randomize bucket select with
     std::vector<unsigned char> nKey;
@@ -223,22 +228,34 @@ protected:
     void Good_(const CService &addr, int64 nTime);
 
     // Add an entry to the "new" table.
-    bool Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty);
+    // nUBucket is its "new" bucket if the caller already computed it, or -1.
+    bool Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty, int nUBucket = -1);
 
     // Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, int64 nTime);
 
     // Select an address to connect to.
     // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_(int nUnkBias);
+    CAddress Select_(int nUnkBias) const;
 
 #ifdef DEBUG_ADDRMAN
     // Perform consistency check. Returns an error code or zero.
     int Check_();
 #endif
 
+    // Consistency check, with cs held exclusively. Readers never change the
+    // tables, so they skip it.
+    void Check_Locked()
+    {
+#ifdef DEBUG_ADDRMAN
+        int err;
+        if ((err=Check_()))
+            printf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
+#endif
+    }
+
     // Select several addresses at once.
-    void GetAddr_(std::vector<CAddress> &vAddr);
+    void GetAddr_(std::vector<CAddress> &vAddr) const;
 
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64 nTime);
@@ -268,7 +285,7 @@ public:
         // This format is more complex, but significantly smaller (at most 1.5 MiB), and supports
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
         {
-            LOCK(cs);
+            CSharedCriticalBlock sharedblock(cs, !fWrite, "cs", __FILE__, __LINE__);
             unsigned char nVersion = 0;
             READWRITE(nVersion);
             READWRITE(nKey);
@@ -389,8 +406,9 @@ public:
     }
 
     // Return the number of (unique) addresses in all tables.
-    int size()
+    int size() const
     {
+        READ_LOCK(cs);
         return vRandom.size();
     }
 
@@ -399,10 +417,8 @@ public:
     {
 #ifdef DEBUG_ADDRMAN
         {
-            LOCK(cs);
-            int err;
-            if ((err=Check_()))
-                printf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
+            WRITE_LOCK(cs);
+            Check_Locked();
         }
 #endif
     }
@@ -410,31 +426,43 @@ public:
     // Add a single address.
     bool Add(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty = 0)
     {
-        bool fRet = false;
-        {
-            LOCK(cs);
-            Check();
-            fRet |= Add_(addr, source, nTimePenalty);
-            Check();
-        }
-        if (fRet)
-            printf("Added %s from %s: %i tried, %i new\n", addr.ToStringIPPort().c_str(), source.ToString().c_str(), nTried, nNew);
-        return fRet;
+        std::vector<CAddress> vAddr(1, addr);
+        return Add(vAddr, source, nTimePenalty);
     }
 
     // Add multiple addresses.
+    // Bucket hashing, the bulk of the work, is done before taking the lock,
+    // and the addresses are then added a batch at a time, so that a large addr
+    // message never holds up Select for long.
     bool Add(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64 nTimePenalty = 0)
     {
-        int nAdd = 0;
+        std::vector<unsigned char> nKeyUsed;
+        {
+            READ_LOCK(cs);
+            nKeyUsed = nKey;
+        }
+        std::vector<int> vUBucket(vAddr.size(), -1);
+        for (unsigned int i = 0; i < vAddr.size(); i++)
+            if (vAddr[i].IsRoutable())
+                vUBucket[i] = CAddrInfo(vAddr[i], source).GetNewBucket(nKeyUsed, source);
+
+        int nAdd = 0, nTriedNow = 0, nNewNow = 0;
+        for (unsigned int nBatch = 0; nBatch < vAddr.size(); nBatch += ADDRMAN_ADD_BATCH)
         {
-            LOCK(cs);
-            Check();
-            for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
-                nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
-            Check();
+            WRITE_LOCK(cs);
+            Check_Locked();
+            // the key only changes when addr.dat is loaded; if it did, let Add_ hash again
+            bool fKeyChanged = (nKey != nKeyUsed);
+            for (unsigned int i = nBatch; i < vAddr.size() && i < nBatch + ADDRMAN_ADD_BATCH; i++)
+                nAdd += Add_(vAddr[i], source, nTimePenalty, fKeyChanged ? -1 : vUBucket[i]) ? 1 : 0;
+            Check_Locked();
+            nTriedNow = nTried;
+            nNewNow = nNew;
         }
-        if (nAdd)
-            printf("Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString().c_str(), nTried, nNew);
+        if (nAdd == 1 && vAddr.size() == 1)
+            printf("Added %s from %s: %i tried, %i new\n", vAddr[0].ToStringIPPort().c_str(), source.ToString().c_str(), nTriedNow, nNewNow);
+        else if (nAdd)
+            printf("Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString().c_str(), nTriedNow, nNewNow);
         return nAdd > 0;
     }
 
@@ -442,10 +470,10 @@ public:
     void Good(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
-            Check();
+            WRITE_LOCK(cs);
+            Check_Locked();
             Good_(addr, nTime);
-            Check();
+            Check_Locked();
         }
     }
 
@@ -453,37 +481,33 @@ public:
     void Attempt(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
-            Check();
+            WRITE_LOCK(cs);
+            Check_Locked();
             Attempt_(addr, nTime);
-            Check();
+            Check_Locked();
         }
     }
 
     // Choose an address to connect to.
     // nUnkBias determines how much "new" entries are favored over "tried" ones (0-100).
-    CAddress Select(int nUnkBias = 50)
+    CAddress Select(int nUnkBias = 50) const
     {
         CAddress addrRet;
         {
-            LOCK(cs);
-            Check();
+            READ_LOCK(cs);
             addrRet = Select_(nUnkBias);
-            Check();
         }
         return addrRet;
     }
 
     // Return a bunch of addresses, selected at random.
-    std::vector<CAddress> GetAddr()
+    std::vector<CAddress> GetAddr() const
     {
-        Check();
         std::vector<CAddress> vAddr;
         {
-            LOCK(cs);
+            READ_LOCK(cs);
             GetAddr_(vAddr);
         }
-        Check();
         return vAddr;
     }
 
@@ -491,10 +515,10 @@ public:
     void Connected(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
-            Check();
+            WRITE_LOCK(cs);
+            Check_Locked();
             Connected_(addr, nTime);
-            Check();
+            Check_Locked();
         }
     }
 };
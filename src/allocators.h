@@ -6,7 +6,10 @@
 #define BITCOIN_ALLOCATORS_H
 
 #include <string.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <boost/thread/mutex.hpp>
 #include <map>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
@@ -269,6 +272,142 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+/**
+ * Thread-safe pool of heap buffers in power-of-two size classes, for
+ * containers that are allocated and freed at a high rate, like the buffers
+ * of network messages. Freed buffers are kept for reuse, up to a limit per
+ * size class; buffers larger than the largest class bypass the pool.
+ *
+ * Buffers are not cleared when they are freed, so the pool must not be used
+ * for anything secret.
+ */
+class CBufferPool
+{
+public:
+    // Size classes go from 64 bytes to 1MB, which holds a full block message
+    static const int MIN_CLASS_BITS = 6;
+    static const int MAX_CLASS_BITS = 20;
+    static const int CLASS_COUNT = MAX_CLASS_BITS - MIN_CLASS_BITS + 1;
+
+    // Free buffers kept per size class: as many as fit in 1MB, but at least 4
+    static const size_t MAX_CACHED_BYTES_PER_CLASS = 1 << 20;
+    static const size_t MIN_CACHED_PER_CLASS = 4;
+
+    static CBufferPool& Instance(); // instantiated in util.cpp
+
+    void* Allocate(size_t nSize)
+    {
+        int nClass = SizeClass(nSize);
+        if (nClass < 0)
+            return ::operator new(nSize);
+        {
+            boost::mutex::scoped_lock lock(mutex[nClass]);
+            std::vector<void*>& vFree = vFreeLists[nClass];
+            if (!vFree.empty())
+            {
+                void* p = vFree.back();
+                vFree.pop_back();
+                nReused[nClass]++;
+                return p;
+            }
+            nAllocated[nClass]++;
+        }
+        return ::operator new((size_t)1 << (nClass + MIN_CLASS_BITS));
+    }
+
+    void Free(void* p, size_t nSize)
+    {
+        int nClass = SizeClass(nSize);
+        if (nClass >= 0)
+        {
+            boost::mutex::scoped_lock lock(mutex[nClass]);
+            std::vector<void*>& vFree = vFreeLists[nClass];
+            if (vFree.size() < vFree.capacity())
+            {
+                vFree.push_back(p);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+    // Number of pooled allocations served from a freed buffer, and from the heap
+    void GetStats(uint64_t& nReusedRet, uint64_t& nAllocatedRet)
+    {
+        nReusedRet = nAllocatedRet = 0;
+        for (int i = 0; i < CLASS_COUNT; i++)
+        {
+            boost::mutex::scoped_lock lock(mutex[i]);
+            nReusedRet += nReused[i];
+            nAllocatedRet += nAllocated[i];
+        }
+    }
+
+private:
+    boost::mutex mutex[CLASS_COUNT];
+    std::vector<void*> vFreeLists[CLASS_COUNT];
+    uint64_t nReused[CLASS_COUNT];
+    uint64_t nAllocated[CLASS_COUNT];
+
+    CBufferPool()
+    {
+        // Reserved up front, so that freeing a buffer never allocates
+        for (int i = 0; i < CLASS_COUNT; i++)
+        {
+            nReused[i] = nAllocated[i] = 0;
+            size_t nBuffers = MAX_CACHED_BYTES_PER_CLASS >> (i + MIN_CLASS_BITS);
+            vFreeLists[i].reserve(std::max(nBuffers, MIN_CACHED_PER_CLASS));
+        }
+    }
+
+    // Index of the smallest size class holding nSize bytes, or -1 if none does
+    static int SizeClass(size_t nSize)
+    {
+        if (nSize > ((size_t)1 << MAX_CLASS_BITS))
+            return -1;
+        int nBits = MIN_CLASS_BITS;
+        while (((size_t)1 << nBits) < nSize)
+            nBits++;
+        return nBits - MIN_CLASS_BITS;
+    }
+};
+
+//
+// Allocator that takes its buffers from CBufferPool. Contents are left in
+// memory after deletion: use zero_after_free_allocator for secrets.
+//
+template<typename T>
+struct pool_allocator : public std::allocator<T>
+{
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    pool_allocator() throw() {}
+    pool_allocator(const pool_allocator& a) throw() : base(a) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : base(a) {}
+    ~pool_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef pool_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        return static_cast<T*>(CBufferPool::Instance().Allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (p != NULL)
+            CBufferPool::Instance().Free(p, sizeof(T) * n);
+    }
+};
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
@@ -0,0 +1,125 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "addrman.h"
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// 100 addr messages of 1000 addresses each, from 100 different peers
+static const int nAddrMessages = 100;
+static const int nAddrPerMessage = 1000;
+
+static void MakeAddrMessages(vector<vector<CAddress> >& vvAddr, vector<CNetAddr>& vSource)
+{
+    vvAddr.resize(nAddrMessages);
+    vSource.resize(nAddrMessages);
+    int64 nNow = GetAdjustedTime();
+    for (int i = 0; i < nAddrMessages; i++)
+    {
+        vSource[i] = CNetAddr(strprintf("%i.%i.1.1", 1 + i % 200, 1 + i));
+        for (int j = 0; j < nAddrPerMessage; j++)
+        {
+            int n = i * nAddrPerMessage + j;
+            CAddress addr(CService(strprintf("%i.%i.%i.%i", 11 + n % 180, 1 + (n / 180) % 250, 1 + n % 250, 1 + (n / 7) % 250), 8333));
+            addr.nTime = nNow - GetRand(3 * 24 * 60 * 60);
+            vvAddr[i].push_back(addr);
+        }
+    }
+}
+
+static void Ingest(CAddrMan& addrman, const vector<vector<CAddress> >& vvAddr, const vector<CNetAddr>& vSource)
+{
+    for (unsigned int i = 0; i < vvAddr.size(); i++)
+        addrman.Add(vvAddr[i], vSource[i], 2 * 60 * 60);
+}
+
+// Selects connections until interrupted, far more often than ThreadOpenConnections does
+static void ThreadSelect(const CAddrMan* paddrman)
+{
+    while (true)
+    {
+        paddrman->Select(50);
+        MilliSleep(1);
+    }
+}
+
+// Answers getaddr until interrupted, as if a new peer connected every 10ms
+static void ThreadGetAddr(const CAddrMan* paddrman)
+{
+    while (true)
+    {
+        paddrman->GetAddr();
+        MilliSleep(10);
+    }
+}
+
+// Ingest all 100k addresses into an empty address manager
+static void AddrManAdd100k(benchmark::State& state)
+{
+    vector<vector<CAddress> > vvAddr;
+    vector<CNetAddr> vSource;
+    MakeAddrMessages(vvAddr, vSource);
+
+    while (state.KeepRunning())
+    {
+        CAddrMan addrman;
+        Ingest(addrman, vvAddr, vSource);
+    }
+}
+
+// The same, while other threads keep selecting connections and answering getaddr
+static void AddrManAdd100kSelecting(benchmark::State& state)
+{
+    vector<vector<CAddress> > vvAddr;
+    vector<CNetAddr> vSource;
+    MakeAddrMessages(vvAddr, vSource);
+
+    while (state.KeepRunning())
+    {
+        CAddrMan addrman;
+        addrman.Add(vvAddr[0], vSource[0]);
+        boost::thread_group threadGroup;
+        threadGroup.create_thread(boost::bind(&ThreadSelect, &addrman));
+        threadGroup.create_thread(boost::bind(&ThreadGetAddr, &addrman));
+        Ingest(addrman, vvAddr, vSource);
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+}
+
+// Ingests the addr messages over and over until interrupted
+static void ThreadIngest(CAddrMan* paddrman, const vector<vector<CAddress> >* pvvAddr, const vector<CNetAddr>* pvSource)
+{
+    while (true)
+    {
+        for (unsigned int i = 0; i < pvvAddr->size(); i++)
+        {
+            boost::this_thread::interruption_point();
+            paddrman->Add((*pvvAddr)[i], (*pvSource)[i], 2 * 60 * 60);
+        }
+    }
+}
+
+// One connection selection, while another thread keeps ingesting addr messages
+static void AddrManSelectWhileAdding(benchmark::State& state)
+{
+    vector<vector<CAddress> > vvAddr;
+    vector<CNetAddr> vSource;
+    MakeAddrMessages(vvAddr, vSource);
+
+    CAddrMan addrman;
+    addrman.Add(vvAddr[0], vSource[0]);
+    boost::thread threadIngest(boost::bind(&ThreadIngest, &addrman, &vvAddr, &vSource));
+    while (state.KeepRunning())
+        addrman.Select(50);
+    threadIngest.interrupt();
+    threadIngest.join();
+}
+
+BENCHMARK(AddrManAdd100k);
+BENCHMARK(AddrManAdd100kSelecting);
+BENCHMARK(AddrManSelectWhileAdding);
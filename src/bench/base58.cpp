@@ -0,0 +1,39 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "base58.h"
+
+using namespace std;
+
+static void Base58Encode(benchmark::State& state)
+{
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vch(hash.begin(), hash.end());
+    while (state.KeepRunning())
+        EncodeBase58(vch);
+}
+
+// An address, with its version byte and checksum
+static void Base58CheckEncodeAddress(benchmark::State& state)
+{
+    CKeyID keyID(Hash160(vector<unsigned char>(33, 2)));
+    while (state.KeepRunning())
+        CBitcoinAddress(keyID).ToString();
+}
+
+static void Base58CheckDecodeAddress(benchmark::State& state)
+{
+    string strAddress = CBitcoinAddress(CKeyID(Hash160(vector<unsigned char>(33, 2)))).ToString();
+    while (state.KeepRunning())
+    {
+        CBitcoinAddress address;
+        if (!address.SetString(strAddress))
+            throw runtime_error("decoding failed");
+    }
+}
+
+BENCHMARK(Base58Encode);
+BENCHMARK(Base58CheckEncodeAddress);
+BENCHMARK(Base58CheckDecodeAddress);
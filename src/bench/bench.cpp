@@ -0,0 +1,89 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <limits>
+
+using namespace std;
+
+static double GetTimeDouble()
+{
+    return GetTimeMicros() * 0.000001;
+}
+
+benchmark::BenchRunner::BenchmarkMap& benchmark::BenchRunner::benchmarks()
+{
+    static BenchmarkMap benchmarks_map;
+    return benchmarks_map;
+}
+
+benchmark::BenchRunner::BenchRunner(const string& name, BenchFunction func)
+{
+    benchmarks().insert(make_pair(name, func));
+}
+
+void benchmark::BenchRunner::RunAll(const string& strFilter, double elapsedTimeForOne)
+{
+    // printf goes to debug.log (see util.h); results always go to stdout
+    fprintf(stdout, "#Benchmark,count,min,max,average\n");
+
+    for (BenchmarkMap::iterator it = benchmarks().begin(); it != benchmarks().end(); ++it)
+    {
+        if (it->first.find(strFilter) == string::npos)
+            continue;
+        State state(it->first, elapsedTimeForOne);
+        (*it->second)(state);
+    }
+}
+
+benchmark::State::State(const string& nameIn, double maxElapsedIn) :
+    name(nameIn), maxElapsed(maxElapsedIn), beginTime(0), lastTime(0),
+    minTime(numeric_limits<double>::max()), maxTime(0), count(0), countMask(1), countMaskInv(0.5)
+{
+}
+
+bool benchmark::State::KeepRunning()
+{
+    if (count & countMask)
+    {
+        ++count;
+        return true;
+    }
+
+    double now;
+    if (count == 0)
+    {
+        lastTime = beginTime = now = GetTimeDouble();
+    }
+    else
+    {
+        now = GetTimeDouble();
+        double elapsed = now - lastTime;
+        double elapsedOne = elapsed * countMaskInv;
+        if (elapsedOne < minTime) minTime = elapsedOne;
+        if (elapsedOne > maxTime) maxTime = elapsedOne;
+
+        // Grow the sampling interval while a sample takes under 1/16th of the budget
+        if (elapsed * 16 < maxElapsed)
+        {
+            uint64 newCountMask = ((countMask << 1) | 1) & ((1ULL << 60) - 1);
+            if ((count & newCountMask) == 0)
+            {
+                countMask = newCountMask;
+                countMaskInv = 1.0 / (countMask + 1);
+            }
+        }
+    }
+    lastTime = now;
+    ++count;
+
+    if (now - beginTime < maxElapsed)
+        return true;
+
+    --count;
+    double average = (now - beginTime) / count;
+    fprintf(stdout, "%s,%"PRI64u",%g,%g,%g\n", name.c_str(), count, minTime, maxTime, average);
+    return false;
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <map>
+#include <string>
+
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+#include "util.h"
+
+/** Simple micro-benchmarking framework.
+ *
+ * static void CodeToTime(benchmark::State& state)
+ * {
+ *     ... do any setup needed ...
+ *     while (state.KeepRunning()) {
+ *         ... do the work you want to time ...
+ *     }
+ *     ... do any cleanup needed ...
+ * }
+ *
+ * BENCHMARK(CodeToTime);
+ *
+ * Each benchmark runs for a fixed wall-clock budget. Time is only sampled
+ * every 2^n iterations, with n chosen so that sampling overhead stays
+ * negligible for very short bodies. Results are written to stdout as one
+ * CSV line per benchmark so that runs can be compared between builds.
+ */
+namespace benchmark {
+
+class State
+{
+    std::string name;
+    double maxElapsed;
+    double beginTime;
+    double lastTime, minTime, maxTime;
+    uint64 count;
+    uint64 countMask;
+    double countMaskInv;
+
+public:
+    State(const std::string& nameIn, double maxElapsedIn);
+
+    bool KeepRunning();
+};
+
+typedef void (*BenchFunction)(State&);
+
+class BenchRunner
+{
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& benchmarks();
+
+public:
+    BenchRunner(const std::string& name, BenchFunction func);
+
+    // Runs every registered benchmark whose name contains strFilter
+    static void RunAll(const std::string& strFilter, double elapsedTimeForOne = 1.0);
+};
+
+}
+
+// BENCHMARK(foo) registers foo under the name "foo"
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif
@@ -0,0 +1,37 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "scrypt.h"
+#include "sha256.h"
+#include "ui_interface.h"
+
+CClientUIInterface uiInterface;
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+// bench_fedoracoin [filter] [seconds]
+//
+// Runs every benchmark whose name contains filter (all of them by default)
+// for the given number of seconds each, printing CSV to stdout.
+int main(int argc, char* argv[])
+{
+    fPrintToDebugger = true; // don't want to write to debug.log file
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+    SHA256AutoDetect();
+
+    std::string strFilter = argc > 1 ? argv[1] : "";
+    double nSeconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (nSeconds <= 0)
+        nSeconds = 1.0;
+
+    benchmark::BenchRunner::RunAll(strFilter, nSeconds);
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bloom.h"
+#include "main.h"
+
+using namespace std;
+
+static uint160 RandomKeyID()
+{
+    uint256 hash = GetRandHash();
+    return uint160(vector<unsigned char>(hash.begin(), hash.begin() + 20));
+}
+
+// Filtering a block of 1000 payments for a wallet of 100 keys that 10 of them
+// pay to, as for a filtered block sent to an SPV peer
+static void BloomFilterBlock(benchmark::State& state)
+{
+    CBloomFilter filterWallet(100, 0.0001, 0, BLOOM_UPDATE_ALL);
+    vector<uint160> vKeys;
+    for (int i = 0; i < 100; i++)
+    {
+        vKeys.push_back(RandomKeyID());
+        filterWallet.insert(vector<unsigned char>(vKeys.back().begin(), vKeys.back().end()));
+    }
+
+    vector<CTransaction> vtx(1000);
+    vector<uint256> vHashes;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        CTransaction& tx = vtx[i];
+        tx.vin.resize(1);
+        tx.vout.resize(2);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72) << vector<unsigned char>(33);
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+        {
+            uint160 hashDest = (i % 100 == 0 && j == 0) ? vKeys[i / 100] : RandomKeyID();
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(hashDest.begin(), hashDest.end()) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        vHashes.push_back(tx.GetHash());
+    }
+
+    while (state.KeepRunning())
+    {
+        // Matches add outpoints, so start from the wallet's filter each time
+        CBloomFilter filter(filterWallet);
+        unsigned int nMatches = 0;
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            if (filter.IsRelevantAndUpdate(vtx[i], vHashes[i]))
+                nMatches++;
+        if (nMatches < 10)
+            throw runtime_error("missed a match");
+    }
+}
+
+// 100 SPV peers, each with a wallet of 20 keys, scanning the same 10 blocks
+// of 500 payments. Either every peer's filter is matched against each block
+// on its own, as before the data elements were shared, or the blocks are
+// prepared once and all the filters matched against that.
+static void MakeSPVPeers(vector<CBloomFilter>& vFilters, vector<CBlock>& vBlocks)
+{
+    vector<uint160> vKeys;
+    for (int i = 0; i < 100; i++)
+    {
+        CBloomFilter filter(20, 0.0001, GetRand(1U << 31), BLOOM_UPDATE_ALL);
+        for (int j = 0; j < 20; j++)
+        {
+            vKeys.push_back(RandomKeyID());
+            filter.insert(vector<unsigned char>(vKeys.back().begin(), vKeys.back().end()));
+        }
+        vFilters.push_back(filter);
+    }
+
+    vBlocks.resize(10);
+    for (unsigned int b = 0; b < vBlocks.size(); b++)
+    {
+        vBlocks[b].vtx.resize(500);
+        for (unsigned int i = 0; i < vBlocks[b].vtx.size(); i++)
+        {
+            CTransaction& tx = vBlocks[b].vtx[i];
+            tx.vin.resize(1);
+            tx.vout.resize(2);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72) << vector<unsigned char>(33);
+            for (unsigned int j = 0; j < tx.vout.size(); j++)
+            {
+                // Every peer gets paid in some block
+                uint160 hashDest = (i % 50 == 0 && j == 0) ? vKeys[(b * 10 + i / 50) * 20 % vKeys.size()] : RandomKeyID();
+                tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(hashDest.begin(), hashDest.end()) << OP_EQUALVERIFY << OP_CHECKSIG;
+            }
+        }
+    }
+}
+
+static void BloomFilterBlocks100Peers(benchmark::State& state)
+{
+    vector<CBloomFilter> vFilters;
+    vector<CBlock> vBlocks;
+    MakeSPVPeers(vFilters, vBlocks);
+
+    while (state.KeepRunning())
+    {
+        vector<CBloomFilter> vPeerFilters(vFilters);
+        unsigned int nMatches = 0;
+        for (unsigned int b = 0; b < vBlocks.size(); b++)
+            for (unsigned int p = 0; p < vPeerFilters.size(); p++)
+                nMatches += CMerkleBlock(vBlocks[b], vPeerFilters[p]).vMatchedTxn.size();
+        if (nMatches < 100)
+            throw runtime_error("missed a match");
+    }
+}
+
+static void BloomFilterBlocks100PeersShared(benchmark::State& state)
+{
+    vector<CBloomFilter> vFilters;
+    vector<CBlock> vBlocks;
+    MakeSPVPeers(vFilters, vBlocks);
+
+    while (state.KeepRunning())
+    {
+        vector<CBloomFilter> vPeerFilters(vFilters);
+        unsigned int nMatches = 0;
+        for (unsigned int b = 0; b < vBlocks.size(); b++)
+        {
+            vector<CBloomTxData> vTxData;
+            vTxData.reserve(vBlocks[b].vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, vBlocks[b].vtx)
+                vTxData.push_back(CBloomTxData(tx, tx.GetHash()));
+            for (unsigned int p = 0; p < vPeerFilters.size(); p++)
+                nMatches += CMerkleBlock(vBlocks[b], vPeerFilters[p], vTxData).vMatchedTxn.size();
+        }
+        if (nMatches < 100)
+            throw runtime_error("missed a match");
+    }
+}
+
+BENCHMARK(BloomFilterBlock);
+BENCHMARK(BloomFilterBlocks100Peers);
+BENCHMARK(BloomFilterBlocks100PeersShared);
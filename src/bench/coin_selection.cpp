@@ -0,0 +1,65 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "wallet.h"
+
+using namespace std;
+
+static CWallet wallet;
+
+// A hot wallet holding nCoins outputs between 0.01 and 100 coins, spread
+// over transactions of 1000 outputs each
+static void CoinSelection(benchmark::State& state, unsigned int nCoins)
+{
+    vector<CWalletTx*> vpwtx;
+    vector<COutput> vCoins;
+    vCoins.reserve(nCoins);
+
+    seed_insecure_rand(true);
+    for (unsigned int i = 0; i < nCoins; i++)
+    {
+        if (i % 1000 == 0)
+        {
+            CTransaction tx;
+            tx.nLockTime = vpwtx.size();    // so all transactions get different hashes
+            vpwtx.push_back(new CWalletTx(&wallet, tx));
+        }
+        CWalletTx* pwtx = vpwtx.back();
+        CTxOut txout;
+        txout.nValue = CENT + (uint64)insecure_rand() % (100 * COIN);
+        pwtx->vout.push_back(txout);
+        vCoins.push_back(COutput(pwtx, pwtx->vout.size() - 1, 6 * 24));
+    }
+
+    set<pair<const CWalletTx*,unsigned int> > setCoinsRet;
+    uint64 nValueRet;
+    while (state.KeepRunning())
+    {
+        if (!wallet.SelectCoinsMinConf(1234 * COIN + 5678, 1, 6, vCoins, setCoinsRet, nValueRet))
+            throw runtime_error("coin selection failed");
+    }
+
+    BOOST_FOREACH(CWalletTx* pwtx, vpwtx)
+        delete pwtx;
+}
+
+static void CoinSelection10k(benchmark::State& state)
+{
+    CoinSelection(state, 10000);
+}
+
+static void CoinSelection100k(benchmark::State& state)
+{
+    CoinSelection(state, 100000);
+}
+
+static void CoinSelection1M(benchmark::State& state)
+{
+    CoinSelection(state, 1000000);
+}
+
+BENCHMARK(CoinSelection10k);
+BENCHMARK(CoinSelection100k);
+BENCHMARK(CoinSelection1M);
@@ -0,0 +1,65 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+
+using namespace std;
+
+// A cache holding 100000 unspent transactions over an empty database
+class CCoinsBench
+{
+public:
+    CCoinsView viewEmpty;
+    CCoinsViewCache view;
+    vector<uint256> vTxids;
+
+    CCoinsBench() : view(viewEmpty)
+    {
+        CCoins coins;
+        coins.nVersion = 1;
+        coins.nHeight = 1;
+        coins.vout.resize(2);
+        BOOST_FOREACH(CTxOut& txout, coins.vout)
+        {
+            txout.nValue = COIN;
+            txout.scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        for (int i = 0; i < 100000; i++)
+        {
+            vTxids.push_back(GetRandHash());
+            view.SetCoins(vTxids.back(), coins);
+        }
+    }
+};
+
+// Looking up a spent output, as for every input of a block
+static void CoinsCacheHit(benchmark::State& state)
+{
+    CCoinsBench bench;
+    unsigned int i = 0;
+    while (state.KeepRunning())
+    {
+        const CCoins& coins = bench.view.GetCoins(bench.vTxids[i++ % bench.vTxids.size()]);
+        if (!coins.IsAvailable(1))
+            throw runtime_error("coins missing");
+    }
+}
+
+// Checking that a transaction isn't already in the chain, as for every
+// transaction accepted or connected
+static void CoinsCacheMiss(benchmark::State& state)
+{
+    CCoinsBench bench;
+    uint256 hash = GetRandHash();
+    while (state.KeepRunning())
+    {
+        hash.begin()[0]++;
+        if (bench.view.HaveCoins(hash))
+            throw runtime_error("unexpected coins");
+    }
+}
+
+BENCHMARK(CoinsCacheHit);
+BENCHMARK(CoinsCacheMiss);
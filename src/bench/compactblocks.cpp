@@ -0,0 +1,185 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "blockencodings.h"
+#include "main.h"
+
+using namespace std;
+
+//
+// Block propagation across a chain of nodes, each with its own memory pool,
+// relaying either full blocks or compact blocks. The nodes live in this one
+// process and talk through serialized messages rather than sockets, so byte
+// counts are exact and reconstruction time is real; network latency is
+// modeled from the link parameters below.
+//
+
+static const unsigned int nRelayNodes = 6;          // the miner, then five hops
+static const unsigned int nBlockTxs = 1500;
+static const unsigned int nUnrelatedPoolTxs = 3000; // pool transactions not in the block
+static const double dLinkRTT = 0.1;                 // seconds
+static const double dLinkBandwidth = 1000000.0;     // bytes per second
+
+// Roughly the size of a one-input, two-output pay-to-pubkey-hash payment
+static CTransaction MakePayment()
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), GetRand(4));
+    tx.vin[0].scriptSig << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+    tx.vout.resize(2);
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        tx.vout[i].nValue = 1 + GetRand(100 * COIN);
+        tx.vout[i].scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, (unsigned char)GetRand(256)) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+static CBlock MakeRelayBlock()
+{
+    CBlock block;
+    block.nBits = 0x1e0ffff0;
+    block.nTime = GetTime();
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig << OP_0 << OP_0;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    block.vtx[0].vout[0].scriptPubKey << vector<unsigned char>(65, 0x04) << OP_CHECKSIG;
+    for (unsigned int i = 1; i < nBlockTxs; i++)
+        block.vtx.push_back(MakePayment());
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Fills pool with each of the block's transactions with probability
+// dOverlap, plus some the block does not have
+static void FillRelayPool(CTxMemPool& pool, const CBlock& block, double dOverlap)
+{
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (GetRand(1000000) < dOverlap * 1000000)
+            pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+    for (unsigned int i = 0; i < nUnrelatedPoolTxs; i++)
+    {
+        CTransaction tx = MakePayment();
+        pool.addUnchecked(tx.GetHash(), tx);
+    }
+}
+
+template<typename T>
+static unsigned int MessageSize(const T& obj)
+{
+    return 24 + ::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION);  // plus message header
+}
+
+struct CRelayHop
+{
+    unsigned int nBytes;
+    unsigned int nMissing;
+    double dCPU;        // seconds spent rebuilding the block
+    double dLatency;    // seconds from inv sent to block rebuilt
+};
+
+// One hop of compact block relay: the sender answers getdata with a
+// cmpctblock, the receiver rebuilds from its pool and fetches what is
+// missing. Returns false if the block could not be rebuilt.
+static bool RelayCompactHop(const CBlock& block, const CTxMemPool& poolTo, CRelayHop& hop)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CBlockHeaderAndShortTxIDs(block);
+    hop.nBytes = 24 + ss.size();
+    unsigned int nTransferBytes = hop.nBytes;
+
+    int64 nStart = GetTimeMicros();
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    ss >> cmpctblock;
+    CPartiallyDownloadedBlock partialBlock;
+    if (partialBlock.InitData(cmpctblock, poolTo) != CPartiallyDownloadedBlock::READ_STATUS_OK)
+        return false;
+    CBlockTransactionsRequest req;
+    req.blockhash = cmpctblock.header.GetHash();
+    partialBlock.GetMissing(req.indexes);
+    hop.nMissing = req.indexes.size();
+    hop.dCPU = (GetTimeMicros() - nStart) * 0.000001;
+
+    // inv, getdata, cmpctblock
+    hop.dLatency = 1.5 * dLinkRTT;
+    CBlockTransactions resp(req);
+    if (!req.indexes.empty())
+    {
+        for (unsigned int i = 0; i < req.indexes.size(); i++)
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        hop.nBytes += MessageSize(req) + MessageSize(resp);
+        nTransferBytes += MessageSize(resp);
+        // getblocktxn, blocktxn
+        hop.dLatency += dLinkRTT;
+    }
+
+    nStart = GetTimeMicros();
+    CBlock blockOut;
+    bool fOK = partialBlock.FillBlock(blockOut, resp.txn) == CPartiallyDownloadedBlock::READ_STATUS_OK &&
+               blockOut.GetHash() == block.GetHash();
+    hop.dCPU += (GetTimeMicros() - nStart) * 0.000001;
+    hop.dLatency += nTransferBytes / dLinkBandwidth + hop.dCPU;
+    return fOK;
+}
+
+static void RelaySimulation(double dOverlap)
+{
+    CBlock block = MakeRelayBlock();
+    CTxMemPool vPool[nRelayNodes];
+    for (unsigned int i = 1; i < nRelayNodes; i++)
+        FillRelayPool(vPool[i], block, dOverlap);
+
+    unsigned int nFullBytes = MessageSize(block);
+    double dFullLatency = 0, dCompactLatency = 0, dCPU = 0;
+    unsigned int nCompactBytes = 0, nMissing = 0, nFailed = 0;
+    for (unsigned int i = 1; i < nRelayNodes; i++)
+    {
+        // inv, getdata, block
+        dFullLatency += 1.5 * dLinkRTT + nFullBytes / dLinkBandwidth;
+
+        CRelayHop hop;
+        if (!RelayCompactHop(block, vPool[i], hop))
+        {
+            nFailed++;
+            continue;
+        }
+        nCompactBytes += hop.nBytes;
+        nMissing += hop.nMissing;
+        dCPU += hop.dCPU;
+        dCompactLatency += hop.dLatency;
+    }
+    unsigned int nHops = nRelayNodes - 1;
+
+    fprintf(stdout, "# relay %u txs over %u hops, %.0f%% of them in each pool: "
+                    "full %u bytes/hop, %.0f ms; compact %u bytes/hop (%.1f%%), %.1f missing/hop, %.2f ms CPU/hop, %.0f ms; %u failed\n",
+            nBlockTxs, nHops, dOverlap * 100,
+            nFullBytes, dFullLatency * 1000,
+            nCompactBytes / nHops, 100.0 * nCompactBytes / (nFullBytes * nHops), (double)nMissing / nHops, dCPU * 1000 / nHops,
+            dCompactLatency * 1000, nFailed);
+}
+
+// Prints the propagation summary, then times the receiving side of a hop
+// from a pool holding all of the block
+static void CompactBlockRelay(benchmark::State& state)
+{
+    fprintf(stdout, "# modeled link: %.0f ms RTT, %.0f kB/s\n", dLinkRTT * 1000, dLinkBandwidth / 1000);
+    RelaySimulation(1.0);
+    RelaySimulation(0.95);
+    RelaySimulation(0.5);
+
+    CBlock block = MakeRelayBlock();
+    CTxMemPool pool;
+    FillRelayPool(pool, block, 1.0);
+    while (state.KeepRunning())
+    {
+        CRelayHop hop;
+        RelayCompactHop(block, pool, hop);
+    }
+}
+
+BENCHMARK(CompactBlockRelay);
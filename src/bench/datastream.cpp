@@ -0,0 +1,94 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+
+using namespace std;
+
+// Relaying a transaction with 2 inputs and 2 outputs: a received message
+// buffer, the unserialized transaction, and the message sent on
+template<typename Stream>
+static void RelayTransaction(benchmark::State& state)
+{
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vout.resize(2);
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+        txin.scriptSig = CScript() << vector<unsigned char>(72) << vector<unsigned char>(33);
+    BOOST_FOREACH(CTxOut& txout, tx.vout)
+        txout.scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    vector<char> vchMessage(ssTx.begin(), ssTx.end());
+
+    while (state.KeepRunning())
+    {
+        Stream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+        vRecv.resize(vchMessage.size());
+        memcpy(&vRecv[0], &vchMessage[0], vchMessage.size());
+        CTransaction txRecv;
+        vRecv >> txRecv;
+
+        Stream ssSend(SER_NETWORK, PROTOCOL_VERSION);
+        ssSend.reserve(4096);
+        ssSend << CMessageHeader("tx", 0) << txRecv;
+    }
+}
+
+static void RelayTransactionPooled(benchmark::State& state)
+{
+    RelayTransaction<CDataStream>(state);
+}
+
+static void RelayTransactionZeroed(benchmark::State& state)
+{
+    RelayTransaction<CSecureDataStream>(state);
+}
+
+// A block of 1000 pay-to-pubkey-hash spends, as stored on disk and relayed
+static CBlock PaymentsBlock()
+{
+    CBlock block;
+    block.vtx.resize(1000);
+    BOOST_FOREACH(CTransaction& tx, block.vtx)
+    {
+        tx.vin.resize(1);
+        tx.vout.resize(2);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72) << vector<unsigned char>(33);
+        BOOST_FOREACH(CTxOut& txout, tx.vout)
+            txout.scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return block;
+}
+
+static void SerializeBlock(benchmark::State& state)
+{
+    CBlock block = PaymentsBlock();
+    unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    while (state.KeepRunning())
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss.reserve(nSize);
+        ss << block;
+    }
+}
+
+static void DeserializeBlock(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << PaymentsBlock();
+    while (state.KeepRunning())
+    {
+        CDataStream ss(ssBlock.begin(), ssBlock.end(), SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        ss >> block;
+    }
+}
+
+BENCHMARK(RelayTransactionPooled);
+BENCHMARK(RelayTransactionZeroed);
+BENCHMARK(SerializeBlock);
+BENCHMARK(DeserializeBlock);
@@ -0,0 +1,87 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "hash.h"
+#include "main.h"
+
+using namespace std;
+
+// Double SHA-256 of an 80-byte block header, as for a block hash
+static void HashBlockHeader(benchmark::State& state)
+{
+    CBlockHeader header;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nBits = 0x1e0ffff0;
+    while (state.KeepRunning())
+    {
+        header.nNonce++;
+        Hash(BEGIN(header.nVersion), END(header.nNonce));
+    }
+}
+
+// Double SHA-256 of a megabyte
+static void Hash1MB(benchmark::State& state)
+{
+    vector<unsigned char> vch(1000000);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = i;
+    while (state.KeepRunning())
+        Hash(vch.begin(), vch.end());
+}
+
+// The txid of a 2-input, 2-output transaction, serialized and hashed
+static void SerializeHashTransaction(benchmark::State& state)
+{
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vout.resize(2);
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+    {
+        txin.prevout = COutPoint(GetRandHash(), 0);
+        txin.scriptSig = CScript() << vector<unsigned char>(72) << vector<unsigned char>(33);
+    }
+    BOOST_FOREACH(CTxOut& txout, tx.vout)
+        txout.scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    while (state.KeepRunning())
+    {
+        tx.nLockTime++;
+        SerializeHash(tx);
+    }
+}
+
+// A serialized outpoint, as bloom filters hash them
+static void MurmurHash3Outpoint(benchmark::State& state)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << COutPoint(GetRandHash(), 1);
+    vector<unsigned char> vch(ss.begin(), ss.end());
+    unsigned int nSeed = 0;
+    while (state.KeepRunning())
+        MurmurHash3(nSeed++, vch);
+}
+
+// The same outpoint for the 16 hash functions of a filter, prepared once
+static void MurmurHash3MultiOutpoint(benchmark::State& state)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << COutPoint(GetRandHash(), 1);
+    vector<unsigned int> vMixed;
+    MurmurHash3Prepare((const unsigned char*)&ss[0], ss.size(), vMixed);
+    unsigned int nSeeds[16], nHashes[16];
+    for (unsigned int i = 0; i < 16; i++)
+        nSeeds[i] = i * 0xFBA4C795;
+    while (state.KeepRunning())
+    {
+        nSeeds[0]++;
+        MurmurHash3Multi(nSeeds, 16, &vMixed[0], ss.size(), nHashes);
+    }
+}
+
+BENCHMARK(HashBlockHeader);
+BENCHMARK(Hash1MB);
+BENCHMARK(SerializeHashTransaction);
+BENCHMARK(MurmurHash3Outpoint);
+BENCHMARK(MurmurHash3MultiOutpoint);
@@ -0,0 +1,55 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "sha256.h"
+
+using namespace std;
+
+// Merkle root of a block with 2000 transactions, from their txids
+static const unsigned int nMerkleLeaves = 2000;
+
+static void MerkleRootBatched(benchmark::State& state)
+{
+    SHA256AutoDetect();
+    vector<uint256> vLeaves(nMerkleLeaves);
+    for (unsigned int i = 0; i < vLeaves.size(); i++)
+        vLeaves[i] = GetRandHash();
+
+    vector<uint256> vMerkleTree;
+    while (state.KeepRunning())
+    {
+        vMerkleTree = vLeaves;
+        BuildMerkleLevels(vMerkleTree, vLeaves.size());
+    }
+}
+
+// The OpenSSL path, one Hash() per node
+static void MerkleRootOpenSSL(benchmark::State& state)
+{
+    vector<uint256> vLeaves(nMerkleLeaves);
+    for (unsigned int i = 0; i < vLeaves.size(); i++)
+        vLeaves[i] = GetRandHash();
+
+    vector<uint256> vMerkleTree;
+    while (state.KeepRunning())
+    {
+        vMerkleTree = vLeaves;
+        int j = 0;
+        for (int nSize = vLeaves.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            for (int i = 0; i < nSize; i += 2)
+            {
+                int i2 = min(i+1, nSize-1);
+                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
+                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+            }
+            j += nSize;
+        }
+    }
+}
+
+BENCHMARK(MerkleRootBatched);
+BENCHMARK(MerkleRootOpenSSL);
@@ -0,0 +1,461 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blocktimings.h"
+#include "main.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "sha256.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+//
+// Offline block replay.
+//
+// Indexes the block files of a copied blocks/ directory, works out the best
+// chain in them, and feeds its blocks through ProcessBlock into a scratch
+// data directory, exactly as if they had come from the network during
+// initial download. Blocks below -from only build up the coin state; blocks
+// -from to -to are timed. The scratch directory can be kept and reused: the
+// state just below -from is saved in it, and restored for every later run
+// with the same -from, so the prefix is only replayed once.
+//
+
+CClientUIInterface uiInterface;
+
+static bool fTempDataDir;
+static size_t nBlockTreeDBCache, nCoinDBCache;
+static CCoinsViewDB* pcoinsdbview;
+static boost::thread_group threadGroup;
+
+// Only AbortNode asks for a shutdown: something went badly wrong
+void StartShutdown()
+{
+    fprintf(stderr, "Error: aborted, see debug output\n");
+    if (fTempDataDir)
+        boost::filesystem::remove_all(mapArgs["-datadir"]);
+    exit(1);
+}
+
+static void Usage()
+{
+    fprintf(stdout,
+        "Usage: replay_fedoracoin -blocksdir=<dir> [options]\n"
+        "\n"
+        "  -blocksdir=<dir>    blocks/ directory to replay blk?????.dat files from\n"
+        "  -from=<n>           first height to time (default: 1)\n"
+        "  -to=<n>             last height to replay (default: best height in -blocksdir)\n"
+        "  -datadir=<dir>      scratch data directory, kept afterwards; the state below -from\n"
+        "                      is saved in it and restored by later runs (default: a\n"
+        "                      temporary directory, removed afterwards)\n"
+        "  -dbcache=<n>        database cache size in megabytes (default: 25)\n"
+        "  -par=<n>            script verification threads, as for fedoracoind (default: 0)\n"
+        "  -checkpoints=0      verify scripts below the last checkpoint too\n"
+        "  -benchmarkcsv=<f>   write the timings of every block connected to <f>\n"
+        "  -printtoconsole     send debug output to the console\n");
+}
+
+// Where a block sits in the source files, and how it fits in the chain
+struct CReplayBlock
+{
+    int nFile;
+    unsigned int nPos;     // of the block itself, after the size
+    uint256 hashPrev;
+    int nHeight;           // -1 until it is linked to the genesis block
+    uint256 nChainWork;
+};
+
+static FILE* OpenSourceFile(const boost::filesystem::path& pathBlocks, int nFile)
+{
+    return fopen((pathBlocks / strprintf("blk%05u.dat", nFile)).string().c_str(), "rb");
+}
+
+// Reads the headers of every block in pathBlocks. Block files are written as
+// pchMessageStart, size, block, and zero-filled beyond the last block.
+static int IndexSourceBlocks(const boost::filesystem::path& pathBlocks, map<uint256, CReplayBlock>& mapBlocks)
+{
+    int nFile = 0;
+    for (; ; nFile++)
+    {
+        FILE* file = OpenSourceFile(pathBlocks, nFile);
+        if (!file)
+            break;
+        while (true)
+        {
+            unsigned char buf[8];
+            if (fread(buf, 1, sizeof(buf), file) != sizeof(buf) || memcmp(buf, pchMessageStart, 4))
+                break;
+            unsigned int nSize = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
+            unsigned int nPos = ftell(file);
+            CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+            CBlockHeader header;
+            try {
+                filein >> header;
+            } catch (std::exception &e) {
+                filein.release();
+                break;
+            }
+            filein.release();
+
+            CReplayBlock& block = mapBlocks[header.GetHash()];
+            block.nFile = nFile;
+            block.nPos = nPos;
+            block.hashPrev = header.hashPrevBlock;
+            block.nHeight = -1;
+            CBlockIndex index;
+            index.nBits = header.nBits;
+            block.nChainWork = index.GetBlockWork();
+
+            if (nSize < 80 || fseek(file, nPos + nSize, SEEK_SET))
+                break;
+        }
+        fclose(file);
+    }
+    return nFile;
+}
+
+// Links the indexed blocks to the genesis block and returns the chain with
+// the most work, by height
+static void FindBestSourceChain(map<uint256, CReplayBlock>& mapBlocks, vector<uint256>& vChain)
+{
+    multimap<uint256, uint256> mapChildren;
+    for (map<uint256, CReplayBlock>::iterator mi = mapBlocks.begin(); mi != mapBlocks.end(); ++mi)
+        mapChildren.insert(make_pair((*mi).second.hashPrev, (*mi).first));
+
+    vChain.clear();
+    map<uint256, CReplayBlock>::iterator miGenesis = mapBlocks.find(nGenesisBlockHash);
+    if (miGenesis == mapBlocks.end())
+        return;
+    (*miGenesis).second.nHeight = 0;
+    uint256 hashBest = nGenesisBlockHash;
+    vector<uint256> vQueue(1, nGenesisBlockHash);
+    for (unsigned int i = 0; i < vQueue.size(); i++)
+    {
+        const CReplayBlock& parent = mapBlocks[vQueue[i]];
+        for (multimap<uint256, uint256>::iterator mi = mapChildren.lower_bound(vQueue[i]); mi != mapChildren.upper_bound(vQueue[i]); ++mi)
+        {
+            CReplayBlock& child = mapBlocks[(*mi).second];
+            child.nHeight = parent.nHeight + 1;
+            child.nChainWork += parent.nChainWork;
+            if (child.nChainWork > mapBlocks[hashBest].nChainWork)
+                hashBest = (*mi).second;
+            vQueue.push_back((*mi).second);
+        }
+    }
+
+    vChain.resize(mapBlocks[hashBest].nHeight + 1);
+    for (uint256 hash = hashBest; hash != 0; hash = mapBlocks[hash].hashPrev)
+    {
+        vChain[mapBlocks[hash].nHeight] = hash;
+        if (hash == nGenesisBlockHash)
+            break;
+    }
+}
+
+static bool ReadSourceBlock(const boost::filesystem::path& pathBlocks, const CReplayBlock& entry, CBlock& block)
+{
+    CAutoFile filein(OpenSourceFile(pathBlocks, entry.nFile), SER_DISK, CLIENT_VERSION);
+    if (!filein || fseek(filein, entry.nPos, SEEK_SET))
+        return false;
+    try {
+        filein >> block;
+    } catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+// In kilobytes, or 0 where we can't tell
+static int64 GetPeakRSS()
+{
+#ifndef WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+#ifdef MAC_OSX
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+#endif
+    return 0;
+}
+
+static void OpenDatabases()
+{
+    pblocktree = new CBlockTreeDB(nBlockTreeDBCache);
+    pcoinsdbview = new CCoinsViewDB(nCoinDBCache);
+    pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+}
+
+static void CloseDatabases()
+{
+    if (pcoinsTip)
+    {
+        LOCK(cs_main);
+        pcoinsTip->Flush();
+        pblocktree->Sync();
+    }
+    delete pcoinsTip;
+    pcoinsTip = NULL;
+    delete pcoinsdbview;
+    pcoinsdbview = NULL;
+    delete pblocktree;
+    pblocktree = NULL;
+}
+
+// Stops the script threads, closes the databases and removes a temporary
+// data directory; returns nRet for main to return
+static int Finish(int nRet)
+{
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    CloseDatabases();
+    if (fTempDataDir)
+        boost::filesystem::remove_all(mapArgs["-datadir"]);
+    return nRet;
+}
+
+static void CopyDirectory(const boost::filesystem::path& pathFrom, const boost::filesystem::path& pathTo)
+{
+    boost::filesystem::create_directories(pathTo);
+    for (boost::filesystem::directory_iterator it(pathFrom); it != boost::filesystem::directory_iterator(); ++it)
+    {
+        if (boost::filesystem::is_directory(it->status()))
+            CopyDirectory(it->path(), pathTo / it->path().filename());
+        else
+            boost::filesystem::copy_file(it->path(), pathTo / it->path().filename());
+    }
+}
+
+// The block files and databases of the data directory, which make up the
+// chain state
+static const char* const pszStateDirs[] = { "blocks", "chainstate" };
+
+// Saves the chain state of the data directory to pathSnapshot. The
+// databases must be closed.
+static void SaveState(const boost::filesystem::path& pathSnapshot)
+{
+    boost::filesystem::path pathTmp = pathSnapshot.string() + ".tmp";
+    boost::filesystem::remove_all(pathTmp);
+    BOOST_FOREACH(const char* pszDir, pszStateDirs)
+        CopyDirectory(GetDataDir() / pszDir, pathTmp / pszDir);
+    // only a complete copy is ever used
+    boost::filesystem::rename(pathTmp, pathSnapshot);
+}
+
+// Replaces the chain state of the data directory by the one saved in
+// pathSnapshot. The databases must be closed.
+static void RestoreState(const boost::filesystem::path& pathSnapshot)
+{
+    BOOST_FOREACH(const char* pszDir, pszStateDirs)
+    {
+        boost::filesystem::remove_all(GetDataDir() / pszDir);
+        CopyDirectory(pathSnapshot / pszDir, GetDataDir() / pszDir);
+    }
+}
+
+// The highest height at or below nMaxHeight that an earlier run saved the
+// state at, or -1
+static int FindSnapshot(int nMaxHeight)
+{
+    int nBest = -1;
+    for (boost::filesystem::directory_iterator it(GetDataDir()); it != boost::filesystem::directory_iterator(); ++it)
+    {
+        std::string strName = it->path().filename().string();
+        if (strName.compare(0, 16, "replay_snapshot_") || !boost::filesystem::is_directory(it->status()))
+            continue;
+        int nHeight = atoi(strName.substr(16));
+        if (strName.substr(16) == strprintf("%d", nHeight) && nHeight <= nMaxHeight && nHeight > nBest)
+            nBest = nHeight;
+    }
+    return nBest;
+}
+
+static bool ReplayBlock(const boost::filesystem::path& pathBlocks, const CReplayBlock& entry, int nHeight,
+                        unsigned int& nTx, unsigned int& nSigOps, int64& nMicros)
+{
+    CBlock block;
+    if (!ReadSourceBlock(pathBlocks, entry, block))
+        return error("ReplayBlock() : failed to read block at height %d", nHeight);
+    nTx = block.vtx.size();
+    nSigOps = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        nSigOps += tx.GetLegacySigOpCount();
+
+    int64 nStart = GetTimeMicros();
+    CValidationState state;
+    LOCK(cs_main);
+    if (!ProcessBlock(state, NULL, &block) || nBestHeight != nHeight)
+        return error("ReplayBlock() : block at height %d not connected", nHeight);
+    nMicros = GetTimeMicros() - nStart;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help") || !mapArgs.count("-blocksdir"))
+    {
+        Usage();
+        return mapArgs.count("-blocksdir") ? 0 : 1;
+    }
+    fPrintToConsole = GetBoolArg("-printtoconsole");
+    fPrintToDebugger = !fPrintToConsole; // don't want to write to debug.log file
+    fBenchmark = GetBoolArg("-benchmark");
+    SHA256AutoDetect();
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+
+    boost::filesystem::path pathBlocks = GetArg("-blocksdir", "");
+    int nFrom = std::max((int)GetArg("-from", 1), 1);
+    int nTo = GetArg("-to", -1);
+
+    // Scratch data directory
+    fTempDataDir = !mapArgs.count("-datadir");
+    if (fTempDataDir)
+        mapArgs["-datadir"] = (GetTempPath() / strprintf("replay_fedoracoin_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000))).string();
+    boost::filesystem::create_directories(mapArgs["-datadir"]);
+
+    if (mapArgs.count("-benchmarkcsv") && !blockTimings.OpenCSV(GetArg("-benchmarkcsv", "")))
+    {
+        fprintf(stderr, "Error: cannot open %s\n", GetArg("-benchmarkcsv", "").c_str());
+        return Finish(1);
+    }
+
+    // The source chain
+    int64 nStart = GetTimeMillis();
+    map<uint256, CReplayBlock> mapSource;
+    int nFiles = IndexSourceBlocks(pathBlocks, mapSource);
+    vector<uint256> vChain;
+    FindBestSourceChain(mapSource, vChain);
+    if (vChain.empty())
+    {
+        fprintf(stderr, "Error: no chain found in %s\n", pathBlocks.string().c_str());
+        return Finish(1);
+    }
+    int nSourceHeight = vChain.size() - 1;
+    fprintf(stdout, "# indexed %u blocks in %d files in %"PRI64d"ms; best height %d\n",
+            (unsigned int)mapSource.size(), nFiles, GetTimeMillis() - nStart, nSourceHeight);
+    if (nTo < 0 || nTo > nSourceHeight)
+        nTo = nSourceHeight;
+    if (nFrom > nTo)
+    {
+        fprintf(stderr, "Error: nothing to replay between heights %d and %d\n", nFrom, nTo);
+        return Finish(1);
+    }
+
+    // Databases sized as fedoracoind sizes them for -dbcache
+    size_t nTotalCache = GetArg("-dbcache", 25) << 20;
+    if (nTotalCache < (1 << 22))
+        nTotalCache = (1 << 22);
+    nBlockTreeDBCache = std::min(nTotalCache / 8, (size_t)(1 << 21));
+    nTotalCache -= nBlockTreeDBCache;
+    nCoinDBCache = nTotalCache / 2;
+    nTotalCache -= nCoinDBCache;
+    nCoinCacheSize = nTotalCache / 300;
+
+    // The state below -from, or as close below it as an earlier run saved it
+    boost::filesystem::path pathSnapshot = GetDataDir() / strprintf("replay_snapshot_%d", nFrom - 1);
+    int nSnapshotHeight = fTempDataDir ? -1 : FindSnapshot(nFrom - 1);
+    bool fHaveSnapshot = (nSnapshotHeight == nFrom - 1);
+    if (nSnapshotHeight >= 0)
+    {
+        fprintf(stdout, "# restoring the state at height %d\n", nSnapshotHeight);
+        RestoreState(GetDataDir() / strprintf("replay_snapshot_%d", nSnapshotHeight));
+    }
+    else if (!fTempDataDir)
+    {
+        // Whatever chain an earlier run left can't be built on: start over
+        fprintf(stdout, "# no state saved at or below height %d, starting from genesis\n", nFrom - 1);
+        BOOST_FOREACH(const char* pszDir, pszStateDirs)
+            boost::filesystem::remove_all(GetDataDir() / pszDir);
+    }
+    boost::filesystem::create_directories(GetDataDir() / "blocks");
+
+    OpenDatabases();
+    if (!LoadBlockIndex() || !InitBlockIndex())
+    {
+        fprintf(stderr, "Error: cannot load the block index in %s\n", mapArgs["-datadir"].c_str());
+        return Finish(1);
+    }
+    if (nBestHeight >= nFrom || (nBestHeight > 0 && vChain[nBestHeight] != hashBestChain))
+    {
+        fprintf(stderr, "Error: the chain in %s is not a prefix of the one to replay\n", mapArgs["-datadir"].c_str());
+        return Finish(1);
+    }
+
+    // Script verification threads, as fedoracoind starts them for -par
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threadGroup.create_thread(&ThreadScriptCheck);
+
+    // Build up the coin state below the timed range
+    if (nBestHeight + 1 < nFrom)
+    {
+        fprintf(stdout, "# replaying heights %d to %d, not timed\n", nBestHeight + 1, nFrom - 1);
+        nStart = GetTimeMillis();
+        for (int nHeight = nBestHeight + 1; nHeight < nFrom; nHeight++)
+        {
+            unsigned int nTx, nSigOps;
+            int64 nMicros;
+            if (!ReplayBlock(pathBlocks, mapSource[vChain[nHeight]], nHeight, nTx, nSigOps, nMicros))
+            {
+                fprintf(stderr, "Error: block at height %d failed, see debug output\n", nHeight);
+                return Finish(1);
+            }
+        }
+        fprintf(stdout, "# done in %"PRI64d"ms\n", GetTimeMillis() - nStart);
+    }
+
+    // Save it for the next run. The block index stays loaded; only the
+    // databases are reopened.
+    if (!fTempDataDir && !fHaveSnapshot)
+    {
+        CloseDatabases();
+        SaveState(pathSnapshot);
+        OpenDatabases();
+    }
+
+    // The timed range. Reading the source files is not counted.
+    uint64 nBlocks = 0, nTxs = 0, nSigOpsTotal = 0;
+    int64 nMicrosTotal = 0;
+    for (int nHeight = nFrom; nHeight <= nTo; nHeight++)
+    {
+        unsigned int nTx, nSigOps;
+        int64 nMicros;
+        if (!ReplayBlock(pathBlocks, mapSource[vChain[nHeight]], nHeight, nTx, nSigOps, nMicros))
+        {
+            fprintf(stderr, "Error: block at height %d failed, see debug output\n", nHeight);
+            return Finish(1);
+        }
+        nBlocks++;
+        nTxs += nTx;
+        nSigOpsTotal += nSigOps;
+        nMicrosTotal += nMicros;
+    }
+    double dSeconds = std::max(nMicrosTotal * 0.000001, 0.000001);
+
+    fprintf(stdout, "# from,to,dbcache,par,blocks,txs,sigops,seconds,blocks_per_s,txs_per_s,sigops_per_s,peak_rss_kb\n");
+    fprintf(stdout, "%d,%d,%"PRI64d",%d,%"PRI64u",%"PRI64u",%"PRI64u",%.3f,%.2f,%.2f,%.2f,%"PRI64d"\n",
+            nFrom, nTo, GetArg("-dbcache", 25), nScriptCheckThreads,
+            nBlocks, nTxs, nSigOpsTotal, dSeconds,
+            nBlocks / dSeconds, nTxs / dSeconds, nSigOpsTotal / dSeconds, GetPeakRSS());
+
+    return Finish(0);
+}
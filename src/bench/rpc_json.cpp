@@ -0,0 +1,78 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bitcoinrpc.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// A sendrawtransaction request carrying a ~100kB transaction
+static string RawTransactionRequest()
+{
+    vector<unsigned char> vchTx(100000);
+    for (unsigned int i = 0; i < vchTx.size(); i++)
+        vchTx[i] = (unsigned char)(i * 7);
+    return "{\"jsonrpc\":\"1.0\",\"id\":\"curltest\",\"method\":\"sendrawtransaction\",\"params\":[\"" + HexStr(vchTx) + "\"]}";
+}
+
+// A JSON-RPC batch of 500 small calls, as sent by exchange back-ends
+static string BatchRequest()
+{
+    string strBatch = "[";
+    for (int i = 0; i < 500; i++)
+    {
+        if (i)
+            strBatch += ",";
+        strBatch += strprintf("{\"id\":%d,\"method\":\"sendmany\",\"params\":[\"hot\",{\"FEDaddr%d\":0.125,\"FEDother%d\":12.5e-3},6,\"payout\\tbatch\"]}", i, i, i);
+    }
+    return strBatch + "]";
+}
+
+static void ReadString(benchmark::State& state, const string& str)
+{
+    while (state.KeepRunning())
+    {
+        Value value;
+        if (!read_string(str, value))
+            throw runtime_error("parse error");
+    }
+}
+
+// the boost::spirit grammar, still used for stream input, for comparison
+static void ReadSpirit(benchmark::State& state, const string& str)
+{
+    while (state.KeepRunning())
+    {
+        Value value;
+        string::const_iterator begin = str.begin();
+        if (!read_range(begin, str.end(), value))
+            throw runtime_error("parse error");
+    }
+}
+
+static void JSONReadRawTransaction(benchmark::State& state)
+{
+    ReadString(state, RawTransactionRequest());
+}
+
+static void JSONReadRawTransactionSpirit(benchmark::State& state)
+{
+    ReadSpirit(state, RawTransactionRequest());
+}
+
+static void JSONReadBatch(benchmark::State& state)
+{
+    ReadString(state, BatchRequest());
+}
+
+static void JSONReadBatchSpirit(benchmark::State& state)
+{
+    ReadSpirit(state, BatchRequest());
+}
+
+BENCHMARK(JSONReadRawTransaction);
+BENCHMARK(JSONReadRawTransactionSpirit);
+BENCHMARK(JSONReadBatch);
+BENCHMARK(JSONReadBatchSpirit);
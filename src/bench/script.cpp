@@ -0,0 +1,76 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "keystore.h"
+#include "main.h"
+
+using namespace std;
+
+// A transaction with one input, signed for scriptPubKey
+static CTransaction SignedSpend(const CKeyStore& keystore, const CScript& scriptPubKey)
+{
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = COIN;
+    txFrom.vout[0].scriptPubKey = scriptPubKey;
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    if (!SignSignature(keystore, txFrom, tx, 0))
+        throw runtime_error("signing failed");
+    return tx;
+}
+
+// Full script evaluation of one input per iteration, bypassing the signature
+// cache so every OP_CHECKSIG really verifies
+static void VerifyInput(benchmark::State& state, const CTransaction& tx, const CScript& scriptPubKey)
+{
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_NOCACHE;
+    while (state.KeepRunning())
+    {
+        if (!VerifyScript(tx.vin[0].scriptSig, scriptPubKey, tx, 0, flags, 0))
+            throw runtime_error("verification failed");
+    }
+}
+
+static void VerifyScriptPayToPubKeyHash(benchmark::State& state)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    VerifyInput(state, SignedSpend(keystore, scriptPubKey), scriptPubKey);
+}
+
+// 2-of-3 multisig behind pay-to-script-hash
+static void VerifyScriptMultisigP2SH(benchmark::State& state)
+{
+    CBasicKeyStore keystore;
+    vector<CPubKey> vPubKeys;
+    for (int i = 0; i < 3; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        vPubKeys.push_back(key.GetPubKey());
+    }
+    CScript scriptMultisig;
+    scriptMultisig.SetMultisig(2, vPubKeys);
+    keystore.AddCScript(scriptMultisig);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(scriptMultisig.GetID());
+
+    VerifyInput(state, SignedSpend(keystore, scriptPubKey), scriptPubKey);
+}
+
+BENCHMARK(VerifyScriptPayToPubKeyHash);
+BENCHMARK(VerifyScriptMultisigP2SH);
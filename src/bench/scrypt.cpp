@@ -0,0 +1,41 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "scrypt.h"
+#include "uint256.h"
+
+// One proof of work hash of an 80-byte block header per iteration, with the
+// nonce changing each time as it does when mining
+static void Scrypt(benchmark::State& state, void (*pScrypt)(const char*, char*, char*))
+{
+    unsigned char header[80];
+    for (unsigned int i = 0; i < sizeof(header); i++)
+        header[i] = i;
+    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+    uint256 hash;
+    unsigned int nNonce = 0;
+    while (state.KeepRunning())
+    {
+        memcpy(&header[76], &nNonce, 4);
+        nNonce++;
+        pScrypt((const char*)header, BEGIN(hash), scratchpad);
+    }
+}
+
+static void ScryptGeneric(benchmark::State& state)
+{
+    Scrypt(state, &scrypt_1024_1_1_256_sp_generic);
+}
+
+#if defined(USE_SSE2)
+static void ScryptSSE2(benchmark::State& state)
+{
+    Scrypt(state, &scrypt_1024_1_1_256_sp_sse2);
+}
+
+BENCHMARK(ScryptSSE2);
+#endif
+
+BENCHMARK(ScryptGeneric);
@@ -0,0 +1,53 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+
+using namespace std;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+// A consolidation transaction spending 1000 pay-to-pubkey-hash outputs
+static CTransaction ConsolidationTx(CScript& scriptCode)
+{
+    CTransaction tx;
+    tx.vin.resize(1000);
+    tx.vout.resize(1);
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+    {
+        txin.prevout = COutPoint(GetRandHash(), 0);
+        txin.scriptSig = CScript() << vector<unsigned char>(72) << vector<unsigned char>(33);
+    }
+    scriptCode = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[0].scriptPubKey = scriptCode;
+    return tx;
+}
+
+// Signature hashes for all inputs, as checked when the transaction is validated
+static void SigHashAllInputs(benchmark::State& state)
+{
+    CScript scriptCode;
+    CTransaction tx = ConsolidationTx(scriptCode);
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL);
+    }
+}
+
+static void SigHashAllInputsCached(benchmark::State& state)
+{
+    CScript scriptCode;
+    CTransaction tx = ConsolidationTx(scriptCode);
+    while (state.KeepRunning())
+    {
+        CSigHashCache sighash(tx);
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            sighash.SignatureHash(scriptCode, i, SIGHASH_ALL);
+    }
+}
+
+BENCHMARK(SigHashAllInputs);
+BENCHMARK(SigHashAllInputsCached);
@@ -0,0 +1,86 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
+#include "bench.h"
+#include "key.h"
+#include "secp256k1.h"
+
+using namespace std;
+
+// 100 signatures by compressed keys over random hashes
+struct CVerifyInput
+{
+    uint256 hash;
+    vector<unsigned char> vchSig;
+    vector<unsigned char> vchPubKey;
+};
+
+static vector<CVerifyInput> VerifyInputs()
+{
+    vector<CVerifyInput> vInputs(100);
+    for (unsigned int i = 0; i < vInputs.size(); i++)
+    {
+        CVerifyInput& input = vInputs[i];
+        CKey key;
+        key.MakeNewKey(true);
+        CPubKey pubkey = key.GetPubKey();
+        input.hash = GetRandHash();
+        input.vchPubKey.assign(pubkey.begin(), pubkey.end());
+        if (!key.Sign(input.hash, input.vchSig))
+            throw runtime_error("signing failed");
+    }
+    return vInputs;
+}
+
+// One native signature check per iteration
+static void VerifyNative(benchmark::State& state)
+{
+    vector<CVerifyInput> vInputs = VerifyInputs();
+    unsigned int i = 0;
+    while (state.KeepRunning())
+    {
+        const CVerifyInput& input = vInputs[i++ % vInputs.size()];
+        if (Secp256k1Verify((const unsigned char*)&input.hash, &input.vchSig[0], input.vchSig.size(),
+                            &input.vchPubKey[0], input.vchPubKey.size()) != SECP256K1_VERIFY_VALID)
+            throw runtime_error("verification failed");
+    }
+}
+
+// CPubKey::Verify, which finds the keys already parsed in its cache
+static void VerifyCachedPubKey(benchmark::State& state)
+{
+    vector<CVerifyInput> vInputs = VerifyInputs();
+    unsigned int i = 0;
+    while (state.KeepRunning())
+    {
+        const CVerifyInput& input = vInputs[i++ % vInputs.size()];
+        if (!CPubKey(input.vchPubKey).Verify(input.hash, input.vchSig))
+            throw runtime_error("verification failed");
+    }
+}
+
+// The same check through OpenSSL, including parsing the public key
+static void VerifyOpenSSL(benchmark::State& state)
+{
+    vector<CVerifyInput> vInputs = VerifyInputs();
+    unsigned int i = 0;
+    while (state.KeepRunning())
+    {
+        const CVerifyInput& input = vInputs[i++ % vInputs.size()];
+        EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        const unsigned char* pbegin = &input.vchPubKey[0];
+        if (!o2i_ECPublicKey(&pkey, &pbegin, input.vchPubKey.size()) ||
+            ECDSA_verify(0, (const unsigned char*)&input.hash, sizeof(input.hash), &input.vchSig[0], input.vchSig.size(), pkey) != 1)
+            throw runtime_error("verification failed");
+        EC_KEY_free(pkey);
+    }
+}
+
+BENCHMARK(VerifyNative);
+BENCHMARK(VerifyCachedPubKey);
+BENCHMARK(VerifyOpenSSL);
@@ -254,6 +254,9 @@ static const CRPCCommand vRPCCommands[] =
     { "signmessage",            &signmessage,            false,     false,     true,     false },
     { "listaccounts",           &listaccounts,           false,     false,     true,     false },
     { "listsinceblock",         &listsinceblock,         false,     false,     true,     false },
+    { "rescanblockchain",       &rescanblockchain,       false,     false,     true,     true  },
+    { "abortrescan",            &abortrescan,            true,      true,      true,     false },
+    { "getrescaninfo",          &getrescaninfo,          true,      true,      true,     false },
     { "dumpprivkey",            &dumpprivkey,            true,      false,     true,     false },
     { "importprivkey",          &importprivkey,          false,     false,     true,     false },
     { "getrawtransaction",      &getrawtransaction,      false,     false,     false,    false },
@@ -286,12 +289,15 @@ static const CRPCCommand vRPCCommands[] =
     { "setgenerate",            &setgenerate,            true,      false,     true,     true  },
     { "gethashespersec",        &gethashespersec,        true,      false,     false,    true  },
     { "getrawmempool",          &getrawmempool,          true,      false,     false,    true  },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      false,     false,    true  },
     { "verifymessage",          &verifymessage,          false,     false,     false,    true  },
     { "settxfee",               &settxfee,               false,     false,     true,     true  },
     { "setmininput",            &setmininput,            false,     false,     false,    true  },
     { "signrawtransaction",     &signrawtransaction,     false,     false,     false,    false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,     false,    true  },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,     false,    true  },
+    { "getpubkeycacheinfo",     &getpubkeycacheinfo,     true,      true,      false,    true  },
+    { "getblocktimings",        &getblocktimings,        true,      true,      false,    true  },
     { "gettxout",               &gettxout,               true,      false,     false,    true  },
     { "verifychain",            &verifychain,            true,      false,     false,    true  },
     { "adduser",                &adduser,                true,      false,     false,    true  },
@@ -1284,6 +1290,7 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "rescanblockchain"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "sendmany"               && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "sendmany"               && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<boost::int64_t>(params[0]);
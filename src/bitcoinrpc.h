@@ -192,6 +192,9 @@ extern json_spirit::Value listtransactions(const json_spirit::Array& params, con
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
+extern json_spirit::Value rescanblockchain(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
+extern json_spirit::Value abortrescan(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
+extern json_spirit::Value getrescaninfo(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value gettransaction(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value backupwallet(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value keypoolrefill(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
@@ -219,9 +222,12 @@ extern json_spirit::Value getdifficulty(const json_spirit::Array& params, const
 extern json_spirit::Value settxfee(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value setmininput(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
+extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
+extern json_spirit::Value getpubkeycacheinfo(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
+extern json_spirit::Value getblocktimings(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
 extern json_spirit::Value createalert(const json_spirit::Array& params, const CRPCContext& ctx, bool fHelp);
@@ -0,0 +1,152 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "hash.h"
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nonce(GetRand(~(uint64)0)), shorttxids(block.vtx.size() - 1), prefilledtxn(1)
+{
+    header = block.GetBlockHeader();
+    FillShortTxIDSelector();
+
+    // The coinbase is the one transaction the peer can't have seen
+    prefilledtxn[0] = CPrefilledTransaction(0, block.vtx[0]);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        shorttxids[i - 1] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header << nonce;
+    uint256 hashKey = ss.GetHash();
+    shorttxidk0 = hashKey.Get64(0);
+    shorttxidk1 = hashKey.Get64(1);
+}
+
+uint64 CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+
+CPartiallyDownloadedBlock::ReadStatus CPartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    // Every transaction takes at least a few dozen bytes, so a block can't
+    // hold more than this many
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / 60)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtxAvailable.clear();
+    vtxAvailable.resize(cmpctblock.BlockTxCount());
+    nPrefilled = 0;
+    nFromMempool = 0;
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn)
+    {
+        if (prefilled.index >= vtxAvailable.size() || !vtxAvailable[prefilled.index].IsNull() || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtxAvailable[prefilled.index] = CTransactionRef(prefilled.tx);
+        nPrefilled++;
+    }
+
+    // Short ID -> index into the block, for the slots not prefilled
+    map<uint64, unsigned short> mapShortIDs;
+    unsigned int nShortID = 0;
+    for (unsigned int i = 0; i < vtxAvailable.size(); i++)
+    {
+        if (!vtxAvailable[i].IsNull())
+            continue;
+        if (nShortID >= cmpctblock.shorttxids.size())
+            return READ_STATUS_INVALID;
+        if (!mapShortIDs.insert(make_pair(cmpctblock.shorttxids[nShortID++], (unsigned short)i)).second)
+        {
+            // Two transactions of the block share a short ID. Rare enough
+            // with 48 bits that the full block is the simplest answer.
+            return READ_STATUS_FAILED;
+        }
+    }
+    if (nShortID != cmpctblock.shorttxids.size())
+        return READ_STATUS_INVALID;
+
+    // Transactions of the pool whose short ID matches a slot. Two pool
+    // transactions matching the same slot leave it empty, so that it is
+    // requested from the peer instead of guessed.
+    vector<bool> vFromPool(vtxAvailable.size(), false);
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTransactionRef>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            map<uint64, unsigned short>::const_iterator it = mapShortIDs.find(cmpctblock.GetShortID(mi->first));
+            if (it == mapShortIDs.end())
+                continue;
+            unsigned short index = it->second;
+            if (!vFromPool[index])
+            {
+                vtxAvailable[index] = mi->second;
+                vFromPool[index] = true;
+                nFromMempool++;
+            }
+            else if (!vtxAvailable[index].IsNull())
+            {
+                vtxAvailable[index] = CTransactionRef();
+                nFromMempool--;
+            }
+        }
+    }
+
+    return READ_STATUS_OK;
+}
+
+bool CPartiallyDownloadedBlock::IsTxAvailable(unsigned int index) const
+{
+    assert(!header.IsNull());
+    assert(index < vtxAvailable.size());
+    return !vtxAvailable[index].IsNull();
+}
+
+void CPartiallyDownloadedBlock::GetMissing(vector<unsigned short>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vtxAvailable.size(); i++)
+        if (vtxAvailable[i].IsNull())
+            vIndexes.push_back(i);
+}
+
+CPartiallyDownloadedBlock::ReadStatus CPartiallyDownloadedBlock::FillBlock(CBlock& block, const vector<CTransaction>& vtxMissing)
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vtx.resize(vtxAvailable.size());
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vtxAvailable.size(); i++)
+    {
+        if (!vtxAvailable[i].IsNull())
+            block.vtx[i] = *vtxAvailable[i];
+        else if (nMissing < vtxMissing.size())
+            block.vtx[i] = vtxMissing[nMissing++];
+        else
+            return READ_STATUS_INVALID;
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // Whatever happens now, this object has served its purpose
+    header.SetNull();
+    vtxAvailable.clear();
+
+    // A transaction from the pool that only shares a short ID with the real
+    // one gives the wrong Merkle root; that is not the peer's fault
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    return READ_STATUS_OK;
+}
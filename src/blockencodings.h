@@ -0,0 +1,223 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include <ios>
+#include <vector>
+
+#include "main.h"
+
+//
+// Compact block relay.
+//
+// A peer that already has most of a new block's transactions in its memory
+// pool does not need them sent again. Instead of "block" we send
+// "cmpctblock": the header, a 6-byte short ID for each transaction and the
+// coinbase, which the peer cannot have seen. The peer rebuilds the block from
+// its memory pool, asks for whatever it is missing with "getblocktxn" and
+// gets those transactions back in "blocktxn". The rebuilt block then goes
+// through ProcessBlock exactly like one received in full.
+//
+// Lists of transaction indexes are differentially encoded: each entry is
+// sent as its distance from the previous index plus one, which keeps them to
+// a single byte for all but very sparse lists.
+//
+
+// Short IDs are this many bytes of SipHash(txid)
+static const int SHORTTXIDS_LENGTH = 6;
+
+/** Wrapper for serializing a list of increasing transaction indexes,
+ * differentially encoded (see above) with a COMPACTSIZE per index. Throws on
+ * indexes that do not fit an unsigned short, which is more than any block can
+ * hold. */
+class CTxIndexes
+{
+protected:
+    std::vector<unsigned short> &vIndexes;
+public:
+    CTxIndexes(std::vector<unsigned short>& vIndexesIn) : vIndexes(vIndexesIn) { }
+
+    unsigned int GetSerializeSize(int, int) const
+    {
+        unsigned int nSize = GetSizeOfCompactSize(vIndexes.size());
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+            nSize += GetSizeOfCompactSize(vIndexes[i] - (i == 0 ? 0 : vIndexes[i-1] + 1));
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int, int) const
+    {
+        WriteCompactSize(s, vIndexes.size());
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+            WriteCompactSize(s, vIndexes[i] - (i == 0 ? 0 : vIndexes[i-1] + 1));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int, int)
+    {
+        uint64 nCount = ReadCompactSize(s);
+        if (nCount > 0xffff)
+            throw std::ios_base::failure("CTxIndexes::Unserialize() : too many indexes");
+        vIndexes.resize(nCount);
+        uint64 nNext = 0;
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+        {
+            uint64 nDiff = ReadCompactSize(s);
+            if (nDiff > 0xffff || nNext + nDiff > 0xffff)
+                throw std::ios_base::failure("CTxIndexes::Unserialize() : index overflowed 16 bits");
+            vIndexes[i] = nNext + nDiff;
+            nNext = vIndexes[i] + 1;
+        }
+    }
+};
+
+#define TXINDEXES(obj) REF(CTxIndexes(REF(obj)))
+
+/** "getblocktxn": the transactions of a compact block that we could not find */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned short> indexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(TXINDEXES(indexes));
+    )
+};
+
+/** "blocktxn": the answer to a getblocktxn, in the order they were asked for */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    CBlockTransactions() { }
+    explicit CBlockTransactions(const CBlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(txn);
+    )
+};
+
+/** A transaction sent whole inside a compact block, at the given index */
+class CPrefilledTransaction
+{
+public:
+    unsigned short index;
+    CTransaction tx;
+
+    CPrefilledTransaction() : index(0) { }
+    CPrefilledTransaction(unsigned short indexIn, const CTransaction& txIn) : index(indexIn), tx(txIn) { }
+};
+
+/** "cmpctblock": a block header, the short IDs of its transactions and the
+ * transactions the receiver is not expected to have (just the coinbase).
+ *
+ * The SipHash key for short IDs is derived from the header and a nonce picked
+ * by the sender, so nobody can grind transactions that collide in every
+ * block, and a collision in one block is gone in the next.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64 shorttxidk0, shorttxidk1;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    CBlockHeader header;
+    uint64 nonce;
+    std::vector<uint64> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : shorttxidk0(0), shorttxidk1(0), nonce(0) { }
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64 GetShortID(const uint256& txhash) const;
+
+    unsigned int BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64 nShortIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortIDs));
+        if (fRead)
+        {
+            if (nShortIDs > MAX_BLOCK_SIZE / SHORTTXIDS_LENGTH)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many short IDs");
+            pthis->shorttxids.resize(nShortIDs);
+        }
+        for (unsigned int i = 0; i < nShortIDs; i++)
+        {
+            unsigned int nLow = pthis->shorttxids[i] & 0xffffffff;
+            unsigned short nHigh = (pthis->shorttxids[i] >> 32) & 0xffff;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (fRead)
+                pthis->shorttxids[i] = ((uint64)nHigh << 32) | nLow;
+        }
+
+        std::vector<unsigned short> vIndexes;
+        for (unsigned int i = 0; i < prefilledtxn.size(); i++)
+            vIndexes.push_back(prefilledtxn[i].index);
+        READWRITE(TXINDEXES(vIndexes));
+        if (fRead)
+        {
+            pthis->prefilledtxn.resize(vIndexes.size());
+            for (unsigned int i = 0; i < vIndexes.size(); i++)
+                pthis->prefilledtxn[i].index = vIndexes[i];
+        }
+        for (unsigned int i = 0; i < prefilledtxn.size(); i++)
+            READWRITE(pthis->prefilledtxn[i].tx);
+
+        if (fRead)
+            FillShortTxIDSelector();
+    )
+};
+
+/** A block being rebuilt from a compact block and the memory pool */
+class CPartiallyDownloadedBlock
+{
+private:
+    // One entry per transaction of the block; null where still missing
+    std::vector<CTransactionRef> vtxAvailable;
+    unsigned int nPrefilled, nFromMempool;
+
+public:
+    enum ReadStatus
+    {
+        READ_STATUS_OK,
+        READ_STATUS_INVALID,    // the peer sent us something malformed
+        READ_STATUS_FAILED,     // could not rebuild the block, ask for it in full
+    };
+
+    CBlockHeader header;
+
+    CPartiallyDownloadedBlock() : nPrefilled(0), nFromMempool(0) { }
+
+    // Fills in what can be found in pool, which is locked while it is scanned
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+    bool IsTxAvailable(unsigned int index) const;
+    void GetMissing(std::vector<unsigned short>& vIndexes) const;
+    // Completes the block with vtxMissing, which holds the missing
+    // transactions in index order, and checks it against the header's
+    // Merkle root
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing);
+
+    unsigned int GetPrefilledCount() const { return nPrefilled; }
+    unsigned int GetMempoolCount() const { return nFromMempool; }
+};
+
+#endif
@@ -0,0 +1,137 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blocktimings.h"
+#include "util.h"
+
+#include <algorithm>
+
+using namespace std;
+
+CBlockTimings blockTimings;
+
+static const char* pszStageNames[BLOCKTIMING_STAGES] =
+{
+    "read",
+    "pow",
+    "checkblock",
+    "inputs",
+    "scripts",
+    "scriptwait",
+    "undo",
+    "wallet",
+    "flush",
+    "total",
+};
+
+const char* GetBlockTimingStageName(int nStage)
+{
+    assert(nStage >= 0 && nStage < BLOCKTIMING_STAGES);
+    return pszStageNames[nStage];
+}
+
+int CBlockTimings::GetBucket(int64 nMicros)
+{
+    int nBucket = 0;
+    while (nMicros > 1 && nBucket < BLOCKTIMING_BUCKETS - 1)
+    {
+        nMicros >>= 1;
+        nBucket++;
+    }
+    return nBucket;
+}
+
+CBlockTimings::CBlockTimings() : nNext(0), nBlocks(0), fileCSV(NULL)
+{
+    memset(nBuckets, 0, sizeof(nBuckets));
+}
+
+CBlockTimings::~CBlockTimings()
+{
+    CloseCSV();
+}
+
+bool CBlockTimings::OpenCSV(const string& strPath)
+{
+    LOCK(cs);
+    if (fileCSV)
+        fclose(fileCSV);
+    fileCSV = fopen(strPath.c_str(), "a");
+    if (!fileCSV)
+        return false;
+    fseek(fileCSV, 0, SEEK_END);
+    if (ftell(fileCSV) == 0)
+    {
+        fprintf(fileCSV, "height,hash,txs,inputs");
+        for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+            fprintf(fileCSV, ",%s_us", pszStageNames[i]);
+        fprintf(fileCSV, "\n");
+    }
+    return true;
+}
+
+void CBlockTimings::CloseCSV()
+{
+    LOCK(cs);
+    if (fileCSV)
+        fclose(fileCSV);
+    fileCSV = NULL;
+}
+
+void CBlockTimings::Add(const CBlockTimingSample& sample)
+{
+    LOCK(cs);
+    if (vSamples.size() < BLOCKTIMING_WINDOW)
+        vSamples.push_back(sample);
+    else
+    {
+        // Take the oldest out of the histograms
+        for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+            nBuckets[i][GetBucket(vSamples[nNext].nMicros[i])]--;
+        vSamples[nNext] = sample;
+    }
+    nNext = (nNext + 1) % BLOCKTIMING_WINDOW;
+    nBlocks++;
+    for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+        nBuckets[i][GetBucket(sample.nMicros[i])]++;
+
+    if (fileCSV)
+    {
+        fprintf(fileCSV, "%d,%s,%u,%u", sample.nHeight, sample.hashBlock.ToString().c_str(), sample.nTx, sample.nInputs);
+        for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+            fprintf(fileCSV, ",%"PRI64d, sample.nMicros[i]);
+        fprintf(fileCSV, "\n");
+        fflush(fileCSV);
+    }
+}
+
+void CBlockTimings::GetStats(CBlockTimingStats& stats) const
+{
+    LOCK(cs);
+    stats.nBlocks = nBlocks;
+    stats.nWindow = vSamples.size();
+    memcpy(stats.nBuckets, nBuckets, sizeof(nBuckets));
+    if (!vSamples.empty())
+        stats.last = vSamples[(nNext + vSamples.size() - 1) % vSamples.size()];
+
+    vector<int64> vMicros(vSamples.size());
+    for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+    {
+        stats.nTotal[i] = 0;
+        stats.nMax[i] = 0;
+        stats.nMedian[i] = stats.n90th[i] = stats.n99th[i] = 0;
+        if (vSamples.empty())
+            continue;
+        for (unsigned int j = 0; j < vSamples.size(); j++)
+        {
+            vMicros[j] = vSamples[j].nMicros[i];
+            stats.nTotal[i] += vMicros[j];
+            stats.nMax[i] = max(stats.nMax[i], vMicros[j]);
+        }
+        sort(vMicros.begin(), vMicros.end());
+        stats.nMedian[i] = vMicros[vMicros.size() / 2];
+        stats.n90th[i] = vMicros[vMicros.size() * 90 / 100];
+        stats.n99th[i] = vMicros[vMicros.size() * 99 / 100];
+    }
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKTIMINGS_H
+#define BITCOIN_BLOCKTIMINGS_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "sync.h"
+#include "uint256.h"
+
+//
+// Where the time connecting a block to the best chain goes.
+//
+// SetBestChain and ConnectBlock fill in a CBlockTimingSample for every block
+// they connect, and hand it to blockTimings. That keeps a histogram of each
+// stage over the last BLOCKTIMING_WINDOW blocks (getblocktimings) and, with
+// -benchmarkcsv, writes every sample to a CSV file.
+//
+
+enum BlockTimingStage
+{
+    BLOCKTIMING_READ,           // reading and deserializing the block
+    BLOCKTIMING_POW,            // checking its proof of work
+    BLOCKTIMING_CHECK,          // the rest of CheckBlock
+    BLOCKTIMING_INPUTS,         // fetching and checking the coins it spends
+    BLOCKTIMING_SCRIPTS,        // verifying scripts, wall time, including...
+    BLOCKTIMING_SCRIPTWAIT,     // ...waiting for the script check threads
+    BLOCKTIMING_UNDO,           // writing undo data and index entries
+    BLOCKTIMING_WALLET,         // SyncWithWallets
+    BLOCKTIMING_FLUSH,          // flushing the coin changes
+    BLOCKTIMING_TOTAL,
+    BLOCKTIMING_STAGES
+};
+
+// Histogram bucket i counts times in [2^i, 2^(i+1)) microseconds, except that
+// the first also counts zero and the last everything above
+static const int BLOCKTIMING_BUCKETS = 26;
+// Blocks covered by the histograms
+static const unsigned int BLOCKTIMING_WINDOW = 1000;
+
+const char* GetBlockTimingStageName(int nStage);
+
+class CBlockTimingSample
+{
+public:
+    uint256 hashBlock;
+    int nHeight;
+    unsigned int nTx;
+    unsigned int nInputs;
+    int64 nMicros[BLOCKTIMING_STAGES];
+
+    CBlockTimingSample()
+    {
+        hashBlock = 0;
+        nHeight = -1;
+        nTx = 0;
+        nInputs = 0;
+        for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+            nMicros[i] = 0;
+    }
+};
+
+class CBlockTimingStats
+{
+public:
+    uint64 nBlocks;     // since startup
+    unsigned int nWindow;
+    int64 nTotal[BLOCKTIMING_STAGES];
+    int64 nMax[BLOCKTIMING_STAGES];
+    int64 nMedian[BLOCKTIMING_STAGES];
+    int64 n90th[BLOCKTIMING_STAGES];
+    int64 n99th[BLOCKTIMING_STAGES];
+    unsigned int nBuckets[BLOCKTIMING_STAGES][BLOCKTIMING_BUCKETS];
+    CBlockTimingSample last;
+};
+
+/** Per-stage timings of the last BLOCKTIMING_WINDOW blocks connected */
+class CBlockTimings
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<CBlockTimingSample> vSamples;   // ring buffer
+    unsigned int nNext;
+    uint64 nBlocks;
+    unsigned int nBuckets[BLOCKTIMING_STAGES][BLOCKTIMING_BUCKETS];
+    FILE* fileCSV;
+
+public:
+    static int GetBucket(int64 nMicros);
+
+    CBlockTimings();
+    ~CBlockTimings();
+
+    // Starts writing every sample to strPath, appending if it exists
+    bool OpenCSV(const std::string& strPath);
+    void CloseCSV();
+
+    void Add(const CBlockTimingSample& sample);
+    void GetStats(CBlockTimingStats& stats) const;
+};
+
+extern CBlockTimings blockTimings;
+
+#endif
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "bloom.h"
+#include "hash.h"
 #include "main.h"
 #include "script.h"
 
@@ -99,7 +100,41 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
+bool CBloomFilter::contains(const CBloomTxData& data, const CBloomTxData::Element& element) const
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    // The hashes four at a time, stopping at the first group with a bit unset
+    unsigned int nSeeds[4];
+    unsigned int nHashes[4];
+    for (unsigned int i = 0; i < nHashFuncs; i += 4)
+    {
+        unsigned int n = min(nHashFuncs - i, 4U);
+        for (unsigned int j = 0; j < n; j++)
+            nSeeds[j] = (i + j) * 0xFBA4C795 + nTweak;
+        MurmurHash3Multi(nSeeds, n, &data.vMixed[element.nOffset], element.nSize, nHashes);
+        for (unsigned int j = 0; j < n; j++)
+        {
+            unsigned int nIndex = nHashes[j] % (vData.size() * 8);
+            if (!(vData[nIndex >> 3] & bit_mask[7 & nIndex]))
+                return false;
+        }
+    }
+    return true;
+}
+
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(tx, CBloomTxData(tx, hash));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const CBloomTxData& data)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -108,35 +143,29 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
         return true;
     if (isEmpty)
         return false;
-    if (contains(hash))
+    if (contains(data, data.vElements[0]))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    for (unsigned int i = 0; i + 1 < data.vOutputBegin.size(); i++)
     {
-        const CTxOut& txout = tx.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (unsigned int j = data.vOutputBegin[i]; j < data.vOutputBegin[i + 1]; j++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(data, data.vElements[j]))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
+                    insert(COutPoint(data.hash, i));
                 else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
                 {
                     txnouttype type;
                     vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
+                    if (Solver(tx.vout[i].scriptPubKey, type, vSolutions) &&
                             (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
+                        insert(COutPoint(data.hash, i));
                 }
                 break;
             }
@@ -146,25 +175,12 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+    // Match if the filter contains an outpoint tx spends, or any arbitrary
+    // script data element in any scriptSig in tx
+    for (unsigned int j = data.vInputBegin[0]; j < data.vInputBegin.back(); j++)
+        if (contains(data, data.vElements[j]))
             return true;
 
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
-        {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-                return true;
-        }
-    }
-
     return false;
 }
 
@@ -180,3 +196,131 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CBloomTxData::CBloomTxData(const CTransaction& tx, const uint256& hashIn) : hash(hashIn)
+{
+    // Room for all the data, plus some partial blocks, so that the common
+    // transactions are prepared without reallocating
+    unsigned int nBytes = hash.size();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nBytes += txout.scriptPubKey.size();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nBytes += 36 + txin.scriptSig.size();
+    vMixed.reserve(nBytes / 4 + 2 * (tx.vout.size() + tx.vin.size()) + 1);
+    vElements.reserve(1 + 2 * tx.vout.size() + 3 * tx.vin.size());
+    vector<unsigned char> vchBuf;
+
+    AddElement(hash.begin(), hash.size());
+
+    vOutputBegin.reserve(tx.vout.size() + 1);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        vOutputBegin.push_back(vElements.size());
+        AddScriptElements(txout.scriptPubKey, vchBuf);
+    }
+    vOutputBegin.push_back(vElements.size());
+
+    vInputBegin.reserve(tx.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        vInputBegin.push_back(vElements.size());
+        // The outpoint as serialized, its hash then n
+        unsigned char pchOutpoint[36];
+        memcpy(pchOutpoint, txin.prevout.hash.begin(), 32);
+        memcpy(pchOutpoint + 32, &txin.prevout.n, 4);
+        AddElement(pchOutpoint, sizeof(pchOutpoint));
+        AddScriptElements(txin.scriptSig, vchBuf);
+    }
+    vInputBegin.push_back(vElements.size());
+}
+
+void CBloomTxData::AddElement(const unsigned char* pch, unsigned int nSize)
+{
+    Element element;
+    element.nOffset = vMixed.size();
+    element.nSize = nSize;
+    vElements.push_back(element);
+    MurmurHash3Prepare(pch, nSize, vMixed);
+}
+
+void CBloomTxData::AddScriptElements(const CScript& script, vector<unsigned char>& vchBuf)
+{
+    CScript::const_iterator pc = script.begin();
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, vchBuf))
+            break;
+        if (vchBuf.size() != 0)
+            AddElement(&vchBuf[0], vchBuf.size());
+    }
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate) :
+    nGenerationSize(max(nElements, 1u)), nInsertions(0), nCurrent(0)
+{
+    // Sized as in CBloomFilter, without its protocol limits
+    unsigned int nBits = max((unsigned int)(-1 / LN2SQUARED * nGenerationSize * log(nFPRate)), 64u);
+    nHashFuncs = max(min((unsigned int)(nBits / nGenerationSize * LN2), MAX_HASH_FUNCS), 1u);
+    vData[0].resize((nBits + 7) / 8);
+    vData[1].resize((nBits + 7) / 8);
+    uint256 key = GetRandHash();
+    k0 = key.Get64(0);
+    k1 = key.Get64(1);
+}
+
+// Bit i of nHashFuncs for hash is (nHash1 + i * nHash2) mod the number of
+// bits, with both halves taken from one SipHash
+void CRollingBloomFilter::GetHashes(const uint256& hash, unsigned int& nHash1, unsigned int& nHash2) const
+{
+    uint64 nHash = SipHashUint256(k0, k1, hash);
+    nHash1 = (unsigned int)nHash;
+    nHash2 = (unsigned int)(nHash >> 32) | 1;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nInsertions == nGenerationSize)
+    {
+        nCurrent ^= 1;
+        fill(vData[nCurrent].begin(), vData[nCurrent].end(), 0);
+        nInsertions = 0;
+    }
+    unsigned int nHash1, nHash2;
+    GetHashes(hash, nHash1, nHash2);
+    vector<unsigned char>& vBits = vData[nCurrent];
+    unsigned int nBits = vBits.size() * 8;
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = (nHash1 + i * nHash2) % nBits;
+        vBits[nIndex >> 3] |= bit_mask[7 & nIndex];
+    }
+    nInsertions++;
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    unsigned int nHash1, nHash2;
+    GetHashes(hash, nHash1, nHash2);
+    for (int nGeneration = 0; nGeneration < 2; nGeneration++)
+    {
+        const vector<unsigned char>& vBits = vData[nGeneration];
+        unsigned int nBits = vBits.size() * 8;
+        bool fFound = true;
+        for (unsigned int i = 0; fFound && i < nHashFuncs; i++)
+        {
+            unsigned int nIndex = (nHash1 + i * nHash2) % nBits;
+            fFound = (vBits[nIndex >> 3] & bit_mask[7 & nIndex]) != 0;
+        }
+        if (fFound)
+            return true;
+    }
+    return false;
+}
+
+void CRollingBloomFilter::clear()
+{
+    fill(vData[0].begin(), vData[0].end(), 0);
+    fill(vData[1].begin(), vData[1].end(), 0);
+    nInsertions = 0;
+}
@@ -10,6 +10,7 @@
 #include "serialize.h"
 
 class COutPoint;
+class CScript;
 class CTransaction;
 
 // 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
@@ -27,6 +28,40 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that CBloomFilter::IsRelevantAndUpdate
+ * looks for: its hash, the data pushed by each output script, and the
+ * outpoint and pushed data of each input. Each element is stored as
+ * MurmurHash3Prepare leaves it, so building one of these does the hashing
+ * work that is the same for every filter, and matching it against the
+ * filters of any number of peers only does the rest.
+ */
+class CBloomTxData
+{
+public:
+    // nSize bytes of data, prepared into vMixed from nOffset on
+    struct Element
+    {
+        unsigned int nOffset;
+        unsigned int nSize;
+    };
+
+    uint256 hash;
+    std::vector<unsigned int> vMixed;
+    // vElements[0] is the hash. The elements of output i run from
+    // vOutputBegin[i] to vOutputBegin[i+1], and those of input i, starting
+    // with its outpoint, from vInputBegin[i] to vInputBegin[i+1].
+    std::vector<Element> vElements;
+    std::vector<unsigned int> vOutputBegin;
+    std::vector<unsigned int> vInputBegin;
+
+    CBloomTxData(const CTransaction& tx, const uint256& hashIn);
+
+private:
+    void AddElement(const unsigned char* pch, unsigned int nSize);
+    void AddScriptElements(const CScript& script, std::vector<unsigned char>& vchBuf);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we sends them.
@@ -49,6 +84,7 @@ private:
     unsigned char nFlags;
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    bool contains(const CBloomTxData& data, const CBloomTxData::Element& element) const;
 
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -83,9 +119,46 @@ public:
 
     // Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash);
+    // The same, with the data elements of tx already prepared
+    bool IsRelevantAndUpdate(const CTransaction& tx, const CBloomTxData& data);
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
+    // Whether IsRelevantAndUpdate matches all transactions or none, without
+    // looking into them
+    bool IsEmptyOrFull() const { return isEmpty || isFull; }
+};
+
+/**
+ * RollingBloomFilter remembers the hashes most recently inserted into it:
+ * contains() is true for at least the last nElements inserted, and for
+ * anything else with about twice nFPRate probability.
+ *
+ * It keeps two generations of bits, each sized like a CBloomFilter for
+ * nElements, and clears the older one to start a new generation whenever
+ * the current one has had nElements inserted. Positions come from a single
+ * SipHash of the hash with a key of its own, so unlike CBloomFilter this is
+ * cheap enough to check for every peer on every relay, and peers cannot
+ * aim collisions at it. It is for local use only and never serialized.
+ */
+class CRollingBloomFilter
+{
+private:
+    std::vector<unsigned char> vData[2];
+    unsigned int nHashFuncs;
+    unsigned int nGenerationSize;
+    unsigned int nInsertions;       // into the current generation
+    int nCurrent;
+    uint64 k0, k1;
+
+    void GetHashes(const uint256& hash, unsigned int& nHash1, unsigned int& nHash2) const;
+
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+    void clear();
 };
 
 #endif /* BITCOIN_BLOOM_H */
@@ -1,5 +1,9 @@
 #include "hash.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
     return (x << r) | (x >> (32 - r));
@@ -56,3 +60,145 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     return h1;
 }
+
+// MurmurHash3 mixes each 4-byte block of the data on its own, the same way
+// whatever the seed, before folding it into the seeded state
+static inline uint32_t MurmurHash3MixBlock(uint32_t k1)
+{
+    k1 *= 0xcc9e2d51;
+    k1 = ROTL32(k1, 15);
+    k1 *= 0x1b873593;
+    return k1;
+}
+
+void MurmurHash3Prepare(const unsigned char* pch, unsigned int nSize, std::vector<unsigned int>& vMixed)
+{
+    const unsigned int nBlocks = nSize / 4;
+    size_t nOffset = vMixed.size();
+    vMixed.resize(nOffset + (nSize + 3) / 4);
+    if (nSize == 0)
+        return;
+    unsigned int* pnMixed = &vMixed[nOffset];
+    for (unsigned int i = 0; i < nBlocks; i++)
+    {
+        uint32_t k1;
+        memcpy(&k1, pch + i * 4, 4);
+        pnMixed[i] = MurmurHash3MixBlock(k1);
+    }
+
+    const uint8_t* tail = pch + nBlocks * 4;
+    uint32_t k1 = 0;
+    switch (nSize & 3)
+    {
+    case 3: k1 ^= tail[2] << 16;
+    case 2: k1 ^= tail[1] << 8;
+    case 1: k1 ^= tail[0];
+            pnMixed[nBlocks] = MurmurHash3MixBlock(k1);
+    };
+}
+
+#if defined(__SSE2__)
+// SSE2 has no 32-bit multiply keeping the low halves; make one from two
+// 32x32->64 multiplies of the even and odd lanes
+static inline __m128i mullo_epi32(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+void MurmurHash3Multi(const unsigned int* pnSeeds, unsigned int nSeeds, const unsigned int* pnMixed, unsigned int nSize, unsigned int* pnHashes)
+{
+    const unsigned int nBlocks = nSize / 4;
+    unsigned int i = 0;
+
+#if defined(__SSE2__)
+    // Four seeds at a time, one in each lane
+    for (; i + 4 <= nSeeds; i += 4)
+    {
+        __m128i h1 = _mm_loadu_si128((const __m128i*)(pnSeeds + i));
+        for (unsigned int j = 0; j < nBlocks; j++)
+        {
+            h1 = _mm_xor_si128(h1, _mm_set1_epi32(pnMixed[j]));
+            h1 = _mm_or_si128(_mm_slli_epi32(h1, 13), _mm_srli_epi32(h1, 19));
+            h1 = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(h1, 2), h1), _mm_set1_epi32(0xe6546b64));
+        }
+        if (nSize & 3)
+            h1 = _mm_xor_si128(h1, _mm_set1_epi32(pnMixed[nBlocks]));
+
+        h1 = _mm_xor_si128(h1, _mm_set1_epi32(nSize));
+        h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+        h1 = mullo_epi32(h1, _mm_set1_epi32(0x85ebca6b));
+        h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 13));
+        h1 = mullo_epi32(h1, _mm_set1_epi32(0xc2b2ae35));
+        h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+        _mm_storeu_si128((__m128i*)(pnHashes + i), h1);
+    }
+#endif
+
+    for (; i < nSeeds; i++)
+    {
+        uint32_t h1 = pnSeeds[i];
+        for (unsigned int j = 0; j < nBlocks; j++)
+        {
+            h1 ^= pnMixed[j];
+            h1 = ROTL32(h1, 13);
+            h1 = h1*5+0xe6546b64;
+        }
+        if (nSize & 3)
+            h1 ^= pnMixed[nBlocks];
+
+        h1 ^= nSize;
+        h1 ^= h1 >> 16;
+        h1 *= 0x85ebca6b;
+        h1 ^= h1 >> 13;
+        h1 *= 0xc2b2ae35;
+        h1 ^= h1 >> 16;
+        pnHashes[i] = h1;
+    }
+}
+
+#define ROTL64(x, b) (uint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; \
+    v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; \
+    v2 = ROTL64(v2, 32); \
+} while (0)
+
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val)
+{
+    // SipHash-2-4 (https://131002.net/siphash/) unrolled for exactly four
+    // 64-bit words of input
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 m = val.Get64(i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // final block: no data, length 32 in the top byte
+    uint64 m = ((uint64)32) << 56;
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -40,6 +40,13 @@ public:
         Init();
     }
 
+    // Resume hashing from a state saved with GetState()
+    CHashWriter(int nTypeIn, int nVersionIn, const SHA256_CTX& ctxIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    const SHA256_CTX& GetState() const {
+        return ctx;
+    }
+
     CHashWriter& write(const char *pch, size_t size) {
         SHA256_Update(&ctx, pch, size);
         return (*this);
@@ -123,4 +130,17 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** MurmurHash3 in two steps, for data hashed with many seeds. The blocks of
+ * the data are mixed once by MurmurHash3Prepare, which appends (nSize+3)/4
+ * words to vMixed; MurmurHash3Multi then finishes the hashes of those words
+ * for nSeeds seeds at once, several in parallel where SSE2 is available.
+ * pnHashes[i] is MurmurHash3(pnSeeds[i], data). */
+void MurmurHash3Prepare(const unsigned char* pch, unsigned int nSize, std::vector<unsigned int>& vMixed);
+void MurmurHash3Multi(const unsigned int* pnSeeds, unsigned int nSeeds, const unsigned int* pnMixed, unsigned int nSize, unsigned int* pnHashes);
+
+/** SipHash-2-4 of a 256-bit value, keyed with (k0, k1). Much cheaper than
+ * SHA-256 and safe against inputs chosen by peers that do not know the key,
+ * so suited to short IDs of txids. */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
 #endif
@@ -11,6 +11,8 @@
 #include "init.h"
 #include "util.h"
 #include "ui_interface.h"
+#include "sha256.h"
+#include "blocktimings.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -327,6 +329,7 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300, 0 = no limit)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -334,6 +337,7 @@ std::string HelpMessage()
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 44889 or testnet: 44890)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+        "  -msgthreads=<n>        " + _("Set the number of threads handling peer messages (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -396,6 +400,9 @@ std::string HelpMessage()
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -maxpubkeycachesize=<n> " + _("Keep at most <n> parsed public keys for signature checks (default: 20000)") + "\n" +
+        "  -benchmark             " + _("Log how long each stage of connecting a block takes") + "\n" +
+        "  -benchmarkcsv=<file>   " + _("Write the timings of every block connected to <file> (default: blocktimings.csv)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -591,6 +598,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nMessageHandlerThreads = GetArg("-msgthreads", 0);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads += boost::thread::hardware_concurrency();
+    nMessageHandlerThreads = std::max(std::min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS), 1);
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -647,6 +659,9 @@ bool AppInit2(boost::thread_group& threadGroup)
             return InitError(strprintf(_("Invalid amount for -minrelaytxfee=<amount>: '%s'"), mapArgs["-minrelaytxfee"].c_str()));
     }
 
+    // Past this, the lowest fee rate transactions are evicted from the memory pool
+    mempool.SetMaxUsage((uint64)std::max((int64)0, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE)) << 20);
+
     if (mapArgs.count("-paytxfee"))
     {
         int64 txfee = 0;
@@ -703,6 +718,18 @@ bool AppInit2(boost::thread_group& threadGroup)
 #if defined(USE_SSE2)
     scrypt_detect_sse2();
 #endif
+    printf("Using SHA-256 kernels: %s\n", SHA256AutoDetect().c_str());
+
+    if (mapArgs.count("-benchmarkcsv")) {
+        filesystem::path pathCSV = GetArg("-benchmarkcsv", "");
+        if (pathCSV.empty())
+            pathCSV = "blocktimings.csv";
+        if (!pathCSV.is_complete())
+            pathCSV = GetDataDir() / pathCSV;
+        if (!blockTimings.OpenCSV(pathCSV.string()))
+            return InitError(strprintf(_("Cannot open block timings file %s"), pathCSV.string().c_str()));
+        printf("Writing block timings to %s\n", pathCSV.string().c_str());
+    }
 
     // ********************************************************* Step 5: verify wallet database integrity
 
@@ -14,6 +14,9 @@
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/version.hpp>
+#include <cmath>
+#include <cstring>
+#include <limits>
 
 #if BOOST_VERSION >= 103800
     #include <boost/spirit/include/classic_core.hpp>
@@ -352,6 +355,549 @@ namespace json_spirit
         String_type name_;              // of current name/value pair
     };
 
+    // hand-written parser for std::string input
+    //
+    // Accepts exactly the grammar of Json_grammer below and produces an identical Value, but
+    // avoids the per-character overhead of spirit (boost::function dispatch, backtracking and
+    // position_iterator bookkeeping) and builds each value in place instead of copying it into
+    // its parent. Strings are located with memchr and copied once. It is used by the
+    // std::string overloads of read_string and read_string_or_throw, which covers every
+    // JSON-RPC request and reply. Nesting is tracked with an explicit stack rather than
+    // recursion, so deeply nested input cannot exhaust the call stack.
+    //
+    template< class Value_type >
+    class Fast_parser
+    {
+    public:
+
+        typedef typename Value_type::Config_type Config_type;
+        typedef typename Config_type::String_type String_type;
+        typedef typename Config_type::Object_type Object_type;
+        typedef typename Config_type::Array_type Array_type;
+
+        Fast_parser( Value_type& value, const std::string& s )
+        :   value_( value )
+        ,   begin_( s.data() )
+        ,   end_( s.data() + s.size() )
+        ,   error_( 0 )
+        {
+        }
+
+        // returns false on a syntax error, in which case error_offset() and error_reason()
+        // describe the failure in the same terms as the spirit grammar
+        //
+        bool parse()
+        {
+            const char* i = begin_;
+
+            skip_ws( i );
+
+            Result r = parse_value( i );
+
+            if( r == no_value ) return fail( i, "not a value" );
+
+            for( ;; )
+            {
+                if( r == failed ) return false;
+
+                if( r == opened )
+                {
+                    // first element of a non-empty array, or first member value of an object
+                    // whose name and colon have already been read
+
+                    r = parse_value( i );
+
+                    if( r == no_value ) return fail( i, in_obj() ? "not a value" : "not an array" );
+
+                    continue;
+                }
+
+                if( stack_.empty() ) return true;
+
+                const char close = in_obj() ? '}' : ']';
+
+                skip_ws( i );
+
+                if( i != end_ && *i == close )
+                {
+                    ++i;
+
+                    stack_.pop_back();
+
+                    continue;
+                }
+
+                if( i == end_ || *i != ',' ) return fail( i, in_obj() ? "not an object" : "not an array" );
+
+                const char* comma = i++;
+
+                skip_ws( i );
+
+                if( in_obj() )
+                {
+                    if( !parse_name( i ) ) return fail( comma, "not an object" );
+
+                    if( !parse_colon( i ) ) return false;
+
+                    r = parse_value( i );
+
+                    if( r == no_value ) return fail( i, "not a value" );
+                }
+                else
+                {
+                    r = parse_value( i );
+
+                    if( r == no_value ) return fail( comma, "not an array" );
+                }
+            }
+        }
+
+        std::string::size_type error_offset() const { return error_; }
+
+        const std::string& error_reason() const { return reason_; }
+
+    private:
+
+        enum Result
+        {
+            no_value,   // nothing matching value_ starts here, no error recorded yet
+            failed,     // syntax error, already recorded
+            complete,   // a scalar or an empty array or object was read
+            opened      // an array or object was opened and its first element is expected
+        };
+
+        Fast_parser& operator=( const Fast_parser& ); // to prevent "assignment operator could not be generated" warning
+
+        static bool is_space( char c )
+        {
+            return c == ' ' || ( c >= '\t' && c <= '\r' );
+        }
+
+        static bool is_digit( char c )
+        {
+            return c >= '0' && c <= '9';
+        }
+
+        static bool is_xdigit( char c )
+        {
+            return is_digit( c ) || ( c >= 'a' && c <= 'f' ) || ( c >= 'A' && c <= 'F' );
+        }
+
+        void skip_ws( const char*& i ) const
+        {
+            while( i != end_ && is_space( *i ) ) ++i;
+        }
+
+        bool fail( const char* i, const char* reason )
+        {
+            error_ = i - begin_;
+            reason_ = reason;
+            return false;
+        }
+
+        bool in_obj() const
+        {
+            return stack_.back()->type() == obj_type;
+        }
+
+        // stores a value into the innermost open array or object, or as the result; strings,
+        // arrays and objects are added empty and then filled in place, as copying a Value is
+        // a deep copy
+        //
+        Value_type& add_value( const Value_type& value )
+        {
+            if( stack_.empty() )
+            {
+                value_ = value;
+
+                return value_;
+            }
+
+            Value_type& current = *stack_.back();
+
+            if( current.type() == array_type )
+            {
+                current.get_array().push_back( value );
+
+                return current.get_array().back();
+            }
+
+            return Config_type::add( current.get_obj(), name_, value );
+        }
+
+        // value_ = string_ | number_ | object_ | array_ | "true" | "false" | "null"
+        //
+        Result parse_value( const char*& i )
+        {
+            if( i == end_ ) return no_value;
+
+            const char c = *i;
+
+            if( c == '"' )
+            {
+                const char* first = i;
+                bool escaped = false;
+
+                if( !scan_string( i, escaped ) ) return no_value;
+
+                get_str( first, i, escaped ).swap( add_value( String_type() ).get_str() );
+
+                return complete;
+            }
+
+            if( parse_real( i ) || parse_int( i ) ) return complete;
+
+            if( c == '{' || c == '[' )
+            {
+                ++i;
+
+                Value_type& value = ( c == '{' ) ? add_value( Object_type() ) : add_value( Array_type() );
+
+                skip_ws( i );
+
+                if( i != end_ && *i == ( c == '{' ? '}' : ']' ) )
+                {
+                    ++i;
+
+                    return complete;
+                }
+
+                stack_.push_back( &value );
+
+                if( c == '[' ) return opened;
+
+                if( !parse_name( i ) )
+                {
+                    fail( i, "not an object" );
+                    return failed;
+                }
+
+                return parse_colon( i ) ? opened : failed;
+            }
+
+            if( parse_literal( i, "true" ) )
+            {
+                add_value( true );
+            }
+            else if( parse_literal( i, "false" ) )
+            {
+                add_value( false );
+            }
+            else if( parse_literal( i, "null" ) )
+            {
+                add_value( Value_type() );
+            }
+            else
+            {
+                return no_value;
+            }
+
+            return complete;
+        }
+
+        bool parse_name( const char*& i )
+        {
+            const char* first = i;
+            bool escaped = false;
+
+            if( i == end_ || *i != '"' || !scan_string( i, escaped ) ) return false;
+
+            get_str( first, i, escaped ).swap( name_ );
+
+            return true;
+        }
+
+        bool parse_colon( const char*& i )
+        {
+            skip_ws( i );
+
+            if( i == end_ || *i != ':' ) return fail( i, "no colon in pair" );
+
+            ++i;
+
+            skip_ws( i );
+
+            return true;
+        }
+
+        bool parse_literal( const char*& i, const char* lit ) const
+        {
+            const char* j = i;
+
+            for( ; *lit != 0; ++lit, ++j )
+            {
+                if( j == end_ || *j != *lit ) return false;
+            }
+
+            i = j;
+
+            return true;
+        }
+
+        // contents of a quoted string, decoded exactly as spirit's semantic actions do
+        //
+        static String_type get_str( const char* first, const char* last, bool escaped )
+        {
+            if( !escaped ) return String_type( first + 1, last - 1 );
+
+            const String_type tmp( first, last );
+
+            return json_spirit::get_str( tmp.begin(), tmp.end() );
+        }
+
+        // advances i past a quoted string, following the lexical rules of lex_escape_ch_p:
+        // a backslash escapes any character, but "\x" must be followed by one or two hex
+        // digits whose value fits in a char
+        //
+        bool scan_string( const char*& i, bool& escaped ) const
+        {
+            const char* p = i + 1;
+            const char* quote = 0;
+
+            for( ;; )
+            {
+                if( quote < p )
+                {
+                    quote = static_cast< const char* >( memchr( p, '"', end_ - p ) );
+
+                    if( quote == 0 ) return false;
+                }
+
+                const char* esc = static_cast< const char* >( memchr( p, '\\', quote - p ) );
+
+                if( esc == 0 )
+                {
+                    i = quote + 1;
+                    return true;
+                }
+
+                escaped = true;
+
+                p = esc + 1;
+
+                if( p == end_ ) return false;
+
+                const char e = *p++;
+
+                if( e == 'x' || e == 'X' )
+                {
+                    int n = 0, digits = 0;
+
+                    for( ; digits < 2 && p != end_ && is_xdigit( *p ); ++digits, ++p )
+                    {
+                        n = n * 16 + ( is_digit( *p ) ? *p - '0' : ( *p | 0x20 ) - 'a' + 10 );
+                    }
+
+                    if( digits == 0 || n > std::numeric_limits< char >::max() ) return false;
+                }
+            }
+        }
+
+        // unsigned decimal digits, accumulated with the same overflow checks as spirit's uint_parser
+        //
+        template< class T >
+        bool accumulate( const char*& i, T& n ) const
+        {
+            static const T max = std::numeric_limits< T >::max();
+
+            const char* first = i;
+
+            n = 0;
+
+            for( ; i != end_ && is_digit( *i ); ++i )
+            {
+                const T digit = *i - '0';
+
+                if( n > max / 10 || n * 10 > max - digit )
+                {
+                    i = first;
+                    return false;
+                }
+
+                n = n * 10 + digit;
+            }
+
+            return i != first;
+        }
+
+        // as above for a negative number, like spirit's int_parser
+        //
+        template< class T >
+        bool accumulate_neg( const char*& i, T& n ) const
+        {
+            static const T min = std::numeric_limits< T >::min();
+
+            const char* first = i;
+
+            n = 0;
+
+            for( ; i != end_ && is_digit( *i ); ++i )
+            {
+                const T digit = *i - '0';
+
+                if( n < min / 10 || n * 10 < min + digit )
+                {
+                    i = first;
+                    return false;
+                }
+
+                n = n * 10 - digit;
+            }
+
+            return i != first;
+        }
+
+        // strict_real_p: a number with a decimal point and/or an exponent, computed the way
+        // spirit's real_parser_impl computes it so that the resulting doubles are identical
+        //
+        bool parse_real( const char*& i )
+        {
+            const char* j = i;
+
+            bool neg = false;
+
+            if( j != end_ && ( *j == '+' || *j == '-' ) ) neg = ( *j++ == '-' );
+
+            double n = 0;
+
+            const bool got_a_number = accumulate( j, n );
+
+            if( neg ) n = -n;
+
+            bool got_a_dot = false;
+
+            if( j != end_ && *j == '.' )
+            {
+                ++j;
+
+                got_a_dot = true;
+
+                const char* frac_begin = j;
+
+                double frac = 0;
+
+                if( accumulate( j, frac ) )
+                {
+                    frac *= std::pow( 10.0, -double( j - frac_begin ) );
+
+                    if( neg ) n -= frac; else n += frac;
+                }
+                else if( !got_a_number )
+                {
+                    return false;
+                }
+            }
+            else if( !got_a_number )
+            {
+                return false;
+            }
+
+            if( j != end_ && ( *j == 'e' || *j == 'E' ) )
+            {
+                ++j;
+
+                bool exp_neg = false;
+
+                if( j != end_ && ( *j == '+' || *j == '-' ) ) exp_neg = ( *j++ == '-' );
+
+                int e = 0;
+
+                if( !( exp_neg ? accumulate_neg( j, e ) : accumulate( j, e ) ) ) return false;
+
+                n *= std::pow( 10.0, double( e ) );
+            }
+            else if( !got_a_dot )
+            {
+                return false;
+            }
+
+            add_value( n );
+
+            i = j;
+
+            return true;
+        }
+
+        // int64_p | uint64_p
+        //
+        bool parse_int( const char*& i )
+        {
+            const char* j = i;
+
+            const bool has_sign = ( j != end_ && ( *j == '+' || *j == '-' ) );
+
+            if( has_sign && *j++ == '-' )
+            {
+                boost::int64_t n;
+
+                if( !accumulate_neg( j, n ) ) return false;
+
+                add_value( n );
+            }
+            else
+            {
+                boost::uint64_t n;
+
+                if( !accumulate( j, n ) ) return false;
+
+                if( n <= boost::uint64_t( std::numeric_limits< boost::int64_t >::max() ) )
+                {
+                    add_value( boost::int64_t( n ) );
+                }
+                else
+                {
+                    if( has_sign ) return false;  // uint64_p takes no sign
+
+                    add_value( n );
+                }
+            }
+
+            i = j;
+
+            return true;
+        }
+
+        Value_type& value_;                 // the value being created
+        const char* const begin_;
+        const char* const end_;
+        std::vector< Value_type* > stack_;  // open arrays and objects, innermost last
+        String_type name_;                  // of current name/value pair
+        std::string::size_type error_;
+        std::string reason_;
+    };
+
+    // converts an offset into a line and column the way spirit's position_iterator counts them
+    //
+    inline Error_position make_error_position( const std::string& s, std::string::size_type offset,
+                                               const std::string& reason )
+    {
+        const unsigned int tab_chars = 4;
+
+        unsigned int line = 1;
+        unsigned int column = 1;
+
+        for( std::string::size_type i = 0; i < offset; ++i )
+        {
+            const char c = s[ i ];
+
+            if( c == '\n' || ( c == '\r' && ( i + 1 == s.size() || s[ i + 1 ] != '\n' ) ) )
+            {
+                ++line;
+                column = 1;
+            }
+            else if( c == '\t' )
+            {
+                column += tab_chars - ( column - 1 ) % tab_chars;
+            }
+            else if( c != '\r' )
+            {
+                ++column;
+            }
+        }
+
+        return Error_position( line, column, reason );
+    }
+
     template< typename Iter_type >
     void throw_error( spirit_namespace::position_iterator< Iter_type > i, const std::string& reason )
     {
@@ -573,6 +1119,25 @@ namespace json_spirit
         return read_range( begin, s.end(), value );
     }
 
+    template< class Value_type >
+    void read_string_or_throw( const std::string& s, Value_type& value )
+    {
+        Fast_parser< Value_type > parser( value, s );
+
+        if( !parser.parse() )
+        {
+            throw make_error_position( s, parser.error_offset(), parser.error_reason() );
+        }
+    }
+
+    template< class Value_type >
+    bool read_string( const std::string& s, Value_type& value )
+    {
+        Fast_parser< Value_type > parser( value, s );
+
+        return parser.parse();
+    }
+
     template< class Istream_type >
     struct Multi_pass_iters
     {
@@ -69,8 +69,9 @@ namespace json_spirit
         boost::uint64_t    get_uint64() const;
         double             get_real()   const;
 
-        Object& get_obj();
-        Array&  get_array();
+        String_type& get_str();
+        Object&      get_obj();
+        Array&       get_array();
 
         template< typename T > T get_value() const;  // example usage: int    i = value.get_value< int >();
                                                      // or             double d = value.get_value< double >();
@@ -419,6 +420,14 @@ namespace json_spirit
         return boost::get< double >( v_ );
     }
 
+    template< class Config >
+    typename Config::String_type& Value_impl< Config >::get_str()
+    {
+        check_type(  str_type );
+
+        return *boost::get< String_type >( &v_ );
+    }
+
     template< class Config >
     typename Value_impl< Config >::Object& Value_impl< Config >::get_obj()
     {
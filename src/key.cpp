@@ -6,7 +6,13 @@
 #include <openssl/rand.h>
 #include <openssl/obj_mac.h>
 
+#include <list>
+#include <map>
+
 #include "key.h"
+#include "secp256k1.h"
+#include "sync.h"
+#include "util.h"
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
@@ -340,9 +346,87 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
     return true;
 }
 
+// Public keys parsed for the native verifier, keyed by their serialization.
+// Addresses are reused heavily, and parsing a compressed key takes a field
+// square root, so the least recently used keys are the ones dropped.
+class CPubKeyCache
+{
+private:
+    typedef std::list<std::pair<CPubKey, CSecp256k1PubKey> > list_type;
+    list_type listKeys;         // most recently used first
+    std::map<CPubKey, list_type::iterator> mapKeys;
+    uint64 nHits;
+    uint64 nMisses;
+    mutable CCriticalSection cs_pubkeycache;
+
+    unsigned int GetMaxSize() const
+    {
+        // About 250 bytes per entry, so 5MB by default
+        return std::max((int64)0, GetArg("-maxpubkeycachesize", 20000));
+    }
+
+public:
+    CPubKeyCache() : nHits(0), nMisses(0) { }
+
+    bool Get(const CPubKey &pubkey, CSecp256k1PubKey &parsed)
+    {
+        {
+            LOCK(cs_pubkeycache);
+            std::map<CPubKey, list_type::iterator>::iterator mi = mapKeys.find(pubkey);
+            if (mi != mapKeys.end()) {
+                listKeys.splice(listKeys.begin(), listKeys, mi->second);
+                parsed = mi->second->second;
+                nHits++;
+                return true;
+            }
+            nMisses++;
+        }
+
+        // Parse outside the lock; keys the native verifier cannot handle are
+        // not cached, so that they keep going to OpenSSL
+        if (!Secp256k1ParsePubKey(parsed, pubkey.begin(), pubkey.size()))
+            return false;
+
+        unsigned int nMaxSize = GetMaxSize();
+        LOCK(cs_pubkeycache);
+        if (nMaxSize == 0 || mapKeys.count(pubkey))
+            return true;
+        while (mapKeys.size() >= nMaxSize) {
+            mapKeys.erase(listKeys.back().first);
+            listKeys.pop_back();
+        }
+        listKeys.push_front(std::make_pair(pubkey, parsed));
+        mapKeys[pubkey] = listKeys.begin();
+        return true;
+    }
+
+    void GetStats(CPubKeyCacheStats &stats) const
+    {
+        LOCK(cs_pubkeycache);
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nSize = mapKeys.size();
+        stats.nMaxSize = GetMaxSize();
+    }
+};
+
+static CPubKeyCache pubkeyCache;
+
+void GetPubKeyCacheStats(CPubKeyCacheStats &stats) {
+    pubkeyCache.GetStats(stats);
+}
+
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+    // Strictly encoded signatures and keys are checked natively; anything else
+    // is left to OpenSSL, so that its leniency stays the reference
+    CSecp256k1PubKey parsed;
+    if (!vchSig.empty() && pubkeyCache.Get(*this, parsed)) {
+        int nResult = Secp256k1VerifyParsed((const unsigned char*)&hash, &vchSig[0], vchSig.size(), parsed);
+        if (nResult != SECP256K1_VERIFY_UNSUPPORTED)
+            return nResult == SECP256K1_VERIFY_VALID;
+    }
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
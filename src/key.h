@@ -253,4 +253,15 @@ public:
     bool SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig) const;
 };
 
+/** Counters of the cache of parsed public keys behind CPubKey::Verify() */
+struct CPubKeyCacheStats
+{
+    uint64 nHits;
+    uint64 nMisses;
+    unsigned int nSize;
+    unsigned int nMaxSize;
+};
+
+void GetPubKeyCacheStats(CPubKeyCacheStats& stats);
+
 #endif
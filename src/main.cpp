@@ -13,11 +13,16 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "checkqueue.h"
+#include "sha256.h"
+#include "blockencodings.h"
+#include "blocktimings.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <deque>
 
 using namespace std;
 using namespace boost;
@@ -37,13 +42,14 @@ unsigned int nTransactionsUpdated = 0;
 map<uint256, CBlockIndex*> mapBlockIndex;
 uint256 nGenesisBlockHash("0x746b18d1b206b817408c355a256a144e740579b6729043d184574642077f2054");
 uint256 nGenesisMerkleRoot("0x51de661d58580e9d49e8d2b6a620c52bb6776953f2410d5814106120ad894f65");
-static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // FedoraCoin: starting difficulty is 1 / 2^12
+static uint256 bnProofOfWorkLimit(~uint256(0) >> 20); // FedoraCoin: starting difficulty is 1 / 2^12
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CBlockIndex* pindexBestHeader = NULL;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
@@ -63,7 +69,7 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CTransaction> mapOrphanTransactions;
+map<uint256, CTransactionRef> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
 // Constant stuff for coinbase transactions we create:
@@ -289,9 +295,10 @@ CUserDB *pusers = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const CTransactionRef& ptx)
 {
-    uint256 hash = tx.GetHash();
+    const CTransaction& tx = *ptx;
+    const uint256& hash = ptx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
@@ -309,7 +316,7 @@ bool AddOrphanTx(const CTransaction& tx)
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    mapOrphanTransactions[hash] = ptx;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
@@ -318,18 +325,23 @@ bool AddOrphanTx(const CTransaction& tx)
     return true;
 }
 
+bool AddOrphanTx(const CTransaction& tx)
+{
+    return AddOrphanTx(CTransactionRef(tx));
+}
+
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, CTransactionRef>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second->vin)
     {
         mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
         if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
             mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
     }
-    mapOrphanTransactions.erase(hash);
+    mapOrphanTransactions.erase(it);
 }
 
 unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
@@ -339,7 +351,7 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
+        map<uint256, CTransactionRef>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
         if (it == mapOrphanTransactions.end())
             it = mapOrphanTransactions.begin();
         EraseOrphanTx(it->first);
@@ -635,6 +647,11 @@ uint64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
     return nMinFee;
 }
 
+CTxMemPool::CTxMemPool() : nBytes(0), nUsage(0), nMaxUsage((uint64)DEFAULT_MAX_MEMPOOL_SIZE << 20), nEvicted(0),
+                           dRollingMinFee(0), nLastRollingFeeUpdate(0)
+{
+}
+
 void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 {
     LOCK(cs);
@@ -648,9 +665,11 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
     }
 }
 
-bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
+bool CTxMemPool::accept(CValidationState &state, const CTransactionRef &ptx, bool fCheckInputs, bool fLimitFree,
                         bool* pfMissingInputs)
 {
+    const CTransaction& tx = *ptx;
+
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -672,7 +691,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
                      strNonStd.c_str());
 
     // is it already in the memory pool?
-    uint256 hash = tx.GetHash();
+    const uint256& hash = ptx.GetHash();
     {
         LOCK(cs);
         if (mapTx.count(hash))
@@ -680,7 +699,8 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     }
 
     // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    const CTransaction* ptxOld = NULL;
+    uint256 hashOld = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -707,6 +727,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         }
     }
 
+    uint64 nFees = 0;
     if (fCheckInputs)
     {
         CCoinsView dummy;
@@ -751,7 +772,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        uint64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
+        nFees = tx.GetValueIn(view)-tx.GetValueOut();
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
         // Don't accept it if it can't get into a block
@@ -761,6 +782,13 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
                          hash.ToString().c_str(),
                          nFees, txMinFee);
 
+        // A pool that has had to evict keeps out anything paying less than it evicted
+        uint64 nPoolMinFee = GetMinFee() * nSize / 1000;
+        if (fLimitFree && nFees < nPoolMinFee)
+            return error("CTxMemPool::accept() : mempool min fee not met %s, %"PRI64d" < %"PRI64d,
+                         hash.ToString().c_str(),
+                         nFees, nPoolMinFee);
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -797,38 +825,169 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         LOCK(cs);
         if (ptxOld)
         {
-            printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            remove(*ptxOld);
+            hashOld = ptxOld->GetHash();
+            printf("CTxMemPool::accept() : replacing tx %s with new version\n", hashOld.ToString().c_str());
+            remove(*ptxOld);    // ptxOld is freed here, keep only its hash
         }
-        addUnchecked(hash, tx);
+        addUnchecked(ptx, nFees);
+
+        // Make room, which may mean evicting this transaction again
+        if (TrimToSize() && !mapTx.count(hash))
+            return state.Invalid(error("CTxMemPool::accept() : mempool full, %s not accepted", hash.ToString().c_str()));
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
     if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+        EraseFromWallets(hashOld);
     SyncWithWallets(hash, tx, NULL, true);
 
     return true;
 }
 
-bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs)
+bool AcceptToMemoryPool(CValidationState &state, const CTransactionRef &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs)
 {
     try {
-        return mempool.accept(state, *this, fCheckInputs, fLimitFree, pfMissingInputs);
+        return mempool.accept(state, tx, fCheckInputs, fLimitFree, pfMissingInputs);
     } catch(std::runtime_error &e) {
         return state.Abort(_("System error: ") + e.what());
     }
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
+bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs)
+{
+    return ::AcceptToMemoryPool(state, CTransactionRef(*this), fCheckInputs, fLimitFree, pfMissingInputs);
+}
+
+// Rough heap usage of a pooled transaction: the transaction with its vectors
+// and scripts, and the map and set nodes indexing it, each of which carries
+// a red-black tree node header of four words
+unsigned int CTxMemPool::GetTxMemoryUsage(const CTransaction& tx)
+{
+    static const unsigned int nNodeSize = 4 * sizeof(void*);
+    unsigned int nTxUsage = sizeof(CTransaction) + 2 * sizeof(void*);   // and its shared_ptr count
+    nTxUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nTxUsage += txin.scriptSig.capacity() + nNodeSize + sizeof(COutPoint) + sizeof(CInPoint);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nTxUsage += txout.scriptPubKey.capacity();
+    // mapTx, mapEntries and setByScore
+    nTxUsage += 3 * (nNodeSize + sizeof(uint256)) + sizeof(CTransactionRef) + sizeof(CTxMemPoolEntry) + sizeof(uint64);
+    return nTxUsage;
+}
+
+// Every transaction in the pool that tx spends from, directly or not
+void CTxMemPool::GetAncestors(const CTransaction& tx, set<uint256>& setAncestors)
+{
+    vector<const CTransaction*> vToVisit(1, &tx);
+    while (!vToVisit.empty())
+    {
+        const CTransaction* ptx = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin)
+        {
+            map<uint256, CTransactionRef>::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(it->first).second)
+                vToVisit.push_back(it->second.get());
+        }
+    }
+}
+
+// Transactions in the pool that spend outputs of hash, directly or through
+// other pool transactions
+void CTxMemPool::GetDescendants(const uint256& hash, const CTransaction& tx, set<uint256>& setDescendants)
+{
+    vector<pair<uint256, const CTransaction*> > vToVisit(1, make_pair(hash, &tx));
+    while (!vToVisit.empty())
+    {
+        uint256 hashVisit = vToVisit.back().first;
+        const CTransaction* ptx = vToVisit.back().second;
+        vToVisit.pop_back();
+        for (unsigned int i = 0; i < ptx->vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hashVisit, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashSpender = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashSpender).second)
+                vToVisit.push_back(make_pair(hashSpender, it->second.ptx));
+        }
+    }
+}
+
+// Adds the fee and size of a descendant to (or takes them from) the
+// descendant totals of hash, keeping setByScore in step
+void CTxMemPool::UpdateDescendantTotals(const uint256& hash, const CTxMemPoolEntry& entryDescendant, bool fAdd)
+{
+    CTxMemPoolEntry& entry = mapEntries[hash];
+    setByScore.erase(make_pair(entry.GetScore(), hash));
+    if (fAdd)
+    {
+        entry.nFeesWithDescendants += entryDescendant.nFee;
+        entry.nSizeWithDescendants += entryDescendant.nSize;
+    }
+    else
+    {
+        entry.nFeesWithDescendants -= entryDescendant.nFee;
+        entry.nSizeWithDescendants -= entryDescendant.nSize;
+    }
+    setByScore.insert(make_pair(entry.GetScore(), hash));
+}
+
+// Adds the fee and size of tx to (or takes them from) the descendant totals
+// of its ancestors
+void CTxMemPool::UpdateAncestors(const CTransaction& tx, const CTxMemPoolEntry& entry, bool fAdd)
+{
+    set<uint256> setAncestors;
+    GetAncestors(tx, setAncestors);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        UpdateDescendantTotals(hashAncestor, entry, fAdd);
+}
+
+bool CTxMemPool::addUnchecked(const CTransactionRef &ptx, uint64 nFee)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        LOCK(cs);
+        const CTransaction& tx = *ptx;
+        const uint256& hash = ptx.GetHash();
+        if (mapTx.count(hash))
+            return true;
+
+        // When a reorg puts a disconnected transaction back, its children may
+        // still be in the pool. They, and the transactions they are left with
+        // as new ancestors, have to be counted as if they had arrived after it.
+        set<uint256> setDescendants;
+        GetDescendants(hash, tx, setDescendants);
+        map<uint256, set<uint256> > mapAncestorsBefore;
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            GetAncestors(*mapTx[hashDescendant], mapAncestorsBefore[hashDescendant]);
+
+        mapTx[hash] = ptx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(ptx.get(), i);
+
+        CTxMemPoolEntry& entry = mapEntries[hash];
+        entry.nFee = nFee;
+        entry.nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        entry.nUsage = GetTxMemoryUsage(tx);
+        entry.nFeesWithDescendants = entry.nFee;
+        entry.nSizeWithDescendants = entry.nSize;
+        setByScore.insert(make_pair(entry.GetScore(), hash));
+        UpdateAncestors(tx, entry, true);
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        {
+            const set<uint256>& setBefore = mapAncestorsBefore[hashDescendant];
+            set<uint256> setAfter;
+            GetAncestors(*mapTx[hashDescendant], setAfter);
+            const CTxMemPoolEntry& entryDescendant = mapEntries[hashDescendant];
+            BOOST_FOREACH(const uint256& hashAncestor, setAfter)
+                if (!setBefore.count(hashAncestor))
+                    UpdateDescendantTotals(hashAncestor, entryDescendant, true);
+        }
+        nBytes += entry.nSize;
+        nUsage += entry.nUsage;
         nTransactionsUpdated++;
     }
     return true;
@@ -850,6 +1009,14 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         }
         if (mapTx.count(hash))
         {
+            map<uint256, CTxMemPoolEntry>::iterator it = mapEntries.find(hash);
+            const CTxMemPoolEntry& entry = it->second;
+            UpdateAncestors(tx, entry, false);
+            setByScore.erase(make_pair(entry.GetScore(), hash));
+            nBytes -= entry.nSize;
+            nUsage -= entry.nUsage;
+            mapEntries.erase(it);
+
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
@@ -879,6 +1046,11 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntries.clear();
+    setByScore.clear();
+    nBytes = 0;
+    nUsage = 0;
+    dRollingMinFee = 0;
     ++nTransactionsUpdated;
 }
 
@@ -888,10 +1060,77 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTransactionRef>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+void CTxMemPool::SetMaxUsage(uint64 nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+}
+
+unsigned int CTxMemPool::TrimToSize()
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    while (nMaxUsage && nUsage > nMaxUsage && !setByScore.empty())
+    {
+        const uint256 hash = setByScore.begin()->second;
+        const CTxMemPoolEntry& entry = mapEntries[hash];
+
+        // Anything paying less than what was evicted would only be evicted
+        // in turn, so from now on it has to pay more than that
+        uint64 nEvictedFee = entry.nFeesWithDescendants * 1000 / entry.nSizeWithDescendants;
+        double dNewMinFee = (double)(nEvictedFee + CTransaction::nMinRelayTxFee);
+        GetMinFee();    // decay what is there first
+        if (dNewMinFee > dRollingMinFee)
+        {
+            dRollingMinFee = dNewMinFee;
+            nLastRollingFeeUpdate = GetTime();
+        }
+
+        CTransactionRef ptx = mapTx[hash];      // remove() would free it
+        unsigned int nBefore = mapTx.size();
+        remove(*ptx, true);
+        nRemoved += nBefore - mapTx.size();
+    }
+    if (nRemoved)
+    {
+        nEvicted += nRemoved;
+        printf("CTxMemPool::TrimToSize() : evicted %u transactions, minimum fee now %"PRI64d"\n",
+               nRemoved, (int64)dRollingMinFee);
+    }
+    return nRemoved;
+}
+
+uint64 CTxMemPool::GetMinFee()
+{
+    LOCK(cs);
+    if (dRollingMinFee == 0)
+        return 0;
+    int64 nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate)
+    {
+        dRollingMinFee /= pow(2.0, (double)(nNow - nLastRollingFeeUpdate) / ROLLING_FEE_HALFLIFE);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinFee < CTransaction::nMinRelayTxFee / 2)
+            dRollingMinFee = 0;
+    }
+    return (uint64)dRollingMinFee;
+}
+
+void CTxMemPool::GetStats(CMemPoolStats& stats)
+{
+    LOCK(cs);
+    stats.nTx = mapTx.size();
+    stats.nBytes = nBytes;
+    stats.nUsage = nUsage;
+    stats.nMaxUsage = nMaxUsage;
+    stats.nMinFee = GetMinFee();
+    stats.nEvicted = nEvicted;
+}
+
 
 
 
@@ -1048,9 +1287,9 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return pblockindex;
 }
 
-bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
+bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fCheckPOW)
 {
-    if (!ReadFromDisk(pindex->GetBlockPos()))
+    if (!ReadFromDisk(pindex->GetBlockPos(), fCheckPOW))
         return false;
     if (GetHash() != pindex->GetBlockHash())
         return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
@@ -1183,7 +1422,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
     if (fTestNet && nTime > nTargetSpacing*2)
         return bnProofOfWorkLimit.GetCompact();
 
-    CBigNum bnResult;
+    uint256 bnResult;
     bnResult.SetCompact(nBase);
     while (nTime > 0 && bnResult < bnProofOfWorkLimit)
     {
@@ -1252,7 +1491,7 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
         nActualTimespan = nActualTimespanMax;
 
     // Retarget
-    CBigNum bnNew;
+    uint256 bnNew;
     bnNew.SetCompact(pindexLast->nBits);
     bnNew *= nActualTimespan;
     bnNew /= nTargetTimespan;
@@ -1263,8 +1502,8 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
 
     return bnNew.GetCompact();
 }
@@ -1338,7 +1577,7 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast, const
     }
 
     // Retarget
-    CBigNum bnNew;
+    uint256 bnNew;
     bnNew.SetCompact(pindexLast->nBits);
     bnNew *= nActualTimespan;
     bnNew /= nTargetTimespan;
@@ -1349,85 +1588,117 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast, const
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
 
     return bnNew.GetCompact();
 }
 
-unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax) {
-    /* current difficulty formula, Anoncoin - kimoto gravity well */
-    const CBlockIndex *BlockLastSolved = pindexLast;
-    const CBlockIndex *BlockReading = pindexLast;
-
-    uint64 PastBlocksMass = 0;
-    int64 PastRateActualSeconds = 0;
-    int64 PastRateTargetSeconds = 0;
-    double PastRateAdjustmentRatio = double(1);
-    CBigNum PastDifficultyAverage;
-    CBigNum PastDifficultyAveragePrev;
-    double EventHorizonDeviation;
-    double EventHorizonDeviationFast;
-    double EventHorizonDeviationSlow;
+// Kimoto Gravity Well
+static const int64 KGW_TARGET_SPACING = 60;              // 1 minute
+static const unsigned int KGW_PAST_BLOCKS_MIN = 6 * 60;  // a quarter of a day
+static const unsigned int KGW_PAST_BLOCKS_MAX = 24 * 60; // a day
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64)BlockLastSolved->nHeight < PastBlocksMin) { return bnProofOfWorkLimit.GetCompact(); }
+// The event horizon for each number of past blocks: the rate the blocks
+// came at, relative to the target spacing, is within it as long as it is
+// above the slow and below the fast deviation
+static double dEventHorizonDeviationFast[KGW_PAST_BLOCKS_MAX + 1];
+static double dEventHorizonDeviationSlow[KGW_PAST_BLOCKS_MAX + 1];
 
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
-        PastBlocksMass++;
-
-        if (i == 1) { PastDifficultyAverage.SetCompact(BlockReading->nBits); }
-        else { PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev; }
-        PastDifficultyAveragePrev = PastDifficultyAverage;
+class CEventHorizonInit
+{
+public:
+    CEventHorizonInit()
+    {
+        for (unsigned int nMass = 1; nMass <= KGW_PAST_BLOCKS_MAX; nMass++)
+        {
+            double EventHorizonDeviation = 1 + (0.7084 * pow((double(nMass)/double(144)), -1.228));
+            dEventHorizonDeviationFast[nMass] = EventHorizonDeviation;
+            dEventHorizonDeviationSlow[nMass] = 1 / EventHorizonDeviation;
+        }
+    }
+} instance_of_ceventhorizoninit;
 
-        PastRateActualSeconds = BlockLastSolved->GetBlockTime() - BlockReading->GetBlockTime();
-        PastRateTargetSeconds = TargetBlocksSpacingSeconds * PastBlocksMass;
-        PastRateAdjustmentRatio = double(1);
-        if (PastRateActualSeconds < 0) { PastRateActualSeconds = 0; }
-        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
-        PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+// Averages the targets of the blocks up to pindexLast, going back until
+// their rate leaves the event horizon, and scales the average by that rate.
+// Gives exactly what the original CBigNum code did for the targets a valid
+// chain can hold, which are positive and at most the proof of work limit;
+// the running average rounds towards zero as BN_div does.
+unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast)
+{
+    if (pindexLast == NULL || pindexLast->nHeight == 0 || (unsigned int)pindexLast->nHeight < KGW_PAST_BLOCKS_MIN)
+        return bnProofOfWorkLimit.GetCompact();
+    if (pindexLast->nBitsNext != 0)
+        return pindexLast->nBitsNext;
+
+    uint256 bnAverage;
+    int64 nActualSeconds = 0;
+    int64 nTargetSeconds = 0;
+    const CBlockIndex* pindex = pindexLast;
+    for (unsigned int nMass = 1; pindex && pindex->nHeight > 0 && nMass <= KGW_PAST_BLOCKS_MAX; nMass++)
+    {
+        uint256 bnTarget;
+        bnTarget.SetCompact(pindex->nBits);
+        if (nMass == 1)
+            bnAverage = bnTarget;
+        else if (bnTarget >= bnAverage)
+        {
+            bnTarget -= bnAverage;
+            bnTarget /= nMass;
+            bnAverage += bnTarget;
+        }
+        else
+        {
+            uint256 bnDelta = bnAverage - bnTarget;
+            bnDelta /= nMass;
+            bnAverage -= bnDelta;
         }
-        EventHorizonDeviation = 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
-        EventHorizonDeviationFast = EventHorizonDeviation;
-        EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
 
-        if (PastBlocksMass >= PastBlocksMin) {
-            if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow) || (PastRateAdjustmentRatio >= EventHorizonDeviationFast)) { assert(BlockReading); break; }
+        nActualSeconds = max(pindexLast->GetBlockTime() - pindex->GetBlockTime(), (int64)0);
+        nTargetSeconds = KGW_TARGET_SPACING * nMass;
+        // No time passed counts as a rate of 1, always within the horizon
+        if (nMass >= KGW_PAST_BLOCKS_MIN && nActualSeconds != 0)
+        {
+            double dRate = double(nTargetSeconds) / double(nActualSeconds);
+            if (dRate <= dEventHorizonDeviationSlow[nMass] || dRate >= dEventHorizonDeviationFast[nMass])
+                break;
         }
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
+        pindex = pindex->pprev;
     }
 
-    CBigNum bnNew(PastDifficultyAverage);
-    if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
-        bnNew *= PastRateActualSeconds;
-        bnNew /= PastRateTargetSeconds;
+    // bnAverage * nActualSeconds / nTargetSeconds, which can overflow 256 bits
+    // on its way to being capped at the limit. Block times are 32-bit, so
+    // nActualSeconds fits a word, and so does nTargetSeconds.
+    uint256 bnNew = bnAverage;
+    if (nActualSeconds != 0)
+    {
+        uint64 nRemainder = bnNew.DivMod(nTargetSeconds);
+        uint256 bnMax = bnProofOfWorkLimit;
+        bnMax /= nActualSeconds;
+        if (bnNew > bnMax)
+            bnNew = bnProofOfWorkLimit;
+        else
+        {
+            bnNew *= nActualSeconds;
+            bnNew += nRemainder * nActualSeconds / nTargetSeconds;
+        }
     }
-    if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
-
-    /// debug print
-    printf("Difficulty Retarget - Kimoto Gravity Well\n");
-    printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
-    printf("Before: %08x %s\n", BlockLastSolved->nBits, CBigNum().SetCompact(BlockLastSolved->nBits).getuint256().ToString().c_str());
-    printf("After: %08x %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
-
+    if (bnNew > bnProofOfWorkLimit)
+        bnNew = bnProofOfWorkLimit;
 
-    return bnNew.GetCompact();
+    pindexLast->nBitsNext = bnNew.GetCompact();
+    if (fDebug)
+        printf("KimotoGravityWell() : height %d, rate %"PRI64d"/%"PRI64d" s, before %08x, after %08x\n",
+               pindexLast->nHeight + 1, nActualSeconds, nTargetSeconds, pindexLast->nBits, pindexLast->nBitsNext);
+    return pindexLast->nBitsNext;
 }
 
 unsigned int static GetNextWorkRequired_V3(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
 {
-    static const int64 BlocksTargetSpacing = 60; // 1 minutes
-    unsigned int TimeDaySeconds = 60 * 60 * 24;
-    int64 PastSecondsMin = TimeDaySeconds*0.25;
-    int64 PastSecondsMax = TimeDaySeconds*1;
-    uint64 PastBlocksMin = PastSecondsMin / BlocksTargetSpacing;
-    uint64 PastBlocksMax = PastSecondsMax / BlocksTargetSpacing;
-
-    return KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+    return KimotoGravityWell(pindexLast);
 }
 
-unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
 {
     assert(pindexLast);
 
@@ -1443,15 +1714,16 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    uint256 bnTarget;
+    bool fNegative, fOverflow;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1478,6 +1750,8 @@ bool IsInitialBlockDownload()
             pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60);
 }
 
+void static InvalidBlockHeaderFound(const uint256& hash);
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (pindexNew->nChainWork > nBestInvalidWork)
@@ -1493,7 +1767,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -1502,6 +1776,7 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
     pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
     setBlockIndexValid.erase(pindex);
     InvalidChainFound(pindex);
+    InvalidBlockHeaderFound(pindex->GetBlockHash());
     if (pindex->pnext) {
         CValidationState stateDummy;
         ConnectBestBlock(stateDummy); // reorganise away from the failed block
@@ -1652,7 +1927,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighash.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
@@ -1714,12 +1989,18 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Serialize the parts of the signature hash shared by all inputs once,
+            // rather than re-serializing the whole transaction for each input
+            boost::shared_ptr<const CSigHashCache> psighash;
+            if (vin.size() > 1)
+                psighash.reset(new CSigHashCache(*this));
+
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
                 const CCoins &coins = inputs.GetCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, *this, i, flags, 0);
+                CScriptCheck check(coins, *this, i, flags, 0, psighash);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1727,7 +2008,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, psighash);
                         if (check())
                             return state.Invalid();
                     }
@@ -1862,11 +2143,23 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, CBlockTimingSample *ptiming)
 {
+    CBlockTimingSample timingDummy;
+    CBlockTimingSample &timing = ptiming ? *ptiming : timingDummy;
+    timing.hashBlock = pindex->GetBlockHash();
+    timing.nHeight = pindex->nHeight;
+    timing.nTx = vtx.size();
+
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
+    int64 nTimeStart = GetTimeMicros();
+    if (!fJustCheck && !CheckProofOfWork(GetPoWHash(), nBits))
+        return state.DoS(50, error("ConnectBlock() : proof of work failed"));
+    int64 nTimePoW = GetTimeMicros();
+    timing.nMicros[BLOCKTIMING_POW] = nTimePoW - nTimeStart;
+    if (!CheckBlock(state, false, !fJustCheck))
         return false;
+    timing.nMicros[BLOCKTIMING_CHECK] = GetTimeMicros() - nTimePoW;
 
     // verify that the view's current state corresponds to the previous block
     assert(pindex->pprev == view.GetBestBlock());
@@ -1947,9 +2240,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             nFees += tx.GetValueIn(view)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
+            int64 nTimeScripts = GetTimeMicros();
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+            timing.nMicros[BLOCKTIMING_SCRIPTS] += GetTimeMicros() - nTimeScripts;
         }
 
         CTxUndo txundo;
@@ -1963,6 +2258,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
         printf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)vtx.size(), 0.001 * nTime, 0.001 * nTime / vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
+    timing.nInputs = nInputs - 1;
+    timing.nMicros[BLOCKTIMING_INPUTS] = nTime - timing.nMicros[BLOCKTIMING_SCRIPTS];
 
     uint256 prevHash = 0;
     if (pindex->pprev)
@@ -1973,9 +2270,12 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees, prevHash))
         return state.DoS(100, error("ConnectBlock() : coinbase pays too much (actual=%"PRI64d" vs limit=%"PRI64d")", vtx[0].GetValueOut(), GetBlockValue(pindex->nHeight, nFees, prevHash)));
 
+    int64 nTimeWait = GetTimeMicros();
     if (!control.Wait())
         return state.DoS(100, false);
     int64 nTime2 = GetTimeMicros() - nStart;
+    timing.nMicros[BLOCKTIMING_SCRIPTWAIT] = nStart + nTime2 - nTimeWait;
+    timing.nMicros[BLOCKTIMING_SCRIPTS] += timing.nMicros[BLOCKTIMING_SCRIPTWAIT];
     if (fBenchmark)
         printf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
 
@@ -1983,6 +2283,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         return true;
 
     // Write undo information to disk
+    int64 nTimeUndo = GetTimeMicros();
     if (pindex->GetUndoPos().IsNull() || (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
     {
         if (pindex->GetUndoPos().IsNull()) {
@@ -2012,8 +2313,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     assert(view.SetBestBlock(pindex));
 
     // Watch for transactions paying to me
+    int64 nTimeWallet = GetTimeMicros();
+    timing.nMicros[BLOCKTIMING_UNDO] = nTimeWallet - nTimeUndo;
     for (unsigned int i=0; i<vtx.size(); i++)
         SyncWithWallets(GetTxHash(i), vtx[i], this, true);
+    timing.nMicros[BLOCKTIMING_WALLET] = GetTimeMicros() - nTimeWallet;
 
     return true;
 }
@@ -2057,6 +2361,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Disconnect shorter branch
     vector<CTransaction> vResurrect;
+    vector<uint256> vDisconnectedTx;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect) {
         CBlock block;
         if (!block.ReadFromDisk(pindex))
@@ -2071,24 +2376,34 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         // We only do this for blocks after the last checkpoint (reorganisation before that
         // point should only happen with -reindex/-loadblock, or a misbehaving peer.
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
             if (!tx.IsCoinBase() && pindex->nHeight > Checkpoints::GetTotalBlocksEstimate())
                 vResurrect.push_back(tx);
+            vDisconnectedTx.push_back(tx.GetHash());
+        }
     }
 
     // Connect longer branch
     vector<CTransaction> vDelete;
-    BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
+    vector<CBlockTimingSample> vTimings(vConnect.size());
+    for (unsigned int i = 0; i < vConnect.size(); i++) {
+        CBlockIndex *pindex = vConnect[i];
+        CBlockTimingSample &timing = vTimings[i];
+        int64 nTimeRead = GetTimeMicros();
         CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        // ConnectBlock checks the proof of work
+        if (!block.ReadFromDisk(pindex, false))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        timing.nMicros[BLOCKTIMING_READ] = nStart - nTimeRead;
+        if (!block.ConnectBlock(state, pindex, view, false, &timing)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
             }
             return error("SetBestBlock() : ConnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
         }
+        timing.nMicros[BLOCKTIMING_TOTAL] = GetTimeMicros() - nTimeRead;
         if (fBenchmark)
             printf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
@@ -2121,6 +2436,15 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
             return state.Abort(_("Failed to write to coin database"));
     }
 
+    // The flushes are charged to the last block connected
+    if (!vTimings.empty()) {
+        CBlockTimingSample &timing = vTimings.back();
+        timing.nMicros[BLOCKTIMING_FLUSH] = GetTimeMicros() - nStart;
+        timing.nMicros[BLOCKTIMING_TOTAL] += timing.nMicros[BLOCKTIMING_FLUSH];
+    }
+    BOOST_FOREACH(const CBlockTimingSample &timing, vTimings)
+        blockTimings.Add(timing);
+
     // At this point, all changes have been done to the database.
     // Proceed by updating the memory structures.
 
@@ -2163,6 +2487,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+
+    // Wallet transactions in the disconnected branch lost their confirmations
+    BOOST_FOREACH(const uint256& hash, vDisconnectedTx)
+        ::UpdatedTransaction(hash);
     printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
@@ -2198,6 +2526,209 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 }
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Header tree
+//
+
+// Headers-first synchronization checks the headers of the best chain before
+// downloading any of its blocks, then fetches the blocks from many peers at
+// once (see FindNextBlocksToDownload). The headers of blocks we don't have
+// yet live in mapBlockHeaders. Their pprev pointers lead back into
+// mapBlockIndex, so difficulty and chain work are computed on them exactly as
+// on blocks. An entry gives way to the block's own CBlockIndex when the
+// block is accepted.
+static map<uint256, CBlockIndex*> mapBlockHeaders;
+static multimap<uint256, CBlockIndex*> mapBlockHeadersByPrev;
+// The chain ending in pindexBestHeader, by height
+static vector<CBlockIndex*> vBestHeaderChain;
+
+static CBlockIndex* LookupBlockHeader(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    mi = mapBlockHeaders.find(hash);
+    if (mi != mapBlockHeaders.end())
+        return (*mi).second;
+    return NULL;
+}
+
+void SetBestHeader(CBlockIndex* pindexNew)
+{
+    pindexBestHeader = pindexNew;
+    vBestHeaderChain.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex* pindex = pindexNew; pindex && vBestHeaderChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBestHeaderChain[pindex->nHeight] = pindex;
+}
+
+// The block of pindexNew was accepted; replace its header entry, if any
+void static PromoteBlockHeader(CBlockIndex* pindexNew)
+{
+    uint256 hash = pindexNew->GetBlockHash();
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockHeaders.find(hash);
+    if (mi != mapBlockHeaders.end())
+    {
+        CBlockIndex* pindexHeader = (*mi).second;
+        for (multimap<uint256, CBlockIndex*>::iterator it = mapBlockHeadersByPrev.lower_bound(hash); it != mapBlockHeadersByPrev.upper_bound(hash); ++it)
+            (*it).second->pprev = pindexNew;
+        uint256 hashPrev = pindexHeader->pprev ? pindexHeader->pprev->GetBlockHash() : 0;
+        for (multimap<uint256, CBlockIndex*>::iterator it = mapBlockHeadersByPrev.lower_bound(hashPrev); it != mapBlockHeadersByPrev.upper_bound(hashPrev); ++it)
+        {
+            if ((*it).second == pindexHeader)
+            {
+                mapBlockHeadersByPrev.erase(it);
+                break;
+            }
+        }
+        if (pindexHeader->nHeight < (int)vBestHeaderChain.size() && vBestHeaderChain[pindexHeader->nHeight] == pindexHeader)
+            vBestHeaderChain[pindexHeader->nHeight] = pindexNew;
+        if (pindexBestHeader == pindexHeader)
+            pindexBestHeader = pindexNew;
+        mapBlockHeaders.erase(mi);
+        delete pindexHeader;
+    }
+
+    if (pindexBestHeader == NULL || pindexNew->nChainWork > pindexBestHeader->nChainWork)
+        SetBestHeader(pindexNew);
+}
+
+// Whether the chain from pindex back to the main chain holds no invalid
+// block. Marks the headers found to be built on one, so that later calls
+// stop there.
+bool static IsHeaderChainValid(CBlockIndex* pindex)
+{
+    vector<CBlockIndex*> vPath;
+    for (; pindex && !pindex->IsInMainChain(); pindex = pindex->pprev)
+    {
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            break;
+        vPath.push_back(pindex);
+    }
+    if (pindex == NULL || !(pindex->nStatus & BLOCK_FAILED_MASK))
+        return true;
+    BOOST_FOREACH(CBlockIndex* pindexChild, vPath)
+        if (mapBlockHeaders.count(pindexChild->GetBlockHash()))
+            pindexChild->nStatus |= BLOCK_FAILED_CHILD;
+    return false;
+}
+
+// The block of hash turned out to be invalid, and with it every header
+// built on it
+void static InvalidBlockHeaderFound(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockHeaders.find(hash);
+    if (mi != mapBlockHeaders.end())
+        (*mi).second->nStatus |= BLOCK_FAILED_VALID;
+
+    // Mark its descendants, following the child links
+    vector<uint256> vQueue(1, hash);
+    for (unsigned int i = 0; i < vQueue.size(); i++)
+    {
+        for (multimap<uint256, CBlockIndex*>::iterator it = mapBlockHeadersByPrev.lower_bound(vQueue[i]); it != mapBlockHeadersByPrev.upper_bound(vQueue[i]); ++it)
+        {
+            (*it).second->nStatus |= BLOCK_FAILED_CHILD;
+            vQueue.push_back((*it).second->GetBlockHash());
+        }
+    }
+
+    // Nothing else to do unless the best header chain runs through it
+    CBlockIndex* pindexFailed = LookupBlockHeader(hash);
+    if (pindexFailed == NULL || pindexFailed->nHeight >= (int)vBestHeaderChain.size() ||
+        vBestHeaderChain[pindexFailed->nHeight]->GetBlockHash() != hash)
+        return;
+
+    // The new best is the header with the most work left. Headers built on
+    // it through blocks we have but never connected aren't marked yet, so
+    // the chain of each is checked, most work first, until one holds up.
+    vector<CBlockIndex*> vCandidates;
+    for (mi = mapBlockHeaders.begin(); mi != mapBlockHeaders.end(); ++mi)
+    {
+        CBlockIndex* pindex = (*mi).second;
+        if (!(pindex->nStatus & BLOCK_FAILED_MASK) && (pindexBest == NULL || pindex->nChainWork > pindexBest->nChainWork))
+            vCandidates.push_back(pindex);
+    }
+    sort(vCandidates.begin(), vCandidates.end(), CBlockIndexWorkComparator());
+    CBlockIndex* pindexNewBest = pindexBest;
+    for (vector<CBlockIndex*>::reverse_iterator it = vCandidates.rbegin(); it != vCandidates.rend(); ++it)
+    {
+        if (IsHeaderChainValid(*it))
+        {
+            pindexNewBest = *it;
+            break;
+        }
+    }
+    if (pindexNewBest && pindexNewBest != pindexBestHeader)
+    {
+        printf("InvalidBlockHeaderFound() : best header now %s, height %d\n", pindexNewBest->GetBlockHash().ToString().c_str(), pindexNewBest->nHeight);
+        SetBestHeader(pindexNewBest);
+    }
+}
+
+// A block whose header entry we have but whose parent we don't is written to
+// disk when it arrives, rather than kept in memory as an orphan. Its header
+// entry then records where, with BLOCK_HAVE_DATA set, until the parent is
+// accepted and the block with it (see ProcessBlock).
+bool HaveStoredBlock(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockHeaders.find(hash);
+    return mi != mapBlockHeaders.end() && ((*mi).second->nStatus & BLOCK_HAVE_DATA);
+}
+
+bool AcceptBlockHeader(CValidationState &state, const CBlockHeader &header, CBlockIndex **ppindex)
+{
+    uint256 hash = header.GetHash();
+    CBlockIndex* pindexNew = LookupBlockHeader(hash);
+    if (pindexNew)
+    {
+        if (ppindex)
+            *ppindex = pindexNew;
+        if (pindexNew->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block %s is marked invalid", hash.ToString().c_str()));
+        return true;
+    }
+
+    // The checks CheckBlock and AcceptBlock make on the header alone
+    if (!CheckProofOfWork(CBlock(header).GetPoWHash(), header.nBits))
+        return state.DoS(50, error("AcceptBlockHeader() : proof of work failed"));
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("AcceptBlockHeader() : block timestamp too far in the future"));
+
+    CBlockIndex* pindexPrev = LookupBlockHeader(header.hashPrevBlock);
+    if (pindexPrev == NULL)
+        return state.DoS(10, error("AcceptBlockHeader() : prev block not found"));
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"));
+    int nHeight = pindexPrev->nHeight + 1;
+
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return state.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("AcceptBlockHeader() : block's timestamp is too early"));
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return state.DoS(100, error("AcceptBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+
+    CBlockHeader headerNew = header;
+    pindexNew = new CBlockIndex(headerNew);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockHeaders.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork();
+    pindexNew->nStatus = BLOCK_VALID_TREE;
+    mapBlockHeadersByPrev.insert(make_pair(header.hashPrevBlock, pindexNew));
+
+    if (pindexBestHeader == NULL || pindexNew->nChainWork > pindexBestHeader->nChainWork)
+        SetBestHeader(pindexNew);
+
+    if (ppindex)
+        *ppindex = pindexNew;
+    return true;
+}
+
 bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
 {
     // Check for duplicate
@@ -2217,13 +2748,14 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
     pindexNew->nTx = vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
     pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
     pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
     setBlockIndexValid.insert(pindexNew);
+    PromoteBlockHeader(pindexNew);
 
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
@@ -2486,13 +3018,22 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     try {
         unsigned int nBlockSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
-            blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, nTime, dbp != NULL))
-            return error("AcceptBlock() : FindBlockPos failed");
-        if (dbp == NULL)
-            if (!WriteToDisk(blockPos))
-                return state.Abort(_("Failed to write block"));
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockHeaders.find(hash);
+        if (mi != mapBlockHeaders.end() && ((*mi).second->nStatus & BLOCK_HAVE_DATA))
+        {
+            // Already written when it arrived ahead of its parent
+            blockPos = (*mi).second->GetBlockPos();
+        }
+        else
+        {
+            if (dbp != NULL)
+                blockPos = *dbp;
+            if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, nTime, dbp != NULL))
+                return error("AcceptBlock() : FindBlockPos failed");
+            if (dbp == NULL)
+                if (!WriteToDisk(blockPos))
+                    return state.Abort(_("Failed to write block"));
+        }
         if (!AddToBlockIndex(state, blockPos))
             return error("AcceptBlock() : AddToBlockIndex failed");
     } catch(std::runtime_error &e) {
@@ -2526,7 +3067,65 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+// Writes a block that arrived ahead of its parent to disk, and notes where in
+// its header entry
+bool static StoreBlockAhead(CValidationState &state, CBlock& block, CBlockIndex* pindex)
+{
+    try {
+        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        CDiskBlockPos blockPos;
+        if (!FindBlockPos(state, blockPos, nBlockSize+8, pindex->nHeight, block.nTime))
+            return error("StoreBlockAhead() : FindBlockPos failed");
+        if (!block.WriteToDisk(blockPos))
+            return state.Abort(_("Failed to write block"));
+        pindex->nFile = blockPos.nFile;
+        pindex->nDataPos = blockPos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+    } catch(std::runtime_error &e) {
+        return state.Abort(_("System error: ") + e.what());
+    }
+    if (fDebug)
+        printf("StoreBlockAhead() : stored block %s at height %d\n", pindex->GetBlockHash().ToString().c_str(), pindex->nHeight);
+    return true;
+}
+
+// Accepts the stored blocks built on hashPrev, one at a time from disk, and
+// queues the hashes of those accepted
+void static ConnectStoredBlocks(const uint256& hashPrev, vector<uint256>& vWorkQueue)
+{
+    // Accepting a block removes its header entry from mapBlockHeadersByPrev
+    vector<CBlockIndex*> vStored;
+    for (multimap<uint256, CBlockIndex*>::iterator mi = mapBlockHeadersByPrev.lower_bound(hashPrev);
+         mi != mapBlockHeadersByPrev.upper_bound(hashPrev);
+         ++mi)
+        if ((*mi).second->nStatus & BLOCK_HAVE_DATA)
+            vStored.push_back((*mi).second);
+
+    BOOST_FOREACH(CBlockIndex* pindex, vStored)
+    {
+        uint256 hash = pindex->GetBlockHash();
+        CBlock block;
+        if (!block.ReadFromDisk(pindex->GetBlockPos()) || block.GetHash() != hash)
+        {
+            // Fetch it again
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            continue;
+        }
+        // The header is what was checked against the chain, so a block
+        // that fails now is invalid whoever sent it
+        CValidationState stateDummy;
+        if (block.AcceptBlock(stateDummy))
+            vWorkQueue.push_back(hash);
+        else if (mapBlockHeaders.count(hash))
+        {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            if (stateDummy.IsInvalid() && !stateDummy.CorruptionPossible())
+                InvalidBlockHeaderFound(hash);
+        }
+    }
+}
+
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2534,9 +3133,11 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().c_str()));
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
+    if (HaveStoredBlock(hash))
+        return state.Invalid(error("ProcessBlock() : already have block (stored) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    if (!fChecked && !pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -2548,9 +3149,9 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         {
             return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"));
         }
-        CBigNum bnNewBlock;
+        uint256 bnNewBlock;
         bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        uint256 bnRequired;
         bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
         if (bnNewBlock > bnRequired)
         {
@@ -2562,6 +3163,15 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     // If we don't already have its previous block, shunt it off to holding area until we get it
     if (pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
     {
+        // On disk, if it's on a header chain we know
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockHeaders.find(hash);
+        if (mi != mapBlockHeaders.end() && !((*mi).second->nStatus & BLOCK_FAILED_MASK))
+        {
+            if (!StoreBlockAhead(state, *pblock, (*mi).second))
+                return error("ProcessBlock() : StoreBlockAhead FAILED");
+            return true;
+        }
+
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().c_str());
 
         // Accept orphans as long as there is a node to request its parents from
@@ -2570,8 +3180,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            // Ask this guy to fill in what we're missing, unless it's one
+            // of the blocks we are downloading ahead along the header chain
+            if (!mapBlockHeaders.count(hash))
+                pfrom->PushGetHeaders(pindexBestHeader, GetOrphanRoot(pblock2));
         }
         return true;
     }
@@ -2580,12 +3192,14 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (!pblock->AcceptBlock(state, dbp))
         return error("ProcessBlock() : AcceptBlock FAILED");
 
-    // Recursively process any orphan blocks that depended on this one
+    // Recursively process any orphan blocks, and blocks stored ahead, that
+    // depended on this one
     vector<uint256> vWorkQueue;
     vWorkQueue.push_back(hash);
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
+        ConnectStoredBlocks(hashPrev, vWorkQueue);
         for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
@@ -2614,6 +3228,21 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
 
 CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 {
+    vector<CBloomTxData> vTxData;
+    vTxData.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vTxData.push_back(CBloomTxData(tx, tx.GetHash()));
+    Init(block, filter, vTxData);
+}
+
+CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter, const vector<CBloomTxData>& vTxData)
+{
+    Init(block, filter, vTxData);
+}
+
+void CMerkleBlock::Init(const CBlock& block, CBloomFilter& filter, const vector<CBloomTxData>& vTxData)
+{
+    assert(vTxData.size() == block.vtx.size());
     header = block.GetBlockHeader();
 
     vector<bool> vMatch;
@@ -2624,8 +3253,8 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        uint256 hash = block.vtx[i].GetHash();
-        if (filter.IsRelevantAndUpdate(block.vtx[i], hash))
+        const uint256& hash = vTxData[i].hash;
+        if (filter.IsRelevantAndUpdate(block.vtx[i], vTxData[i]))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(make_pair(i, hash));
@@ -2645,24 +3274,39 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
 
 
-uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid) {
-    if (height == 0) {
-        // hash at height 0 is the txids themself
-        return vTxid[pos];
-    } else {
-        // calculate left hash
-        uint256 left = CalcHash(height-1, pos*2, vTxid), right;
-        // calculate right hash if not beyong the end of the array - copy left hash otherwise1
-        if (pos*2+1 < CalcTreeWidth(height-1))
-            right = CalcHash(height-1, pos*2+1, vTxid);
-        else
-            right = left;
-        // combine subhashes
-        return Hash(BEGIN(left), END(left), BEGIN(right), END(right));
+void BuildMerkleLevels(std::vector<uint256>& vMerkleTree, unsigned int nLeaves)
+{
+    // size the whole tree up front, so that each level can be hashed straight
+    // from the one below it inside the same buffer
+    unsigned int nTotal = 0;
+    for (unsigned int nSize = nLeaves; nSize > 1; nSize = (nSize + 1) / 2)
+        nTotal += nSize;
+    vMerkleTree.reserve(nTotal + 1);
+
+    unsigned int j = 0;
+    for (unsigned int nSize = nLeaves; nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[j + nSize].begin(), vMerkleTree[j].begin(), nSize / 2);
+        if (nSize & 1)
+        {
+            // an odd node out is paired with itself
+            uint256 pair[2] = {vMerkleTree[j + nSize - 1], vMerkleTree[j + nSize - 1]};
+            SHA256D64(vMerkleTree.back().begin(), pair[0].begin(), 1);
+        }
+        j += nSize;
     }
 }
 
-void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) {
+uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vMerkleTree) {
+    // skip the levels below height
+    unsigned int nOffset = 0;
+    for (int h = 0; h < height; h++)
+        nOffset += CalcTreeWidth(h);
+    return vMerkleTree[nOffset + pos];
+}
+
+void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vMerkleTree, const std::vector<bool> &vMatch) {
     // determine whether this node is the parent of at least one matched txid
     bool fParentOfMatch = false;
     for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
@@ -2671,12 +3315,12 @@ void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const st
     vBits.push_back(fParentOfMatch);
     if (height==0 || !fParentOfMatch) {
         // if at height 0, or nothing interesting below, store hash and stop
-        vHash.push_back(CalcHash(height, pos, vTxid));
+        vHash.push_back(CalcHash(height, pos, vMerkleTree));
     } else {
         // otherwise, don't store any hash, but descend into the subtrees
-        TraverseAndBuild(height-1, pos*2, vTxid, vMatch);
+        TraverseAndBuild(height-1, pos*2, vMerkleTree, vMatch);
         if (pos*2+1 < CalcTreeWidth(height-1))
-            TraverseAndBuild(height-1, pos*2+1, vTxid, vMatch);
+            TraverseAndBuild(height-1, pos*2+1, vMerkleTree, vMatch);
     }
 }
 
@@ -2720,8 +3364,10 @@ CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const
     while (CalcTreeWidth(nHeight) > 1)
         nHeight++;
 
-    // traverse the partial tree
-    TraverseAndBuild(nHeight, 0, vTxid, vMatch);
+    // hash every level of the tree in batches, then traverse the partial tree
+    std::vector<uint256> vMerkleTree(vTxid);
+    BuildMerkleLevels(vMerkleTree, nTransactions);
+    TraverseAndBuild(nHeight, 0, vMerkleTree, vMatch);
 }
 
 CPartialMerkleTree::CPartialMerkleTree() : nTransactions(0), fBad(true) {}
@@ -2858,7 +3504,7 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
@@ -2899,6 +3545,7 @@ bool static LoadBlockIndexDB()
          pindexPrev->pnext = pindex;
          pindex = pindexPrev;
     }
+    SetBestHeader(pindexBest);
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -2989,6 +3636,10 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    mapBlockHeaders.clear();
+    mapBlockHeadersByPrev.clear();
+    vBestHeaderChain.clear();
+    pindexBestHeader = NULL;
 }
 
 bool LoadBlockIndex()
@@ -3188,14 +3839,311 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+//
+// Importing blocks from a file is a pipeline. The importing thread scans the
+// file for pchMessageStart frames and queues the raw bytes of each block. A
+// pool of workers deserializes them and runs the checks that need no context
+// (proof of work, Merkle root, transactions), in parallel. A single connector
+// thread takes the checked blocks back in file order and hands them to
+// ProcessBlock, so they are accepted in exactly the order they would be
+// without the pipeline. A block that fails to deserialize may be a bogus
+// frame around real blocks: everything read after it is dropped and the file
+// is scanned again from the byte after its magic, as it was before.
+//
+
+// Bytes of blocks read from the file but not yet connected, at most
+static const uint64 MAX_IMPORT_BYTES_IN_FLIGHT = 32 * MAX_BLOCK_SIZE;
+
+class CBlockImporter
 {
-    int64 nStart = GetTimeMillis();
+private:
+    // A block as found in the file
+    struct CFrame
+    {
+        unsigned int nSeq;
+        unsigned int nGeneration;
+        uint64 nFramePos;   // of the message start
+        uint64 nBlockPos;
+        std::vector<char> vch;
+    };
+
+    // A block after the workers are done with it
+    struct CCheckedBlock
+    {
+        CBlock* pblock;     // NULL if it could not be deserialized
+        bool fValid;        // passed CheckBlock
+        uint64 nFramePos;
+        uint64 nBlockPos;
+        unsigned int nSize;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condReader;       // room in the pipeline, connector done or rescan wanted
+    boost::condition_variable condWorker;       // frames to check
+    boost::condition_variable condConnector;    // the next block to connect is checked
+    std::deque<CFrame> queueFrames;
+    std::map<unsigned int, CCheckedBlock> mapChecked;
+    unsigned int nSeqRead;      // frames handed to the pipeline
+    unsigned int nSeqConnect;   // the next frame to connect
+    uint64 nBytesInFlight;
+    unsigned int nGeneration;   // bumped when frames in flight are dropped for a rescan
+    bool fRescan;               // the reader must scan again from nRescanPos
+    uint64 nRescanPos;
+    bool fStop;     // stop early, on a fatal error or shutdown
+    int nLoaded;
+
+    CDiskBlockPos *dbp;
+    multimap<uint256, CDiskBlockPos> &mapBlocksUnknownParent;
+    boost::thread_group threadGroup;
+
+    void ThreadCheck()
+    {
+        RenameThread("bitcoin-loadchk");
+        while (true) {
+            CFrame frame;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueFrames.empty() && !fStop)
+                    condWorker.wait(lock);
+                if (fStop)
+                    return;
+                std::swap(frame, queueFrames.front());
+                queueFrames.pop_front();
+            }
 
-    int nLoaded = 0;
-    try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64 nStartByte = 0;
+            // Every frame gets a result, even a NULL one, or the connector
+            // would wait for it forever
+            CCheckedBlock checked;
+            checked.pblock = NULL;
+            checked.fValid = false;
+            checked.nFramePos = frame.nFramePos;
+            checked.nBlockPos = frame.nBlockPos;
+            checked.nSize = frame.vch.size();
+            try {
+                checked.pblock = new CBlock();
+                CDataStream ss(frame.vch, SER_DISK, CLIENT_VERSION);
+                ss >> *checked.pblock;
+                CValidationState state;
+                checked.fValid = checked.pblock->CheckBlock(state);
+            } catch (std::exception &e) {
+                delete checked.pblock;
+                checked.pblock = NULL;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (frame.nGeneration != nGeneration) {
+                // dropped for a rescan while we were checking it
+                delete checked.pblock;
+                nBytesInFlight -= checked.nSize;
+                condReader.notify_all();
+                continue;
+            }
+            mapChecked[frame.nSeq] = checked;
+            if (frame.nSeq == nSeqConnect)
+                condConnector.notify_one();
+        }
+    }
+
+    // Drops every frame after the one being connected, which could not be
+    // deserialized, and has the reader scan again from the byte after its
+    // magic. Called with mutex held.
+    void RequestRescan(const CCheckedBlock &checked)
+    {
+        nGeneration++;
+        for (std::deque<CFrame>::iterator it = queueFrames.begin(); it != queueFrames.end(); ++it)
+            nBytesInFlight -= (*it).vch.size();
+        queueFrames.clear();
+        for (std::map<unsigned int, CCheckedBlock>::iterator it = mapChecked.begin(); it != mapChecked.end(); ++it) {
+            nBytesInFlight -= (*it).second.nSize;
+            delete (*it).second.pblock;
+        }
+        mapChecked.clear();
+        nSeqRead = nSeqConnect + 1;
+        fRescan = true;
+        nRescanPos = checked.nFramePos + 1;
+    }
+
+    // Returns false if importing must stop
+    bool ProcessCheckedBlock(const CCheckedBlock &checked)
+    {
+        CBlock &block = *checked.pblock;
+
+        LOCK(cs_main);
+        CDiskBlockPos pos;
+        if (dbp)
+            pos = CDiskBlockPos(dbp->nFile, checked.nBlockPos);
+        if (dbp && block.hashPrevBlock != 0 && !mapBlockIndex.count(block.hashPrevBlock)) {
+            mapBlocksUnknownParent.insert(make_pair(block.hashPrevBlock, pos));
+            return true;
+        }
+        // CheckBlock already said why
+        if (!checked.fValid)
+            return true;
+        CValidationState state;
+        if (ProcessBlock(state, NULL, &block, dbp ? &pos : NULL, true))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+
+        // Now process the blocks that were waiting for it
+        vector<uint256> vQueue(1, block.GetHash());
+        for (unsigned int i = 0; i < vQueue.size() && dbp; i++) {
+            multimap<uint256, CDiskBlockPos>::iterator it = mapBlocksUnknownParent.lower_bound(vQueue[i]);
+            while (it != mapBlocksUnknownParent.upper_bound(vQueue[i])) {
+                CDiskBlockPos posChild = (*it).second;
+                mapBlocksUnknownParent.erase(it++);
+                CBlock blockChild;
+                if (!blockChild.ReadFromDisk(posChild))
+                    continue;
+                CValidationState stateChild;
+                if (ProcessBlock(stateChild, NULL, &blockChild, &posChild)) {
+                    nLoaded++;
+                    vQueue.push_back(blockChild.GetHash());
+                }
+            }
+        }
+        return true;
+    }
+
+    void ThreadConnect()
+    {
+        RenameThread("bitcoin-loadcon");
+        while (true) {
+            CCheckedBlock checked;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !mapChecked.count(nSeqConnect))
+                    condConnector.wait(lock);
+                if (fStop)
+                    return;
+                std::map<unsigned int, CCheckedBlock>::iterator it = mapChecked.find(nSeqConnect);
+                checked = (*it).second;
+                mapChecked.erase(it);
+                if (!checked.pblock) {
+                    printf("LoadExternalBlockFile() : Deserialize error caught during load\n");
+                    RequestRescan(checked);
+                }
+            }
+
+            bool fContinue = true;
+            if (checked.pblock) {
+                fContinue = false;
+                try {
+                    fContinue = ProcessCheckedBlock(checked);
+                } catch (std::runtime_error &e) {
+                    AbortNode(_("Error: system error: ") + e.what());
+                } catch (std::exception &e) {
+                    printf("%s() : %s\n", BOOST_CURRENT_FUNCTION, e.what());
+                }
+                delete checked.pblock;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nSeqConnect++;
+            nBytesInFlight -= checked.nSize;
+            if (!fContinue) {
+                fStop = true;
+                condWorker.notify_all();
+            }
+            condReader.notify_all();
+        }
+    }
+
+public:
+    CBlockImporter(CDiskBlockPos *dbpIn, multimap<uint256, CDiskBlockPos> &mapBlocksUnknownParentIn) :
+        nSeqRead(0), nSeqConnect(0), nBytesInFlight(0), nGeneration(0), fRescan(false), nRescanPos(0), fStop(false), nLoaded(0),
+        dbp(dbpIn), mapBlocksUnknownParent(mapBlocksUnknownParentIn)
+    {
+        // As many workers as script verification threads (-par)
+        int nWorkers = std::max(nScriptCheckThreads, 1);
+        for (int i = 0; i < nWorkers; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+        threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadConnect, this));
+    }
+
+    ~CBlockImporter()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condWorker.notify_all();
+            condConnector.notify_all();
+        }
+        threadGroup.join_all();
+        for (std::map<unsigned int, CCheckedBlock>::iterator it = mapChecked.begin(); it != mapChecked.end(); ++it)
+            delete (*it).second.pblock;
+    }
+
+    // Queues a block found at nBlockPos, in a frame starting at nFramePos,
+    // waiting for room if the pipeline is full. Takes the contents of vch.
+    // The block is dropped if a rescan is pending. Returns false if importing
+    // has stopped.
+    bool Add(uint64 nFramePos, uint64 nBlockPos, std::vector<char> &vch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && !fRescan && nBytesInFlight > 0 && nBytesInFlight + vch.size() > MAX_IMPORT_BYTES_IN_FLIGHT)
+            condReader.wait(lock);
+        if (fStop)
+            return false;
+        if (fRescan)
+            return true;
+        queueFrames.push_back(CFrame());
+        CFrame &frame = queueFrames.back();
+        frame.nSeq = nSeqRead++;
+        frame.nGeneration = nGeneration;
+        frame.nFramePos = nFramePos;
+        frame.nBlockPos = nBlockPos;
+        frame.vch.swap(vch);
+        nBytesInFlight += frame.vch.size();
+        condWorker.notify_one();
+        return true;
+    }
+
+    // Returns true, and where to scan the file from, if the reader has to go
+    // back for a frame that could not be deserialized
+    bool TakeRescan(uint64 &nPos)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fRescan)
+            return false;
+        fRescan = false;
+        nPos = nRescanPos;
+        return true;
+    }
+
+    // Waits for every queued block to be connected, or for a rescan to be
+    // wanted, in which case it returns true with the position to scan from
+    bool WaitConnected(uint64 &nPos)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && !fRescan && nSeqConnect != nSeqRead)
+                condReader.wait(lock);
+        }
+        return TakeRescan(nPos);
+    }
+
+    // Returns how many blocks were loaded
+    int GetLoaded()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nLoaded;
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Blocks of our own block files whose parent comes later (they were
+    // stored ahead of it during sync), by parent hash. Kept across files.
+    static multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+    int64 nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        CBlockImporter importer(dbp, mapBlocksUnknownParent);
+        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        uint64 nStartByte = 0;
         if (dbp) {
             // (try to) skip already indexed part
             CBlockFileInfo info;
@@ -3205,53 +4153,72 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             }
         }
         uint64 nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
-            boost::this_thread::interruption_point();
+        bool fStopped = false;
+        while (!fStopped) {
+            while (blkdat.good() && !blkdat.eof()) {
+                boost::this_thread::interruption_point();
+
+                // a frame we passed over could not be deserialized
+                uint64 nRescan;
+                if (importer.TakeRescan(nRescan)) {
+                    if (!blkdat.Seek(nRescan))
+                        break;
+                    nRewind = nRescan;
+                }
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[4];
-                blkdat.FindByte(pchMessageStart[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, pchMessageStart, 4))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                uint64 nFramePos = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[4];
+                    blkdat.FindByte(pchMessageStart[0]);
+                    nFramePos = blkdat.GetPos();
+                    nRewind = nFramePos+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, pchMessageStart, 4))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (std::exception &e) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read block, in pieces small enough for the buffer to keep
+                    // the whole of it for rewinding
+                    uint64 nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    std::vector<char> vch(nSize);
+                    for (unsigned int nRead = 0; nRead < nSize; nRead += 65536)
+                        blkdat.read(&vch[nRead], std::min(nSize - nRead, 65536U));
+                    // past the frame; the connector sends us back to
+                    // nFramePos+1 if it turns out not to hold a block
+                    nRewind = blkdat.GetPos();
+
+                    // hand it to the workers
+                    if (nBlockPos >= nStartByte && !importer.Add(nFramePos, nBlockPos, vch)) {
+                        fStopped = true;
                         break;
+                    }
+                } catch (std::exception &e) {
+                    printf("%s() : I/O error caught during load\n", BOOST_CURRENT_FUNCTION);
                 }
-            } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", BOOST_CURRENT_FUNCTION);
             }
+            if (fStopped)
+                break;
+            // at the end of the file, unless a late rescan sends us back
+            uint64 nRescan;
+            if (!importer.WaitConnected(nRescan) || !blkdat.Seek(nRescan))
+                break;
+            nRewind = nRescan;
         }
         fclose(fileIn);
+        nLoaded = importer.GetLoaded();
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
     }
@@ -3294,7 +4261,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = _("Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.");
@@ -3351,7 +4318,8 @@ bool static AlreadyHave(const CInv& inv)
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               HaveStoredBlock(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -3366,8 +4334,200 @@ bool static AlreadyHave(const CInv& inv)
 unsigned char pchMessageStart[4] = { 0xde, 0xad, 0x13, 0x37 };
 
 
+// Compact blocks waiting for a "blocktxn", by block hash and the peer that
+// sent the compact block, which is the only one that may complete it
+struct CPendingCompactBlock
+{
+    CPartiallyDownloadedBlock partialBlock;
+    int64 nTimeReceived;
+};
+static map<pair<uint256, CNode*>, CPendingCompactBlock> mapPendingCompactBlocks;
+static const unsigned int MAX_PENDING_COMPACT_BLOCKS = 16;
+static const int64 PENDING_COMPACT_BLOCK_TIMEOUT = 60;
+
+// Only blocks this close to the tip are sent as compact blocks; older ones
+// are unlikely to find their transactions in the peer's memory pool
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+
+
+// Blocks requested during headers-first sync, by block hash
+struct CBlockInFlight
+{
+    CNode* pnode;
+    int64 nTime;
+};
+static map<uint256, CBlockInFlight> mapBlocksInFlight;
+
+void MarkBlockAsInFlight(CNode* pnode, const uint256& hash)
+{
+    CBlockInFlight& inflight = mapBlocksInFlight[hash];
+    inflight.pnode = pnode;
+    inflight.nTime = GetTime();
+    pnode->nBlocksInFlight++;
+}
+
+// The block arrived, or its peer can't deliver it: it's free to be asked
+// from anyone again
+void MarkBlockAsReceived(const uint256& hash)
+{
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    CNode* pnode = (*mi).second.pnode;
+    pnode->nBlocksInFlight--;
+    pnode->nStallingSince = 0;
+    mapBlocksInFlight.erase(mi);
+}
+
+void FinalizeNode(CNode* pnode)
+{
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin();
+    while (mi != mapBlocksInFlight.end())
+    {
+        if ((*mi).second.pnode == pnode)
+            mapBlocksInFlight.erase(mi++);
+        else
+            mi++;
+    }
+    pnode->nBlocksInFlight = 0;
+
+    map<pair<uint256, CNode*>, CPendingCompactBlock>::iterator mi2 = mapPendingCompactBlocks.begin();
+    while (mi2 != mapPendingCompactBlocks.end())
+    {
+        if ((*mi2).first.second == pnode)
+            mapPendingCompactBlocks.erase(mi2++);
+        else
+            mi2++;
+    }
+}
+
+// Picks up to nCount blocks of the best header chain for pto to download,
+// from the BLOCK_DOWNLOAD_WINDOW blocks following the last block we have on
+// that chain. If pto has nothing left to do in the window while the first
+// block missing is still being downloaded from some other peer, that peer is
+// returned in pnodeStalling: it is holding up the whole download.
+void FindNextBlocksToDownload(CNode* pto, unsigned int nCount, vector<CBlockIndex*>& vBlocks, CNode*& pnodeStalling)
+{
+    vBlocks.clear();
+    pnodeStalling = NULL;
+    if (pindexBestHeader == NULL || pindexBest == NULL || pindexBestHeader->nChainWork <= pindexBest->nChainWork)
+        return;
+
+    // Last block of the best header chain that we have
+    int nHeight = min(pindexBest->nHeight, pindexBestHeader->nHeight);
+    while (nHeight > 0 && !vBestHeaderChain[nHeight]->IsInMainChain())
+        nHeight--;
+
+    int nWindowEnd = min(nHeight + BLOCK_DOWNLOAD_WINDOW, pindexBestHeader->nHeight);
+    CNode* pnodeFirstMissing = NULL;
+    bool fFirstMissing = true;
+    while (++nHeight <= nWindowEnd && vBlocks.size() < nCount)
+    {
+        const uint256& hash = vBestHeaderChain[nHeight]->GetBlockHash();
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || HaveStoredBlock(hash))
+            continue;
+        map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end())
+        {
+            if (fFirstMissing)
+                pnodeFirstMissing = (*mi).second.pnode;
+            fFirstMissing = false;
+            continue;
+        }
+        fFirstMissing = false;
+        // The peer doesn't have it
+        if (nHeight > pto->nSyncHeight)
+            break;
+        vBlocks.push_back(vBestHeaderChain[nHeight]);
+    }
+
+    // Stalling only if the window, rather than the headers or pto, is what
+    // keeps pto idle
+    if (vBlocks.empty() && nHeight > nWindowEnd && nWindowEnd < min(pindexBestHeader->nHeight, pto->nSyncHeight) &&
+        pnodeFirstMissing != pto)
+        pnodeStalling = pnodeFirstMissing;
+}
+
+// Disconnects pto if it has been holding up the download window for longer
+// than BLOCK_STALLING_TIMEOUT, and any peer that took longer than
+// BLOCK_DOWNLOAD_TIMEOUT to send a block we asked for. Returns true if pto
+// was disconnected.
+bool CheckBlockDownloadTimeouts(CNode* pto, int64 nTime)
+{
+    if (pto->nStallingSince && nTime - pto->nStallingSince > BLOCK_STALLING_TIMEOUT)
+    {
+        printf("peer %s is stalling block download, disconnecting\n", pto->addr.ToString().c_str());
+        pto->fDisconnect = true;
+        FinalizeNode(pto);
+        return true;
+    }
+
+    // Peers that took too long to send a block we asked for
+    static int64 nLastTimeoutCheck;
+    if (nTime > nLastTimeoutCheck)
+    {
+        nLastTimeoutCheck = nTime;
+        set<CNode*> setTimedOut;
+        for (map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); ++mi)
+            if (nTime - (*mi).second.nTime > BLOCK_DOWNLOAD_TIMEOUT)
+                setTimedOut.insert((*mi).second.pnode);
+        BOOST_FOREACH(CNode* pnode, setTimedOut)
+        {
+            printf("peer %s timed out on block download, disconnecting\n", pnode->addr.ToString().c_str());
+            pnode->fDisconnect = true;
+            FinalizeNode(pnode);
+        }
+        if (pto->fDisconnect)
+            return true;
+    }
+    return false;
+}
+
+
+// The blocks most recently sent filtered, each with the data elements of its
+// transactions prepared, for the SPV peers that ask for the same blocks in
+// turn to share. Guarded by cs_main. The prepared data takes about as much
+// memory as the block itself, so up to MAX_BLOOM_BLOCK_DATA full blocks and
+// as much again, 64MB at worst, stay resident until newer blocks are asked
+// for filtered, however long that takes.
+struct CBloomBlockData
+{
+    CBlock block;
+    vector<CBloomTxData> vTxData;
+};
+typedef boost::shared_ptr<const CBloomBlockData> CBloomBlockDataRef;
+static map<uint256, CBloomBlockDataRef> mapBloomBlockData;
+static deque<uint256> vBloomBlockDataOrder;
+static const unsigned int MAX_BLOOM_BLOCK_DATA = 32;
+
+// Empty if the block can't be read
+static CBloomBlockDataRef GetBloomBlockData(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    map<uint256, CBloomBlockDataRef>::iterator mi = mapBloomBlockData.find(hash);
+    if (mi != mapBloomBlockData.end())
+        return (*mi).second;
+
+    boost::shared_ptr<CBloomBlockData> pdata(new CBloomBlockData());
+    if (!pdata->block.ReadFromDisk(pindex))
+        return CBloomBlockDataRef();
+    pdata->vTxData.reserve(pdata->block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, pdata->block.vtx)
+        pdata->vTxData.push_back(CBloomTxData(tx, tx.GetHash()));
+
+    if (vBloomBlockDataOrder.size() >= MAX_BLOOM_BLOCK_DATA)
+    {
+        mapBloomBlockData.erase(vBloomBlockDataOrder.front());
+        vBloomBlockDataOrder.pop_front();
+    }
+    mapBloomBlockData[hash] = pdata;
+    vBloomBlockDataOrder.push_back(hash);
+    return pdata;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
+    LOCK(cs_main);
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
@@ -3388,7 +4548,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = true;
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
@@ -3407,21 +4567,42 @@ void static ProcessGetData(CNode* pfrom)
                        }
                     }
                 } else {
+                    // Let a syncing peer ask someone else
                     send = false;
+                    vNotFound.push_back(inv);
+                }
+                // Filtered blocks come with the prepared data to match the
+                // peer's filter against; one we can't read we don't have
+                CBloomBlockDataRef pdata;
+                if (send && inv.type == MSG_FILTERED_BLOCK)
+                {
+                    pdata = GetBloomBlockData((*mi).second);
+                    if (!pdata)
+                    {
+                        send = false;
+                        vNotFound.push_back(inv);
+                    }
                 }
                 if (send)
                 {
                     // Send block from disk
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    if (inv.type == MSG_BLOCK)
+                    CBlock blockRead;
+                    if (!pdata)
+                        blockRead.ReadFromDisk((*mi).second);
+                    const CBlock& block = pdata ? pdata->block : blockRead;
+                    if (inv.type == MSG_CMPCT_BLOCK && nBestHeight - (*mi).second->nHeight < MAX_CMPCTBLOCK_DEPTH)
+                    {
+                        CBlockHeaderAndShortTxIDs cmpctblock(block);
+                        pfrom->PushMessage("cmpctblock", cmpctblock);
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                         pfrom->PushMessage("block", block);
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            CMerkleBlock merkleBlock(block, *pfrom->pfilter, pdata->vTxData);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -3431,7 +4612,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->IsInventoryKnown(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -3453,20 +4634,19 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
+                // Send the message from relay memory
                 bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                if (inv.type == MSG_TX) {
+                    CSharedMessage msg = relayCache.Find(inv.hash);
+                    if (msg) {
+                        pfrom->PushSharedMessage(msg);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
                     LOCK(mempool.cs);
                     if (mempool.exists(inv.hash)) {
-                        CTransaction tx = mempool.lookup(inv.hash);
+                        const CTransaction& tx = mempool.lookup(inv.hash);
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
                         ss << tx;
@@ -3482,7 +4662,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3501,6 +4681,88 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// A block received in full, or rebuilt from a compact block. pstateChecked,
+// if given, holds what CheckBlock already said about it.
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block, CValidationState* pstateChecked = NULL)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    MarkBlockAsReceived(inv.hash);
+    CValidationState state;
+    bool fAccepted = false;
+    if (pstateChecked && !pstateChecked->IsValid())
+        state = *pstateChecked;
+    else
+        fAccepted = ProcessBlock(state, pfrom, &block, NULL, pstateChecked != NULL);
+    if (fAccepted || state.CorruptionPossible())
+        mapAlreadyAskedFor.erase(inv);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
+// A "block" message, handled by ProcessMessage without cs_main. Its
+// context-free checks are done before taking cs_main, so blocks from
+// different peers are checked in parallel.
+bool static ProcessBlockMessage(CNode* pfrom, CDataStream& vRecv)
+{
+    CBlock block;
+    vRecv >> block;
+    uint256 hash = block.GetHash();
+
+    printf("received block %s\n", hash.ToString().c_str());
+    // block.print();
+
+    CInv inv(MSG_BLOCK, hash);
+    pfrom->AddInventoryKnown(inv);
+
+    // A block we already have costs no more than before: ProcessBlock
+    // turns it away before checking it
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || HaveStoredBlock(hash))
+        {
+            ProcessReceivedBlock(pfrom, block);
+            return true;
+        }
+    }
+
+    CValidationState state;
+    block.CheckBlock(state);
+
+    LOCK(cs_main);
+    ProcessReceivedBlock(pfrom, block, &state);
+    return true;
+}
+
+// Ask pfrom for a block in full, after a compact block could not be rebuilt
+void static RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// Forgets the "getblocktxn" requests that peers never answered
+void static ExpirePendingCompactBlocks(int64 nNow)
+{
+    map<pair<uint256, CNode*>, CPendingCompactBlock>::iterator mi = mapPendingCompactBlocks.begin();
+    while (mi != mapPendingCompactBlocks.end())
+    {
+        if ((*mi).second.nTimeReceived < nNow - PENDING_COMPACT_BLOCK_TIMEOUT)
+            mapPendingCompactBlocks.erase(mi++);
+        else
+            mi++;
+    }
+}
+
+// Whether some peer has yet to send the transactions missing from its
+// compact block for hash
+bool static IsCompactBlockPending(const uint256& hash)
+{
+    map<pair<uint256, CNode*>, CPendingCompactBlock>::iterator mi = mapPendingCompactBlocks.lower_bound(make_pair(hash, (CNode*)NULL));
+    return mi != mapPendingCompactBlocks.end() && (*mi).first.first == hash;
+}
+
 bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3544,10 +4806,14 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         if (!vRecv.empty())
             vRecv >> pfrom->nStartingHeight;
-        if (!vRecv.empty())
-            vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
-        else
-            pfrom->fRelayTxes = true;
+        pfrom->nSyncHeight = pfrom->nStartingHeight;
+        {
+            LOCK(pfrom->cs_filter);
+            if (!vRecv.empty())
+                vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
+            else
+                pfrom->fRelayTxes = true;
+        }
 
         if (pfrom->fInbound && addrMe.IsRoutable())
         {
@@ -3732,16 +4998,30 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
+            if (inv.type == MSG_BLOCK) {
+                CBlockIndex* pindex = LookupBlockHeader(inv.hash);
+                if (pindex && pindex->nHeight > pfrom->nSyncHeight)
+                    pfrom->nSyncHeight = pindex->nHeight;
+            }
+
             if (!fAlreadyHave) {
-                if (!fImporting && !fReindex)
+                if (fImporting || fReindex)
+                    ;
+                else if (inv.type == MSG_BLOCK && IsInitialBlockDownload()) {
+                    // Catching up: the headers come first, the block with
+                    // the others (see SendMessages)
+                    if (!mapBlockHeaders.count(inv.hash))
+                        pfrom->PushGetHeaders(pindexBestHeader, inv.hash);
+                }
+                else
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+                pfrom->PushGetHeaders(pindexBestHeader, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
-                // this situation and push another getblocks to continue.
-                pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
+                // this situation and push a getheaders to continue.
+                pfrom->PushGetHeaders(mapBlockIndex[inv.hash], uint256(0));
                 if (fDebug)
                     printf("force request: %s\n", inv.ToString().c_str());
             }
@@ -3832,7 +5112,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3844,6 +5124,78 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        unsigned int nCount = ReadCompactSize(vRecv);
+        if (nCount > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("headers message size = %u", nCount);
+        }
+        vector<CBlockHeader> vHeaders(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            vRecv >> vHeaders[i];
+            ReadCompactSize(vRecv); // ignore the transaction count, always 0
+        }
+        if (vHeaders.empty())
+            return true;
+
+        // Headers that don't connect to ours: we're missing the ones between
+        if (LookupBlockHeader(vHeaders[0].hashPrevBlock) == NULL)
+        {
+            pfrom->PushGetHeaders(pindexBestHeader, uint256(0));
+            return true;
+        }
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(const CBlockHeader& header, vHeaders)
+        {
+            if (pindexLast && header.hashPrevBlock != pindexLast->GetBlockHash())
+            {
+                pfrom->Misbehaving(20);
+                return error("headers message not a chain");
+            }
+            CValidationState state;
+            if (!AcceptBlockHeader(state, header, &pindexLast))
+            {
+                int nDoS = 0;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                return error("invalid header %s received", header.GetHash().ToString().c_str());
+            }
+        }
+        if (pindexLast->nHeight > pfrom->nSyncHeight)
+            pfrom->nSyncHeight = pindexLast->nHeight;
+
+        // A full message means there are more to come
+        if (nCount == MAX_HEADERS_RESULTS)
+            pfrom->PushGetHeaders(pindexLast, uint256(0));
+    }
+
+
+    else if (strCommand == "notfound")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() > MAX_INV_SZ)
+        {
+            pfrom->Misbehaving(20);
+            return error("message notfound size() = %"PRIszu"", vInv.size());
+        }
+
+        // Someone else will have to send the blocks this peer didn't have
+        BOOST_FOREACH(const CInv& inv, vInv)
+        {
+            if (inv.type != MSG_BLOCK)
+                continue;
+            map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(inv.hash);
+            if (mi != mapBlocksInFlight.end() && (*mi).second.pnode == pfrom)
+                MarkBlockAsReceived(inv.hash);
+        }
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3851,13 +5203,14 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
+        CTransactionRef ptx(tx);
 
-        CInv inv(MSG_TX, tx.GetHash());
+        CInv inv(MSG_TX, ptx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
         bool fMissingInputs = false;
         CValidationState state;
-        if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
+        if (AcceptToMemoryPool(state, ptx, true, true, &fMissingInputs))
         {
             RelayTransaction(tx, inv.hash);
             mapAlreadyAskedFor.erase(inv);
@@ -3866,7 +5219,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str(),
+                inv.hash.ToString().c_str(),
                 mempool.mapTx.size());
 
             // Recursively process any orphan transactions that depended on this one
@@ -3878,17 +5231,17 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                      ++mi)
                 {
                     const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
+                    const CTransactionRef& orphanTx = mapOrphanTransactions[orphanHash];
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
                     // anyone relaying LegitTxX banned)
                     CValidationState stateDummy;
 
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
+                    if (AcceptToMemoryPool(stateDummy, orphanTx, true, true, &fMissingInputs2))
                     {
                         printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
-                        RelayTransaction(orphanTx, orphanHash);
+                        RelayTransaction(*orphanTx, orphanHash);
                         mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
                         vWorkQueue.push_back(orphanHash);
                         vEraseQueue.push_back(orphanHash);
@@ -3907,7 +5260,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            AddOrphanTx(ptx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
@@ -3917,7 +5270,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
         {
-            printf("%s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
+            printf("%s from %s %s was not accepted into the memory pool\n", inv.hash.ToString().c_str(),
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
             if (nDoS > 0)
                 pfrom->Misbehaving(nDoS);
@@ -3927,22 +5280,136 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
-        CBlock block;
-        vRecv >> block;
+        ProcessBlockMessage(pfrom, vRecv);
+    }
 
-        printf("received block %s\n", block.GetHash().ToString().c_str());
-        // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hash);
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
+        if (fDebug)
+            printf("received compact block %s (%u txs)\n", hash.ToString().c_str(), cmpctblock.BlockTxCount());
+
+        int64 nNow = GetTime();
+        ExpirePendingCompactBlocks(nNow);
+
+        // Don't let a peer make us scan the memory pool for free
+        if (!CheckProofOfWork(CBlock(cmpctblock.header).GetPoWHash(), cmpctblock.header.nBits))
+            pfrom->Misbehaving(50);
+        else if (!AlreadyHave(inv) && IsCompactBlockPending(hash))
+        {
+            // Rather than wait on the peer that sent it first as well, get it
+            // in full from this one
+            if (!mapPendingCompactBlocks.count(make_pair(hash, pfrom)))
+                RequestFullBlock(pfrom, hash);
+        }
+        else if (!AlreadyHave(inv))
+        {
+            CPartiallyDownloadedBlock partialBlock;
+            CPartiallyDownloadedBlock::ReadStatus status = partialBlock.InitData(cmpctblock, mempool);
+            vector<unsigned short> vMissing;
+            if (status == CPartiallyDownloadedBlock::READ_STATUS_OK)
+                partialBlock.GetMissing(vMissing);
+
+            if (status == CPartiallyDownloadedBlock::READ_STATUS_INVALID)
+                pfrom->Misbehaving(100);
+            else if (status == CPartiallyDownloadedBlock::READ_STATUS_FAILED)
+                RequestFullBlock(pfrom, hash);
+            else if (vMissing.empty())
+            {
+                CBlock block;
+                if (partialBlock.FillBlock(block, vector<CTransaction>()) == CPartiallyDownloadedBlock::READ_STATUS_OK)
+                {
+                    printf("received block %s (compact, all %"PRIszu" txs known)\n", hash.ToString().c_str(), block.vtx.size());
+                    ProcessReceivedBlock(pfrom, block);
+                }
+                else
+                    RequestFullBlock(pfrom, hash);
+            }
+            else
+            {
+                if (mapPendingCompactBlocks.size() >= MAX_PENDING_COMPACT_BLOCKS)
+                    RequestFullBlock(pfrom, hash);
+                else
+                {
+                    CPendingCompactBlock& pending = mapPendingCompactBlocks[make_pair(hash, pfrom)];
+                    pending.partialBlock = partialBlock;
+                    pending.nTimeReceived = nNow;
+
+                    CBlockTransactionsRequest req;
+                    req.blockhash = hash;
+                    req.indexes = vMissing;
+                    pfrom->PushMessage("getblocktxn", req);
+                    if (fDebug)
+                        printf("compact block %s: %"PRIszu" of %u txs missing\n", hash.ToString().c_str(), vMissing.size(), cmpctblock.BlockTxCount());
+                }
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi != mapBlockIndex.end() && nBestHeight - mi->second->nHeight < MAX_CMPCTBLOCK_DEPTH)
+        {
+            CBlock block;
+            block.ReadFromDisk(mi->second);
+
+            CBlockTransactions resp(req);
+            bool fValid = true;
+            for (unsigned int i = 0; i < req.indexes.size(); i++)
+            {
+                if (req.indexes[i] >= block.vtx.size())
+                {
+                    fValid = false;
+                    break;
+                }
+                resp.txn[i] = block.vtx[req.indexes[i]];
+            }
+            if (fValid)
+                pfrom->PushMessage("blocktxn", resp);
+            else
+                pfrom->Misbehaving(100);
+        }
+        else if (fDebug)
+            printf("getblocktxn for unknown or old block %s\n", req.blockhash.ToString().c_str());
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<pair<uint256, CNode*>, CPendingCompactBlock>::iterator mi = mapPendingCompactBlocks.find(make_pair(resp.blockhash, pfrom));
+        if (mi != mapPendingCompactBlocks.end())
+        {
+            CBlock block;
+            CPartiallyDownloadedBlock::ReadStatus status = mi->second.partialBlock.FillBlock(block, resp.txn);
+            mapPendingCompactBlocks.erase(mi);
+
+            if (status == CPartiallyDownloadedBlock::READ_STATUS_INVALID)
+                pfrom->Misbehaving(100);
+            else if (status == CPartiallyDownloadedBlock::READ_STATUS_FAILED)
+                RequestFullBlock(pfrom, resp.blockhash);
+            else
+            {
+                printf("received block %s (compact, %"PRIszu" txs fetched)\n", resp.blockhash.ToString().c_str(), resp.txn.size());
+                ProcessReceivedBlock(pfrom, block);
+            }
+        }
+        else if (fDebug)
+            printf("unrequested blocktxn for %s\n", resp.blockhash.ToString().c_str());
     }
 
 
@@ -4079,12 +5546,12 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CBloomFilter filter;
         vRecv >> filter;
 
+        LOCK(pfrom->cs_filter);
         if (!filter.IsWithinSizeConstraints())
             // There is no excuse for sending a too-large filter
             pfrom->Misbehaving(100);
         else
         {
-            LOCK(pfrom->cs_filter);
             delete pfrom->pfilter;
             pfrom->pfilter = new CBloomFilter(filter);
             pfrom->pfilter->UpdateEmptyFull();
@@ -4211,10 +5678,16 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Process message
+        // Process message. Most need cs_main, which serializes them with
+        // those of other peers; these few don't, and "block" takes it only
+        // after checking the block.
         bool fRet = false;
         try
         {
+            if (strCommand == "ping" || strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear" ||
+                strCommand == "block")
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -4261,7 +5734,7 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
-bool SendMessages(CNode* pto, bool fSendTrickle)
+bool SendMessages(CNode* pto)
 {
     TRY_LOCK(cs_main, lockMain);
     if (lockMain) {
@@ -4282,7 +5755,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            pto->PushGetBlocks(pindexBest, uint256(0));
+            pto->PushGetHeaders(pindexBestHeader, uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4320,8 +5793,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: addr
         //
-        if (fSendTrickle)
+        if (pto->nNextAddrSend < GetTimeMicros())
         {
+            pto->nNextAddrSend = PoissonNextSend(GetTimeMicros(), ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -4348,55 +5822,35 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+            // Blocks are announced right away. Transactions wait for the
+            // peer's next batch, due at random intervals so that the timing
+            // doesn't give away which peer a transaction reached us from,
+            // or that it is our own; outbound peers get theirs more often
+            vector<CInv> vInvNow;
+            vInvNow.swap(pto->vInventoryToSend);
+            int64 nNow = GetTimeMicros();
+            if (nNow >= pto->nNextInvSend)
+            {
+                vInvNow.insert(vInvNow.end(), pto->vInventoryTxToSend.begin(), pto->vInventoryTxToSend.end());
+                pto->vInventoryTxToSend.clear();
+                pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+            }
+            vInv.reserve(min(vInvNow.size(), (size_t)1000));
+            BOOST_FOREACH(const CInv& inv, vInvNow)
             {
-                if (pto->setInventoryKnown.count(inv))
+                uint256 key = CNode::GetInventoryKey(inv);
+                if (pto->filterInventoryKnown.contains(key))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(key);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -4407,14 +5861,47 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         vector<CInv> vGetData;
         int64 nNow = GetTime() * 1000000;
+
+        // Blocks of the best header chain, from every peer that has them
+        if (!pto->fClient && !pto->fOneShot && !fImporting && !fReindex &&
+            (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END))
+        {
+            int64 nTime = GetTime();
+            if (CheckBlockDownloadTimeouts(pto, nTime))
+                return true;
+
+            if (pto->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            {
+                vector<CBlockIndex*> vToDownload;
+                CNode* pnodeStalling = NULL;
+                FindNextBlocksToDownload(pto, MAX_BLOCKS_IN_TRANSIT_PER_PEER - pto->nBlocksInFlight, vToDownload, pnodeStalling);
+                BOOST_FOREACH(CBlockIndex* pindex, vToDownload)
+                {
+                    if (fDebugNet)
+                        printf("requesting block %s (%d) from %s\n", pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, pto->addr.ToString().c_str());
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pto, pindex->GetBlockHash());
+                }
+                if (pnodeStalling && pnodeStalling->nStallingSince == 0)
+                {
+                    pnodeStalling->nStallingSince = nTime;
+                    printf("block download stalled on peer %s\n", pnodeStalling->addr.ToString().c_str());
+                }
+            }
+        }
+
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(inv))
+            if (!AlreadyHave(inv) && !mapBlocksInFlight.count(inv.hash))
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
+                // New blocks are mostly transactions we already have
+                if (inv.type == MSG_BLOCK && pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -4488,12 +5975,12 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 class COrphan
 {
 public:
-    CTransaction* ptx;
+    const CTransactionRef* ptx;
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(const CTransactionRef* ptxIn)
     {
         ptx = ptxIn;
         dPriority = dFeePerKb = 0;
@@ -4513,7 +6000,7 @@ uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTransactionRef*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -4586,9 +6073,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        for (map<uint256, CTransactionRef>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
-            CTransaction& tx = (*mi).second;
+            const CTransaction& tx = *(*mi).second;
             if (tx.IsCoinBase() || !tx.IsFinal())
                 continue;
 
@@ -4618,12 +6105,12 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     if (!porphan)
                     {
                         // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
+                        vOrphan.push_back(COrphan(&(*mi).second));
                         porphan = &vOrphan.back();
                     }
                     mapDependers[txin.prevout.hash].push_back(porphan);
                     porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+                    nTotalIn += mempool.mapTx[txin.prevout.hash]->vout[txin.prevout.n].nValue;
                     continue;
                 }
                 const CCoins &coins = view.GetCoins(txin.prevout.hash);
@@ -4669,7 +6156,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             // Take highest priority transaction off the priority queue:
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTransactionRef& ptx = *(vecPriority.front().get<2>());
+            const CTransaction& tx = *ptx;
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
@@ -4712,7 +6200,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 continue;
 
             CTxUndo txundo;
-            uint256 hash = tx.GetHash();
+            const uint256& hash = ptx.GetHash();
             tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
 
             // Added
@@ -4727,7 +6215,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             if (fPrintPriority)
             {
                 printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                       dPriority, dFeePerKb, hash.ToString().c_str());
             }
 
             // Add transactions that depend on this one to the priority queue
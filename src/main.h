@@ -13,8 +13,12 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+
 class CWallet;
 class CBlock;
+class CBlockHeader;
+class CBlockTimingSample;
 class CBlockIndex;
 class CKeyItem;
 class CReserveKey;
@@ -41,6 +45,14 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Default for -maxmempool, maximum megabytes of memory for the transaction memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Seconds for the minimum fee raised by evicting from a full memory pool to halve */
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+/** Average seconds between transaction inv batches to an inbound peer; outbound peers get them twice as often */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Average seconds between relaying the addresses queued for a peer */
+static const int ADDRESS_BROADCAST_INTERVAL = 30;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -66,6 +78,16 @@ static const int COINBASE_MATURITY = 30;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of headers sent in one "headers" message; a full one means there are more */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks that can be requested from one peer at a time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Blocks are only requested this far past the last one connected, so that a slow peer can't leave the others far ahead */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds a peer may hold up the download window before we disconnect it */
+static const int64 BLOCK_STALLING_TIMEOUT = 5;
+/** Seconds a requested block may take to arrive before we disconnect its peer */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 120;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -101,6 +123,7 @@ extern uint256 nBestChainWork;
 extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern CBlockIndex* pindexBestHeader;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -146,8 +169,12 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block; fChecked if CheckBlock already passed on it */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
+/** Check a block header and add it to the header tree, for headers-first synchronization */
+bool AcceptBlockHeader(CValidationState &state, const CBlockHeader &header, CBlockIndex **ppindex = NULL);
+/** Calculate the proof of work target (nBits) of the block after pindexLast */
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -172,7 +199,9 @@ CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
 /** Send queued protocol messages to be sent to a give node */
-bool SendMessages(CNode* pto, bool fSendTrickle);
+bool SendMessages(CNode* pto);
+/** Forget what was requested from a peer that is about to be deleted. Requires cs_main. */
+void FinalizeNode(CNode* pnode);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Run the miner threads */
@@ -267,11 +296,11 @@ struct CDiskTxPos : public CDiskBlockPos
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -695,6 +724,33 @@ protected:
     static const CTxOut &GetOutputFor(const CTxIn& input, CCoinsViewCache& mapInputs);
 };
 
+/** A transaction that can no longer change, shared by reference count, with
+ * its hash computed once when it is created. The memory pool, the orphan pool
+ * and mapNextTx hold these, so a transaction passed between them is neither
+ * copied nor re-serialized to find its hash.
+ */
+class CTransactionRef
+{
+private:
+    boost::shared_ptr<const CTransaction> ptx;
+    uint256 hash;
+
+public:
+    CTransactionRef() : hash(0) {}
+    explicit CTransactionRef(const CTransaction& tx) : ptx(new CTransaction(tx)), hash(tx.GetHash()) {}
+    // hashIn must be tx.GetHash(), for callers that have already computed it
+    CTransactionRef(const CTransaction& tx, const uint256& hashIn) : ptx(new CTransaction(tx)), hash(hashIn) {}
+
+    bool IsNull() const { return !ptx; }
+    const uint256& GetHash() const { return hash; }
+    const CTransaction& operator*() const { return *ptx; }
+    const CTransaction* operator->() const { return ptx.get(); }
+    const CTransaction* get() const { return ptx.get(); }
+};
+
+// Try to accept a transaction into the memory pool
+bool AcceptToMemoryPool(CValidationState &state, const CTransactionRef &tx, bool fCheckInputs=true, bool fLimitFree=true, bool* pfMissingInputs=NULL);
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
@@ -1102,21 +1158,24 @@ class CScriptCheck
 private:
     CScript scriptPubKey;
     const CTransaction *ptxTo;
+    boost::shared_ptr<const CSigHashCache> psighash;   // shared by the transaction's checks, may be null
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSigHashCache>& psighashIn = boost::shared_ptr<const CSigHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), psighash(psighashIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
 
     bool operator()() const;
 
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
+        psighash.swap(check.psighash);
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
@@ -1175,6 +1234,11 @@ public:
 
 
 
+/** Append the inner levels of a Merkle tree to vMerkleTree, which holds its
+ * nLeaves leaves: the result is every level from the leaves up to the root,
+ * one after another. Each level is hashed as one batch by SHA256D64. */
+void BuildMerkleLevels(std::vector<uint256>& vMerkleTree, unsigned int nLeaves);
+
 /** Data structure that represents a partial merkle tree.
  *
  * It respresents a subset of the txid's of a known block, in a way that
@@ -1229,11 +1293,12 @@ protected:
         return (nTransactions+(1 << height)-1) >> height;
     }
 
-    // calculate the hash of a node in the merkle tree (at leaf level: the txid's themself)
-    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid);
+    // look up the hash of a node in the merkle tree (at leaf level: the txid's themself),
+    // given all its levels as computed by BuildMerkleLevels
+    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vMerkleTree);
 
     // recursive function that traverses tree nodes, storing the data as bits and hashes
-    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vMerkleTree, const std::vector<bool> &vMatch);
 
     // recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
     // it returns the hash of the respective node.
@@ -1392,17 +1457,7 @@ public:
         vMerkleTree.clear();
         BOOST_FOREACH(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
-        int j = 0;
-        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-        {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
-            j += nSize;
-        }
+        BuildMerkleLevels(vMerkleTree, vtx.size());
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
     }
 
@@ -1469,7 +1524,7 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(const CDiskBlockPos &pos)
+    bool ReadFromDisk(const CDiskBlockPos &pos, bool fCheckPOW = true)
     {
         SetNull();
 
@@ -1487,7 +1542,7 @@ public:
         }
 
         // Check the header
-        if (!CheckProofOfWork(GetPoWHash(), nBits))
+        if (fCheckPOW && !CheckProofOfWork(GetPoWHash(), nBits))
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -1524,11 +1579,12 @@ public:
      *  of problems. Note that in any case, coins may be modified. */
     bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins;
+    // records where the time went in *ptiming, if given
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, CBlockTimingSample *ptiming = NULL);
 
-    // Read a block from disk
-    bool ReadFromDisk(const CBlockIndex* pindex);
+    // Read a block from disk; fCheckPOW=false leaves the proof of work check to the caller
+    bool ReadFromDisk(const CBlockIndex* pindex, bool fCheckPOW = true);
 
     // Add this block to the block index, and if necessary, switch the active block chain to this
     bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos);
@@ -1671,6 +1727,10 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
+    // (memory only) Kimoto Gravity Well target of the next block, or 0 if
+    // not computed yet
+    mutable unsigned int nBitsNext;
+
 
     CBlockIndex()
     {
@@ -1691,6 +1751,7 @@ public:
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
+        nBitsNext      = 0;
     }
 
     CBlockIndex(CBlockHeader& block)
@@ -1712,6 +1773,7 @@ public:
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
+        nBitsNext      = 0;
     }
 
     CDiskBlockPos GetBlockPos() const {
@@ -1755,13 +1817,16 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        uint256 bnTarget;
+        bool fNegative, fOverflow;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (bnTarget+1), which doesn't fit in 256 bits; as bnTarget+1
+        // is at most 2**256, it is the same as ~bnTarget / (bnTarget+1) + 1
+        return (~bnTarget / (bnTarget + 1)) + 1;
     }
 
     bool IsInMainChain() const
@@ -2099,21 +2164,83 @@ public:
 
 
 
+/** Fee and size of a memory pool transaction, and of it together with
+ * everything in the pool that spends it (its descendants) */
+class CTxMemPoolEntry
+{
+public:
+    uint64 nFee;
+    unsigned int nSize;
+    unsigned int nUsage;    // estimated bytes of memory it takes in the pool
+    uint64 nFeesWithDescendants;
+    uint64 nSizeWithDescendants;
+
+    CTxMemPoolEntry() : nFee(0), nSize(0), nUsage(0), nFeesWithDescendants(0), nSizeWithDescendants(0) {}
+
+    // Satoshis per 1000 bytes: the higher of its own fee rate and that of it
+    // with its descendants, so a parent paid for by a child is kept like the child
+    uint64 GetScore() const
+    {
+        return std::max(nFee * 1000 / nSize, nFeesWithDescendants * 1000 / nSizeWithDescendants);
+    }
+};
+
+struct CMemPoolStats
+{
+    unsigned int nTx;
+    uint64 nBytes;          // serialized size of all transactions
+    uint64 nUsage;          // estimated memory usage
+    uint64 nMaxUsage;
+    uint64 nMinFee;         // rolling minimum fee per 1000 bytes
+    uint64 nEvicted;        // transactions evicted to stay below nMaxUsage
+};
+
 class CTxMemPool
 {
+private:
+    std::map<uint256, CTxMemPoolEntry> mapEntries;
+    // Eviction order, lowest score first
+    std::set<std::pair<uint64, uint256> > setByScore;
+    uint64 nBytes;
+    uint64 nUsage;
+    uint64 nMaxUsage;
+    uint64 nEvicted;
+    // Raised above the fee rate of each evicted transaction, and halved
+    // every ROLLING_FEE_HALFLIFE seconds after that
+    double dRollingMinFee;
+    int64 nLastRollingFeeUpdate;
+
+    static unsigned int GetTxMemoryUsage(const CTransaction& tx);
+    void GetAncestors(const CTransaction& tx, std::set<uint256>& setAncestors);
+    void GetDescendants(const uint256& hash, const CTransaction& tx, std::set<uint256>& setDescendants);
+    void UpdateDescendantTotals(const uint256& hash, const CTxMemPoolEntry& entryDescendant, bool fAdd);
+    void UpdateAncestors(const CTransaction& tx, const CTxMemPoolEntry& entry, bool fAdd);
+
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTransactionRef> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
-    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, const CTransaction &tx);
+    CTxMemPool();
+
+    bool accept(CValidationState &state, const CTransactionRef &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
+    bool addUnchecked(const CTransactionRef &tx, uint64 nFee = 0);
+    bool addUnchecked(const uint256& hash, const CTransaction &tx) { return addUnchecked(CTransactionRef(tx, hash)); }
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
 
+    // Memory limit enforced by TrimToSize, 0 for none
+    void SetMaxUsage(uint64 nMaxUsageIn);
+    // Evicts the lowest scoring transactions, with their descendants, until
+    // the pool uses no more than nMaxUsage; returns how many were evicted
+    unsigned int TrimToSize();
+    // Fee per 1000 bytes a transaction needs to get into the pool
+    uint64 GetMinFee();
+    void GetStats(CMemPoolStats& stats);
+
     unsigned long size()
     {
         LOCK(cs);
@@ -2125,9 +2252,10 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    // The transaction must exist()
+    const CTransaction& lookup(uint256 hash)
     {
-        return mapTx[hash];
+        return *mapTx[hash];
     }
 };
 
@@ -2281,6 +2409,14 @@ public:
     // Note that this will call IsRelevantAndUpdate on the filter for each transaction,
     // thus the filter will likely be modified.
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
+    // The same, with the data elements of the block's transactions prepared
+    // beforehand, vTxData[i] for block.vtx[i]
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomTxData>& vTxData);
+
+private:
+    void Init(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomTxData>& vTxData);
+
+public:
 
     IMPLEMENT_SERIALIZE
     (
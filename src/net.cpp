@@ -10,6 +10,8 @@
 #include "ui_interface.h"
 #include "script.h"
 
+#include <boost/scoped_ptr.hpp>
+
 #ifdef WIN32
 #include <string.h>
 #endif
@@ -59,12 +61,11 @@ uint64 nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageHandlerThreads = 1;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -78,6 +79,11 @@ CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
 
+// Nodes waiting for a message handler thread, each holding a reference
+static deque<CNode*> vMsgProcQueue;
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -100,6 +106,19 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd)
+{
+    // Filter out duplicate requests. By hash: the header-only index of the
+    // last request may have been freed when its block arrived.
+    uint256 hashBegin = pindexBegin ? pindexBegin->GetBlockHash() : 0;
+    if (hashBegin == hashLastGetHeadersBegin && hashEnd == hashLastGetHeadersEnd)
+        return;
+    hashLastGetHeadersBegin = hashBegin;
+    hashLastGetHeadersEnd = hashEnd;
+
+    PushMessage("getheaders", CBlockLocator(pindexBegin), hashEnd);
+}
+
 // find 'best' local address for a particular peer
 bool GetLocal(CService& addr, const CNetAddr *paddrPeer)
 {
@@ -627,11 +646,13 @@ void CNode::copyStats(CNodeStats &stats)
     X(nRecvBytes);
     X(nBlocksRequested);
     stats.fSyncNode = (this == pnodeSync);
+    X(nSyncHeight);
+    X(nBlocksInFlight);
 }
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete)
 {
     while (nBytes > 0) {
 
@@ -654,6 +675,9 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         pch += handled;
         nBytes -= handled;
+
+        if (msg.complete())
+            fComplete = true;
     }
 
     return true;
@@ -713,10 +737,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -806,7 +830,14 @@ void ThreadSocketHandler()
                             {
                                 TRY_LOCK(pnode->cs_inventory, lockInv);
                                 if (lockInv)
-                                    fDelete = true;
+                                {
+                                    TRY_LOCK(cs_main, lockMain);
+                                    if (lockMain)
+                                    {
+                                        FinalizeNode(pnode);
+                                        fDelete = true;
+                                    }
+                                }
                             }
                         }
                     }
@@ -987,40 +1018,45 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                bool fComplete = false;
                 {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
                     {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
                         {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            // typical socket buffer is 8K-64K
+                            char pchBuf[0x10000];
+                            int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                            if (nBytes > 0)
+                            {
+                                if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fComplete))
+                                    pnode->CloseSocketDisconnect();
+                                pnode->nLastRecv = GetTime();
+                                pnode->nRecvBytes += nBytes;
+                            }
+                            else if (nBytes == 0)
                             {
+                                // socket closed gracefully
                                 if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
+                                    printf("socket closed\n");
                                 pnode->CloseSocketDisconnect();
                             }
+                            else if (nBytes < 0)
+                            {
+                                // error
+                                int nErr = WSAGetLastError();
+                                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                                {
+                                    if (!pnode->fDisconnect)
+                                        printf("socket recv error %d\n", nErr);
+                                    pnode->CloseSocketDisconnect();
+                                }
+                            }
                         }
                     }
                 }
+                if (fComplete)
+                    WakeMessageHandler(pnode);
             }
 
             //
@@ -1030,9 +1066,20 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetSend))
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                // Processing stops while the send buffer is full, so pick it
+                // up again as soon as there is room
+                bool fDrained = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                    {
+                        bool fFull = pnode->nSendSize >= SendBufferSize();
+                        SocketSendData(pnode);
+                        fDrained = fFull && pnode->nSendSize < SendBufferSize();
+                    }
+                }
+                if (fDrained)
+                    WakeMessageHandler(pnode);
             }
 
             //
@@ -1577,6 +1624,8 @@ double static NodeSyncScore(const CNode *pnode) {
     return -pnode->nLastRecv;
 }
 
+// The sync node sends us the headers of the best chain; the blocks themselves
+// are fetched from every peer that has them (see SendMessages)
 void static StartSync(const vector<CNode*> &vNodes) {
     CNode *pnodeNewSync = NULL;
     double dBestScore = 0;
@@ -1608,75 +1657,116 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+void WakeMessageHandler(CNode* pnode)
 {
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-    while (true)
+    LOCK(cs_vNodes);
+    boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+    if (pnode->fMsgProcQueued)
     {
-        bool fHaveSyncNode = false;
+        // Already waiting, or in the hands of a thread that will look again
+        pnode->fMsgProcAgain = true;
+        return;
+    }
+    pnode->fMsgProcQueued = true;
+    pnode->fMsgProcAgain = false;
+    vMsgProcQueue.push_back(pnode->AddRef());
+    condMsgProc.notify_one();
+}
 
-        vector<CNode*> vNodesCopy;
+// Processes one message from pnode and sends what is due to it. Returns true
+// if it has more messages ready.
+bool static HandleNodeMessages(CNode* pnode)
+{
+    if (pnode->fDisconnect)
+        return false;
+
+    bool fMore = false;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
+            if (!ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+
+            if (pnode->nSendSize < SendBufferSize())
+            {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                    fMore = true;
             }
         }
+        else
+            fMore = true;
+    }
+    boost::this_thread::interruption_point();
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
-
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            SendMessages(pnode);
+    }
+    boost::this_thread::interruption_point();
 
-        bool fSleep = true;
+    return fMore && !pnode->fDisconnect;
+}
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+// One of nMessageHandlerThreads threads taking nodes off vMsgProcQueue. A node
+// is in the queue at most once and goes back to its end after each message, so
+// every peer's messages are handled in order, by one thread at a time, while
+// different peers are handled in parallel and take turns.
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode;
         {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            while (vMsgProcQueue.empty())
+                condMsgProc.wait(lock);
+            pnode = vMsgProcQueue.front();
+            vMsgProcQueue.pop_front();
+            pnode->fMsgProcAgain = false;
+        }
 
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
+        bool fMore = HandleNodeMessages(pnode);
 
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
-            }
-            boost::this_thread::interruption_point();
+        LOCK(cs_vNodes);
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        if ((fMore || pnode->fMsgProcAgain) && !pnode->fDisconnect)
+        {
+            vMsgProcQueue.push_back(pnode);
+            condMsgProc.notify_one();
+        }
+        else
+        {
+            pnode->fMsgProcQueued = false;
+            pnode->Release();
         }
+    }
+}
 
+// Messages wake the worker threads as they arrive; this only gives every node
+// a regular turn for the timers in SendMessages, and picks the sync node
+void ThreadMessageHandler()
+{
+    while (true)
+    {
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
-        }
+            bool fHaveSyncNode = false;
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode == pnodeSync)
+                    fHaveSyncNode = true;
+            if (!fHaveSyncNode)
+                StartSync(vNodes);
 
-        if (fSleep)
-            MilliSleep(100);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                WakeMessageHandler(pnode);
+        }
+        MilliSleep(100);
     }
 }
 
@@ -1878,6 +1968,8 @@ void StartNode(boost::thread_group& threadGroup)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgproc", &ThreadMessageWorker));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1952,30 +2044,82 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
+    relayCache.Add(hash, MakeSharedMessage("tx", ss));
+    // Prepared for the first filter that has to look into tx, and shared
+    // with the others. Most peers have none, or one that matches everything.
+    boost::scoped_ptr<CBloomTxData> ptxdata;
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
+        LOCK(pnode->cs_filter);
         if (!pnode->fRelayTxes)
             continue;
-        LOCK(pnode->cs_filter);
         if (pnode->pfilter)
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
+            if (!ptxdata && !pnode->pfilter->IsEmptyOrFull())
+                ptxdata.reset(new CBloomTxData(tx, hash));
+            if (ptxdata ? pnode->pfilter->IsRelevantAndUpdate(tx, *ptxdata) : pnode->pfilter->IsRelevantAndUpdate(tx, hash))
                 pnode->PushInventory(inv);
         } else
             pnode->PushInventory(inv);
     }
 }
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << hdr << ssPayload;
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    return pmsg;
+}
+
+CRelayCache::CTxidHasher::CTxidHasher()
+{
+    uint256 key = GetRandHash();
+    k0 = key.Get64(0);
+    k1 = key.Get64(1);
+}
+
+void CRelayCache::Add(const uint256& hash, const CSharedMessage& msg)
+{
+    LOCK(cs);
+    // Expire old relay messages
+    int64 nNow = GetTime();
+    while (!vExpiration.empty() && vExpiration.front().first < nNow)
+    {
+        mapMessages.erase(vExpiration.front().second);
+        vExpiration.pop_front();
+    }
+
+    // Save original serialized message so newer versions are preserved
+    if (mapMessages.insert(std::make_pair(hash, msg)).second)
+        vExpiration.push_back(std::make_pair(nNow + 15 * 60, hash));
+}
+
+CSharedMessage CRelayCache::Find(const uint256& hash) const
+{
+    LOCK(cs);
+    boost::unordered_map<uint256, CSharedMessage, CTxidHasher>::const_iterator it = mapMessages.find(hash);
+    if (it == mapMessages.end())
+        return CSharedMessage();
+    return it->second;
+}
+
+size_t CRelayCache::size() const
+{
+    LOCK(cs);
+    return mapMessages.size();
+}
+
+int64 PoissonNextSend(int64 nNow, int nAverageInterval)
+{
+    // -log(uniform(0, 1]) is exponentially distributed with mean 1
+    double dUniform = (GetRand((uint64)1 << 48) + 1) / (double)((uint64)1 << 48);
+    return nNow + (int64)(-log(dUniform) * nAverageInterval * 1000000.0 + 0.5);
+}
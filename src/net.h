@@ -13,13 +13,14 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
 #include "limitedmap.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -36,6 +37,9 @@ extern int nBestHeight;
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -49,6 +53,10 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+// Queues pnode for a message handler thread, to process what it sent us and send what is due
+void WakeMessageHandler(CNode* pnode);
+// When to next send something averaging one every nAverageInterval seconds, in microseconds
+int64 PoissonNextSend(int64 nNow, int nAverageInterval);
 
 enum
 {
@@ -80,12 +88,10 @@ extern uint64 nLocalServices;
 extern uint64 nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -94,6 +100,44 @@ extern CCriticalSection cs_vAddedNodes;
 
 
 
+/** A complete message, header and checksum included, ready to be queued for
+ * any number of peers without being copied or hashed again */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+/** The "tx" messages of recently relayed transactions, kept for 15 minutes
+ * to answer getdata requests for them */
+class CRelayCache
+{
+private:
+    // txids come from peers, so hash them with a key they don't know
+    class CTxidHasher
+    {
+    private:
+        uint64 k0, k1;
+    public:
+        CTxidHasher();
+        size_t operator()(const uint256& hash) const { return SipHashUint256(k0, k1, hash); }
+    };
+
+    boost::unordered_map<uint256, CSharedMessage, CTxidHasher> mapMessages;
+    std::deque<std::pair<int64, uint256> > vExpiration;
+    mutable CCriticalSection cs;
+
+public:
+    // Keeps msg for hash, unless there already is one
+    void Add(const uint256& hash, const CSharedMessage& msg);
+    // Null if there is none
+    CSharedMessage Find(const uint256& hash) const;
+    size_t size() const;
+};
+
+extern CRelayCache relayCache;
+
+
+
+
 class CNodeStats
 {
 public:
@@ -111,6 +155,8 @@ public:
     uint64 nRecvBytes;
     uint64 nBlocksRequested;
     bool fSyncNode;
+    int nSyncHeight;
+    int nBlocksInFlight;
 };
 
 
@@ -166,7 +212,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -199,11 +245,16 @@ public:
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
+    // Guarded by cs_filter, as the filter* messages are handled without cs_main.
     bool fRelayTxes;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
     int nRefCount;
+    // Waiting for or held by a message handler thread, and whether it has to
+    // go over the node again when done; guarded by the handler queue's mutex
+    bool fMsgProcQueued;
+    bool fMsgProcAgain;
 protected:
 
     // Denial-of-service detection/prevention
@@ -216,23 +267,35 @@ public:
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
+    uint256 hashLastGetHeadersBegin;
+    uint256 hashLastGetHeadersEnd;
     int nStartingHeight;
     bool fStartSync;
 
+    // block download, guarded by cs_main
+    int nSyncHeight;            // best height this peer is known to have
+    int nBlocksInFlight;        // blocks requested from this peer, not yet received
+    int64 nStallingSince;       // when it started holding up the download window, or 0
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    int64 nNextAddrSend;
     bool fGetAddr;
     std::set<uint256> setKnownAlerts;
     std::set<uint256> setKnownAnns;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    // Transactions are announced in batches, at random intervals
+    std::vector<CInv> vInventoryTxToSend;
+    int64 nNextInvSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) :
+        ssSend(SER_NETWORK, INIT_PROTO_VERSION), filterInventoryKnown(SendBufferSize() / 1000, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -255,17 +318,25 @@ public:
         fSuccessfullyConnected = false;
         fDisconnect = false;
         nRefCount = 0;
+        fMsgProcQueued = false;
+        fMsgProcAgain = false;
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
+        hashLastGetHeadersBegin = 0;
+        hashLastGetHeadersEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        nSyncHeight = -1;
+        nBlocksInFlight = 0;
+        nStallingSince = 0;
+        nNextAddrSend = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
         pfilter = new CBloomFilter();
 
         // Be shy and don't send version until we hear
@@ -305,8 +376,8 @@ public:
         return total;
     }
 
-    // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+    // requires LOCK(cs_vRecvMsg); fComplete is set if a message was completed
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -344,11 +415,24 @@ public:
     }
 
 
+    // filterInventoryKnown is keyed by hash, with the type mixed in to tell
+    // a block apart from its filtered and compact versions
+    static uint256 GetInventoryKey(const CInv& inv)
+    {
+        return inv.hash ^ uint256((uint64)inv.type);
+    }
+
+    bool IsInventoryKnown(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return filterInventoryKnown.contains(GetInventoryKey(inv));
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(GetInventoryKey(inv));
         }
     }
 
@@ -356,8 +440,13 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (!filterInventoryKnown.contains(GetInventoryKey(inv)))
+            {
+                if (inv.type == MSG_TX)
+                    vInventoryTxToSend.push_back(inv);
+                else
+                    vInventoryToSend.push_back(inv);
+            }
         }
     }
 
@@ -441,17 +530,30 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+        ssSend.GetAndClear(*pmsg);
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queues a message made by MakeSharedMessage
+    void PushSharedMessage(const CSharedMessage& msg)
+    {
+        LOCK(cs_vSend);
+        if (fDebug)
+            printf("sending: shared message (%"PRIszu" bytes)\n", msg->size() - CMessageHeader::HEADER_SIZE);
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
+        if (vSendMsg.size() == 1)
+            SocketSendData(this);
+    }
+
     void PushVersion();
 
 
@@ -614,6 +716,7 @@ public:
     }
 
     void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
@@ -143,6 +143,9 @@ enum
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Likewise, MSG_CMPCT_BLOCK only appears in a getdata, to ask for a block
+    // as a "cmpctblock" (see blockencodings.h) instead of a "block".
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
@@ -8,6 +8,7 @@
 #include "alert.h"
 #include "mixerann.h"
 #include "base58.h"
+#include "blocktimings.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -369,6 +370,28 @@ Value getrawmempool(const Array& params, const CRPCContext& ctx, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, const CRPCContext& ctx, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the size and memory usage of the transaction memory pool, and the fee per KB it takes.");
+
+    if (!ctx.isAdmin) throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (unauthorized)");
+
+    CMemPoolStats stats;
+    mempool.GetStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("size", (boost::int64_t)stats.nTx));
+    ret.push_back(Pair("bytes", (boost::int64_t)stats.nBytes));
+    ret.push_back(Pair("usage", (boost::int64_t)stats.nUsage));
+    ret.push_back(Pair("maxmempool", (boost::int64_t)stats.nMaxUsage));
+    ret.push_back(Pair("evicted", (boost::int64_t)stats.nEvicted));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(std::max(stats.nMinFee, CTransaction::nMinRelayTxFee))));
+    return ret;
+}
+
 Value getblockhash(const Array& params, const CRPCContext& ctx, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -442,6 +465,82 @@ Value gettxoutsetinfo(const Array& params, const CRPCContext& ctx, bool fHelp)
     return ret;
 }
 
+Value getpubkeycacheinfo(const Array& params, const CRPCContext& ctx, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getpubkeycacheinfo\n"
+            "Returns statistics about the cache of parsed public keys used to verify signatures.");
+
+    if (!ctx.isAdmin) throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (unauthorized)");
+
+    CPubKeyCacheStats stats;
+    GetPubKeyCacheStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("size", (boost::int64_t)stats.nSize));
+    ret.push_back(Pair("maxsize", (boost::int64_t)stats.nMaxSize));
+    ret.push_back(Pair("hits", (boost::int64_t)stats.nHits));
+    ret.push_back(Pair("misses", (boost::int64_t)stats.nMisses));
+    uint64 nLookups = stats.nHits + stats.nMisses;
+    ret.push_back(Pair("hitrate", nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return ret;
+}
+
+Value getblocktimings(const Array& params, const CRPCContext& ctx, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblocktimings\n"
+            "Returns how long each stage of connecting a block took, over the last blocks connected.\n"
+            "Each histogram entry counts the blocks that took from from_us to twice that many microseconds.");
+
+    if (!ctx.isAdmin) throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (unauthorized)");
+
+    CBlockTimingStats stats;
+    blockTimings.GetStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("blocks", (boost::int64_t)stats.nBlocks));
+    ret.push_back(Pair("window", (boost::int64_t)stats.nWindow));
+    Object stages;
+    for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+    {
+        Object stage;
+        stage.push_back(Pair("total_ms", 0.001 * stats.nTotal[i]));
+        stage.push_back(Pair("mean_ms", stats.nWindow ? 0.001 * stats.nTotal[i] / stats.nWindow : 0.0));
+        stage.push_back(Pair("median_ms", 0.001 * stats.nMedian[i]));
+        stage.push_back(Pair("90th_ms", 0.001 * stats.n90th[i]));
+        stage.push_back(Pair("99th_ms", 0.001 * stats.n99th[i]));
+        stage.push_back(Pair("max_ms", 0.001 * stats.nMax[i]));
+        Array histogram;
+        for (int j = 0; j < BLOCKTIMING_BUCKETS; j++)
+        {
+            if (stats.nBuckets[i][j] == 0)
+                continue;
+            Object bucket;
+            bucket.push_back(Pair("from_us", j == 0 ? (boost::int64_t)0 : (boost::int64_t)1 << j));
+            bucket.push_back(Pair("count", (boost::int64_t)stats.nBuckets[i][j]));
+            histogram.push_back(bucket);
+        }
+        stage.push_back(Pair("histogram", histogram));
+        stages.push_back(Pair(GetBlockTimingStageName(i), stage));
+    }
+    ret.push_back(Pair("stages", stages));
+    if (stats.nWindow)
+    {
+        Object last;
+        last.push_back(Pair("height", stats.last.nHeight));
+        last.push_back(Pair("hash", stats.last.hashBlock.GetHex()));
+        last.push_back(Pair("txs", (boost::int64_t)stats.last.nTx));
+        last.push_back(Pair("inputs", (boost::int64_t)stats.last.nInputs));
+        for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+            last.push_back(Pair(strprintf("%s_ms", GetBlockTimingStageName(i)), 0.001 * stats.last.nMicros[i]));
+        ret.push_back(Pair("last", last));
+    }
+    return ret;
+}
+
 Value gettxout(const Array& params, const CRPCContext& ctx, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
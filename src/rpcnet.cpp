@@ -66,6 +66,8 @@ Value getpeerinfo(const Array& params, const CRPCContext& ctx, bool fHelp)
         obj.push_back(Pair("subver", stats.cleanSubVer));
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
+        obj.push_back(Pair("syncheight", stats.nSyncHeight));
+        obj.push_back(Pair("blocksinflight", stats.nBlocksInFlight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
         if (stats.fSyncNode)
             obj.push_back(Pair("syncnode", true));
@@ -577,7 +577,7 @@ Value movecmd(const Array& params, const CRPCContext& ctx, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    ctx.wallet->AddAccountingEntry(debit, walletdb);
 
     // Credit
     CAccountingEntry credit;
@@ -587,7 +587,7 @@ Value movecmd(const Array& params, const CRPCContext& ctx, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    ctx.wallet->AddAccountingEntry(credit, walletdb);
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
@@ -1106,11 +1106,10 @@ Value listtransactions(const Array& params, const CRPCContext& ctx, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = ctx.wallet->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems& txOrdered = ctx.wallet->OrderedTxItems();
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1227,12 +1226,21 @@ Value listsinceblock(const Array& params, const CRPCContext& ctx, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = ctx.wallet->mapWallet.begin(); it != ctx.wallet->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", ctx, 0, true, transactions);
+        for (map<uint256, CWalletTx>::iterator it = ctx.wallet->mapWallet.begin(); it != ctx.wallet->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", ctx, 0, true, transactions);
+    }
+    else
+    {
+        // Only transactions in later blocks or outside the main chain can qualify
+        vector<const CWalletTx*> vpwtx;
+        ctx.wallet->GetTransactionsAbove(pindex->nHeight, vpwtx);
+        BOOST_FOREACH(const CWalletTx* pwtx, vpwtx)
+        {
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", ctx, 0, true, transactions);
+        }
     }
 
     uint256 lastblock;
@@ -1260,6 +1268,65 @@ Value listsinceblock(const Array& params, const CRPCContext& ctx, bool fHelp)
     return ret;
 }
 
+Value rescanblockchain(const Array& params, const CRPCContext& ctx, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "rescanblockchain [startheight=0]\n"
+            "Rescan the block chain from [startheight] for transactions involving the wallet.\n"
+            "Can be interrupted with abortrescan.");
+
+    int nStartHeight = 0;
+    if (params.size() > 0)
+        nStartHeight = params[0].get_int();
+    if (nStartHeight < 0 || nStartHeight > nBestHeight)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+
+    if (ctx.wallet->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning");
+
+    CBlockIndex* pindexStart = FindBlockByHeight(nStartHeight);
+    int nFound = ctx.wallet->ScanForWalletTransactions(pindexStart, true);
+    ctx.wallet->ReacceptWalletTransactions();
+
+    Object ret;
+    ret.push_back(Pair("startheight", nStartHeight));
+    ret.push_back(Pair("stopheight", (int)ctx.wallet->nRescanHeight));
+    ret.push_back(Pair("found", nFound));
+    ret.push_back(Pair("aborted", (bool)ctx.wallet->fAbortRescan));
+    return ret;
+}
+
+Value abortrescan(const Array& params, const CRPCContext& ctx, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stop a running wallet rescan (started by rescanblockchain or importprivkey).\n"
+            "Returns false if no rescan was in progress.");
+
+    if (!ctx.wallet->IsScanning())
+        return false;
+    ctx.wallet->AbortRescan();
+    return true;
+}
+
+Value getrescaninfo(const Array& params, const CRPCContext& ctx, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the state of the wallet rescan.");
+
+    Object ret;
+    ret.push_back(Pair("scanning", ctx.wallet->IsScanning()));
+    ret.push_back(Pair("startheight", (int)ctx.wallet->nRescanStartHeight));
+    ret.push_back(Pair("currentheight", (int)ctx.wallet->nRescanHeight));
+    ret.push_back(Pair("stopheight", (int)ctx.wallet->nRescanStopHeight));
+    ret.push_back(Pair("progress", ctx.wallet->GetRescanProgress()));
+    return ret;
+}
+
 Value gettransaction(const Array& params, const CRPCContext& ctx, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -16,7 +16,7 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache* psighash=NULL);
 
 
 
@@ -289,7 +289,7 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* psighash)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -843,7 +843,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                     popstack(stack);
                     popstack(stack);
@@ -905,7 +905,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                         if (fOk) {
                             isig++;
@@ -963,6 +963,53 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
+// Serialize the transaction as it is signed for input nIn: other inputs'
+// scriptSigs blanked, the signed input carrying scriptCode, and outputs and
+// sequence numbers masked according to nHashType. This is the same byte
+// stream as serializing a modified copy of txTo, without making the copy.
+static void SerializeSignatureTx(CHashWriter& ss, const CTransaction& txTo, const CScript& scriptCode, unsigned int nIn, int nHashType)
+{
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    bool fHashNone = (nHashType & 0x1f) == SIGHASH_NONE;
+    bool fHashSingle = (nHashType & 0x1f) == SIGHASH_SINGLE;
+
+    ss << txTo.nVersion;
+
+    // Blank out other inputs completely, not recommended for open transactions
+    unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+    WriteCompactSize(ss, nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        unsigned int nInput = fAnyoneCanPay ? nIn : i;
+        const CTxIn& txin = txTo.vin[nInput];
+        ss << txin.prevout;
+        // Blank out other inputs' signatures
+        if (nInput == nIn)
+            ss << scriptCode;
+        else
+            ss << CScript();
+        // With SIGHASH_NONE and SIGHASH_SINGLE, let the others update at will
+        if (nInput != nIn && (fHashNone || fHashSingle))
+            ss << (unsigned int)0;
+        else
+            ss << txin.nSequence;
+    }
+
+    // SIGHASH_NONE is a wildcard payee; SIGHASH_SINGLE only locks in the
+    // txout payee at the same index as the txin
+    unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn + 1 : txTo.vout.size());
+    WriteCompactSize(ss, nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++)
+    {
+        if (fHashSingle && i != nIn)
+            ss << CTxOut();
+        else
+            ss << txTo.vout[i];
+    }
+
+    ss << txTo.nLockTime;
+}
+
 uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     if (nIn >= txTo.vin.size())
@@ -970,57 +1017,65 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
-
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
-    {
-        // Wildcard payee
-        txTmp.vout.clear();
+    // Serialize and hash
+    CHashWriter ss(SER_GETHASH, 0);
+    SerializeSignatureTx(ss, txTo, scriptCode, nIn, nHashType);
+    ss << nHashType;
+    return ss.GetHash();
+}
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
-    }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+CSigHashCache::CSigHashCache(const CTransaction& txTo) : ptxTo(&txTo)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+        ss << txin.prevout << CScript() << txin.nSequence;
+    vchInputs.assign(ss.begin(), ss.end());
+    assert(vchInputs.size() == txTo.vin.size() * BLANK_TXIN_SIZE);
+
+    ss.clear();
+    ss << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ss.begin(), ss.end());
+
+    CHashWriter hasher(SER_GETHASH, 0);
+    hasher << txTo.nVersion;
+    WriteCompactSize(hasher, txTo.vin.size());
+    vMidstate.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
-        {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
-        }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        vMidstate.push_back(hasher.GetState());
+        hasher.write(&vchInputs[i * BLANK_TXIN_SIZE], BLANK_TXIN_SIZE);
     }
+}
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
-    {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
-    }
+uint256 CSigHashCache::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    if ((nHashType & SIGHASH_ANYONECANPAY) || (nHashType & 0x1f) == SIGHASH_NONE ||
+        (nHashType & 0x1f) == SIGHASH_SINGLE || nIn >= vMidstate.size())
+        return ::SignatureHash(scriptCode, *ptxTo, nIn, nHashType);
 
-    // Serialize and hash
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << txTmp << nHashType;
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Inputs before nIn are already in the midstate, inputs after it and
+    // the outputs are hashed as they were serialized
+    const char* pinput = &vchInputs[0] + nIn * BLANK_TXIN_SIZE;
+    const char* pend = &vchInputs[0] + vchInputs.size();
+    CHashWriter ss(SER_GETHASH, 0, vMidstate[nIn]);
+    ss.write(pinput, BLANK_TXIN_SIZE - 5);                  // prevout
+    ss << scriptCode;
+    ss.write(pinput + BLANK_TXIN_SIZE - 4, 4);              // nSequence
+    ss.write(pinput + BLANK_TXIN_SIZE, pend - (pinput + BLANK_TXIN_SIZE));
+    ss.write(&vchOutputs[0], vchOutputs.size());
+    ss << nHashType;
     return ss.GetHash();
 }
 
@@ -1082,7 +1137,7 @@ public:
 };
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache* psighash)
 {
     static CSignatureCache signatureCache;
 
@@ -1099,7 +1154,8 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighash ? psighash->SignatureHash(scriptCode, nIn, nHashType) :
+                                 SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -1475,14 +1531,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSigHashCache* psighash)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighash))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighash))
         return false;
     if (stack.empty())
         return false;
@@ -1505,7 +1561,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -13,6 +13,7 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "hash.h"
 
 class CCoins;
 class CTransaction;
@@ -665,10 +666,36 @@ public:
     }
 };
 
+/** The parts of a transaction's signature hash preimage that do not depend on
+ * the input being signed, serialized once per transaction. Checking every
+ * input with SignatureHash() copies, blanks and re-serializes the whole
+ * transaction each time; with this, a SIGHASH_ALL hash resumes from the
+ * SHA-256 state after the preceding inputs and hashes the rest straight
+ * from these buffers. Other hash types fall back to SignatureHash().
+ * Read-only once built, so it can be shared by all script checks of the
+ * transaction. The transaction must outlive it.
+ */
+class CSigHashCache
+{
+private:
+    // Serialized size of an input with an empty scriptSig
+    static const unsigned int BLANK_TXIN_SIZE = 41;
+
+    const CTransaction* ptxTo;
+    std::vector<char> vchInputs;        // all inputs, with empty scriptSigs
+    std::vector<char> vchOutputs;       // outputs and nLockTime
+    std::vector<SHA256_CTX> vMidstate;  // state after nVersion and inputs [0, i)
+
+public:
+    explicit CSigHashCache(const CTransaction& txTo);
+
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* psighash=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -678,7 +705,7 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* psighash=NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
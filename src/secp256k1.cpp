@@ -0,0 +1,1018 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "secp256k1.h"
+
+#include <stdint.h>
+#include <string.h>
+
+//
+// Native ECDSA verification over secp256k1: y^2 = x^3 + 7 over the field of
+// integers modulo p = 2^256 - 2^32 - 977, with a generator G of prime order n.
+//
+// Field elements and scalars are four little-endian 64-bit limbs, kept fully
+// reduced after every operation. u1*G + u2*Q is computed with Shamir's trick
+// over the GLV endomorphism (x, y) -> (beta*x, y), which multiplies a point
+// by lambda: each 256-bit scalar splits into two ~128-bit halves, halving the
+// number of doublings. Odd multiples of G and lambda*G are precomputed once
+// at startup for a wide window; odd multiples of the public key are computed
+// per signature for a narrow one.
+//
+
+static const uint64_t FIELD_P[4] = {0xFFFFFFFEFFFFFC2FULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL};
+// 2^256 - p
+static const uint64_t FIELD_C = 0x1000003D1ULL;
+static const uint64_t FIELD_BETA[4] = {0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL};
+
+static const uint64_t ORDER_N[4] = {0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+static const uint64_t ORDER_N_MINUS_2[4] = {0xBFD25E8CD036413FULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+// 2^256 - n, three limbs
+static const uint64_t ORDER_C[3] = {0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 0x0000000000000001ULL};
+// p - n: r and r + n are both possible x coordinates when r < p - n
+static const uint64_t P_MINUS_N[4] = {0x402DA1722FC9BAEEULL, 0x4551231950B75FC4ULL, 0x0000000000000001ULL, 0x0000000000000000ULL};
+
+static const uint64_t GENERATOR_X[4] = {0x59F2815B16F81798ULL, 0x029BFCDB2DCE28D9ULL, 0x55A06295CE870B07ULL, 0x79BE667EF9DCBBACULL};
+static const uint64_t GENERATOR_Y[4] = {0x9C47D08FFB10D4B8ULL, 0xFD17B448A6855419ULL, 0x5DA4FBFC0E1108A8ULL, 0x483ADA7726A3C465ULL};
+
+// Scalar splitting: k = k1 + k2*lambda (mod n) with k1, k2 of about 128 bits.
+// g1 = round(2^384 * b2 / n), g2 = round(2^384 * -b1 / n) for the lattice
+// basis (a1, b1), (a2, b2) of the endomorphism.
+static const uint64_t SPLIT_G1[4] = {0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL};
+static const uint64_t SPLIT_G2[4] = {0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL};
+static const uint64_t SPLIT_MINUS_B1[4] = {0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0x0000000000000000ULL, 0x0000000000000000ULL};
+static const uint64_t SPLIT_MINUS_B2[4] = {0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+static const uint64_t SPLIT_MINUS_LAMBDA[4] = {0xE0CFC810B51283CFULL, 0xA880B9FC8EC739C2ULL, 0x5AD9E3FD77ED9BA4ULL, 0xAC9C52B33FA3CF1FULL};
+
+// wNAF window sizes: the public key's table holds 2^(WINDOW_A-2) points,
+// the generator's 2^(WINDOW_G-2)
+static const int WINDOW_A = 5;
+static const int WINDOW_G = 10;
+static const int TABLE_SIZE_A = 1 << (WINDOW_A - 2);
+static const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+
+// Digits of a wNAF for scalars of up to 256 bits
+static const int WNAF_BITS = 257;
+
+
+//
+// 256-bit integers as four little-endian 64-bit limbs
+//
+
+// a * b, returning the low half and setting hi to the high half
+static inline uint64_t MulWide(uint64_t a, uint64_t b, uint64_t& hi)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 t = (uint128)a * b;
+    hi = (uint64_t)(t >> 64);
+    return (uint64_t)t;
+#else
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    return (mid << 32) | (uint32_t)p00;
+#endif
+}
+
+// a + b + carry, setting carry to the carry out
+static inline uint64_t AddCarry(uint64_t a, uint64_t b, uint64_t& carry)
+{
+    uint64_t s = a + carry;
+    uint64_t c = (s < carry);
+    s += b;
+    carry = c + (s < b);
+    return s;
+}
+
+// a - b - borrow, setting borrow to the borrow out
+static inline uint64_t SubBorrow(uint64_t a, uint64_t b, uint64_t& borrow)
+{
+    uint64_t d = a - b;
+    uint64_t bo = (a < b);
+    uint64_t r = d - borrow;
+    borrow = bo + (d < borrow);
+    return r;
+}
+
+// (c0, c1, c2) += a * b
+static inline void MulAcc(uint64_t& c0, uint64_t& c1, uint64_t& c2, uint64_t a, uint64_t b)
+{
+    uint64_t hi, lo = MulWide(a, b, hi);
+    c0 += lo;
+    hi += (c0 < lo);
+    c1 += hi;
+    c2 += (c1 < hi);
+}
+
+static int Cmp256(const uint64_t* a, const uint64_t* b)
+{
+    for (int i = 3; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+static bool IsZero256(const uint64_t* a)
+{
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+// r = a + b, returns the carry
+static uint64_t Add256(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < 4; i++)
+        r[i] = AddCarry(a[i], b[i], carry);
+    return carry;
+}
+
+// r = a - b, returns the borrow
+static uint64_t Sub256(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++)
+        r[i] = SubBorrow(a[i], b[i], borrow);
+    return borrow;
+}
+
+// t[0..8) = a * b
+static void Mul256(uint64_t* t, const uint64_t* a, const uint64_t* b)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0;
+    MulAcc(c0, c1, c2, a[0], b[0]);
+    t[0] = c0; c0 = c1; c1 = c2; c2 = 0;
+    MulAcc(c0, c1, c2, a[0], b[1]);
+    MulAcc(c0, c1, c2, a[1], b[0]);
+    t[1] = c0; c0 = c1; c1 = c2; c2 = 0;
+    MulAcc(c0, c1, c2, a[0], b[2]);
+    MulAcc(c0, c1, c2, a[1], b[1]);
+    MulAcc(c0, c1, c2, a[2], b[0]);
+    t[2] = c0; c0 = c1; c1 = c2; c2 = 0;
+    MulAcc(c0, c1, c2, a[0], b[3]);
+    MulAcc(c0, c1, c2, a[1], b[2]);
+    MulAcc(c0, c1, c2, a[2], b[1]);
+    MulAcc(c0, c1, c2, a[3], b[0]);
+    t[3] = c0; c0 = c1; c1 = c2; c2 = 0;
+    MulAcc(c0, c1, c2, a[1], b[3]);
+    MulAcc(c0, c1, c2, a[2], b[2]);
+    MulAcc(c0, c1, c2, a[3], b[1]);
+    t[4] = c0; c0 = c1; c1 = c2; c2 = 0;
+    MulAcc(c0, c1, c2, a[2], b[3]);
+    MulAcc(c0, c1, c2, a[3], b[2]);
+    t[5] = c0; c0 = c1; c1 = c2; c2 = 0;
+    MulAcc(c0, c1, c2, a[3], b[3]);
+    t[6] = c0;
+    t[7] = c1;
+}
+
+// r[0..nr) += a[0..na) * b[0..nb); the sum must fit in nr limbs
+static void MulAdd(uint64_t* r, int nr, const uint64_t* a, int na, const uint64_t* b, int nb)
+{
+    for (int i = 0; i < na; i++)
+    {
+        uint64_t carry = 0;
+        for (int j = 0; j < nb; j++)
+        {
+            uint64_t hi, lo = MulWide(a[i], b[j], hi);
+            lo += carry;
+            hi += (lo < carry);
+            lo += r[i + j];
+            hi += (lo < r[i + j]);
+            r[i + j] = lo;
+            carry = hi;
+        }
+        for (int k = i + nb; carry && k < nr; k++)
+        {
+            r[k] += carry;
+            carry = (r[k] < carry);
+        }
+    }
+}
+
+// Big-endian bytes to limbs
+static void SetBytes256(uint64_t* r, const unsigned char* pch)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        const unsigned char* p = pch + 24 - 8 * i;
+        uint64_t v = 0;
+        for (int j = 0; j < 8; j++)
+            v = (v << 8) | p[j];
+        r[i] = v;
+    }
+}
+
+
+//
+// Field arithmetic modulo p
+//
+
+struct CSecpField
+{
+    uint64_t n[4];
+};
+
+static void FieldSetInt(CSecpField& r, uint64_t a)
+{
+    r.n[0] = a;
+    r.n[1] = r.n[2] = r.n[3] = 0;
+}
+
+static bool FieldIsZero(const CSecpField& a)
+{
+    return IsZero256(a.n);
+}
+
+static bool FieldEqual(const CSecpField& a, const CSecpField& b)
+{
+    return Cmp256(a.n, b.n) == 0;
+}
+
+// r holds a value below 2p as r + 2^256 * carry; bring it below p by adding
+// 2^256 - p and dropping the 2^256 bit
+static void FieldNormalize(uint64_t* r, uint64_t carry)
+{
+    if (!carry && Cmp256(r, FIELD_P) < 0)
+        return;
+    uint64_t c = 0;
+    r[0] = AddCarry(r[0], FIELD_C, c);
+    r[1] = AddCarry(r[1], 0, c);
+    r[2] = AddCarry(r[2], 0, c);
+    r[3] = AddCarry(r[3], 0, c);
+}
+
+static void FieldAdd(CSecpField& r, const CSecpField& a, const CSecpField& b)
+{
+    uint64_t carry = Add256(r.n, a.n, b.n);
+    FieldNormalize(r.n, carry);
+}
+
+static void FieldSub(CSecpField& r, const CSecpField& a, const CSecpField& b)
+{
+    if (Sub256(r.n, a.n, b.n))
+        Add256(r.n, r.n, FIELD_P);
+}
+
+static void FieldNegate(CSecpField& r, const CSecpField& a)
+{
+    CSecpField zero;
+    FieldSetInt(zero, 0);
+    FieldSub(r, zero, a);
+}
+
+// Reduce a 512-bit product modulo p
+static void FieldReduce(uint64_t* r, const uint64_t* t)
+{
+    // t = lo + hi * 2^256 = lo + hi * (2^256 - p) (mod p)
+    uint64_t carry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t hi, lo = MulWide(t[4 + i], FIELD_C, hi);
+        lo += carry;
+        hi += (lo < carry);
+        lo += t[i];
+        hi += (lo < t[i]);
+        r[i] = lo;
+        carry = hi;
+    }
+
+    // Fold the remaining carry (below 2^34) in the same way
+    uint64_t hi, lo = MulWide(carry, FIELD_C, hi);
+    uint64_t c = 0;
+    r[0] = AddCarry(r[0], lo, c);
+    r[1] = AddCarry(r[1], hi, c);
+    r[2] = AddCarry(r[2], 0, c);
+    r[3] = AddCarry(r[3], 0, c);
+    FieldNormalize(r, c);
+}
+
+static void FieldMul(CSecpField& r, const CSecpField& a, const CSecpField& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+    FieldReduce(r.n, t);
+}
+
+static void FieldSqr(CSecpField& r, const CSecpField& a)
+{
+    FieldMul(r, a, a);
+}
+
+static void FieldSqrN(CSecpField& r, const CSecpField& a, int n)
+{
+    r = a;
+    for (int i = 0; i < n; i++)
+        FieldSqr(r, r);
+}
+
+// Computes a^(2^223 - 1), the common prefix of the exponents of FieldInv and
+// FieldSqrt, and returns a^(2^22 - 1) and a^(2^2 - 1) along the way
+static void FieldPow223(CSecpField& x223, CSecpField& x22, CSecpField& x2, const CSecpField& a)
+{
+    CSecpField x3, x6, x9, x11, x44, x88, x176, x220, t;
+    FieldSqr(x2, a);
+    FieldMul(x2, x2, a);
+    FieldSqr(x3, x2);
+    FieldMul(x3, x3, a);
+    FieldSqrN(t, x3, 3);
+    FieldMul(x6, t, x3);
+    FieldSqrN(t, x6, 3);
+    FieldMul(x9, t, x3);
+    FieldSqrN(t, x9, 2);
+    FieldMul(x11, t, x2);
+    FieldSqrN(t, x11, 11);
+    FieldMul(x22, t, x11);
+    FieldSqrN(t, x22, 22);
+    FieldMul(x44, t, x22);
+    FieldSqrN(t, x44, 44);
+    FieldMul(x88, t, x44);
+    FieldSqrN(t, x88, 88);
+    FieldMul(x176, t, x88);
+    FieldSqrN(t, x176, 44);
+    FieldMul(x220, t, x44);
+    FieldSqrN(t, x220, 3);
+    FieldMul(x223, t, x3);
+}
+
+// r = a^(p-2) = 1/a
+static void FieldInv(CSecpField& r, const CSecpField& a)
+{
+    CSecpField x223, x22, x2, t;
+    FieldPow223(x223, x22, x2, a);
+    FieldSqrN(t, x223, 23);
+    FieldMul(t, t, x22);
+    FieldSqrN(t, t, 5);
+    FieldMul(t, t, a);
+    FieldSqrN(t, t, 3);
+    FieldMul(t, t, x2);
+    FieldSqrN(t, t, 2);
+    FieldMul(r, t, a);
+}
+
+// r = a^((p+1)/4); returns whether r is a square root of a
+static bool FieldSqrt(CSecpField& r, const CSecpField& a)
+{
+    CSecpField x223, x22, x2, t;
+    FieldPow223(x223, x22, x2, a);
+    FieldSqrN(t, x223, 23);
+    FieldMul(t, t, x22);
+    FieldSqrN(t, t, 6);
+    FieldMul(t, t, x2);
+    FieldSqrN(r, t, 2);
+    FieldSqr(t, r);
+    return FieldEqual(t, a);
+}
+
+
+//
+// Scalar arithmetic modulo n
+//
+
+struct CSecpScalar
+{
+    uint64_t n[4];
+};
+
+// Reduce a 512-bit product modulo n, using 2^256 = C (mod n)
+static void ScalarReduce(uint64_t* r, const uint64_t* t)
+{
+    uint64_t m[7] = {0};        // lo + hi * C < 2^386
+    memcpy(m, t, 32);
+    MulAdd(m, 7, t + 4, 4, ORDER_C, 3);
+
+    uint64_t q[5] = {0};        // < 2^260
+    memcpy(q, m, 32);
+    MulAdd(q, 5, m + 4, 3, ORDER_C, 3);
+
+    uint64_t s[5] = {0};        // < 2^256 + 2^133
+    memcpy(s, q, 32);
+    MulAdd(s, 5, q + 4, 1, ORDER_C, 3);
+
+    if (s[4])
+    {
+        uint64_t c[4] = {ORDER_C[0], ORDER_C[1], ORDER_C[2], 0};
+        Add256(s, s, c);
+    }
+    if (Cmp256(s, ORDER_N) >= 0)
+        Sub256(s, s, ORDER_N);
+    memcpy(r, s, 32);
+}
+
+static void ScalarSet(CSecpScalar& r, const uint64_t* a)
+{
+    memcpy(r.n, a, 32);
+}
+
+static bool ScalarIsZero(const CSecpScalar& a)
+{
+    return IsZero256(a.n);
+}
+
+static void ScalarAdd(CSecpScalar& r, const CSecpScalar& a, const CSecpScalar& b)
+{
+    uint64_t carry = Add256(r.n, a.n, b.n);
+    if (carry || Cmp256(r.n, ORDER_N) >= 0)
+        Sub256(r.n, r.n, ORDER_N);
+}
+
+static void ScalarNegate(CSecpScalar& r, const CSecpScalar& a)
+{
+    if (ScalarIsZero(a))
+        r = a;
+    else
+        Sub256(r.n, ORDER_N, a.n);
+}
+
+static void ScalarMul(CSecpScalar& r, const CSecpScalar& a, const CSecpScalar& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b.n);
+    ScalarReduce(r.n, t);
+}
+
+// r = a^(n-2) = 1/a, with a 4-bit fixed window
+static void ScalarInv(CSecpScalar& r, const CSecpScalar& a)
+{
+    CSecpScalar pow[16];
+    pow[1] = a;
+    for (int i = 2; i < 16; i++)
+        ScalarMul(pow[i], pow[i - 1], a);
+
+    // The top nibble of n-2 is 0xF
+    r = pow[15];
+    for (int i = 62; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            ScalarMul(r, r, r);
+        int nibble = (ORDER_N_MINUS_2[i / 16] >> (4 * (i % 16))) & 15;
+        if (nibble)
+            ScalarMul(r, r, pow[nibble]);
+    }
+}
+
+// r = round(a * b / 2^384)
+static void ScalarMulShift384(CSecpScalar& r, const CSecpScalar& a, const uint64_t* b)
+{
+    uint64_t t[8];
+    Mul256(t, a.n, b);
+    uint64_t c = t[5] >> 63;
+    r.n[0] = AddCarry(t[6], 0, c);
+    r.n[1] = AddCarry(t[7], 0, c);
+    r.n[2] = c;
+    r.n[3] = 0;
+}
+
+// Split k into k1 + k2*lambda (mod n)
+static void ScalarSplitLambda(CSecpScalar& k1, CSecpScalar& k2, const CSecpScalar& k)
+{
+    CSecpScalar c1, c2, b;
+    ScalarMulShift384(c1, k, SPLIT_G1);
+    ScalarMulShift384(c2, k, SPLIT_G2);
+    ScalarSet(b, SPLIT_MINUS_B1);
+    ScalarMul(c1, c1, b);
+    ScalarSet(b, SPLIT_MINUS_B2);
+    ScalarMul(c2, c2, b);
+    ScalarAdd(k2, c1, c2);
+    ScalarSet(b, SPLIT_MINUS_LAMBDA);
+    ScalarMul(k1, k2, b);
+    ScalarAdd(k1, k1, k);
+}
+
+static int GetBits(const uint64_t* a, int offset, int count)
+{
+    int i = offset >> 6, shift = offset & 63;
+    uint64_t v = a[i] >> shift;
+    if (shift + count > 64)
+        v |= a[i + 1] << (64 - shift);
+    return (int)(v & ((1ULL << count) - 1));
+}
+
+// Write a as a width-w NAF: every digit is zero or odd with absolute value
+// below 2^(w-1), and any two non-zero digits are at least w positions apart.
+// Digits are negated for sign < 0. Returns the number of digits used.
+static int ScalarWnaf(int* wnaf, const CSecpScalar& a, int w, int sign)
+{
+    uint64_t s[5];
+    memcpy(s, a.n, 32);
+    s[4] = 0;
+    memset(wnaf, 0, WNAF_BITS * sizeof(int));
+
+    int nLast = -1, carry = 0;
+    int bit = 0;
+    while (bit < WNAF_BITS)
+    {
+        if (GetBits(s, bit, 1) == carry)
+        {
+            bit++;
+            continue;
+        }
+        int now = w;
+        if (now > WNAF_BITS - bit)
+            now = WNAF_BITS - bit;
+        int word = GetBits(s, bit, now) + carry;
+        carry = (word >> (w - 1)) & 1;
+        word -= carry << w;
+        wnaf[bit] = sign * word;
+        nLast = bit;
+        bit += now;
+    }
+    return nLast + 1;
+}
+
+// Split k for the endomorphism and write both halves as wNAFs, taking the
+// shorter of each half and its negation
+static void ScalarSplitWnaf(int* wnaf1, int* wnaf2, int& nBits, const CSecpScalar& k, int w)
+{
+    CSecpScalar k1, k2;
+    ScalarSplitLambda(k1, k2, k);
+    int sign1 = 1, sign2 = 1;
+    if (k1.n[3] | k1.n[2])
+    {
+        ScalarNegate(k1, k1);
+        sign1 = -1;
+    }
+    if (k2.n[3] | k2.n[2])
+    {
+        ScalarNegate(k2, k2);
+        sign2 = -1;
+    }
+    int nBits1 = ScalarWnaf(wnaf1, k1, w, sign1);
+    int nBits2 = ScalarWnaf(wnaf2, k2, w, sign2);
+    nBits = nBits1 > nBits2 ? nBits1 : nBits2;
+}
+
+
+//
+// Group arithmetic in affine and Jacobian coordinates
+//
+
+struct CSecpPoint
+{
+    CSecpField x, y;
+    bool fInfinity;
+};
+
+// (x/z^2, y/z^3)
+struct CSecpPointJ
+{
+    CSecpField x, y, z;
+    bool fInfinity;
+};
+
+static bool PointIsValid(const CSecpPoint& a)
+{
+    CSecpField y2, x3, seven;
+    FieldSqr(y2, a.y);
+    FieldSqr(x3, a.x);
+    FieldMul(x3, x3, a.x);
+    FieldSetInt(seven, 7);
+    FieldAdd(x3, x3, seven);
+    return FieldEqual(y2, x3);
+}
+
+static void PointSetJ(CSecpPointJ& r, const CSecpPoint& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FieldSetInt(r.z, 1);
+    r.fInfinity = a.fInfinity;
+}
+
+static void PointNegate(CSecpPoint& r, const CSecpPoint& a)
+{
+    r = a;
+    FieldNegate(r.y, a.y);
+}
+
+static void PointNegateJ(CSecpPointJ& r, const CSecpPointJ& a)
+{
+    r = a;
+    FieldNegate(r.y, a.y);
+}
+
+// lambda * (x, y) = (beta * x, y)
+static void PointMulLambda(CSecpPoint& r, const CSecpPoint& a)
+{
+    CSecpField beta;
+    memcpy(beta.n, FIELD_BETA, 32);
+    r = a;
+    FieldMul(r.x, a.x, beta);
+}
+
+static void PointMulLambdaJ(CSecpPointJ& r, const CSecpPointJ& a)
+{
+    CSecpField beta;
+    memcpy(beta.n, FIELD_BETA, 32);
+    r = a;
+    FieldMul(r.x, a.x, beta);
+}
+
+static void PointDouble(CSecpPointJ& r, const CSecpPointJ& a)
+{
+    // dbl-2009-l; there are no points with y = 0 on this curve
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    CSecpField A, B, C, D, E, F, t;
+    FieldSqr(A, a.x);
+    FieldSqr(B, a.y);
+    FieldSqr(C, B);
+    FieldAdd(t, a.x, B);
+    FieldSqr(t, t);
+    FieldSub(t, t, A);
+    FieldSub(t, t, C);
+    FieldAdd(D, t, t);
+    FieldAdd(E, A, A);
+    FieldAdd(E, E, A);
+    FieldSqr(F, E);
+
+    FieldMul(r.z, a.y, a.z);
+    FieldAdd(r.z, r.z, r.z);
+    FieldSub(r.x, F, D);
+    FieldSub(r.x, r.x, D);
+    FieldSub(t, D, r.x);
+    FieldMul(r.y, E, t);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldSub(r.y, r.y, C);
+    r.fInfinity = false;
+}
+
+// r = a + b with b in affine coordinates; r may alias a
+static void PointAddAffine(CSecpPointJ& r, const CSecpPointJ& a, const CSecpPoint& b)
+{
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    if (a.fInfinity)
+    {
+        PointSetJ(r, b);
+        return;
+    }
+    CSecpField z1z1, u2, s2, h, rr, hh, hhh, v, t;
+    FieldSqr(z1z1, a.z);
+    FieldMul(u2, b.x, z1z1);
+    FieldMul(s2, b.y, a.z);
+    FieldMul(s2, s2, z1z1);
+    FieldSub(h, u2, a.x);
+    FieldSub(rr, s2, a.y);
+    if (FieldIsZero(h))
+    {
+        if (FieldIsZero(rr))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FieldSqr(hh, h);
+    FieldMul(hhh, h, hh);
+    FieldMul(v, a.x, hh);
+
+    FieldMul(r.z, a.z, h);
+    FieldMul(t, a.y, hhh);
+    FieldSqr(r.x, rr);
+    FieldSub(r.x, r.x, hhh);
+    FieldSub(r.x, r.x, v);
+    FieldSub(r.x, r.x, v);
+    FieldSub(v, v, r.x);
+    FieldMul(r.y, rr, v);
+    FieldSub(r.y, r.y, t);
+    r.fInfinity = false;
+}
+
+// r = a + b; r may alias a
+static void PointAdd(CSecpPointJ& r, const CSecpPointJ& a, const CSecpPointJ& b)
+{
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    CSecpField z1z1, z2z2, u1, u2, s1, s2, h, rr, hh, hhh, v, t;
+    FieldSqr(z1z1, a.z);
+    FieldSqr(z2z2, b.z);
+    FieldMul(u1, a.x, z2z2);
+    FieldMul(u2, b.x, z1z1);
+    FieldMul(s1, a.y, b.z);
+    FieldMul(s1, s1, z2z2);
+    FieldMul(s2, b.y, a.z);
+    FieldMul(s2, s2, z1z1);
+    FieldSub(h, u2, u1);
+    FieldSub(rr, s2, s1);
+    if (FieldIsZero(h))
+    {
+        if (FieldIsZero(rr))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FieldSqr(hh, h);
+    FieldMul(hhh, h, hh);
+    FieldMul(v, u1, hh);
+
+    FieldMul(r.z, a.z, b.z);
+    FieldMul(r.z, r.z, h);
+    FieldMul(t, s1, hhh);
+    FieldSqr(r.x, rr);
+    FieldSub(r.x, r.x, hhh);
+    FieldSub(r.x, r.x, v);
+    FieldSub(r.x, r.x, v);
+    FieldSub(v, v, r.x);
+    FieldMul(r.y, rr, v);
+    FieldSub(r.y, r.y, t);
+    r.fInfinity = false;
+}
+
+// Odd multiples a, 3a, 5a, ... of a
+static void PointOddMultiples(CSecpPointJ* pre, int nSize, const CSecpPointJ& a)
+{
+    CSecpPointJ a2;
+    PointDouble(a2, a);
+    pre[0] = a;
+    for (int i = 1; i < nSize; i++)
+        PointAdd(pre[i], pre[i - 1], a2);
+}
+
+// Convert Jacobian points to affine with a single field inversion
+static void PointsToAffine(CSecpPoint* r, const CSecpPointJ* a, int nSize, CSecpField* scratch)
+{
+    // scratch[i] = product of z[0..i]
+    scratch[0] = a[0].z;
+    for (int i = 1; i < nSize; i++)
+        FieldMul(scratch[i], scratch[i - 1], a[i].z);
+    CSecpField inv, zi, zi2, zi3;
+    FieldInv(inv, scratch[nSize - 1]);
+    for (int i = nSize - 1; i >= 0; i--)
+    {
+        if (i > 0)
+        {
+            FieldMul(zi, inv, scratch[i - 1]);
+            FieldMul(inv, inv, a[i].z);
+        }
+        else
+            zi = inv;
+        FieldSqr(zi2, zi);
+        FieldMul(zi3, zi2, zi);
+        FieldMul(r[i].x, a[i].x, zi2);
+        FieldMul(r[i].y, a[i].y, zi3);
+        r[i].fInfinity = false;
+    }
+}
+
+
+//
+// Precomputed generator tables
+//
+
+class CSecp256k1Tables
+{
+public:
+    // Odd multiples G, 3G, ..., and the same multiples of lambda*G
+    CSecpPoint preG[TABLE_SIZE_G];
+    CSecpPoint preLambdaG[TABLE_SIZE_G];
+
+    CSecp256k1Tables()
+    {
+        CSecpPoint g;
+        memcpy(g.x.n, GENERATOR_X, 32);
+        memcpy(g.y.n, GENERATOR_Y, 32);
+        g.fInfinity = false;
+
+        CSecpPointJ gj;
+        PointSetJ(gj, g);
+        CSecpPointJ pre[TABLE_SIZE_G];
+        CSecpField scratch[TABLE_SIZE_G];
+        PointOddMultiples(pre, TABLE_SIZE_G, gj);
+        PointsToAffine(preG, pre, TABLE_SIZE_G, scratch);
+        for (int i = 0; i < TABLE_SIZE_G; i++)
+            PointMulLambda(preLambdaG[i], preG[i]);
+    }
+}
+secp256k1_tables;
+
+
+//
+// Signature and public key parsing
+//
+
+// Public keys in compressed (0x02, 0x03) or uncompressed (0x04) form, with
+// coordinates below p and on the curve
+static bool ParsePubKey(CSecpPoint& r, const unsigned char* pch, size_t nLen)
+{
+    r.fInfinity = false;
+    if (nLen == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        SetBytes256(r.x.n, pch + 1);
+        if (Cmp256(r.x.n, FIELD_P) >= 0)
+            return false;
+        CSecpField y2, seven;
+        FieldSqr(y2, r.x);
+        FieldMul(y2, y2, r.x);
+        FieldSetInt(seven, 7);
+        FieldAdd(y2, y2, seven);
+        if (!FieldSqrt(r.y, y2))
+            return false;
+        if ((r.y.n[0] & 1) != (pch[0] & 1))
+            FieldNegate(r.y, r.y);
+        return true;
+    }
+    if (nLen == 65 && pch[0] == 0x04)
+    {
+        SetBytes256(r.x.n, pch + 1);
+        SetBytes256(r.y.n, pch + 33);
+        if (Cmp256(r.x.n, FIELD_P) >= 0 || Cmp256(r.y.n, FIELD_P) >= 0)
+            return false;
+        return PointIsValid(r);
+    }
+    return false;
+}
+
+// Parse one INTEGER of a strict DER signature into a 256-bit value. Returns
+// false for encodings that are not minimal, negative, or wider than 256 bits.
+static bool ParseDERInteger(uint64_t* r, const unsigned char*& pch, const unsigned char* pend)
+{
+    if (pend - pch < 2 || pch[0] != 0x02)
+        return false;
+    size_t nLen = pch[1];
+    pch += 2;
+    if (nLen == 0 || nLen > (size_t)(pend - pch))
+        return false;
+    if (pch[0] & 0x80)
+        return false;
+    if (nLen > 1 && pch[0] == 0x00 && !(pch[1] & 0x80))
+        return false;
+    const unsigned char* pbegin = pch;
+    pch += nLen;
+    if (pbegin[0] == 0x00)
+    {
+        pbegin++;
+        nLen--;
+    }
+    if (nLen > 32)
+        return false;
+    unsigned char buf[32];
+    memset(buf, 0, 32);
+    memcpy(buf + 32 - nLen, pbegin, nLen);
+    SetBytes256(r, buf);
+    return true;
+}
+
+static bool ParseDERSignature(CSecpScalar& r, CSecpScalar& s, const unsigned char* pch, size_t nLen)
+{
+    // 0x30 [total length] 0x02 [R length] [R] 0x02 [S length] [S]
+    if (nLen < 8 || nLen > 72)
+        return false;
+    if (pch[0] != 0x30 || pch[1] != nLen - 2)
+        return false;
+    const unsigned char* pend = pch + nLen;
+    pch += 2;
+    if (!ParseDERInteger(r.n, pch, pend))
+        return false;
+    if (!ParseDERInteger(s.n, pch, pend))
+        return false;
+    return pch == pend;
+}
+
+
+//
+// Verification
+//
+
+// Whether the affine x coordinate of a, reduced modulo n, is r
+static bool PointHasXModN(const CSecpPointJ& a, const CSecpScalar& r)
+{
+    // x/z^2 = r, or = r + n when that is still a field element
+    CSecpField zz, xr, t;
+    FieldSqr(zz, a.z);
+    memcpy(xr.n, r.n, 32);
+    FieldMul(t, xr, zz);
+    if (FieldEqual(t, a.x))
+        return true;
+    if (Cmp256(r.n, P_MINUS_N) >= 0)
+        return false;
+    Add256(xr.n, r.n, ORDER_N);
+    FieldMul(t, xr, zz);
+    return FieldEqual(t, a.x);
+}
+
+bool Secp256k1ParsePubKey(CSecp256k1PubKey& pubkey, const unsigned char* pchPubKey, size_t nPubKeyLen)
+{
+    CSecpPoint q;
+    if (!ParsePubKey(q, pchPubKey, nPubKeyLen))
+        return false;
+    memcpy(pubkey.data, q.x.n, 32);
+    memcpy(pubkey.data + 32, q.y.n, 32);
+    return true;
+}
+
+int Secp256k1Verify(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigLen,
+                    const unsigned char* pchPubKey, size_t nPubKeyLen)
+{
+    CSecp256k1PubKey pubkey;
+    if (!Secp256k1ParsePubKey(pubkey, pchPubKey, nPubKeyLen))
+        return SECP256K1_VERIFY_UNSUPPORTED;
+    return Secp256k1VerifyParsed(pchHash, pchSig, nSigLen, pubkey);
+}
+
+int Secp256k1VerifyParsed(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigLen,
+                          const CSecp256k1PubKey& pubkey)
+{
+    CSecpPoint q;
+    memcpy(q.x.n, pubkey.data, 32);
+    memcpy(q.y.n, pubkey.data + 32, 32);
+    q.fInfinity = false;
+    CSecpScalar r, s;
+    if (!ParseDERSignature(r, s, pchSig, nSigLen))
+        return SECP256K1_VERIFY_UNSUPPORTED;
+    if (ScalarIsZero(r) || Cmp256(r.n, ORDER_N) >= 0 || ScalarIsZero(s) || Cmp256(s.n, ORDER_N) >= 0)
+        return SECP256K1_VERIFY_INVALID;
+
+    // The hash is read as a big-endian number, like ECDSA_verify does
+    CSecpScalar z, w, u1, u2;
+    SetBytes256(z.n, pchHash);
+    if (Cmp256(z.n, ORDER_N) >= 0)
+        Sub256(z.n, z.n, ORDER_N);
+    ScalarInv(w, s);
+    ScalarMul(u1, z, w);
+    ScalarMul(u2, r, w);
+
+    // Odd multiples of the public key and of lambda times it
+    CSecpPointJ qj, preA[TABLE_SIZE_A], preLambdaA[TABLE_SIZE_A];
+    PointSetJ(qj, q);
+    PointOddMultiples(preA, TABLE_SIZE_A, qj);
+    for (int i = 0; i < TABLE_SIZE_A; i++)
+        PointMulLambdaJ(preLambdaA[i], preA[i]);
+
+    int wnafA1[WNAF_BITS], wnafA2[WNAF_BITS], wnafG1[WNAF_BITS], wnafG2[WNAF_BITS];
+    int nBitsA, nBitsG;
+    ScalarSplitWnaf(wnafA1, wnafA2, nBitsA, u2, WINDOW_A);
+    ScalarSplitWnaf(wnafG1, wnafG2, nBitsG, u1, WINDOW_G);
+    int nBits = nBitsA > nBitsG ? nBitsA : nBitsG;
+
+    // Shamir's trick: one shared chain of doublings for all four terms
+    CSecpPointJ acc, tj;
+    CSecpPoint t;
+    acc.fInfinity = true;
+    for (int i = nBits - 1; i >= 0; i--)
+    {
+        PointDouble(acc, acc);
+        int n;
+        if ((n = wnafA1[i]) != 0)
+        {
+            if (n > 0)
+                PointAdd(acc, acc, preA[(n - 1) / 2]);
+            else
+            {
+                PointNegateJ(tj, preA[(-n - 1) / 2]);
+                PointAdd(acc, acc, tj);
+            }
+        }
+        if ((n = wnafA2[i]) != 0)
+        {
+            if (n > 0)
+                PointAdd(acc, acc, preLambdaA[(n - 1) / 2]);
+            else
+            {
+                PointNegateJ(tj, preLambdaA[(-n - 1) / 2]);
+                PointAdd(acc, acc, tj);
+            }
+        }
+        if ((n = wnafG1[i]) != 0)
+        {
+            if (n > 0)
+                PointAddAffine(acc, acc, secp256k1_tables.preG[(n - 1) / 2]);
+            else
+            {
+                PointNegate(t, secp256k1_tables.preG[(-n - 1) / 2]);
+                PointAddAffine(acc, acc, t);
+            }
+        }
+        if ((n = wnafG2[i]) != 0)
+        {
+            if (n > 0)
+                PointAddAffine(acc, acc, secp256k1_tables.preLambdaG[(n - 1) / 2]);
+            else
+            {
+                PointNegate(t, secp256k1_tables.preLambdaG[(-n - 1) / 2]);
+                PointAddAffine(acc, acc, t);
+            }
+        }
+    }
+
+    if (acc.fInfinity)
+        return SECP256K1_VERIFY_INVALID;
+    return PointHasXModN(acc, r) ? SECP256K1_VERIFY_VALID : SECP256K1_VERIFY_INVALID;
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stddef.h>
+
+/** Results of Secp256k1Verify() */
+enum Secp256k1VerifyResult
+{
+    SECP256K1_VERIFY_INVALID = 0,
+    SECP256K1_VERIFY_VALID = 1,
+    // The signature or public key is not in an encoding handled natively.
+    // The caller must verify it through OpenSSL instead, which decides
+    // how lax to be.
+    SECP256K1_VERIFY_UNSUPPORTED = -1,
+};
+
+/** Verify an ECDSA signature over secp256k1 without OpenSSL and without
+ * heap allocation.
+ *
+ * Only strict DER signatures and 33- or 65-byte (0x02, 0x03, 0x04) public
+ * keys are handled. For those, the result is exactly what OpenSSL's
+ * ECDSA_verify returns. Everything else is reported as unsupported rather
+ * than guessed at, so that consensus never depends on a second parser.
+ *
+ * pchHash points to the 32 hash bytes in the order they are passed to
+ * ECDSA_verify, that is, the in-memory bytes of a uint256.
+ *
+ * This is verification only: every input is public, so the code is free
+ * to branch on data and use variable-time algorithms.
+ */
+int Secp256k1Verify(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigLen,
+                    const unsigned char* pchPubKey, size_t nPubKeyLen);
+
+/** A public key parsed and checked to be on the curve, for verifying many
+ * signatures without decompressing it again. Plain data: safe to copy and
+ * to share between threads. */
+struct CSecp256k1PubKey
+{
+    unsigned char data[64];
+};
+
+/** Parse a 33- or 65-byte public key for Secp256k1VerifyParsed(). Returns
+ * false for keys Secp256k1Verify() would report as unsupported. */
+bool Secp256k1ParsePubKey(CSecp256k1PubKey& pubkey, const unsigned char* pchPubKey, size_t nPubKeyLen);
+
+/** Secp256k1Verify() with an already parsed public key. Only the signature
+ * encoding can make the result SECP256K1_VERIFY_UNSUPPORTED. */
+int Secp256k1VerifyParsed(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigLen,
+                          const CSecp256k1PubKey& pubkey);
+
+#endif
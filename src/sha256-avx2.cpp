@@ -0,0 +1,47 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+#include "sha256_lanes.h"
+
+#include <immintrin.h>
+
+namespace {
+
+// Eight inputs, one per 32-bit lane
+struct CLanesAVX2
+{
+    typedef __m256i Word;
+
+    static inline Word Add(Word x, Word y) { return _mm256_add_epi32(x, y); }
+    static inline Word Xor(Word x, Word y) { return _mm256_xor_si256(x, y); }
+    static inline Word And(Word x, Word y) { return _mm256_and_si256(x, y); }
+    static inline Word Or(Word x, Word y) { return _mm256_or_si256(x, y); }
+    static inline Word ShR(Word x, int n) { return _mm256_srli_epi32(x, n); }
+    static inline Word ShL(Word x, int n) { return _mm256_slli_epi32(x, n); }
+    static inline Word Set1(uint32_t x) { return _mm256_set1_epi32(x); }
+
+    static inline Word Load(const unsigned char* in, int i)
+    {
+        return _mm256_set_epi32(ReadBE32(in + 448 + 4 * i), ReadBE32(in + 384 + 4 * i),
+                                ReadBE32(in + 320 + 4 * i), ReadBE32(in + 256 + 4 * i),
+                                ReadBE32(in + 192 + 4 * i), ReadBE32(in + 128 + 4 * i),
+                                ReadBE32(in + 64 + 4 * i), ReadBE32(in + 4 * i));
+    }
+
+    static inline void Store(unsigned char* out, int i, Word x)
+    {
+        uint32_t v[8];
+        _mm256_storeu_si256((__m256i*)v, x);
+        for (int j = 0; j < 8; j++)
+            WriteBE32(out + 32 * j + 4 * i, v[j]);
+    }
+};
+
+}
+
+void SHA256D64_8way_avx2(unsigned char* out, const unsigned char* in)
+{
+    CSHA256Rounds<CLanesAVX2>::D64(out, in);
+}
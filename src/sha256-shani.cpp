@@ -0,0 +1,109 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+#include "sha256_lanes.h"
+
+#include <immintrin.h>
+
+namespace {
+
+// The SHA extensions keep the state as two registers, ABEF and CDGH
+inline void ToABEF(__m128i& s0, __m128i& s1)
+{
+    __m128i t1 = _mm_shuffle_epi32(s0, 0xB1);
+    __m128i t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 8);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+}
+
+inline void FromABEF(__m128i& s0, __m128i& s1)
+{
+    __m128i t1 = _mm_shuffle_epi32(s0, 0x1B);
+    __m128i t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 8);
+}
+
+inline __m128i LoadBE(const unsigned char* in)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), mask);
+}
+
+// Compress one block in each of two independent streams, interleaved so
+// that the latency of one hides behind the other. x holds the 16 message
+// words of each stream in four registers; a NULL x uses the padding block
+// of a 64-byte message instead.
+inline void Compress2(__m128i* s0, __m128i* s1, __m128i (*x)[16])
+{
+    __m128i so0[2] = {s0[0], s0[1]}, so1[2] = {s1[0], s1[1]};
+    for (int j = 0; j < 16; j++)
+    {
+        for (int l = 0; l < 2; l++)
+        {
+            __m128i msg;
+            if (x)
+            {
+                if (j >= 4)
+                    x[l][j] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(x[l][j - 4], x[l][j - 3]),
+                                                                 _mm_alignr_epi8(x[l][j - 1], x[l][j - 2], 4)),
+                                                   x[l][j - 1]);
+                msg = _mm_add_epi32(x[l][j], _mm_loadu_si128((const __m128i*)&SHA256_K[4 * j]));
+            }
+            else
+                msg = _mm_loadu_si128((const __m128i*)&SHA256_K_PAD64[4 * j]);
+            s1[l] = _mm_sha256rnds2_epu32(s1[l], s0[l], msg);
+            s0[l] = _mm_sha256rnds2_epu32(s0[l], s1[l], _mm_shuffle_epi32(msg, 0x0E));
+        }
+    }
+    for (int l = 0; l < 2; l++)
+    {
+        s0[l] = _mm_add_epi32(s0[l], so0[l]);
+        s1[l] = _mm_add_epi32(s1[l], so1[l]);
+    }
+}
+
+}
+
+void SHA256D64_2way_shani(unsigned char* out, const unsigned char* in)
+{
+    __m128i s0[2], s1[2], x[2][16];
+    __m128i init0 = _mm_loadu_si128((const __m128i*)&SHA256_INIT[0]);
+    __m128i init1 = _mm_loadu_si128((const __m128i*)&SHA256_INIT[4]);
+    ToABEF(init0, init1);
+
+    // First hash: the input block, then its padding
+    for (int l = 0; l < 2; l++)
+    {
+        s0[l] = init0;
+        s1[l] = init1;
+        for (int j = 0; j < 4; j++)
+            x[l][j] = LoadBE(in + 64 * l + 16 * j);
+    }
+    Compress2(s0, s1, x);
+    Compress2(s0, s1, NULL);
+
+    // Second hash: the 32-byte digest and its padding in one block
+    for (int l = 0; l < 2; l++)
+    {
+        __m128i d0 = s0[l], d1 = s1[l];
+        FromABEF(d0, d1);
+        x[l][0] = d0;
+        x[l][1] = d1;
+        x[l][2] = _mm_set_epi32(0, 0, 0, 0x80000000);
+        x[l][3] = _mm_set_epi32(256, 0, 0, 0);
+        s0[l] = init0;
+        s1[l] = init1;
+    }
+    Compress2(s0, s1, x);
+
+    for (int l = 0; l < 2; l++)
+    {
+        FromABEF(s0[l], s1[l]);
+        const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        _mm_storeu_si128((__m128i*)(out + 32 * l), _mm_shuffle_epi8(s0[l], mask));
+        _mm_storeu_si128((__m128i*)(out + 32 * l + 16), _mm_shuffle_epi8(s1[l], mask));
+    }
+}
@@ -0,0 +1,45 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+#include "sha256_lanes.h"
+
+#include <smmintrin.h>
+
+namespace {
+
+// Four inputs, one per 32-bit lane
+struct CLanesSSE41
+{
+    typedef __m128i Word;
+
+    static inline Word Add(Word x, Word y) { return _mm_add_epi32(x, y); }
+    static inline Word Xor(Word x, Word y) { return _mm_xor_si128(x, y); }
+    static inline Word And(Word x, Word y) { return _mm_and_si128(x, y); }
+    static inline Word Or(Word x, Word y) { return _mm_or_si128(x, y); }
+    static inline Word ShR(Word x, int n) { return _mm_srli_epi32(x, n); }
+    static inline Word ShL(Word x, int n) { return _mm_slli_epi32(x, n); }
+    static inline Word Set1(uint32_t x) { return _mm_set1_epi32(x); }
+
+    static inline Word Load(const unsigned char* in, int i)
+    {
+        return _mm_set_epi32(ReadBE32(in + 192 + 4 * i), ReadBE32(in + 128 + 4 * i),
+                             ReadBE32(in + 64 + 4 * i), ReadBE32(in + 4 * i));
+    }
+
+    static inline void Store(unsigned char* out, int i, Word x)
+    {
+        WriteBE32(out + 4 * i, _mm_extract_epi32(x, 0));
+        WriteBE32(out + 32 + 4 * i, _mm_extract_epi32(x, 1));
+        WriteBE32(out + 64 + 4 * i, _mm_extract_epi32(x, 2));
+        WriteBE32(out + 96 + 4 * i, _mm_extract_epi32(x, 3));
+    }
+};
+
+}
+
+void SHA256D64_4way_sse41(unsigned char* out, const unsigned char* in)
+{
+    CSHA256Rounds<CLanesSSE41>::D64(out, in);
+}
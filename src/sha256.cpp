@@ -0,0 +1,139 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+
+#include <openssl/sha.h>
+
+#if defined(USE_SHA256_X86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// One input at a time, through OpenSSL
+static void SHA256D64_1way(unsigned char* out, const unsigned char* in)
+{
+    unsigned char hash1[32];
+    SHA256(in, 64, hash1);
+    SHA256(hash1, 32, out);
+}
+
+typedef void (*SHA256D64Kernel)(unsigned char* out, const unsigned char* in);
+
+// Kernels hashing 8, 4 and 2 inputs at once, or NULL where the CPU has none
+static SHA256D64Kernel pSHA256D64_8way = NULL;
+static SHA256D64Kernel pSHA256D64_4way = NULL;
+static SHA256D64Kernel pSHA256D64_2way = NULL;
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+    if (pSHA256D64_8way)
+    {
+        while (nBlocks >= 8)
+        {
+            pSHA256D64_8way(out, in);
+            out += 256;
+            in += 512;
+            nBlocks -= 8;
+        }
+    }
+    if (pSHA256D64_4way)
+    {
+        while (nBlocks >= 4)
+        {
+            pSHA256D64_4way(out, in);
+            out += 128;
+            in += 256;
+            nBlocks -= 4;
+        }
+    }
+    if (pSHA256D64_2way)
+    {
+        while (nBlocks >= 2)
+        {
+            pSHA256D64_2way(out, in);
+            out += 64;
+            in += 128;
+            nBlocks -= 2;
+        }
+    }
+    while (nBlocks > 0)
+    {
+        SHA256D64_1way(out, in);
+        out += 32;
+        in += 64;
+        nBlocks--;
+    }
+}
+
+#if defined(USE_SHA256_X86)
+static void CPUID(unsigned int nLeaf, unsigned int nSubLeaf, unsigned int& a, unsigned int& b, unsigned int& c, unsigned int& d)
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuidex(regs, nLeaf, nSubLeaf);
+    a = regs[0]; b = regs[1]; c = regs[2]; d = regs[3];
+#else
+    __cpuid_count(nLeaf, nSubLeaf, a, b, c, d);
+#endif
+}
+
+// Whether the OS saves the AVX registers on a context switch
+static bool HaveAVXState()
+{
+#ifdef _MSC_VER
+    return (_xgetbv(0) & 6) == 6;
+#else
+    unsigned int lo, hi;
+    __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (lo & 6) == 6;
+#endif
+}
+#endif
+
+std::string SHA256AutoDetect()
+{
+    std::string strKernels = "openssl";
+    pSHA256D64_8way = pSHA256D64_4way = pSHA256D64_2way = NULL;
+#if defined(USE_SHA256_X86)
+    unsigned int a, b, c, d;
+    CPUID(0, 0, a, b, c, d);
+    unsigned int nMaxLeaf = a;
+    CPUID(1, 0, a, b, c, d);
+    bool fSSE41 = (c >> 19) & 1;
+    bool fAVX = ((c >> 27) & 1) && ((c >> 28) & 1) && HaveAVXState();     // OSXSAVE and AVX
+    bool fAVX2 = false, fSHA = false;
+    if (nMaxLeaf >= 7)
+    {
+        CPUID(7, 0, a, b, c, d);
+        fAVX2 = fAVX && ((b >> 5) & 1);
+        fSHA = fSSE41 && ((b >> 29) & 1);
+    }
+
+    // The SHA extensions beat even eight AVX2 lanes, so they take every
+    // input when present
+    if (fSHA)
+    {
+        pSHA256D64_2way = SHA256D64_2way_shani;
+        strKernels += ",shani(2way)";
+    }
+    else
+    {
+        if (fAVX2)
+        {
+            pSHA256D64_8way = SHA256D64_8way_avx2;
+            strKernels += ",avx2(8way)";
+        }
+        if (fSSE41)
+        {
+            pSHA256D64_4way = SHA256D64_4way_sse41;
+            strKernels += ",sse41(4way)";
+        }
+    }
+#endif
+    return strKernels;
+}
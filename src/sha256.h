@@ -0,0 +1,29 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stddef.h>
+#include <string>
+
+/** Double SHA-256 of nBlocks independent 64-byte inputs: out[32*i..] is
+ * SHA256(SHA256(in[64*i..])), the same as Hash() of that input. This is what
+ * every inner node of a Merkle tree takes, so whole tree levels can be
+ * hashed several at a time with the kernels picked by SHA256AutoDetect().
+ */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks);
+
+/** Select the fastest SHA256D64 kernels the CPU supports. Until this is
+ * called, SHA256D64 uses OpenSSL for every input. Returns a description of
+ * the selection. */
+std::string SHA256AutoDetect();
+
+#if defined(USE_SHA256_X86)
+// Kernels, each in a file built with its own instruction set flags
+void SHA256D64_4way_sse41(unsigned char* out, const unsigned char* in);
+void SHA256D64_8way_avx2(unsigned char* out, const unsigned char* in);
+void SHA256D64_2way_shani(unsigned char* out, const unsigned char* in);
+#endif
+
+#endif
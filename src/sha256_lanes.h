@@ -0,0 +1,168 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHA256_LANES_H
+#define BITCOIN_SHA256_LANES_H
+
+#include <stdint.h>
+
+//
+// Double SHA-256 of several independent 64-byte inputs at once, one input
+// per lane of a vector register. Each kernel (sha256-sse41.cpp,
+// sha256-avx2.cpp) includes this file and instantiates SHA256D64Lanes with
+// its own register type.
+//
+// Everything here lives in an anonymous namespace on purpose: the kernels
+// are compiled with different instruction set flags, and a shared inline
+// function would let the linker pick, say, the AVX2 copy for every caller.
+//
+
+namespace {
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// K[i] plus the message schedule of the padding block of a 64-byte message,
+// which is the same for every input
+const uint32_t SHA256_K_PAD64[64] = {
+    0xc28a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf374,
+    0x649b69c1, 0xf0fe4786, 0x0fe1edc6, 0x240cf254, 0x4fe9346f, 0x6cc984be, 0x61b9411e, 0x16f988fa,
+    0xf2c65152, 0xa88e5a6d, 0xb019fc65, 0xb9d99ec7, 0x9a1231c3, 0xe70eeaa0, 0xfdb1232b, 0xc7353eb0,
+    0x3069bad5, 0xcb976d5f, 0x5a0f118f, 0xdc1eeefd, 0x0a35b689, 0xde0b7a04, 0x58f4ca9d, 0xe15d5b16,
+    0x007f3e86, 0x37088980, 0xa507ea32, 0x6fab9537, 0x17406110, 0x0d8cd6f1, 0xcdaa3b6d, 0xc0bbbe37,
+    0x83613bda, 0xdb48a363, 0x0b02e931, 0x6fd15ca7, 0x521afaca, 0x31338431, 0x6ed41a95, 0x6d437890,
+    0xc39c91f2, 0x9eccabbd, 0xb5c9a0e6, 0x532fb63c, 0xd2c741c6, 0x07237ea3, 0xa4954b68, 0x4c191d76,
+};
+
+const uint32_t SHA256_INIT[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+// Lanes provides, for a register type Lanes::Word holding Lanes::COUNT
+// 32-bit words: Add, Xor, And, Or, ShR, ShL, Set1, Load (word i of every
+// lane's input) and Store (word i of every lane's output).
+template<typename Lanes>
+struct CSHA256Rounds
+{
+    typedef typename Lanes::Word Word;
+
+    static inline Word Rotr(Word x, int n) { return Lanes::Or(Lanes::ShR(x, n), Lanes::ShL(x, 32 - n)); }
+    static inline Word Sigma0(Word x) { return Lanes::Xor(Lanes::Xor(Rotr(x, 2), Rotr(x, 13)), Rotr(x, 22)); }
+    static inline Word Sigma1(Word x) { return Lanes::Xor(Lanes::Xor(Rotr(x, 6), Rotr(x, 11)), Rotr(x, 25)); }
+    static inline Word sigma0(Word x) { return Lanes::Xor(Lanes::Xor(Rotr(x, 7), Rotr(x, 18)), Lanes::ShR(x, 3)); }
+    static inline Word sigma1(Word x) { return Lanes::Xor(Lanes::Xor(Rotr(x, 17), Rotr(x, 19)), Lanes::ShR(x, 10)); }
+    static inline Word Ch(Word x, Word y, Word z) { return Lanes::Xor(z, Lanes::And(x, Lanes::Xor(y, z))); }
+    static inline Word Maj(Word x, Word y, Word z) { return Lanes::Or(Lanes::And(x, y), Lanes::And(z, Lanes::Or(x, y))); }
+
+    // One round; k is the round constant plus the message word
+    static inline void Round(Word a, Word b, Word c, Word& d, Word e, Word f, Word g, Word& h, Word k)
+    {
+        Word t1 = Lanes::Add(Lanes::Add(h, Sigma1(e)), Lanes::Add(Ch(e, f, g), k));
+        Word t2 = Lanes::Add(Sigma0(a), Maj(a, b, c));
+        d = Lanes::Add(d, t1);
+        h = Lanes::Add(t1, t2);
+    }
+
+    // Compress the 16 message words w, which are overwritten by the schedule
+    static void Compress(Word* s, Word* w)
+    {
+        Word a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i += 8)
+        {
+            for (int j = i; j < i + 8; j++)
+            {
+                if (j >= 16)
+                    w[j & 15] = Lanes::Add(Lanes::Add(w[j & 15], sigma0(w[(j + 1) & 15])),
+                                           Lanes::Add(w[(j + 9) & 15], sigma1(w[(j + 14) & 15])));
+            }
+            Round(a, b, c, d, e, f, g, h, Lanes::Add(Lanes::Set1(SHA256_K[i + 0]), w[(i + 0) & 15]));
+            Round(h, a, b, c, d, e, f, g, Lanes::Add(Lanes::Set1(SHA256_K[i + 1]), w[(i + 1) & 15]));
+            Round(g, h, a, b, c, d, e, f, Lanes::Add(Lanes::Set1(SHA256_K[i + 2]), w[(i + 2) & 15]));
+            Round(f, g, h, a, b, c, d, e, Lanes::Add(Lanes::Set1(SHA256_K[i + 3]), w[(i + 3) & 15]));
+            Round(e, f, g, h, a, b, c, d, Lanes::Add(Lanes::Set1(SHA256_K[i + 4]), w[(i + 4) & 15]));
+            Round(d, e, f, g, h, a, b, c, Lanes::Add(Lanes::Set1(SHA256_K[i + 5]), w[(i + 5) & 15]));
+            Round(c, d, e, f, g, h, a, b, Lanes::Add(Lanes::Set1(SHA256_K[i + 6]), w[(i + 6) & 15]));
+            Round(b, c, d, e, f, g, h, a, Lanes::Add(Lanes::Set1(SHA256_K[i + 7]), w[(i + 7) & 15]));
+        }
+        s[0] = Lanes::Add(s[0], a); s[1] = Lanes::Add(s[1], b);
+        s[2] = Lanes::Add(s[2], c); s[3] = Lanes::Add(s[3], d);
+        s[4] = Lanes::Add(s[4], e); s[5] = Lanes::Add(s[5], f);
+        s[6] = Lanes::Add(s[6], g); s[7] = Lanes::Add(s[7], h);
+    }
+
+    // Compress the padding block of a 64-byte message, whose schedule is
+    // folded into SHA256_K_PAD64
+    static void CompressPad64(Word* s)
+    {
+        Word a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i += 8)
+        {
+            Round(a, b, c, d, e, f, g, h, Lanes::Set1(SHA256_K_PAD64[i + 0]));
+            Round(h, a, b, c, d, e, f, g, Lanes::Set1(SHA256_K_PAD64[i + 1]));
+            Round(g, h, a, b, c, d, e, f, Lanes::Set1(SHA256_K_PAD64[i + 2]));
+            Round(f, g, h, a, b, c, d, e, Lanes::Set1(SHA256_K_PAD64[i + 3]));
+            Round(e, f, g, h, a, b, c, d, Lanes::Set1(SHA256_K_PAD64[i + 4]));
+            Round(d, e, f, g, h, a, b, c, Lanes::Set1(SHA256_K_PAD64[i + 5]));
+            Round(c, d, e, f, g, h, a, b, Lanes::Set1(SHA256_K_PAD64[i + 6]));
+            Round(b, c, d, e, f, g, h, a, Lanes::Set1(SHA256_K_PAD64[i + 7]));
+        }
+        s[0] = Lanes::Add(s[0], a); s[1] = Lanes::Add(s[1], b);
+        s[2] = Lanes::Add(s[2], c); s[3] = Lanes::Add(s[3], d);
+        s[4] = Lanes::Add(s[4], e); s[5] = Lanes::Add(s[5], f);
+        s[6] = Lanes::Add(s[6], g); s[7] = Lanes::Add(s[7], h);
+    }
+
+    // out[32*i..] = SHA256(SHA256(in[64*i..])) for each lane i
+    static void D64(unsigned char* out, const unsigned char* in)
+    {
+        Word s[8], w[16];
+
+        // First hash: the input block, then its padding
+        for (int i = 0; i < 8; i++)
+            s[i] = Lanes::Set1(SHA256_INIT[i]);
+        for (int i = 0; i < 16; i++)
+            w[i] = Lanes::Load(in, i);
+        Compress(s, w);
+        CompressPad64(s);
+
+        // Second hash: the 32-byte digest and its padding in one block
+        for (int i = 0; i < 8; i++)
+            w[i] = s[i];
+        w[8] = Lanes::Set1(0x80000000);
+        for (int i = 9; i < 15; i++)
+            w[i] = Lanes::Set1(0);
+        w[15] = Lanes::Set1(256);
+        for (int i = 0; i < 8; i++)
+            s[i] = Lanes::Set1(SHA256_INIT[i]);
+        Compress(s, w);
+
+        for (int i = 0; i < 8; i++)
+            Lanes::Store(out, i, s[i]);
+    }
+};
+
+}
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include "threadsafety.h"
@@ -40,6 +41,51 @@ typedef AnnotatedMixin<boost::recursive_mutex> CCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 
+/** Wrapped boost mutex: many readers or one writer, not recursive.
+ * boost::shared_mutex alone lets a steady stream of readers starve a writer;
+ * here a waiting writer holds a turnstile that new readers have to pass. */
+class LOCKABLE CSharedCriticalSection
+{
+private:
+    boost::shared_mutex mutex;
+    boost::mutex turnstile;
+
+public:
+    void lock() EXCLUSIVE_LOCK_FUNCTION()
+    {
+        boost::mutex::scoped_lock lock(turnstile);
+        mutex.lock();
+    }
+
+    bool try_lock() EXCLUSIVE_TRYLOCK_FUNCTION(true)
+    {
+        return mutex.try_lock();
+    }
+
+    void unlock() UNLOCK_FUNCTION()
+    {
+        mutex.unlock();
+    }
+
+    void lock_shared() SHARED_LOCK_FUNCTION()
+    {
+        {
+            boost::mutex::scoped_lock lock(turnstile);
+        }
+        mutex.lock_shared();
+    }
+
+    bool try_lock_shared() SHARED_TRYLOCK_FUNCTION(true)
+    {
+        return mutex.try_lock_shared();
+    }
+
+    void unlock_shared() UNLOCK_FUNCTION()
+    {
+        mutex.unlock_shared();
+    }
+};
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -110,6 +156,41 @@ typedef CMutexLock<CCriticalSection> CCriticalBlock;
 #define LOCK3(cs1,cs2,cs3) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__),criticalblock3(cs3, #cs3, __FILE__, __LINE__)
 #define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
 
+/** RAII lock on a CSharedCriticalSection, shared for readers or exclusive for writers */
+class CSharedCriticalBlock
+{
+private:
+    CSharedCriticalSection& cs;
+    bool fExclusive;
+
+public:
+    CSharedCriticalBlock(CSharedCriticalSection& csIn, bool fExclusiveIn, const char* pszName, const char* pszFile, int nLine) : cs(csIn), fExclusive(fExclusiveIn)
+    {
+        EnterCritical(pszName, pszFile, nLine, (void*)(&cs));
+#ifdef DEBUG_LOCKCONTENTION
+        if (fExclusive ? cs.try_lock() : cs.try_lock_shared())
+            return;
+        PrintLockContention(pszName, pszFile, nLine);
+#endif
+        if (fExclusive)
+            cs.lock();
+        else
+            cs.lock_shared();
+    }
+
+    ~CSharedCriticalBlock()
+    {
+        if (fExclusive)
+            cs.unlock();
+        else
+            cs.unlock_shared();
+        LeaveCritical();
+    }
+};
+
+#define READ_LOCK(cs) CSharedCriticalBlock sharedblock(cs, false, #cs, __FILE__, __LINE__)
+#define WRITE_LOCK(cs) CSharedCriticalBlock sharedblock(cs, true, #cs, __FILE__, __LINE__)
+
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
         EnterCritical(#cs, __FILE__, __LINE__, (void*)(&cs)); \
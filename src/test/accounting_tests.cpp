@@ -120,4 +120,44 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     BOOST_CHECK(6 == vpwtx[1]->nOrderPos);
 }
 
+BOOST_AUTO_TEST_CASE(acc_ordered_index)
+{
+    LOCK(pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CWalletTx wtx;
+    CAccountingEntry ae;
+
+    // Build the index, then check that new entries are appended to it
+    size_t nItems = pwalletMain->OrderedTxItems().size();
+
+    ae.strAccount = "f";
+    ae.nCreditDebit = 1;
+    ae.nTime = 1333333340;
+    ae.strOtherAccount = "g";
+    ae.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    BOOST_CHECK(pwalletMain->AddAccountingEntry(ae, walletdb));
+
+    wtx.mapValue["comment"] = "w";
+    wtx.nLockTime = 1000;
+    pwalletMain->AddToWallet(wtx);
+
+    const CWallet::TxItems& txOrdered = pwalletMain->OrderedTxItems();
+    BOOST_CHECK_EQUAL(txOrdered.size(), nItems + 2);
+    CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin();
+    BOOST_CHECK((*it).second.first == &pwalletMain->mapWallet[wtx.GetHash()]);
+    ++it;
+    BOOST_CHECK((*it).second.second && (*it).second.second->strOtherAccount == "g");
+
+    // An unconfirmed transaction is past every block height
+    std::vector<const CWalletTx*> vpwtx;
+    pwalletMain->GetTransactionsAbove(1000000, vpwtx);
+    BOOST_CHECK(std::count(vpwtx.begin(), vpwtx.end(), &pwalletMain->mapWallet[wtx.GetHash()]) == 1);
+
+    // Erasing removes it from both indexes
+    pwalletMain->EraseFromWallet(wtx.GetHash());
+    BOOST_CHECK_EQUAL(pwalletMain->OrderedTxItems().size(), nItems + 1);
+    pwalletMain->GetTransactionsAbove(-1, vpwtx);
+    BOOST_CHECK_EQUAL(vpwtx.size(), pwalletMain->mapWallet.size());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,90 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <set>
+#include <vector>
+
+#include "addrman.h"
+#include "util.h"
+
+using namespace std;
+
+static vector<CAddress> MakeAddresses(int nFirst, int nCount)
+{
+    vector<CAddress> vAddr;
+    int64 nNow = GetAdjustedTime();
+    for (int n = nFirst; n < nFirst + nCount; n++)
+    {
+        CAddress addr(CService(strprintf("%i.%i.%i.%i", 11 + n % 180, 1 + (n / 180) % 250, 1 + n % 250, 1 + (n / 7) % 250), 8333));
+        addr.nTime = nNow - 60 * 60;
+        vAddr.push_back(addr);
+    }
+    return vAddr;
+}
+
+static void ThreadRead(const CAddrMan* paddrman, int* pnBad)
+{
+    for (int i = 0; i < 200; i++)
+    {
+        if (paddrman->size() > 0 && !paddrman->Select(50).IsValid())
+            (*pnBad)++;
+        vector<CAddress> vAddr = paddrman->GetAddr();
+        set<CService> setAddr(vAddr.begin(), vAddr.end());
+        if (setAddr.size() != vAddr.size())
+            (*pnBad)++;
+        boost::this_thread::yield();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_getaddr)
+{
+    CAddrMan addrman;
+    BOOST_CHECK(addrman.GetAddr().empty());
+    BOOST_CHECK(!addrman.Select(50).IsValid());
+
+    // Unroutable addresses are never added
+    vector<CAddress> vLocal(1, CAddress(CService("127.0.0.1", 8333)));
+    BOOST_CHECK(!addrman.Add(vLocal, CNetAddr("1.2.3.4")));
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+
+    BOOST_CHECK(addrman.Add(MakeAddresses(0, 1000), CNetAddr("1.2.3.4")));
+    int nSize = addrman.size();
+    BOOST_CHECK(nSize > 0 && nSize <= 1000);
+
+    // GetAddr returns distinct known addresses, and does not change what is known
+    vector<CAddress> vAddr = addrman.GetAddr();
+    BOOST_CHECK_EQUAL((int)vAddr.size(), ADDRMAN_GETADDR_MAX_PCT * nSize / 100);
+    set<CService> setAddr(vAddr.begin(), vAddr.end());
+    BOOST_CHECK_EQUAL(setAddr.size(), vAddr.size());
+    BOOST_CHECK_EQUAL(addrman.size(), nSize);
+
+    // Adding what is already known adds nothing new
+    addrman.Add(MakeAddresses(0, 1000), CNetAddr("1.2.3.4"));
+    BOOST_CHECK_EQUAL(addrman.size(), nSize);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_concurrent)
+{
+    CAddrMan addrman;
+    addrman.Add(MakeAddresses(0, 100), CNetAddr("1.2.3.4"));
+
+    int nBad[2] = {0, 0};
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 2; i++)
+        threadGroup.create_thread(boost::bind(&ThreadRead, &addrman, &nBad[i]));
+    for (int i = 1; i < 20; i++)
+    {
+        addrman.Add(MakeAddresses(i * 500, 500), CNetAddr(strprintf("1.%i.3.4", i)));
+        CAddress addr = addrman.Select(0);
+        addrman.Attempt(addr);
+        addrman.Good(addr);
+    }
+    threadGroup.join_all();
+
+    BOOST_CHECK_EQUAL(nBad[0] + nBad[1], 0);
+    BOOST_CHECK(addrman.size() > 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -112,4 +112,59 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(test_pool_allocator)
+{
+    CBufferPool& pool = CBufferPool::Instance();
+    uint64_t nReused, nAllocated, nReusedAfter, nAllocatedAfter;
+
+    // A freed buffer is handed out again for any size in its class
+    void* p = pool.Allocate(1000);
+    pool.Free(p, 1000);
+    pool.GetStats(nReused, nAllocated);
+    void* q = pool.Allocate(1024);
+    pool.GetStats(nReusedAfter, nAllocatedAfter);
+    BOOST_CHECK(q == p);
+    BOOST_CHECK_EQUAL(nReusedAfter, nReused + 1);
+    BOOST_CHECK_EQUAL(nAllocatedAfter, nAllocated);
+    memset(q, 0xAA, 1024);
+    pool.Free(q, 1024);
+
+    // Buffers above the largest class bypass the pool
+    size_t nLarge = ((size_t)1 << CBufferPool::MAX_CLASS_BITS) + 1;
+    pool.GetStats(nReused, nAllocated);
+    p = pool.Allocate(nLarge);
+    pool.Free(p, nLarge);
+    pool.GetStats(nReusedAfter, nAllocatedAfter);
+    BOOST_CHECK_EQUAL(nReusedAfter, nReused);
+    BOOST_CHECK_EQUAL(nAllocatedAfter, nAllocated);
+
+    // Streams of public data recycle their buffers
+    for (int i = 0; i < 10; i++)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << std::vector<char>(5000, (char)i);
+    }
+    pool.GetStats(nReused, nAllocated);
+    for (int i = 0; i < 10; i++)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << std::vector<char>(5000, (char)i);
+        BOOST_CHECK_EQUAL(ss.size(), 5003U);
+        BOOST_CHECK_EQUAL(ss[4000], (char)i);
+    }
+    pool.GetStats(nReusedAfter, nAllocatedAfter);
+    BOOST_CHECK_EQUAL(nAllocatedAfter, nAllocated);
+    BOOST_CHECK(nReusedAfter > nReused);
+
+    // Secure streams stay out of the pool
+    pool.GetStats(nReused, nAllocated);
+    {
+        CSecureDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << std::vector<char>(5000, 1);
+    }
+    pool.GetStats(nReusedAfter, nAllocatedAfter);
+    BOOST_CHECK_EQUAL(nReusedAfter, nReused);
+    BOOST_CHECK_EQUAL(nAllocatedAfter, nAllocated);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,217 @@
+//
+// Unit tests for headers-first block download
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+// Tests these internal-to-main.cpp methods:
+extern void SetBestHeader(CBlockIndex* pindexNew);
+extern void MarkBlockAsInFlight(CNode* pnode, const uint256& hash);
+extern void MarkBlockAsReceived(const uint256& hash);
+extern void FindNextBlocksToDownload(CNode* pto, unsigned int nCount, vector<CBlockIndex*>& vBlocks, CNode*& pnodeStalling);
+extern bool CheckBlockDownloadTimeouts(CNode* pto, int64 nTime);
+
+// A best header chain of nHeight headers on top of the genesis block. Their
+// blocks are in none of the block maps, so all of them are wanted.
+struct CTestHeaderChain
+{
+    vector<uint256> vHash;
+    vector<CBlockIndex*> vIndex;   // by height
+    CBlockIndex* pindexBestHeaderBefore;
+
+    CTestHeaderChain(int nHeight) : vHash(nHeight + 1), vIndex(nHeight + 1)
+    {
+        pindexBestHeaderBefore = pindexBestHeader;
+        vIndex[0] = pindexGenesisBlock;
+        for (int i = 1; i <= nHeight; i++)
+        {
+            vHash[i] = GetRandHash();
+            CBlockIndex* pindex = new CBlockIndex();
+            pindex->phashBlock = &vHash[i];
+            pindex->pprev = vIndex[i - 1];
+            pindex->nHeight = i;
+            pindex->nChainWork = pindex->pprev->nChainWork + uint256(1);
+            vIndex[i] = pindex;
+        }
+        SetBestHeader(vIndex[nHeight]);
+    }
+
+    ~CTestHeaderChain()
+    {
+        if (pindexBestHeaderBefore)
+            SetBestHeader(pindexBestHeaderBefore);
+        else
+            pindexBestHeader = NULL;
+        for (unsigned int i = 1; i < vIndex.size(); i++)
+            delete vIndex[i];
+    }
+};
+
+static CAddress TestAddr(unsigned int i)
+{
+    struct in_addr s;
+    s.s_addr = 0x0100000a + (i << 24);
+    return CAddress(CService(CNetAddr(s), GetDefaultPort()));
+}
+
+// Asks for what FindNextBlocksToDownload picks for pto, as SendMessages does
+static vector<CBlockIndex*> Request(CNode* pto, CNode*& pnodeStalling)
+{
+    vector<CBlockIndex*> vBlocks;
+    FindNextBlocksToDownload(pto, MAX_BLOCKS_IN_TRANSIT_PER_PEER - pto->nBlocksInFlight, vBlocks, pnodeStalling);
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+        MarkBlockAsInFlight(pto, pindex->GetBlockHash());
+    return vBlocks;
+}
+
+BOOST_AUTO_TEST_SUITE(blockdownload_tests)
+
+BOOST_AUTO_TEST_CASE(blockdownload_parallel)
+{
+    LOCK(cs_main);
+    CTestHeaderChain chain(40);
+    CNode nodeA(INVALID_SOCKET, TestAddr(1), "", true);
+    CNode nodeB(INVALID_SOCKET, TestAddr(2), "", true);
+    CNode nodeC(INVALID_SOCKET, TestAddr(3), "", true);
+    nodeA.nSyncHeight = 40;
+    nodeB.nSyncHeight = 40;
+    nodeC.nSyncHeight = 10;
+    CNode* pnodeStalling = NULL;
+
+    // Each peer gets the next blocks nobody has been asked for yet
+    vector<CBlockIndex*> vBlocks = Request(&nodeA, pnodeStalling);
+    BOOST_CHECK_EQUAL(vBlocks.size(), (unsigned int)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(vBlocks.front() == chain.vIndex[1]);
+    BOOST_CHECK(vBlocks.back() == chain.vIndex[16]);
+    BOOST_CHECK_EQUAL(nodeA.nBlocksInFlight, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // ...up to what it has
+    vBlocks = Request(&nodeB, pnodeStalling);
+    BOOST_CHECK_EQUAL(vBlocks.size(), (unsigned int)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(vBlocks.front() == chain.vIndex[17]);
+    BOOST_CHECK(Request(&nodeC, pnodeStalling).empty());
+    BOOST_CHECK(pnodeStalling == NULL);
+
+    // A full peer gets nothing more
+    BOOST_CHECK(Request(&nodeA, pnodeStalling).empty());
+
+    // A received block frees a slot, and a refused one can go to anyone
+    MarkBlockAsReceived(chain.vIndex[1]->GetBlockHash());
+    MarkBlockAsReceived(chain.vIndex[1]->GetBlockHash());
+    BOOST_CHECK_EQUAL(nodeA.nBlocksInFlight, MAX_BLOCKS_IN_TRANSIT_PER_PEER - 1);
+    vBlocks = Request(&nodeC, pnodeStalling);
+    BOOST_CHECK_EQUAL(vBlocks.size(), 1U);
+    BOOST_CHECK(vBlocks[0] == chain.vIndex[1]);
+    vBlocks = Request(&nodeA, pnodeStalling);
+    BOOST_CHECK_EQUAL(vBlocks.size(), 1U);
+    BOOST_CHECK(vBlocks[0] == chain.vIndex[33]);
+
+    // A peer that goes away leaves its blocks to the others
+    FinalizeNode(&nodeA);
+    BOOST_CHECK_EQUAL(nodeA.nBlocksInFlight, 0);
+    vBlocks = Request(&nodeC, pnodeStalling);
+    BOOST_CHECK_EQUAL(vBlocks.size(), 9U);
+    BOOST_CHECK(vBlocks.front() == chain.vIndex[2]);
+
+    FinalizeNode(&nodeB);
+    FinalizeNode(&nodeC);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_stalling)
+{
+    LOCK(cs_main);
+    int64 nStartTime = GetTime();
+    SetMockTime(nStartTime);
+    CTestHeaderChain chain(BLOCK_DOWNLOAD_WINDOW + 100);
+    CNode nodeA(INVALID_SOCKET, TestAddr(1), "", true);
+    CNode nodeB(INVALID_SOCKET, TestAddr(2), "", true);
+    nodeA.nSyncHeight = BLOCK_DOWNLOAD_WINDOW + 100;
+    nodeB.nSyncHeight = BLOCK_DOWNLOAD_WINDOW + 100;
+    CNode* pnodeStalling = NULL;
+
+    // A takes the first blocks of the window and B the rest of it
+    Request(&nodeA, pnodeStalling);
+    while (true)
+    {
+        vector<CBlockIndex*> vBlocks;
+        FindNextBlocksToDownload(&nodeB, MAX_BLOCKS_IN_TRANSIT_PER_PEER, vBlocks, pnodeStalling);
+        if (vBlocks.empty())
+            break;
+        BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+            MarkBlockAsInFlight(&nodeB, pindex->GetBlockHash());
+    }
+    BOOST_CHECK_EQUAL(nodeB.nBlocksInFlight, BLOCK_DOWNLOAD_WINDOW - MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // B would have more to do if A were not holding up the window
+    BOOST_CHECK(pnodeStalling == &nodeA);
+    Request(&nodeA, pnodeStalling);
+    BOOST_CHECK(pnodeStalling == NULL);
+
+    nodeA.nStallingSince = nStartTime;
+    BOOST_CHECK(!CheckBlockDownloadTimeouts(&nodeA, nStartTime + BLOCK_STALLING_TIMEOUT));
+    BOOST_CHECK(!nodeA.fDisconnect);
+    BOOST_CHECK(CheckBlockDownloadTimeouts(&nodeA, nStartTime + BLOCK_STALLING_TIMEOUT + 1));
+    BOOST_CHECK(nodeA.fDisconnect);
+    BOOST_CHECK_EQUAL(nodeA.nBlocksInFlight, 0);
+
+    // Which frees the window for B
+    vector<CBlockIndex*> vBlocks;
+    FindNextBlocksToDownload(&nodeB, MAX_BLOCKS_IN_TRANSIT_PER_PEER, vBlocks, pnodeStalling);
+    BOOST_CHECK_EQUAL(vBlocks.size(), (unsigned int)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(vBlocks.front() == chain.vIndex[1]);
+
+    FinalizeNode(&nodeB);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_timeout)
+{
+    LOCK(cs_main);
+    int64 nStartTime = GetTime() + 1000;
+    SetMockTime(nStartTime);
+    CTestHeaderChain chain(40);
+    CNode nodeA(INVALID_SOCKET, TestAddr(1), "", true);
+    CNode nodeB(INVALID_SOCKET, TestAddr(2), "", true);
+    nodeA.nSyncHeight = 40;
+    nodeB.nSyncHeight = 40;
+    CNode* pnodeStalling = NULL;
+
+    Request(&nodeA, pnodeStalling);
+    BOOST_CHECK(!CheckBlockDownloadTimeouts(&nodeB, nStartTime + BLOCK_DOWNLOAD_TIMEOUT));
+    BOOST_CHECK(!nodeA.fDisconnect);
+
+    // Any peer's turn disconnects the one that is too slow
+    BOOST_CHECK(!CheckBlockDownloadTimeouts(&nodeB, nStartTime + BLOCK_DOWNLOAD_TIMEOUT + 1));
+    BOOST_CHECK(nodeA.fDisconnect);
+    BOOST_CHECK(!nodeB.fDisconnect);
+    BOOST_CHECK_EQUAL(nodeA.nBlocksInFlight, 0);
+    vector<CBlockIndex*> vBlocks = Request(&nodeB, pnodeStalling);
+    BOOST_CHECK(vBlocks.front() == chain.vIndex[1]);
+
+    FinalizeNode(&nodeB);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_getheaders_dedupe)
+{
+    CNode node(INVALID_SOCKET, TestAddr(1), "", true);
+    uint256 hashA = GetRandHash();
+    uint256 hashB = GetRandHash();
+    CBlockIndex index;
+    index.phashBlock = &hashA;
+
+    node.PushGetHeaders(&index, 0);
+    BOOST_CHECK(node.hashLastGetHeadersBegin == hashA);
+
+    // A new index at the address of a freed one is a different request
+    index.phashBlock = &hashB;
+    node.PushGetHeaders(&index, 0);
+    BOOST_CHECK(node.hashLastGetHeadersBegin == hashB);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+
+#include "blocktimings.h"
+#include "util.h"
+
+using namespace std;
+
+static CBlockTimingSample MakeSample(int nHeight, int64 nMicros)
+{
+    CBlockTimingSample sample;
+    sample.hashBlock = nHeight;
+    sample.nHeight = nHeight;
+    sample.nTx = 1;
+    for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+        sample.nMicros[i] = nMicros;
+    return sample;
+}
+
+BOOST_AUTO_TEST_SUITE(blocktimings_tests)
+
+BOOST_AUTO_TEST_CASE(blocktimings_buckets)
+{
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket(0), 0);
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket(1), 0);
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket(2), 1);
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket(3), 1);
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket(4), 2);
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket(1023), 9);
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket(1024), 10);
+    BOOST_CHECK_EQUAL(CBlockTimings::GetBucket((int64)1 << 40), BLOCKTIMING_BUCKETS - 1);
+}
+
+BOOST_AUTO_TEST_CASE(blocktimings_window)
+{
+    CBlockTimings timings;
+    CBlockTimingStats stats;
+    timings.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 0U);
+    BOOST_CHECK_EQUAL(stats.nWindow, 0U);
+
+    // 1..100 microseconds
+    for (int i = 1; i <= 100; i++)
+        timings.Add(MakeSample(i, i));
+    timings.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nWindow, 100U);
+    BOOST_CHECK_EQUAL(stats.last.nHeight, 100);
+    for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+    {
+        BOOST_CHECK_EQUAL(stats.nTotal[i], 5050);
+        BOOST_CHECK_EQUAL(stats.nMax[i], 100);
+        BOOST_CHECK_EQUAL(stats.nMedian[i], 51);
+        BOOST_CHECK_EQUAL(stats.n90th[i], 91);
+        BOOST_CHECK_EQUAL(stats.n99th[i], 100);
+        BOOST_CHECK_EQUAL(stats.nBuckets[i][0], 1U);
+        BOOST_CHECK_EQUAL(stats.nBuckets[i][1], 2U);
+        BOOST_CHECK_EQUAL(stats.nBuckets[i][6], 37U);    // 64..100
+    }
+
+    // Push them all out of the window with slower blocks
+    for (unsigned int i = 0; i < BLOCKTIMING_WINDOW; i++)
+        timings.Add(MakeSample(101 + i, 5000));
+    timings.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 100 + BLOCKTIMING_WINDOW);
+    BOOST_CHECK_EQUAL(stats.nWindow, BLOCKTIMING_WINDOW);
+    BOOST_CHECK_EQUAL(stats.last.nHeight, (int)(100 + BLOCKTIMING_WINDOW));
+    for (int i = 0; i < BLOCKTIMING_STAGES; i++)
+    {
+        BOOST_CHECK_EQUAL(stats.nTotal[i], 5000 * (int64)BLOCKTIMING_WINDOW);
+        BOOST_CHECK_EQUAL(stats.nMedian[i], 5000);
+        for (int j = 0; j < BLOCKTIMING_BUCKETS; j++)
+            BOOST_CHECK_EQUAL(stats.nBuckets[i][j], j == CBlockTimings::GetBucket(5000) ? BLOCKTIMING_WINDOW : 0U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blocktimings_csv)
+{
+    boost::filesystem::path temp = GetTempPath() / "blocktimings.csv";
+    boost::filesystem::remove(temp);
+
+    CBlockTimings timings;
+    BOOST_CHECK(timings.OpenCSV(temp.string()));
+    timings.Add(MakeSample(7, 42));
+    timings.CloseCSV();
+    // Reopening appends, without another header
+    BOOST_CHECK(timings.OpenCSV(temp.string()));
+    timings.Add(MakeSample(8, 43));
+    timings.CloseCSV();
+
+    vector<string> vLines;
+    ifstream f(temp.string().c_str());
+    string strLine;
+    while (getline(f, strLine))
+        vLines.push_back(strLine);
+    BOOST_CHECK_EQUAL(vLines.size(), 3U);
+    BOOST_CHECK_EQUAL(vLines[0], "height,hash,txs,inputs,read_us,pow_us,checkblock_us,inputs_us,scripts_us,"
+                                 "scriptwait_us,undo_us,wallet_us,flush_us,total_us");
+    BOOST_CHECK_EQUAL(vLines[1], "7," + uint256(7).ToString() + ",1,0,42,42,42,42,42,42,42,42,42,42");
+    BOOST_CHECK_EQUAL(vLines[2], "8," + uint256(8).ToString() + ",1,0,43,43,43,43,43,43,43,43,43,43");
+
+    boost::filesystem::remove(temp);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -443,4 +443,191 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_multi)
+{
+    // Every tail length, a single seed and more than fit in one SIMD group
+    for (unsigned int nSize = 0; nSize < 40; nSize++)
+    {
+        vector<unsigned char> vch(nSize);
+        for (unsigned int i = 0; i < nSize; i++)
+            vch[i] = insecure_rand();
+        vector<unsigned int> vMixed;
+        MurmurHash3Prepare(nSize ? &vch[0] : NULL, nSize, vMixed);
+        BOOST_CHECK_EQUAL(vMixed.size(), (nSize + 3) / 4);
+
+        for (unsigned int nSeeds = 1; nSeeds <= 9; nSeeds++)
+        {
+            unsigned int nSeed[9], nHash[9];
+            for (unsigned int i = 0; i < nSeeds; i++)
+                nSeed[i] = insecure_rand();
+            MurmurHash3Multi(nSeed, nSeeds, vMixed.empty() ? NULL : &vMixed[0], nSize, nHash);
+            for (unsigned int i = 0; i < nSeeds; i++)
+                BOOST_CHECK_EQUAL(nHash[i], MurmurHash3(nSeed[i], vch));
+        }
+    }
+}
+
+// The per-element walk IsRelevantAndUpdate made before transactions were
+// prepared, for comparing it with
+static bool ReferenceIsRelevantAndUpdate(CBloomFilter& filter, unsigned char nFlags, const CTransaction& tx, const uint256& hash)
+{
+    bool fFound = false;
+    if (filter.contains(hash))
+        fFound = true;
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        CScript::const_iterator pc = txout.scriptPubKey.begin();
+        vector<unsigned char> data;
+        while (pc < txout.scriptPubKey.end())
+        {
+            opcodetype opcode;
+            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0 && filter.contains(data))
+            {
+                fFound = true;
+                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
+                    filter.insert(COutPoint(hash, i));
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
+                {
+                    txnouttype type;
+                    vector<vector<unsigned char> > vSolutions;
+                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
+                            (type == TX_PUBKEY || type == TX_MULTISIG))
+                        filter.insert(COutPoint(hash, i));
+                }
+                break;
+            }
+        }
+    }
+
+    if (fFound)
+        return true;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (filter.contains(txin.prevout))
+            return true;
+        CScript::const_iterator pc = txin.scriptSig.begin();
+        vector<unsigned char> data;
+        while (pc < txin.scriptSig.end())
+        {
+            opcodetype opcode;
+            if (!txin.scriptSig.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0 && filter.contains(data))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+static string SerializeFilter(const CBloomFilter& filter)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << filter;
+    return stream.str();
+}
+
+BOOST_AUTO_TEST_CASE(bloom_match_prepared)
+{
+    // A pay-to-pubkey-hash transaction, and one with a pay-to-pubkey and a
+    // multisig output spending it
+    CDataStream stream(ParseHex("01000000010b26e9b7735eb6aabdf358bab62f9816a21ba9ebdb719d5299e88607d722c190000000008b4830450220070aca44506c5cef3a16ed519d7c3c39f8aab192c4e1c90d065f37b8a4af6141022100a8e160b856c2d43d27d8fba71e5aef6405b8643ac4cb7cb3c462aced7f14711a0141046d11fee51b0e60666d5049a9101a72741df480b96ee26488a4d3466b95c9a40ac5eeef87e10a5cd336c19a84565f80fa6c547957b7700ff4dfbdefe76036c339ffffffff021bff3d11000000001976a91404943fdd508053c75000106d3bc6e2754dbcff1988ac2f15de00000000001976a914a266436d2965547608b9e15d9032a7b9d64fa43188ac00000000"), SER_DISK, CLIENT_VERSION);
+    CTransaction tx;
+    stream >> tx;
+    CKey key1, key2;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    CPubKey pubkey1 = key1.GetPubKey();
+    CPubKey pubkey2 = key2.GetPubKey();
+    CTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+    tx2.vin[0].scriptSig << ParseHex("3045022100aa") << pubkey1;
+    tx2.vout.resize(2);
+    tx2.vout[0].scriptPubKey << pubkey1 << OP_CHECKSIG;
+    tx2.vout[1].scriptPubKey << OP_1 << pubkey1 << pubkey2 << OP_2 << OP_CHECKMULTISIG;
+
+    // Everything either transaction can be matched by, and things it can't
+    vector<vector<unsigned char> > vElement;
+    vElement.push_back(ParseHex("04943fdd508053c75000106d3bc6e2754dbcff19"));
+    vElement.push_back(ParseHex("a266436d2965547608b9e15d9032a7b9d64fa431"));
+    vElement.push_back(ParseHex("046d11fee51b0e60666d5049a9101a72741df480b96ee26488a4d3466b95c9a40ac5eeef87e10a5cd336c19a84565f80fa6c547957b7700ff4dfbdefe76036c339"));
+    vElement.push_back(vector<unsigned char>(pubkey1.begin(), pubkey1.end()));
+    vElement.push_back(vector<unsigned char>(pubkey2.begin(), pubkey2.end()));
+    vElement.push_back(ParseHex("3045022100aa"));
+    vElement.push_back(vector<unsigned char>(tx.GetHash().begin(), tx.GetHash().end()));
+    vElement.push_back(vector<unsigned char>(tx2.GetHash().begin(), tx2.GetHash().end()));
+    CDataStream ssOutPoint(SER_NETWORK, PROTOCOL_VERSION);
+    ssOutPoint << tx.vin[0].prevout;
+    vElement.push_back(vector<unsigned char>(ssOutPoint.begin(), ssOutPoint.end()));
+    for (int i = 0; i < 4; i++)
+    {
+        uint256 hash = GetRandHash();
+        vElement.push_back(vector<unsigned char>(hash.begin(), hash.end()));
+    }
+
+    const unsigned char nFlags[] = { BLOOM_UPDATE_NONE, BLOOM_UPDATE_ALL, BLOOM_UPDATE_P2PUBKEY_ONLY };
+    int nMatches = 0;
+    for (int i = 0; i < 300; i++)
+    {
+        CBloomFilter filter(10, 0.001, insecure_rand(), nFlags[i % 3]);
+        for (unsigned int j = 0; j < vElement.size(); j++)
+            if (insecure_rand() % 8 == 0)
+                filter.insert(vElement[j]);
+
+        // Both in turn, the second seeing what the first added
+        CBloomFilter filterRef(filter);
+        const CTransaction* ptxs[] = { &tx, &tx2 };
+        BOOST_FOREACH(const CTransaction* ptx, ptxs)
+        {
+            CBloomTxData data(*ptx, ptx->GetHash());
+            bool fMatch = ReferenceIsRelevantAndUpdate(filterRef, nFlags[i % 3], *ptx, ptx->GetHash());
+            BOOST_CHECK_EQUAL(filter.IsRelevantAndUpdate(*ptx, data), fMatch);
+            BOOST_CHECK(SerializeFilter(filter) == SerializeFilter(filterRef));
+            nMatches += fMatch;
+        }
+    }
+    // Not a vacuous comparison
+    BOOST_CHECK(nMatches > 100 && nMatches < 500);
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    CRollingBloomFilter filter(100, 0.01);
+    vector<uint256> vHashes;
+    for (int i = 0; i < 1000; i++)
+        vHashes.push_back(GetRandHash());
+
+    // Everything inserted is remembered until at least 100 more have been
+    for (int i = 0; i < 1000; i++)
+    {
+        filter.insert(vHashes[i]);
+        for (int j = max(0, i - 99); j <= i; j++)
+            BOOST_CHECK(filter.contains(vHashes[j]));
+    }
+
+    // Of the older ones, only about as many as the false positive rate predicts
+    unsigned int nFalsePositives = 0;
+    for (int i = 0; i < 800; i++)
+        if (filter.contains(vHashes[i]))
+            nFalsePositives++;
+    BOOST_CHECK(nFalsePositives < 40);
+
+    unsigned int nNeverInserted = 0;
+    for (int i = 0; i < 10000; i++)
+        if (filter.contains(GetRandHash()))
+            nNeverInserted++;
+    BOOST_CHECK(nNeverInserted < 400);
+
+    filter.clear();
+    for (int i = 0; i < 1000; i++)
+        if (filter.contains(vHashes[i]))
+            BOOST_ERROR("cleared filter still contains " << i);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,305 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "main.h"
+#include "net.h"
+
+using namespace std;
+
+static CTransaction MakeTransaction(bool fCoinBase)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    if (fCoinBase)
+        tx.vin[0].scriptSig << OP_0 << OP_0;
+    else
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1 + GetRand(100 * COIN);
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+// A block of nTx transactions, the first nInPool of which (after the
+// coinbase) are also put in pool
+static CBlock MakeBlock(unsigned int nTx, unsigned int nInPool, CTxMemPool& pool)
+{
+    CBlock block;
+    block.nBits = 0x1e0ffff0;
+    block.nTime = GetTime();
+    block.vtx.push_back(MakeTransaction(true));
+    for (unsigned int i = 1; i < nTx; i++)
+    {
+        block.vtx.push_back(MakeTransaction(false));
+        if (i <= nInPool)
+            pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+template<typename T>
+static T RoundTrip(const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION));
+    T objOut;
+    ss >> objOut;
+    BOOST_CHECK(ss.empty());
+    return objOut;
+}
+
+// A block on the genesis block whose header has valid proof of work, and
+// whose second transaction is in no memory pool
+static CBlock MakeWorkedBlock()
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = pindexGenesisBlock->GetBlockHash();
+    block.nTime = pindexGenesisBlock->nTime + 60;
+    block.nBits = 0x1e0ffff0;
+    block.nNonce = 0x0058b934;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig << OP_0 << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    block.vtx.push_back(tx);
+    tx.vin[0].scriptSig = CScript();
+    tx.vin[0].prevout = COutPoint(uint256(1), 0);
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void SendCompactBlock(CNode& node, const CBlock& block)
+{
+    CDataStream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+    vRecv << CBlockHeaderAndShortTxIDs(block);
+    ProcessMessage(&node, "cmpctblock", vRecv);
+}
+
+// The commands of the messages queued for node, which are all still there
+// as it has no socket to send them on
+static vector<string> TakeSent(CNode& node)
+{
+    vector<string> vCommand;
+    BOOST_FOREACH(const CSharedMessage& msg, node.vSendMsg)
+    {
+        CDataStream ss(&(*msg)[0], &(*msg)[0] + msg->size(), SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr;
+        ss >> hdr;
+        vCommand.push_back(hdr.GetCommand());
+    }
+    node.vSendMsg.clear();
+    node.nSendSize = 0;
+    return vCommand;
+}
+
+BOOST_AUTO_TEST_SUITE(compactblocks_tests)
+
+BOOST_AUTO_TEST_CASE(compactblocks_serialization)
+{
+    CTxMemPool pool;
+    CBlock block = MakeBlock(50, 0, pool);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), 50U);
+
+    CBlockHeaderAndShortTxIDs cmpctblock2 = RoundTrip(cmpctblock);
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock2.nonce, cmpctblock.nonce);
+    BOOST_CHECK(cmpctblock2.shorttxids == cmpctblock.shorttxids);
+    BOOST_CHECK_EQUAL(cmpctblock2.prefilledtxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock2.prefilledtxn[0].index, 0);
+    BOOST_CHECK(cmpctblock2.prefilledtxn[0].tx.GetHash() == block.vtx[0].GetHash());
+
+    // The receiver derives the same short IDs, which fit in 6 bytes
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        uint64 nShortID = cmpctblock2.GetShortID(block.vtx[i].GetHash());
+        BOOST_CHECK_EQUAL(nShortID, cmpctblock.shorttxids[i - 1]);
+        BOOST_CHECK_EQUAL(nShortID >> 48, 0U);
+    }
+
+    // 80-byte header, nonce, count, 6 bytes per short ID, one prefilled index
+    BOOST_CHECK_EQUAL(::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION),
+                      80 + 8 + 1 + 49 * 6 + 1 + 1 + ::GetSerializeSize(block.vtx[0], SER_NETWORK, PROTOCOL_VERSION));
+
+    // Indexes are differentially encoded
+    CBlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.indexes.push_back(0);
+    req.indexes.push_back(1);
+    req.indexes.push_back(300);
+    req.indexes.push_back(65535);
+    CBlockTransactionsRequest req2 = RoundTrip(req);
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.indexes == req.indexes);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(req, SER_NETWORK, PROTOCOL_VERSION), 32U + 1 + 1 + 1 + 3 + 3);
+
+    // ... and may not overflow 16 bits
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req.blockhash;
+    WriteCompactSize(ss, 2);
+    WriteCompactSize(ss, 65535);
+    WriteCompactSize(ss, 0);
+    BOOST_CHECK_THROW(ss >> req2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(compactblocks_reconstruct)
+{
+    // Everything in the pool
+    {
+        CTxMemPool pool;
+        CBlock block = MakeBlock(100, 99, pool);
+        CTransaction txUnrelated = MakeTransaction(false);
+        pool.addUnchecked(txUnrelated.GetHash(), txUnrelated);
+
+        CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+        CPartiallyDownloadedBlock partialBlock;
+        BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartiallyDownloadedBlock::READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+        BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 99U);
+        vector<unsigned short> vMissing;
+        partialBlock.GetMissing(vMissing);
+        BOOST_CHECK(vMissing.empty());
+
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>()) == CPartiallyDownloadedBlock::READ_STATUS_OK);
+        BOOST_CHECK(block2.GetHash() == block.GetHash());
+        BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+    }
+
+    // Some missing, fetched with getblocktxn
+    {
+        CTxMemPool pool;
+        CBlock block = MakeBlock(100, 60, pool);
+        CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+        CPartiallyDownloadedBlock partialBlock;
+        BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartiallyDownloadedBlock::READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(partialBlock.IsTxAvailable(60));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(61));
+
+        CBlockTransactionsRequest req;
+        req.blockhash = block.GetHash();
+        partialBlock.GetMissing(req.indexes);
+        BOOST_CHECK_EQUAL(req.indexes.size(), 39U);
+        req = RoundTrip(req);
+
+        CBlockTransactions resp(req);
+        for (unsigned int i = 0; i < req.indexes.size(); i++)
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        resp = RoundTrip(resp);
+
+        // Too few or too many transactions are the peer's fault
+        vector<CTransaction> vtxShort(resp.txn.begin(), resp.txn.end() - 1);
+        CBlock block2;
+        CPartiallyDownloadedBlock partialCopy = partialBlock;
+        BOOST_CHECK(partialCopy.FillBlock(block2, vtxShort) == CPartiallyDownloadedBlock::READ_STATUS_INVALID);
+        vector<CTransaction> vtxLong(resp.txn);
+        vtxLong.push_back(block.vtx[1]);
+        partialCopy = partialBlock;
+        BOOST_CHECK(partialCopy.FillBlock(block2, vtxLong) == CPartiallyDownloadedBlock::READ_STATUS_INVALID);
+
+        // A wrong transaction gives the wrong Merkle root
+        vector<CTransaction> vtxWrong(resp.txn);
+        vtxWrong[0] = MakeTransaction(false);
+        partialCopy = partialBlock;
+        BOOST_CHECK(partialCopy.FillBlock(block2, vtxWrong) == CPartiallyDownloadedBlock::READ_STATUS_FAILED);
+
+        BOOST_CHECK(partialBlock.FillBlock(block2, resp.txn) == CPartiallyDownloadedBlock::READ_STATUS_OK);
+        BOOST_CHECK(block2.GetHash() == block.GetHash());
+        BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(compactblocks_collisions)
+{
+    CTxMemPool pool;
+    CBlock block = MakeBlock(20, 19, pool);
+
+    // Two transactions of the block with the same short ID: fall back to the
+    // full block
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.shorttxids[5] = cmpctblock.shorttxids[4];
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartiallyDownloadedBlock::READ_STATUS_FAILED);
+
+    // A pool transaction that only shares its short ID with one of the block's
+    // is found, but the Merkle root catches it
+    CTransaction txOther = MakeTransaction(false);
+    pool.addUnchecked(txOther.GetHash(), txOther);
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    pool.remove(block.vtx[7]);
+    cmpctblock.shorttxids[6] = cmpctblock.GetShortID(txOther.GetHash());
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartiallyDownloadedBlock::READ_STATUS_OK);
+    vector<unsigned short> vMissing;
+    partialBlock.GetMissing(vMissing);
+    BOOST_CHECK(vMissing.empty());
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>()) == CPartiallyDownloadedBlock::READ_STATUS_FAILED);
+
+    // Malformed compact blocks are invalid
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.prefilledtxn[0].index = 20;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartiallyDownloadedBlock::READ_STATUS_INVALID);
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.prefilledtxn.push_back(cmpctblock.prefilledtxn[0]);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartiallyDownloadedBlock::READ_STATUS_INVALID);
+    cmpctblock.prefilledtxn.clear();
+    cmpctblock.shorttxids.clear();
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartiallyDownloadedBlock::READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(compactblocks_unanswered)
+{
+    LOCK(cs_main);
+    int64 nStartTime = GetTime();
+    SetMockTime(nStartTime);
+    CBlock block = MakeWorkedBlock();
+    BOOST_REQUIRE(CheckProofOfWork(block.GetPoWHash(), block.nBits));
+
+    struct in_addr s;
+    s.s_addr = 0x0100000a;
+    CNode nodeA(INVALID_SOCKET, CAddress(CService(CNetAddr(s), GetDefaultPort())), "", true);
+    s.s_addr = 0x0200000a;
+    CNode nodeB(INVALID_SOCKET, CAddress(CService(CNetAddr(s), GetDefaultPort())), "", true);
+    nodeA.nVersion = PROTOCOL_VERSION;
+    nodeB.nVersion = PROTOCOL_VERSION;
+
+    // A is asked for the missing transaction, once
+    SendCompactBlock(nodeA, block);
+    vector<string> vSent = TakeSent(nodeA);
+    BOOST_REQUIRE_EQUAL(vSent.size(), 1U);
+    BOOST_CHECK_EQUAL(vSent[0], "getblocktxn");
+    SendCompactBlock(nodeA, block);
+    BOOST_CHECK(TakeSent(nodeA).empty());
+
+    // While A keeps us waiting, B is asked for the whole block
+    SendCompactBlock(nodeB, block);
+    vSent = TakeSent(nodeB);
+    BOOST_REQUIRE_EQUAL(vSent.size(), 1U);
+    BOOST_CHECK_EQUAL(vSent[0], "getdata");
+
+    // Once A's request has expired, B can complete it the compact way
+    SetMockTime(nStartTime + 61);
+    SendCompactBlock(nodeB, block);
+    vSent = TakeSent(nodeB);
+    BOOST_REQUIRE_EQUAL(vSent.size(), 1U);
+    BOOST_CHECK_EQUAL(vSent[0], "getblocktxn");
+
+    // And a peer that goes away takes its requests with it
+    FinalizeNode(&nodeB);
+    SendCompactBlock(nodeA, block);
+    vSent = TakeSent(nodeA);
+    BOOST_REQUIRE_EQUAL(vSent.size(), 1U);
+    BOOST_CHECK_EQUAL(vSent[0], "getblocktxn");
+
+    FinalizeNode(&nodeA);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
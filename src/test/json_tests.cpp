@@ -0,0 +1,105 @@
+#include <boost/test/unit_test.hpp>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+BOOST_AUTO_TEST_SUITE(json_tests)
+
+// read_range() on plain iterators still goes through the spirit grammar
+static bool ReadSpirit(const string& str, Value& value)
+{
+    string::const_iterator begin = str.begin();
+    return read_range(begin, str.end(), value);
+}
+
+static Error_position ReadOrThrow(const string& str, bool fSpirit)
+{
+    Value value;
+    try
+    {
+        if (fSpirit)
+            add_posn_iter_and_read_range_or_throw(str.begin(), str.end(), value);
+        else
+            read_string_or_throw(str, value);
+    }
+    catch (Error_position& e)
+    {
+        return e;
+    }
+    return Error_position();
+}
+
+static const char* vstrValid[] = {
+    "{}", "[]", " \t\r\n[ ]", "\"\"", "0", "-0", "007", "+5", "1.", "-.5", ".5e1", "1E+3", "2.5e-3",
+    "0.00000001", "21000000.0", "9223372036854775807", "9223372036854775808", "18446744073709551615",
+    "-9223372036854775808", "true", "false", "null", "trueish",
+    "\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\"", "\"\\x41\\101\\u00e9\\q\"",
+    "{\"method\":\"getbalance\",\"params\":[\"\",6],\"id\":1}",
+    "[{\"a\":{\"b\":[[],{}]}},{\"a\":1,\"a\":2},[true,false,null]]",
+    "[1,2] trailing bytes are ignored",
+};
+
+static const char* vstrInvalid[] = {
+    "", "   ", "[", "{", "[1,]", "[,]", "{,}", "[1 2]", "[1,x]", "{1}", "{\"a\" 1}", "{\"a\":}",
+    "{\"a\":1,\"b\"}", "{\"a\":1, 5}", "\"abc", "\"\\", "\"\\xZZ\"", "\"\\x80\"", "-", ".", "nul",
+    "+9223372036854775808", "-9223372036854775809", "18446744073709551616", "[1,{]", "\n\n  [\t1,\n]",
+};
+
+BOOST_AUTO_TEST_CASE(json_read_string_matches_spirit)
+{
+    for (unsigned int i = 0; i < sizeof(vstrValid)/sizeof(vstrValid[0]); i++)
+    {
+        string str(vstrValid[i]);
+        Value vFast, vSpirit;
+        BOOST_CHECK_MESSAGE(read_string(str, vFast), str);
+        BOOST_CHECK(ReadSpirit(str, vSpirit));
+        BOOST_CHECK_MESSAGE(vFast == vSpirit, str);
+        BOOST_CHECK_EQUAL(write_string(vFast, false), write_string(vSpirit, false));
+    }
+    for (unsigned int i = 0; i < sizeof(vstrInvalid)/sizeof(vstrInvalid[0]); i++)
+    {
+        string str(vstrInvalid[i]);
+        Value vFast, vSpirit;
+        BOOST_CHECK_MESSAGE(!read_string(str, vFast), str);
+        BOOST_CHECK(!ReadSpirit(str, vSpirit));
+
+        Error_position eFast = ReadOrThrow(str, false), eSpirit = ReadOrThrow(str, true);
+        BOOST_CHECK_MESSAGE(eFast == eSpirit, str + ": " + eFast.reason_ + " vs " + eSpirit.reason_);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(json_read_string_types)
+{
+    Value v;
+    BOOST_CHECK(read_string(string("[18446744073709551615,-1,1.5,\"x\",true,null]"), v));
+    const Array& a = v.get_array();
+    BOOST_CHECK(a[0].type() == int_type && a[0].is_uint64());
+    BOOST_CHECK_EQUAL(a[0].get_uint64(), 18446744073709551615ULL);
+    BOOST_CHECK(a[1].type() == int_type && !a[1].is_uint64());
+    BOOST_CHECK_EQUAL(a[1].get_int64(), -1);
+    BOOST_CHECK(a[2].type() == real_type);
+    BOOST_CHECK_EQUAL(a[2].get_real(), 1.5);
+    BOOST_CHECK_EQUAL(a[3].get_str(), "x");
+    BOOST_CHECK(a[4].get_bool());
+    BOOST_CHECK(a[5].is_null());
+
+    mValue m;
+    BOOST_CHECK(read_string(string("{\"a\":1,\"a\":{\"b\":[]}}"), m));
+    BOOST_CHECK_EQUAL(m.get_obj().size(), 1U);
+    BOOST_CHECK(m.get_obj()["a"].type() == obj_type);
+}
+
+BOOST_AUTO_TEST_CASE(json_read_string_deep)
+{
+    // nesting is not limited by the call stack
+    string str = string(10000, '[') + string(10000, ']');
+    Value v;
+    BOOST_CHECK(read_string(str, v));
+    str.erase(str.size() - 1);
+    BOOST_CHECK(!read_string(str, v));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
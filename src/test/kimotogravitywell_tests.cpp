@@ -0,0 +1,140 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "main.h"
+
+using namespace std;
+
+// The CBigNum implementation the native one replaced, word for word
+static unsigned int ReferenceKimotoGravityWell(const CBlockIndex* pindexLast)
+{
+    static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
+    uint64 TargetBlocksSpacingSeconds = 60;
+    uint64 PastBlocksMin = 360;
+    uint64 PastBlocksMax = 1440;
+
+    const CBlockIndex *BlockLastSolved = pindexLast;
+    const CBlockIndex *BlockReading = pindexLast;
+
+    uint64 PastBlocksMass = 0;
+    int64 PastRateActualSeconds = 0;
+    int64 PastRateTargetSeconds = 0;
+    double PastRateAdjustmentRatio = double(1);
+    CBigNum PastDifficultyAverage;
+    CBigNum PastDifficultyAveragePrev;
+    double EventHorizonDeviation;
+    double EventHorizonDeviationFast;
+    double EventHorizonDeviationSlow;
+
+    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64)BlockLastSolved->nHeight < PastBlocksMin) { return bnProofOfWorkLimit.GetCompact(); }
+
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
+        PastBlocksMass++;
+
+        if (i == 1) { PastDifficultyAverage.SetCompact(BlockReading->nBits); }
+        else { PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev; }
+        PastDifficultyAveragePrev = PastDifficultyAverage;
+
+        PastRateActualSeconds = BlockLastSolved->GetBlockTime() - BlockReading->GetBlockTime();
+        PastRateTargetSeconds = TargetBlocksSpacingSeconds * PastBlocksMass;
+        PastRateAdjustmentRatio = double(1);
+        if (PastRateActualSeconds < 0) { PastRateActualSeconds = 0; }
+        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+        }
+        EventHorizonDeviation = 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+        EventHorizonDeviationFast = EventHorizonDeviation;
+        EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
+
+        if (PastBlocksMass >= PastBlocksMin) {
+            if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow) || (PastRateAdjustmentRatio >= EventHorizonDeviationFast)) { assert(BlockReading); break; }
+        }
+        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
+        BlockReading = BlockReading->pprev;
+    }
+
+    CBigNum bnNew(PastDifficultyAverage);
+    if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        bnNew *= PastRateActualSeconds;
+        bnNew /= PastRateTargetSeconds;
+    }
+    if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
+
+    return bnNew.GetCompact();
+}
+
+// A random target at most the proof of work limit, over a wide range of
+// difficulties
+static unsigned int RandomBits()
+{
+    uint256 bnTarget = ~uint256(0) >> (20 + GetRand(40));
+    bnTarget >>= GetRand(8);
+    return bnTarget.GetCompact();
+}
+
+// Block spacing for each stretch of the chain: steady, hash rate surging,
+// hash rate leaving, clocks running backwards, and a stall
+static int64 BlockSpacing(int nBlock)
+{
+    switch ((nBlock / 500) % 5)
+    {
+    case 0: return 30 + GetRand(61);
+    case 1: return GetRand(20);
+    case 2: return 120 + GetRand(600);
+    case 3: return (int64)GetRand(241) - 120;
+    default: return nBlock % 500 == 250 ? 24 * 60 * 60 : 60;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(kimotogravitywell_tests)
+
+BOOST_AUTO_TEST_CASE(kimotogravitywell_equivalence)
+{
+    // A chain past the Kimoto Gravity Well fork whose first blocks have
+    // random targets, and the rest the targets it requires of them
+    const int nBlocks = 5000;
+    const int nFirstHeight = 60000;
+    vector<CBlockIndex> vChain(nBlocks);
+    unsigned int nTime = 1380000000;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex& index = vChain[i];
+        index.pprev = i > 0 ? &vChain[i - 1] : NULL;
+        index.nHeight = nFirstHeight + i;
+        nTime += BlockSpacing(i);
+        index.nTime = nTime;
+        if (i < 1440)
+            index.nBits = RandomBits();
+        else
+        {
+            index.nBits = GetNextWorkRequired(index.pprev, NULL);
+            BOOST_CHECK_EQUAL(index.nBits, ReferenceKimotoGravityWell(index.pprev));
+        }
+    }
+
+    // Every block of it, and the block at the bottom on its own
+    for (int i = 0; i < nBlocks; i++)
+    {
+        unsigned int nBits = GetNextWorkRequired(&vChain[i], NULL);
+        BOOST_CHECK_EQUAL(nBits, ReferenceKimotoGravityWell(&vChain[i]));
+        // Cached
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&vChain[i], NULL), nBits);
+    }
+
+    // Targets at the limit, where the average times the elapsed time
+    // overflows 256 bits
+    unsigned int nLimitBits = (~uint256(0) >> 20).GetCompact();
+    vector<CBlockIndex> vSlow(400);
+    for (unsigned int i = 0; i < vSlow.size(); i++)
+    {
+        vSlow[i].pprev = i > 0 ? &vSlow[i - 1] : NULL;
+        vSlow[i].nHeight = nFirstHeight + i;
+        vSlow[i].nTime = 1380000000 + i * 5000000;
+        vSlow[i].nBits = nLimitBits;
+    }
+    BOOST_CHECK_EQUAL(GetNextWorkRequired(&vSlow.back(), NULL), nLimitBits);
+    BOOST_CHECK_EQUAL(ReferenceKimotoGravityWell(&vSlow.back()), nLimitBits);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
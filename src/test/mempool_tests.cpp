@@ -0,0 +1,141 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+// A transaction spending output 0 of prevout's transaction, or a random one
+static CTransaction MakeTx(const uint256& hashPrev = 0)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev == 0 ? GetRandHash() : hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static uint64 Usage()
+{
+    CMemPoolStats stats;
+    mempool.GetStats(stats);
+    return stats.nUsage;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_accounting)
+{
+    mempool.clear();
+    CTransaction txParent = MakeTx();
+    CTransaction txChild = MakeTx(txParent.GetHash());
+    unsigned int nSize = ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION);
+
+    mempool.addUnchecked(CTransactionRef(txParent), 1000);
+    mempool.addUnchecked(CTransactionRef(txChild), 5000);
+    CMemPoolStats stats;
+    mempool.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nTx, 2U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 2 * nSize);
+    BOOST_CHECK(stats.nUsage > stats.nBytes);
+    uint64 nUsageBoth = stats.nUsage;
+
+    mempool.remove(txChild);
+    mempool.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nTx, 1U);
+    BOOST_CHECK_EQUAL(stats.nBytes, nSize);
+    BOOST_CHECK_EQUAL(stats.nUsage * 2, nUsageBoth);
+
+    // Removing the parent takes its descendants with it
+    mempool.addUnchecked(CTransactionRef(txChild), 5000);
+    mempool.remove(txParent, true);
+    mempool.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nTx, 0U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 0U);
+    BOOST_CHECK_EQUAL(stats.nUsage, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    mempool.clear();
+    CMemPoolStats stats;
+    mempool.GetStats(stats);
+    uint64 nEvictedBefore = stats.nEvicted;
+
+    CTransaction txLow = MakeTx();
+    CTransaction txMedium = MakeTx();
+    // A parent paying nothing, paid for by its child
+    CTransaction txParent = MakeTx();
+    CTransaction txChild = MakeTx(txParent.GetHash());
+
+    mempool.addUnchecked(CTransactionRef(txLow), 1000);
+    mempool.addUnchecked(CTransactionRef(txMedium), 50000);
+    mempool.addUnchecked(CTransactionRef(txParent), 0);
+    mempool.addUnchecked(CTransactionRef(txChild), 200000);
+    BOOST_CHECK_EQUAL(mempool.GetMinFee(), 0U);
+
+    mempool.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(), 0U);
+
+    // The lowest fee rate goes first, and raises the fee needed to get in
+    mempool.SetMaxUsage(Usage() - 1);
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(), 1U);
+    BOOST_CHECK(!mempool.exists(txLow.GetHash()));
+    unsigned int nSize = ::GetSerializeSize(txLow, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(mempool.GetMinFee() >= 1000 * 1000 / nSize + CTransaction::nMinRelayTxFee);
+
+    // The parent is kept for its child
+    mempool.SetMaxUsage(Usage() - 1);
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(), 1U);
+    BOOST_CHECK(!mempool.exists(txMedium.GetHash()));
+    BOOST_CHECK(mempool.exists(txParent.GetHash()));
+
+    // ...and they go together
+    mempool.SetMaxUsage(Usage() - 1);
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(), 2U);
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+    BOOST_CHECK_EQUAL(Usage(), 0U);
+
+    mempool.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEvicted - nEvictedBefore, 4U);
+
+    mempool.SetMaxUsage((uint64)DEFAULT_MAX_MEMPOOL_SIZE << 20);
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(mempool_parent_after_child)
+{
+    // A reorg puts a disconnected parent back while its child is still there
+    mempool.clear();
+    CTransaction txMedium = MakeTx();
+    CTransaction txParent = MakeTx();
+    CTransaction txChild = MakeTx(txParent.GetHash());
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION),
+                      ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION));
+
+    mempool.addUnchecked(CTransactionRef(txMedium), 50000);
+    mempool.addUnchecked(CTransactionRef(txChild), 200000);
+    mempool.addUnchecked(CTransactionRef(txParent), 0);
+
+    // The parent is still kept for the child that arrived before it
+    mempool.SetMaxUsage(Usage() - 1);
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(), 1U);
+    BOOST_CHECK(!mempool.exists(txMedium.GetHash()));
+    BOOST_CHECK(mempool.exists(txParent.GetHash()));
+    mempool.SetMaxUsage((uint64)DEFAULT_MAX_MEMPOOL_SIZE << 20);
+
+    // Taking the child out leaves the parent with only its own fee and size
+    mempool.remove(txChild);
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+    mempool.SetMaxUsage(Usage() - 1);
+    BOOST_CHECK_EQUAL(mempool.TrimToSize(), 1U);
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+    BOOST_CHECK_EQUAL(Usage(), 0U);
+
+    mempool.SetMaxUsage((uint64)DEFAULT_MAX_MEMPOOL_SIZE << 20);
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -444,4 +444,87 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+// The original SignatureHash, which builds a modified copy of the transaction
+static uint256 SignatureHashCopy(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        if (nIn >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nIn+1);
+        for (unsigned int i = 0; i < nIn; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return ss.GetHash();
+}
+
+static CScript RandomScript()
+{
+    static const opcodetype ops[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    CScript script;
+    int nOps = insecure_rand() % 10;
+    for (int i = 0; i < nOps; i++)
+        script << ops[insecure_rand() % (sizeof(ops)/sizeof(ops[0]))];
+    return script;
+}
+
+BOOST_AUTO_TEST_CASE(script_sighash_cache)
+{
+    seed_insecure_rand(true);
+    for (int n = 0; n < 200; n++)
+    {
+        CTransaction tx;
+        tx.nVersion = insecure_rand();
+        tx.nLockTime = (insecure_rand() % 2) ? insecure_rand() : 0;
+        tx.vin.resize(insecure_rand() % 20 + 1);
+        tx.vout.resize(insecure_rand() % 20 + 1);
+        BOOST_FOREACH(CTxIn& txin, tx.vin)
+        {
+            txin.prevout.hash = GetRandHash();
+            txin.prevout.n = insecure_rand() % 4;
+            txin.scriptSig = RandomScript();
+            txin.nSequence = (insecure_rand() % 2) ? insecure_rand() : (unsigned int)-1;
+        }
+        BOOST_FOREACH(CTxOut& txout, tx.vout)
+        {
+            txout.nValue = insecure_rand() % 100000000;
+            txout.scriptPubKey = RandomScript();
+        }
+
+        CSigHashCache sighash(tx);
+        for (unsigned int nIn = 0; nIn <= tx.vin.size(); nIn++)
+        {
+            CScript scriptCode = RandomScript();
+            int nHashType = (insecure_rand() % 2) ? insecure_rand() : (int)(insecure_rand() % 4) | (insecure_rand() % 2 ? SIGHASH_ANYONECANPAY : 0);
+            uint256 hash = SignatureHashCopy(scriptCode, tx, nIn, nHashType);
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType) == hash);
+            BOOST_CHECK(sighash.SignatureHash(scriptCode, nIn, nHashType) == hash);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,206 @@
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
+#include <vector>
+
+#include "key.h"
+#include "secp256k1.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+
+// Reference result: ECDSA_verify on the key as OpenSSL parses it
+static int OpenSSLVerify(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char* pbegin = &vchPubKey[0];
+    int ret = 0;
+    if (o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+        ret = ECDSA_verify(0, (const unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1;
+    EC_KEY_free(pkey);
+    return ret;
+}
+
+static int NativeVerify(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+{
+    return Secp256k1Verify((const unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+}
+
+// A strict DER signature with the given big-endian r and s
+static vector<unsigned char> EncodeDER(const vector<unsigned char>& r, const vector<unsigned char>& s)
+{
+    vector<unsigned char> vch;
+    vch.push_back(0x30);
+    vch.push_back(4 + r.size() + s.size());
+    vch.push_back(0x02);
+    vch.push_back(r.size());
+    vch.insert(vch.end(), r.begin(), r.end());
+    vch.push_back(0x02);
+    vch.push_back(s.size());
+    vch.insert(vch.end(), s.begin(), s.end());
+    return vch;
+}
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+BOOST_AUTO_TEST_CASE(secp256k1_differential)
+{
+    seed_insecure_rand(true);
+    vector<CKey> keys(8);
+    for (unsigned int i = 0; i < keys.size(); i++)
+        keys[i].MakeNewKey(i % 2 == 0);
+
+    int nValid = 0;
+    for (int i = 0; i < 2000; i++)
+    {
+        const CKey& key = keys[i % keys.size()];
+        CPubKey pubkey = key.GetPubKey();
+        vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+        uint256 hash = GetRandHash();
+        if (i % 50 == 0)
+            hash = 0;
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+
+        switch (i % 6)
+        {
+        case 1:     // flipped signature bit
+            vchSig[insecure_rand() % vchSig.size()] ^= 1 << (insecure_rand() % 8);
+            break;
+        case 2:     // different message
+            *hash.begin() ^= 1;
+            break;
+        case 3:     // different key
+        {
+            CPubKey pubkeyOther = keys[(i + 1) % keys.size()].GetPubKey();
+            vchPubKey.assign(pubkeyOther.begin(), pubkeyOther.end());
+            break;
+        }
+        case 4:     // flipped public key bit
+            vchPubKey[1 + insecure_rand() % (vchPubKey.size() - 1)] ^= 1 << (insecure_rand() % 8);
+            break;
+        }
+
+        int nNative = NativeVerify(hash, vchSig, vchPubKey);
+        int nOpenSSL = OpenSSLVerify(hash, vchSig, vchPubKey);
+        if (nNative != SECP256K1_VERIFY_UNSUPPORTED)
+            BOOST_CHECK_EQUAL(nNative, nOpenSSL);
+        if (i % 6 == 0)
+        {
+            // Signatures from CKey::Sign are always strict DER
+            BOOST_CHECK_EQUAL(nNative, SECP256K1_VERIFY_VALID);
+            nValid++;
+        }
+    }
+    BOOST_CHECK(nValid > 0);
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_edge_cases)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchSig, vchPubKey), SECP256K1_VERIFY_VALID);
+
+    // r or s of 0, n or above n are invalid, not unsupported
+    vector<unsigned char> vchOne(1, 0x01), vchZero(1, 0x00);
+    vector<unsigned char> vchN = ParseHex("00FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+    vector<unsigned char> vchNMinus1 = ParseHex("00FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364140");
+    vector<unsigned char> vchMax = ParseHex("00FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF");
+    const vector<unsigned char>* values[] = {&vchZero, &vchOne, &vchN, &vchNMinus1, &vchMax};
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        for (unsigned int j = 0; j < 5; j++)
+        {
+            vector<unsigned char> vchEdge = EncodeDER(*values[i], *values[j]);
+            int nNative = NativeVerify(hash, vchEdge, vchPubKey);
+            BOOST_CHECK(nNative != SECP256K1_VERIFY_UNSUPPORTED);
+            BOOST_CHECK_EQUAL(nNative, OpenSSLVerify(hash, vchEdge, vchPubKey));
+        }
+    }
+
+    // Non-DER and non-minimal encodings are left to OpenSSL
+    vector<unsigned char> vchBad = vchSig;
+    vchBad[1]++;
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchBad, vchPubKey), SECP256K1_VERIFY_UNSUPPORTED);
+    vchBad = vchSig;
+    vchBad.push_back(0x00);
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchBad, vchPubKey), SECP256K1_VERIFY_UNSUPPORTED);
+    vector<unsigned char> vchPadded(1, 0x00);
+    vchPadded.push_back(0x01);
+    BOOST_CHECK_EQUAL(NativeVerify(hash, EncodeDER(vchPadded, vchOne), vchPubKey), SECP256K1_VERIFY_UNSUPPORTED);
+    vector<unsigned char> vchNegative(1, 0x80);
+    BOOST_CHECK_EQUAL(NativeVerify(hash, EncodeDER(vchNegative, vchOne), vchPubKey), SECP256K1_VERIFY_UNSUPPORTED);
+
+    // So are hybrid and malformed public keys
+    vector<unsigned char> vchHybrid(vchPubKey);
+    vchHybrid[0] = 0x06;
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchSig, vchHybrid), SECP256K1_VERIFY_UNSUPPORTED);
+    vector<unsigned char> vchShort(vchPubKey.begin(), vchPubKey.end() - 1);
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchSig, vchShort), SECP256K1_VERIFY_UNSUPPORTED);
+
+    // CPubKey::Verify gives the same answers either way
+    BOOST_CHECK(pubkey.Verify(hash, vchSig));
+    BOOST_CHECK(!pubkey.Verify(hash, EncodeDER(vchOne, vchOne)));
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_pubkey_cache)
+{
+    mapArgs["-maxpubkeycachesize"] = "4";
+    vector<CKey> keys(6);
+    vector<uint256> hashes(keys.size());
+    vector<vector<unsigned char> > sigs(keys.size());
+    for (unsigned int i = 0; i < keys.size(); i++)
+    {
+        keys[i].MakeNewKey(i % 2 == 0);
+        hashes[i] = GetRandHash();
+        BOOST_CHECK(keys[i].Sign(hashes[i], sigs[i]));
+
+        // A parsed key verifies exactly like the serialized one
+        CPubKey pubkey = keys[i].GetPubKey();
+        CSecp256k1PubKey parsed;
+        BOOST_CHECK(Secp256k1ParsePubKey(parsed, pubkey.begin(), pubkey.size()));
+        BOOST_CHECK_EQUAL(Secp256k1VerifyParsed((const unsigned char*)&hashes[i], &sigs[i][0], sigs[i].size(), parsed),
+                          SECP256K1_VERIFY_VALID);
+    }
+
+    CPubKeyCacheStats before, after;
+    GetPubKeyCacheStats(before);
+    for (int nRound = 0; nRound < 3; nRound++)
+    {
+        for (unsigned int i = 0; i < keys.size(); i++)
+        {
+            CPubKey pubkey = keys[i].GetPubKey();
+            BOOST_CHECK(pubkey.Verify(hashes[i], sigs[i]));
+            BOOST_CHECK(!pubkey.Verify(hashes[(i + 1) % keys.size()], sigs[i]));
+        }
+    }
+    GetPubKeyCacheStats(after);
+
+    // Each key is looked up twice per round, and the second lookup always
+    // hits; with room for only four keys, cycling through six misses on
+    // every first lookup
+    BOOST_CHECK_EQUAL(after.nHits - before.nHits, 18U);
+    BOOST_CHECK_EQUAL(after.nMisses - before.nMisses, 18U);
+    BOOST_CHECK_EQUAL(after.nSize, 4U);
+    BOOST_CHECK_EQUAL(after.nMaxSize, 4U);
+
+    // Recently used keys survive
+    GetPubKeyCacheStats(before);
+    for (int nRound = 0; nRound < 3; nRound++)
+        BOOST_CHECK(keys[5].GetPubKey().Verify(hashes[5], sigs[5]));
+    GetPubKeyCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nHits - before.nHits, 3U);
+
+    mapArgs.erase("-maxpubkeycachesize");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,68 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "hash.h"
+#include "main.h"
+#include "sha256.h"
+#include "util.h"
+
+using namespace std;
+
+// Merkle root the straightforward way, one Hash() per node
+static uint256 NaiveMerkleRoot(vector<uint256> vLevel)
+{
+    while (vLevel.size() > 1)
+    {
+        vector<uint256> vNext;
+        for (unsigned int i = 0; i < vLevel.size(); i += 2)
+        {
+            const uint256& right = vLevel[min<size_t>(i + 1, vLevel.size() - 1)];
+            vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(right), END(right)));
+        }
+        vLevel.swap(vNext);
+    }
+    return vLevel.empty() ? 0 : vLevel[0];
+}
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    seed_insecure_rand(true);
+    BOOST_TEST_MESSAGE("SHA-256 kernels: " << SHA256AutoDetect());
+
+    // Every count up to a few times the widest kernel, so that each kernel
+    // and each leftover path gets used
+    for (unsigned int n = 0; n <= 33; n++)
+    {
+        vector<unsigned char> in(64 * n + 1), out(32 * n + 1, 0xAA);
+        for (unsigned int i = 0; i < in.size(); i++)
+            in[i] = insecure_rand();
+        SHA256D64(&out[0], &in[0], n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            uint256 hash = Hash(in.begin() + 64 * i, in.begin() + 64 * (i + 1));
+            BOOST_CHECK(memcmp(&out[32 * i], hash.begin(), 32) == 0);
+        }
+        // nothing written past the end
+        BOOST_CHECK_EQUAL(out[32 * n], 0xAA);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64_merkle)
+{
+    SHA256AutoDetect();
+    for (unsigned int nLeaves = 0; nLeaves <= 70; nLeaves++)
+    {
+        vector<uint256> vLeaves(nLeaves);
+        for (unsigned int i = 0; i < nLeaves; i++)
+            vLeaves[i] = GetRandHash();
+        vector<uint256> vMerkleTree(vLeaves);
+        BuildMerkleLevels(vMerkleTree, nLeaves);
+        BOOST_CHECK(equal(vLeaves.begin(), vLeaves.end(), vMerkleTree.begin()));
+        BOOST_CHECK((vMerkleTree.empty() ? 0 : vMerkleTree.back()) == NaiveMerkleRoot(vLeaves));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
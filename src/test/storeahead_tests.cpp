@@ -0,0 +1,122 @@
+//
+// Unit tests for blocks that arrive ahead of their parent
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// Tests these internal-to-main.cpp methods:
+extern bool HaveStoredBlock(const uint256& hash);
+extern map<uint256, CBlock*> mapOrphanBlocks;
+
+// Nonces that give the blocks below valid proof of work at the genesis
+// difficulty
+static const unsigned int blocknonce[] = { 0x00002aa9, 0x00014f2e, 0x001c1c0e };
+
+// A block at nHeight on hashPrev whose coinbase pays nothing to OP_TRUE
+static CBlock TestBlock(const uint256& hashPrev, int nHeight)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = hashPrev;
+    block.nTime = pindexGenesisBlock->nTime + 60 * nHeight;
+    block.nBits = pindexGenesisBlock->nBits;
+    block.nNonce = blocknonce[nHeight - 1];
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].nValue = 0;
+    txCoinBase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(txCoinBase);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(storeahead_tests)
+
+BOOST_AUTO_TEST_CASE(storeahead_connect)
+{
+    LOCK(cs_main);
+    BOOST_REQUIRE(pindexBest == pindexGenesisBlock);
+
+    vector<CBlock> vBlock;
+    uint256 hashPrev = pindexGenesisBlock->GetBlockHash();
+    for (int i = 1; i <= 3; i++)
+    {
+        vBlock.push_back(TestBlock(hashPrev, i));
+        hashPrev = vBlock.back().GetHash();
+        BOOST_REQUIRE(CheckProofOfWork(vBlock.back().GetPoWHash(), vBlock.back().nBits));
+    }
+    uint256 hash1 = vBlock[0].GetHash();
+    uint256 hash2 = vBlock[1].GetHash();
+    uint256 hash3 = vBlock[2].GetHash();
+
+    // Headers first, as a peer would send them
+    vector<CBlockIndex*> vHeader;
+    for (int i = 0; i < 3; i++)
+    {
+        CValidationState state;
+        CBlockIndex* pindex = NULL;
+        BOOST_CHECK(AcceptBlockHeader(state, vBlock[i].GetBlockHeader(), &pindex));
+        vHeader.push_back(pindex);
+    }
+    BOOST_CHECK(pindexBestHeader == vHeader[2]);
+
+    // A block whose parent is missing goes to disk, not the orphan pool
+    {
+        CValidationState state;
+        BOOST_CHECK(ProcessBlock(state, NULL, &vBlock[2]));
+        BOOST_CHECK(state.IsValid());
+    }
+    BOOST_CHECK(HaveStoredBlock(hash3));
+    BOOST_CHECK(!mapBlockIndex.count(hash3));
+    BOOST_CHECK(!mapOrphanBlocks.count(hash3));
+    CDiskBlockPos pos3 = vHeader[2]->GetBlockPos();
+
+    // Storing it again is refused, without blaming the sender, and leaves
+    // the first copy where it was
+    {
+        CValidationState state;
+        BOOST_CHECK(!ProcessBlock(state, NULL, &vBlock[2]));
+        int nDoS = -1;
+        BOOST_CHECK(state.IsInvalid(nDoS));
+        BOOST_CHECK_EQUAL(nDoS, 0);
+    }
+    BOOST_CHECK(vHeader[2]->GetBlockPos() == pos3);
+
+    {
+        CValidationState state;
+        BOOST_CHECK(ProcessBlock(state, NULL, &vBlock[1]));
+    }
+    BOOST_CHECK(HaveStoredBlock(hash2));
+    CDiskBlockPos pos2 = vHeader[1]->GetBlockPos();
+    BOOST_CHECK(pos2 != pos3);
+    BOOST_CHECK(pindexBest == pindexGenesisBlock);
+
+    // The parent connects the whole stored run, from where it was stored
+    {
+        CValidationState state;
+        BOOST_CHECK(ProcessBlock(state, NULL, &vBlock[0]));
+        BOOST_CHECK(state.IsValid());
+    }
+    BOOST_CHECK(hashBestChain == hash3);
+    BOOST_CHECK_EQUAL(nBestHeight, 3);
+    BOOST_CHECK(!HaveStoredBlock(hash2));
+    BOOST_CHECK(!HaveStoredBlock(hash3));
+    BOOST_REQUIRE(mapBlockIndex.count(hash1) && mapBlockIndex.count(hash2) && mapBlockIndex.count(hash3));
+    BOOST_CHECK(mapBlockIndex[hash2]->GetBlockPos() == pos2);
+    BOOST_CHECK(mapBlockIndex[hash3]->GetBlockPos() == pos3);
+
+    // Once connected it is a duplicate like any other
+    {
+        CValidationState state;
+        BOOST_CHECK(!ProcessBlock(state, NULL, &vBlock[2]));
+        BOOST_CHECK(!HaveStoredBlock(hash3));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
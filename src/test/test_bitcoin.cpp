@@ -7,6 +7,7 @@
 #include "main.h"
 #include "wallet.h"
 #include "util.h"
+#include "sha256.h"
 
 CWallet* pwalletMain;
 CClientUIInterface uiInterface;
@@ -22,6 +23,7 @@ struct TestingSetup {
     TestingSetup() {
         fPrintToDebugger = true; // don't want to write to debug.log file
         noui_connect();
+        SHA256AutoDetect();
         bitdb.MakeMock();
         pathTemp = GetTempPath() / strprintf("test_fedoracoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
         boost::filesystem::create_directories(pathTemp);
@@ -1,6 +1,9 @@
 #include <boost/test/unit_test.hpp>
 
+#include "bignum.h"
+#include "main.h"
 #include "uint256.h"
+#include "util.h"
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +18,94 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+// A random number of random bit length, so that operands of every size
+// meet
+static uint256 RandomUint256()
+{
+    return GetRandHash() >> GetRand(257);
+}
+
+BOOST_AUTO_TEST_CASE(uint256_arithmetic)
+{
+    uint256 a = ~uint256(0) >> 20;
+    BOOST_CHECK(a * 1 == a);
+    BOOST_CHECK(a * 4 == a << 2);
+    BOOST_CHECK(a / 16 == a >> 4);
+    BOOST_CHECK(a / a == 1);
+    BOOST_CHECK(a / (a + 1) == 0);
+    BOOST_CHECK(a * uint256(0) == 0);
+    BOOST_CHECK((uint256(1) << 128) * (uint256(1) << 128) == 0);
+    BOOST_CHECK(((uint256(1) << 100) + 1) * ((uint256(1) << 100) - 1) == (uint256(1) << 200) - 1);
+    BOOST_CHECK(~uint256(0) * ~uint256(0) == 1); // (-1)*(-1) modulo 2^256
+    uint256 b = a;
+    BOOST_CHECK_EQUAL(b.DivMod(1000), (a - a / 1000 * 1000).Get64());
+    BOOST_CHECK(b == a / 1000);
+    BOOST_CHECK_EQUAL(a.bits(), 236U);
+    BOOST_CHECK_EQUAL(uint256(0).bits(), 0U);
+    BOOST_CHECK_EQUAL(uint256(1).bits(), 1U);
+    BOOST_CHECK_THROW(a / uint256(0), uint_error);
+}
+
+// Multiplication and division against CBigNum, taken modulo 2^256
+BOOST_AUTO_TEST_CASE(uint256_bignum_differential)
+{
+    for (int i = 0; i < 10000; i++)
+    {
+        uint256 a = RandomUint256();
+        uint256 b = RandomUint256();
+        uint32_t n = GetRand(0xffffffff) + 1;
+        CBigNum bnA(a), bnB(b);
+
+        BOOST_CHECK((a * b).GetHex() == (bnA * bnB).getuint256().GetHex());
+        BOOST_CHECK((a * n).GetHex() == (bnA * CBigNum(n)).getuint256().GetHex());
+        BOOST_CHECK((a / n).GetHex() == (bnA / CBigNum(n)).getuint256().GetHex());
+        if (b != 0)
+            BOOST_CHECK((a / b).GetHex() == (bnA / bnB).getuint256().GetHex());
+        BOOST_CHECK_EQUAL(a.GetCompact(), bnA.GetCompact());
+    }
+}
+
+// The compact encoding and block work for random nBits against CBigNum,
+// with the values CBigNum makes negative or too large for 256 bits flagged
+BOOST_AUTO_TEST_CASE(uint256_compact_differential)
+{
+    for (int i = 0; i < 10000; i++)
+    {
+        unsigned int nCompact = GetRand(0xffffffff);
+        if (i % 2)
+            nCompact = (nCompact & 0x00ffffff) | ((unsigned int)GetRand(36) << 24);
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        uint256 num;
+        bool fNegative, fOverflow;
+        num.SetCompact(nCompact, &fNegative, &fOverflow);
+
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        BOOST_CHECK_EQUAL(fOverflow, (bn < 0 ? -bn : bn) > CBigNum(~uint256(0)));
+        if (!fNegative && !fOverflow)
+        {
+            BOOST_CHECK(num.GetHex() == bn.getuint256().GetHex());
+            BOOST_CHECK_EQUAL(num.GetCompact(), bn.GetCompact());
+        }
+
+        CBlockIndex index;
+        index.nBits = nCompact;
+        CBigNum bnWork = bn <= 0 ? CBigNum(0) : (CBigNum(1) << 256) / (bn + 1);
+        BOOST_CHECK(index.GetBlockWork().GetHex() == bnWork.getuint256().GetHex());
+    }
+
+    uint256 num;
+    bool fNegative, fOverflow;
+    num.SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(fNegative && !fOverflow);
+    num.SetCompact(0x04800000, &fNegative, &fOverflow);
+    BOOST_CHECK(!fNegative && !fOverflow && num == 0);
+    num.SetCompact(0x21010000, &fNegative, &fOverflow);
+    BOOST_CHECK(!fNegative && fOverflow);
+    num.SetCompact(0x2000ffff, &fNegative, &fOverflow);
+    BOOST_CHECK(!fOverflow && num == uint256(0xffff) << 232);
+    num.SetCompact(0xff000000, &fNegative, &fOverflow);
+    BOOST_CHECK(!fNegative && !fOverflow && num == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -253,8 +254,8 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             for (int i2 = 0; i2 < 100; i2++)
                 add_coin(COIN);
 
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
+            // picking 50 from 100 identical coins depends on which
+            // of the equal-valued coins the subset search sees first
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
@@ -291,4 +292,58 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(balance_tracking_tests)
+{
+    LOCK(pwalletMain->cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKey(key));
+
+    uint64 nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+    uint64 nBalance = pwalletMain->GetBalance();
+    vector<COutput> vAvailable;
+    pwalletMain->AvailableCoins(vAvailable, false);
+    unsigned int nAvailable = vAvailable.size();
+
+    // Unconfirmed payment with one output to us and one elsewhere
+    CTransaction txCredit;
+    txCredit.vin.resize(1);
+    txCredit.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txCredit.vout.resize(2);
+    txCredit.vout[0].nValue = 5 * COIN;
+    txCredit.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    txCredit.vout[1].nValue = 7 * COIN;
+    txCredit.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txCredit)));
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 5 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), nAvailable + 1);
+    pwalletMain->AvailableCoins(vAvailable, true);
+    BOOST_CHECK(vAvailable.size() <= nAvailable);
+
+    // Spending it takes it out of the balance and the available coins
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txCredit.GetHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 5 * COIN;
+    txSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txSpend)));
+    BOOST_CHECK(pwalletMain->mapWallet[txCredit.GetHash()].IsSpent(0));
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), nAvailable);
+
+    // Rebuilding the unspent index from mapWallet gives the same answers
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), nAvailable);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
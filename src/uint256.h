@@ -13,6 +13,7 @@
 #else
 #include <stdint.h>
 #endif
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -23,6 +24,12 @@ typedef unsigned long long  uint64;
 inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
 
+class uint_error : public std::runtime_error
+{
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
 
 /** Base class without constructors for uint256 and uint160.
  * This makes the compiler let you use it in a union.
@@ -183,6 +190,147 @@ public:
         return *this;
     }
 
+    // Product modulo 2^BITS
+    base_uint& operator*=(uint32_t b32)
+    {
+        uint64 carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = carry + (uint64)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    // Divides by b32, which must not be zero, and returns the remainder
+    uint32_t DivMod(uint32_t b32)
+    {
+        uint64 rem = 0;
+        for (int i = WIDTH - 1; i >= 0; i--)
+        {
+            uint64 n = (rem << 32) | pn[i];
+            pn[i] = n / b32;
+            rem = n % b32;
+        }
+        return rem;
+    }
+
+    base_uint& operator/=(uint32_t b32)
+    {
+        DivMod(b32);
+        return *this;
+    }
+
+    // Product modulo 2^BITS
+    base_uint& operator*=(const base_uint& b)
+    {
+        base_uint a(*this);
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        for (int j = 0; j < WIDTH; j++)
+        {
+            uint64 carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64 n = carry + pn[i + j] + (uint64)a.pn[j] * b.pn[i];
+                pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        return *this;
+    }
+
+    // Long division, one bit of the quotient at a time
+    base_uint& operator/=(const base_uint& b)
+    {
+        base_uint div(b);
+        base_uint num(*this);
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int nNumBits = num.bits();
+        int nDivBits = div.bits();
+        if (nDivBits == 0)
+            throw uint_error("base_uint::operator/= : division by zero");
+        if (nDivBits > nNumBits)
+            return *this;
+        int nShift = nNumBits - nDivBits;
+        div <<= nShift;
+        for (; nShift >= 0; nShift--)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[nShift / 32] |= (1U << (nShift & 31));
+            }
+            div >>= 1;
+        }
+        return *this;
+    }
+
+    // Position of the highest bit set, plus one
+    unsigned int bits() const
+    {
+        for (int i = WIDTH - 1; i >= 0; i--)
+            if (pn[i])
+                for (int nbits = 31; nbits >= 0; nbits--)
+                    if (pn[i] & (1U << nbits))
+                        return 32 * i + nbits + 1;
+        return 0;
+    }
+
+    // The compact "nBits" encoding of block headers, as CBigNum does it.
+    // Being unsigned, this type can't hold what CBigNum makes of a sign bit
+    // or of more than BITS bits: those are only reported, through
+    // pfNegative (set for a nonzero mantissa with the sign bit) and
+    // pfOverflow, and the value is left as the magnitude, minus whatever
+    // bits were shifted past the top.
+    base_uint& SetCompact(unsigned int nCompact, bool *pfNegative = NULL, bool *pfOverflow = NULL)
+    {
+        unsigned int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8*(3-nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8*(nSize-3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > BITS/8 + 2) ||
+                                         (nWord > 0xff && nSize > BITS/8 + 1) ||
+                                         (nWord > 0xffff && nSize > BITS/8));
+        return *this;
+    }
+
+    unsigned int GetCompact() const
+    {
+        unsigned int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3)
+            nCompact = Get64() << 8*(3-nSize);
+        else
+        {
+            base_uint bn(*this);
+            bn >>= 8*(nSize-3);
+            nCompact = bn.Get64();
+        }
+        // The 0x00800000 bit denotes the sign.
+        // Thus, if it is already set, divide the mantissa by 256 and increase the exponent.
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        return nCompact;
+    }
+
 
     base_uint& operator++()
     {
@@ -641,6 +789,10 @@ inline const uint256 operator&(const uint256& a, const uint256& b)      { return
 inline const uint256 operator|(const uint256& a, const uint256& b)      { return (base_uint256)a |  (base_uint256)b; }
 inline const uint256 operator+(const uint256& a, const uint256& b)      { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const uint256& a, const uint256& b)      { return (base_uint256)a -  (base_uint256)b; }
+inline const uint256 operator*(const uint256& a, const uint256& b)      { return uint256(a) *= b; }
+inline const uint256 operator/(const uint256& a, const uint256& b)      { return uint256(a) /= b; }
+inline const uint256 operator*(const uint256& a, uint32_t b)            { return uint256(a) *= b; }
+inline const uint256 operator/(const uint256& a, uint32_t b)            { return uint256(a) /= b; }
 
 
 
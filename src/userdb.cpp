@@ -74,7 +74,7 @@ bool CUserDB::UserAdd(string username, const SecureString& password)
     std::string salt = EncodeBase58(&rand_pwd[0],&rand_pwd[0]+32).c_str();
 
     // create a password hash like hash(DataStream(hash(password) + hash(salt)))
-    CDataStream ds(SER_NETWORK, 0);
+    CSecureDataStream ds(SER_NETWORK, 0);
     ds << Hash(password.begin(), password.end());//password;
     ds << Hash(salt.begin(), salt.end());
     uint256 pass_hash = Hash(ds.begin(), ds.end());
@@ -107,7 +107,7 @@ bool CUserDB::UserUpdate(string username, const SecureString& password)
     string salt;
     if (!Read("US:" + user, salt)) return false;
 
-    CDataStream ds(SER_NETWORK, 0);
+    CSecureDataStream ds(SER_NETWORK, 0);
     ds << Hash(password.begin(), password.end());
     ds << Hash(salt.begin(), salt.end());
     uint256 pass_hash = Hash(ds.begin(), ds.end());
@@ -124,7 +124,7 @@ bool CUserDB::UserAuth(string username, const SecureString& password)
     uint256 pass_hash("0x0");
     string salt;
     if (!Read("U:" + user, pass_hash) || !Read("US:" + user, salt) || pass_hash == uint256("0x0")) return false;
-    CDataStream ds(SER_NETWORK, 0);
+    CSecureDataStream ds(SER_NETWORK, 0);
     ds << Hash(password.begin(), password.end());
     ds << Hash(salt.begin(), salt.end());
     uint256 auth_hash = Hash(ds.begin(), ds.end());
@@ -99,6 +99,13 @@ void locking_callback(int mode, int i, const char* file, int line)
 
 LockedPageManager LockedPageManager::instance;
 
+CBufferPool& CBufferPool::Instance()
+{
+    // Never destroyed, since pooled containers may outlive any other static
+    static CBufferPool* pool = new CBufferPool();
+    return *pool;
+}
+
 // Init
 class CInit
 {
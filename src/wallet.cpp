@@ -322,28 +322,95 @@ int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::IndexTransactions()
 {
-    CWalletDB walletdb(strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    if (fTxIndexed)
+        return;
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+    wtxOrdered.clear();
+    laccentries.clear();
+    mapTxByHeight.clear();
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtx->nIndexHeight = -1;
+        IndexTxHeight(*wtx, true);
+    }
+    if (fFileBacked)
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+    {
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    fTxIndexed = true;
+}
+
+// Key wtx by the height of its block, or by INT_MAX if it isn't in a block
+// we know. With fCheckMainChain a block that isn't in the main chain counts
+// as unknown; without it, the block is taken to be the one being connected.
+// Transactions keyed INT_MAX are returned by every GetTransactionsAbove call,
+// so a block disconnect must re-key its transactions (see UpdatedTransaction).
+void CWallet::IndexTxHeight(CWalletTx& wtx, bool fCheckMainChain)
+{
+    int nHeight = std::numeric_limits<int>::max();
+    if (wtx.hashBlock != 0)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && (!fCheckMainChain || (*mi).second->IsInMainChain()))
+            nHeight = (*mi).second->nHeight;
+    }
+    if (wtx.nIndexHeight == nHeight)
+        return;
+    UnindexTxHeight(wtx);
+    mapTxByHeight.insert(make_pair(nHeight, &wtx));
+    wtx.nIndexHeight = nHeight;
+}
+
+void CWallet::UnindexTxHeight(CWalletTx& wtx)
+{
+    if (wtx.nIndexHeight == -1)
+        return;
+    typedef multimap<int, CWalletTx*>::iterator Iter;
+    pair<Iter, Iter> range = mapTxByHeight.equal_range(wtx.nIndexHeight);
+    for (Iter it = range.first; it != range.second; ++it)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        if ((*it).second == &wtx)
+        {
+            mapTxByHeight.erase(it);
+            break;
+        }
     }
+    wtx.nIndexHeight = -1;
+}
+
+const CWallet::TxItems& CWallet::OrderedTxItems()
+{
+    IndexTransactions();
+    return wtxOrdered;
+}
+
+void CWallet::GetTransactionsAbove(int nHeight, std::vector<const CWalletTx*>& vpwtx)
+{
+    vpwtx.clear();
+    IndexTransactions();
+    for (multimap<int, CWalletTx*>::const_iterator it = mapTxByHeight.upper_bound(nHeight); it != mapTxByHeight.end(); ++it)
+        vpwtx.push_back((*it).second);
+}
+
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb)
+{
+    if (!walletdb.WriteAccountingEntry(acentry))
+        return false;
 
-    return txOrdered;
+    LOCK(cs_wallet);
+    if (fTxIndexed)
+    {
+        laccentries.push_back(acentry);
+        CAccountingEntry& entry = laccentries.back();
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    }
+    return true;
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx)
@@ -366,6 +433,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    SyncUnspent(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -379,7 +447,44 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // IsMine may have changed for any output
+        setUnspent.clear();
+        fUnspentIndexed = false;
+        fBalanceCached = false;
+    }
+}
+
+void CWallet::IndexUnspent() const
+{
+    if (fUnspentIndexed)
+        return;
+    setUnspent.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = (*it).second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+                setUnspent.insert(setUnspent.end(), COutPoint((*it).first, i));
     }
+    fUnspentIndexed = true;
+    fBalanceCached = false;
+}
+
+// Bring setUnspent up to date after mapWallet[hash] was added, changed or erased
+void CWallet::SyncUnspent(const uint256& hash)
+{
+    fBalanceCached = false;
+    if (!fUnspentIndexed)
+        return;
+    setUnspent.erase(setUnspent.lower_bound(COutPoint(hash, 0)),
+                     setUnspent.upper_bound(COutPoint(hash, std::numeric_limits<unsigned int>::max())));
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = (*mi).second;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            setUnspent.insert(COutPoint(hash, i));
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -396,6 +501,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            if (fTxIndexed)
+            {
+                wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+                IndexTxHeight(wtx, false);
+            }
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -407,9 +517,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64 latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        const TxItems& txOrdered = OrderedTxItems();
+                        for (TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -451,6 +560,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
             {
                 wtx.hashBlock = wtxIn.hashBlock;
+                if (fTxIndexed)
+                    IndexTxHeight(wtx, false);
                 fUpdated = true;
             }
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
@@ -470,6 +581,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        if (fInsertedNew || fUpdated)
+            SyncUnspent(hash);
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
@@ -559,8 +673,25 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end() && fTxIndexed)
+        {
+            CWalletTx* pwtx = &(*mi).second;
+            UnindexTxHeight(*pwtx);
+            for (TxItems::iterator it = wtxOrdered.lower_bound(pwtx->nOrderPos); it != wtxOrdered.end() && (*it).first == pwtx->nOrderPos; ++it)
+            {
+                if ((*it).second.first == pwtx)
+                {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            }
+        }
         if (mapWallet.erase(hash))
+        {
+            SyncUnspent(hash);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -797,31 +928,199 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+/** One block of a wallet rescan: read from disk and matched against the
+  * wallet's keys by a worker thread, then committed by the scanning thread.
+  */
+struct CWalletScanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    std::vector<uint256> vHash;     // txids, in block order
+    std::vector<bool> vfMine;       // IsMine(tx) for each transaction
+    bool fReady;
+
+    CWalletScanBlock() : pindex(NULL), fReady(false) {}
+};
+
+/** Pipeline for ScanForWalletTransactions.
+  *
+  * Worker threads walk the chain from pindexStart, each claiming the next
+  * block, reading it from disk and evaluating IsMine for its outputs, which
+  * only needs the key store. At most vSlots.size() blocks are in flight, so
+  * memory stays bounded. The scanning thread takes the results back in chain
+  * order, and does everything that depends on earlier transactions (IsFromMe,
+  * spent tracking, AddToWallet) itself.
+  */
+class CWalletScanQueue
+{
+private:
+    boost::mutex mutex;
+
+    // Workers block on this when the window is full
+    boost::condition_variable condWorker;
+
+    // The scanning thread blocks on this while the next block isn't ready
+    boost::condition_variable condScanner;
+
+    const CWallet* pwallet;
+    CBlockIndex* pindexNext;        // next block to hand out to a worker
+    unsigned int nNext;             // sequence number of pindexNext
+    unsigned int nCommitted;        // number of blocks released by the scanner
+    std::vector<CWalletScanBlock> vSlots;
+    bool fQuit;
+
+    void Process(CWalletScanBlock& slot)
+    {
+        slot.block.SetNull();
+        slot.vHash.clear();
+        slot.vfMine.clear();
+        if (!slot.block.ReadFromDisk(slot.pindex))
+            return;
+        slot.vHash.reserve(slot.block.vtx.size());
+        slot.vfMine.reserve(slot.block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, slot.block.vtx)
+        {
+            slot.vHash.push_back(tx.GetHash());
+            slot.vfMine.push_back(pwallet->IsMine(tx));
+        }
+    }
+
+public:
+    CWalletScanQueue(const CWallet* pwalletIn, CBlockIndex* pindexStart, unsigned int nWindow) :
+        pwallet(pwalletIn), pindexNext(pindexStart), nNext(0), nCommitted(0), vSlots(nWindow), fQuit(false) {}
+
+    void Thread()
+    {
+        while (true)
+        {
+            CWalletScanBlock* pslot;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && pindexNext && nNext >= nCommitted + vSlots.size())
+                    condWorker.wait(lock);
+                if (fQuit || !pindexNext)
+                    return;
+                pslot = &vSlots[nNext % vSlots.size()];
+                pslot->pindex = pindexNext;
+                pindexNext = pindexNext->pnext;
+                nNext++;
+            }
+            Process(*pslot);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pslot->fReady = true;
+            }
+            condScanner.notify_one();
+        }
+    }
+
+    // Wait for the next block in chain order; NULL once the tip has been passed
+    CWalletScanBlock* Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CWalletScanBlock& slot = vSlots[nCommitted % vSlots.size()];
+        while (!slot.fReady)
+        {
+            if (nCommitted == nNext && !pindexNext)
+                return NULL;
+            condScanner.wait(lock);
+        }
+        return &slot;
+    }
+
+    // Hand the block returned by Next() back so its slot can be reused
+    void Release()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vSlots[nCommitted % vSlots.size()].fReady = false;
+            nCommitted++;
+        }
+        condWorker.notify_all();
+    }
+
+    void Quit()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+    }
+};
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// Blocks are read and matched by a pool of -par threads while this thread
+// applies the results in chain order. The scan can be stopped from another
+// thread with AbortRescan(), and its progress read with GetRescanProgress().
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    if (!pindexStart)
+        return ret;
+
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    CWalletScanQueue queue(this, pindexStart, 16 * nThreads);
+    boost::thread_group threadGroup;
 
-    CBlockIndex* pindex = pindexStart;
+    nRescanStartHeight = pindexStart->nHeight;
+    nRescanStopHeight = pindexBest ? pindexBest->nHeight : pindexStart->nHeight;
+    nRescanHeight = nRescanStartHeight;
+    fAbortRescan = false;
+    fScanningWallet = true;
+
+    int64 nNow = GetTime();
     {
         LOCK(cs_wallet);
-        while (pindex)
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CWalletScanQueue::Thread, &queue));
+
+        CWalletScanBlock* pslot;
+        while (!fAbortRescan && (pslot = queue.Next()) != NULL)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            const CBlock& block = pslot->block;
+            for (unsigned int i = 0; i < pslot->vHash.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                const uint256& hash = pslot->vHash[i];
+                const CTransaction& tx = block.vtx[i];
+                // Cheap rejection of the common case; AddToWalletIfInvolvingMe
+                // would call WalletUpdateSpent for it as well
+                if (!pslot->vfMine[i] && !mapWallet.count(hash) && !IsFromMe(tx))
+                {
+                    WalletUpdateSpent(tx);
+                    continue;
+                }
+                if (AddToWalletIfInvolvingMe(hash, tx, &block, fUpdate))
                     ret++;
             }
-            pindex = pindex->pnext;
+            nRescanHeight = pslot->pindex->nHeight;
+            queue.Release();
+
+            if (GetTime() >= nNow + 60)
+            {
+                nNow = GetTime();
+                printf("Still rescanning. At block %d. Progress=%f\n", nRescanHeight, GetRescanProgress());
+            }
         }
+        if (fAbortRescan)
+            printf("Rescan aborted at block %d.\n", nRescanHeight);
+
+        queue.Quit();
+        threadGroup.join_all();
     }
+    fScanningWallet = false;
     return ret;
 }
 
+double CWallet::GetRescanProgress() const
+{
+    if (nRescanStopHeight <= nRescanStartHeight)
+        return 1.0;
+    return std::min(1.0, (double)(nRescanHeight - nRescanStartHeight) / (nRescanStopHeight - nRescanStartHeight));
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     bool fRepeat = true;
@@ -858,6 +1157,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    SyncUnspent(item.first);
                 }
             }
             else
@@ -948,49 +1248,60 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-uint64 CWallet::GetBalance() const
+// Recompute the balance totals if the wallet or the best chain changed since
+// they were last computed. Only transactions with unspent outputs of ours
+// can contribute, so this walks setUnspent rather than all of mapWallet.
+void CWallet::UpdateBalanceCache() const
 {
-    uint64 nTotal = 0;
+    if (fBalanceCached && hashBalanceTip == hashBestChain)
+        return;
+    IndexUnspent();
+
+    uint64 nBalance = 0, nUnconfirmed = 0, nImmature = 0;
+    uint256 hashLast = 0;
+    BOOST_FOREACH(const COutPoint& outpoint, setUnspent)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        if (outpoint.hash == hashLast)
+            continue;
+        hashLast = outpoint.hash;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &(*mi).second;
+        bool fConfirmed = pcoin->IsConfirmed();
+        if (fConfirmed)
+            nBalance += pcoin->GetAvailableCredit();
+        if (!pcoin->IsFinal() || !fConfirmed)
+            nUnconfirmed += pcoin->GetAvailableCredit();
+        nImmature += pcoin->GetImmatureCredit();
     }
 
-    return nTotal;
+    nBalanceCached = nBalance;
+    nUnconfirmedBalanceCached = nUnconfirmed;
+    nImmatureBalanceCached = nImmature;
+    hashBalanceTip = hashBestChain;
+    fBalanceCached = true;
+}
+
+uint64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateBalanceCache();
+    return nBalanceCached;
 }
 
 uint64 CWallet::GetUnconfirmedBalance() const
 {
-    uint64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    UpdateBalanceCache();
+    return nUnconfirmedBalanceCached;
 }
 
 uint64 CWallet::GetImmatureBalance() const
 {
-    uint64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    UpdateBalanceCache();
+    return nImmatureBalanceCached;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -999,91 +1310,151 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     vCoins.clear();
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        IndexUnspent();
+
+        const CWalletTx* pcoin = NULL;
+        uint256 hashLast = 0;
+        int nDepth = 0;
+        BOOST_FOREACH(const COutPoint& outpoint, setUnspent)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            if (outpoint.hash != hashLast)
+            {
+                hashLast = outpoint.hash;
+                pcoin = NULL;
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+                if (mi == mapWallet.end())
+                    continue;
+                const CWalletTx* ptx = &(*mi).second;
 
-            if (!pcoin->IsFinal())
-                continue;
+                if (!ptx->IsFinal())
+                    continue;
 
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
-                continue;
+                if (fOnlyConfirmed && !ptx->IsConfirmed())
+                    continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                if (ptx->IsCoinBase() && ptx->GetBlocksToMaturity() > 0)
+                    continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i))) 
-                        vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+                pcoin = ptx;
+                nDepth = pcoin->GetDepthInMainChain();
             }
+            if (!pcoin)
+                continue;
+
+            unsigned int i = outpoint.n;
+            if (!IsLockedCoin(outpoint.hash, i) && pcoin->vout[i].nValue >= nMinimumInputValue &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(outpoint.hash, i)))
+                    vCoins.push_back(COutput(pcoin, i, nDepth));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<uint64, pair<const CWalletTx*,unsigned int> > >vValue, uint64 nTotalLower, uint64 nTargetValue,
-                                  vector<char>& vfBest, uint64& nBest, int iterations = 1000)
+typedef pair<uint64, pair<const CWalletTx*, unsigned int> > CValueCoin;
+
+static int InsecureRandInt(int nMax)
 {
-    vector<char> vfIncluded;
+    return insecure_rand() % nMax;
+}
 
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
+// Branch-and-bound search for the subset of vValue (sorted by descending
+// value, nTotalLower the sum of all of it) with the smallest total that is at
+// least nTargetValue. The tree is walked depth first, trying each coin
+// included before excluded, so the first leaf is the greedy largest-first
+// answer. A branch is cut as soon as it can no longer reach the target or beat
+// the best total so far, and coins equal in value to one just excluded are
+// skipped since they lead to the same totals. The search stops at an exact
+// match or when COIN_SELECTION_MAX_TRIES branches or COIN_SELECTION_MAX_MICROS
+// have been spent, returning the best subset found.
+static void SelectCoinsBnB(const vector<CValueCoin>& vValue, uint64 nTotalLower, uint64 nTargetValue,
+                           vector<char>& vfBest, uint64& nBest)
+{
+    const unsigned int nCoins = vValue.size();
+    vector<unsigned int> vSelected;         // included coins, in index order
+    vector<unsigned int> vBestSelected;
+    bool fAll = true;                       // best is still "every coin"
+    uint64 nTotal = 0;                      // value of vSelected
+    uint64 nAvailable = nTotalLower;        // value of coins from nNext on
+    unsigned int nNext = 0;                 // next coin to decide on
 
-    seed_insecure_rand();
+    nBest = nTotalLower;
+    int64 nStart = GetTimeMicros();
 
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    for (unsigned int nTries = 0; nTries < COIN_SELECTION_MAX_TRIES; nTries++)
     {
-        vfIncluded.assign(vValue.size(), false);
-        uint64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        if ((nTries & 0xfff) == 0xfff && GetTimeMicros() - nStart > COIN_SELECTION_MAX_MICROS)
+            break;
+
+        bool fBacktrack = false;
+        if (nTotal + nAvailable < nTargetValue || nTotal >= nBest)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
+        {
+            nBest = nTotal;
+            vBestSelected = vSelected;
+            fAll = false;
+            if (nBest == nTargetValue)
+                break;
+            fBacktrack = true;
+        }
+
+        if (!fBacktrack)
         {
-            for (unsigned int i = 0; i < vValue.size(); i++)
+            // Include coins until the target or the best total is reached;
+            // nTotal + nAvailable doesn't change, so no other cut can apply
+            do
             {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
+                nAvailable -= vValue[nNext].first;
+                nTotal += vValue[nNext].first;
+                vSelected.push_back(nNext);
+                nNext++;
+            } while (nTotal < nTargetValue && nTotal < nBest);
+            continue;
         }
+
+        if (vSelected.empty())
+            break;                          // whole tree searched
+
+        // Exclude the most recently included coin instead, giving back the
+        // coins that were excluded after it
+        unsigned int nLast = vSelected.back();
+        vSelected.pop_back();
+        nTotal -= vValue[nLast].first;
+        for (unsigned int i = nLast + 1; i < nNext; i++)
+            nAvailable += vValue[i].first;
+        nNext = nLast + 1;
+        while (nNext < nCoins && vValue[nNext].first == vValue[nLast].first)
+            nAvailable -= vValue[nNext++].first;
+    }
+
+    vfBest.assign(nCoins, fAll);
+    if (!fAll)
+    {
+        BOOST_FOREACH(unsigned int i, vBestSelected)
+            vfBest[i] = true;
     }
 }
 
-bool CWallet::SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, uint64& nValueRet)
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
     // List of values less than target
-    pair<uint64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    CValueCoin coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<uint64>::max();
     coinLowestLarger.second.first = NULL;
-    vector<pair<uint64, pair<const CWalletTx*,unsigned int> > > vValue;
+    CValueCoin coinExact;
+    coinExact.second.first = NULL;
+    vector<CValueCoin> vValue;
     uint64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Where several coins qualify as the exact match or the smallest larger
+    // coin, pick one uniformly at random (reservoir sampling) rather than
+    // shuffling the whole candidate list
+    unsigned int nExact = 0, nLowestLarger = 0;
 
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1093,13 +1464,12 @@ bool CWallet::SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTh
         int i = output.i;
         uint64 n = pcoin->vout[i].nValue;
 
-        pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+        CValueCoin coin = make_pair(n,make_pair(pcoin, i));
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (GetRandInt(++nExact) == 0)
+                coinExact = coin;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -1109,9 +1479,22 @@ bool CWallet::SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTh
         else if (n < coinLowestLarger.first)
         {
             coinLowestLarger = coin;
+            nLowestLarger = 1;
+        }
+        else if (n == coinLowestLarger.first)
+        {
+            if (GetRandInt(++nLowestLarger) == 0)
+                coinLowestLarger = coin;
         }
     }
 
+    if (coinExact.second.first)
+    {
+        setCoinsRet.insert(coinExact.second);
+        nValueRet += coinExact.first;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1131,16 +1514,21 @@ bool CWallet::SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTh
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Solve subset sum by branch and bound over the coins sorted by value.
+    // The shuffle decides which of several equal-valued coins get used;
+    // the randomness serves no security purpose but avoids always spending
+    // the same outputs, so the fast insecure generator is good enough.
+    seed_insecure_rand();
+    random_shuffle(vValue.begin(), vValue.end(), InsecureRandInt);
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     uint64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    SelectCoinsBnB(vValue, nTotalLower, nTargetValue, vfBest, nBest);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        SelectCoinsBnB(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest);
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    // If we have a bigger coin and (either the subset search didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
     if (coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
@@ -1157,11 +1545,8 @@ bool CWallet::SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTh
             }
 
         //// debug print
-        printf("SelectCoins() best subset: ");
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                printf("%s ", FormatMoney(vValue[i].first).c_str());
-        printf("total %s\n", FormatMoney(nBest).c_str());
+        printf("SelectCoins() best subset of %"PRIszu": %"PRIszu" coins, total %s\n",
+               vValue.size(), setCoinsRet.size(), FormatMoney(nBest).c_str());
     }
 
     return true;
@@ -1553,6 +1938,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                SyncUnspent(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -1909,34 +2295,41 @@ std::map<CTxDestination, uint64> CWallet::GetAddressBalances()
 
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
-        {
-            CWalletTx *pcoin = &walletEntry.second;
-
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        IndexUnspent();
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe() ? 0 : 1))
-                continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        const CWalletTx* pcoin = NULL;
+        uint256 hashLast = 0;
+        BOOST_FOREACH(const COutPoint& outpoint, setUnspent)
+        {
+            if (outpoint.hash != hashLast)
             {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
+                hashLast = outpoint.hash;
+                pcoin = NULL;
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+                if (mi == mapWallet.end())
                     continue;
-                if (!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
+                const CWalletTx* ptx = &(*mi).second;
+
+                if (!ptx->IsFinal() || !ptx->IsConfirmed())
+                    continue;
+
+                if (ptx->IsCoinBase() && ptx->GetBlocksToMaturity() > 0)
                     continue;
 
-                uint64 n = pcoin->IsSpent(i) ? 0 : pcoin->vout[i].nValue;
+                int nDepth = ptx->GetDepthInMainChain();
+                if (nDepth < (ptx->IsFromMe() ? 0 : 1))
+                    continue;
 
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-                balances[addr] += n;
+                pcoin = ptx;
             }
+            if (!pcoin)
+                continue;
+
+            CTxDestination addr;
+            if (!ExtractDestination(pcoin->vout[outpoint.n].scriptPubKey, addr))
+                continue;
+
+            balances[addr] += pcoin->vout[outpoint.n].nValue;
         }
     }
 
@@ -2097,9 +2490,14 @@ void CWallet::UpdatedTransaction(const uint256 &hashTx)
     {
         LOCK(cs_wallet);
         // Only notify UI if this transaction is in this wallet
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end())
+        {
+            // Its block may have left the main chain
+            if (fTxIndexed)
+                IndexTxHeight((*mi).second, true);
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
+        }
     }
 }
 
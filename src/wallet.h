@@ -26,6 +26,11 @@ class COutput;
 class CCoinControl;
 class CRPCContext;
 
+/** Branch budget for the branch-and-bound search in SelectCoinsMinConf */
+static const unsigned int COIN_SELECTION_MAX_TRIES = 100000;
+/** Wall-clock budget for the same search, in microseconds */
+static const int64 COIN_SELECTION_MAX_MICROS = 100000;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -81,6 +86,26 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Outputs in mapWallet that are ours and not yet spent, ordered by txid so
+    // outputs of one transaction are adjacent. Balances and coin selection
+    // only look at these transactions. Built on first use and dropped by
+    // MarkDirty(); SyncUnspent() keeps it current after each change to a
+    // wallet transaction.
+    mutable std::set<COutPoint> setUnspent;
+    mutable bool fUnspentIndexed;
+
+    // GetBalance/GetUnconfirmedBalance/GetImmatureBalance totals, valid while
+    // the wallet is unchanged and the best chain is still hashBalanceTip
+    mutable bool fBalanceCached;
+    mutable uint256 hashBalanceTip;
+    mutable uint64 nBalanceCached;
+    mutable uint64 nUnconfirmedBalanceCached;
+    mutable uint64 nImmatureBalanceCached;
+
+    void IndexUnspent() const;
+    void SyncUnspent(const uint256& hash);
+    void UpdateBalanceCache() const;
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -102,6 +127,13 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        nRescanStartHeight = nRescanStopHeight = nRescanHeight = 0;
+        fUnspentIndexed = false;
+        fBalanceCached = false;
+        nBalanceCached = nUnconfirmedBalanceCached = nImmatureBalanceCached = 0;
+        fTxIndexed = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -112,6 +144,13 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        nRescanStartHeight = nRescanStopHeight = nRescanHeight = 0;
+        fUnspentIndexed = false;
+        fBalanceCached = false;
+        nBalanceCached = nUnconfirmedBalanceCached = nImmatureBalanceCached = 0;
+        fTxIndexed = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -127,11 +166,19 @@ public:
     int64 nWalletUnlockTime;
     CCriticalSection cs_nWalletUnlockTime;
 
+    // State of a running ScanForWalletTransactions, which holds cs_wallet;
+    // these are read and fAbortRescan set from other threads without it
+    volatile bool fScanningWallet;
+    volatile bool fAbortRescan;
+    volatile int nRescanStartHeight;
+    volatile int nRescanStopHeight;
+    volatile int nRescanHeight;
+
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL);
-    bool SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, uint64& nValueRet);
+    bool SelectCoinsMinConf(uint64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, uint64& nValueRet);
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -167,11 +214,37 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64, TxPair > TxItems;
 
+private:
+    // Wallet transactions and accounting entries (of all accounts) by
+    // nOrderPos, and wallet transactions by the height of their block, so
+    // that listtransactions and listsinceblock only visit what they return.
+    // Built on first use, then kept in step by AddToWallet,
+    // AddAccountingEntry, EraseFromWallet and UpdatedTransaction.
+    bool fTxIndexed;
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+    std::multimap<int, CWalletTx*> mapTxByHeight;
+
+    void IndexTransactions();
+    void IndexTxHeight(CWalletTx& wtx, bool fCheckMainChain);
+    void UnindexTxHeight(CWalletTx& wtx);
+
+public:
     /** Get the wallet's activity log
         @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+        @warning Only valid while cs_wallet is held
+     */
+    const TxItems& OrderedTxItems();
+
+    /** Wallet transactions that may have fewer than (1 + nBestHeight - nHeight)
+        confirmations: those in blocks above nHeight, and those not in the main chain
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    void GetTransactionsAbove(int nHeight, std::vector<const CWalletTx*>& vpwtx);
+
+    bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb);
+
+    // nOrderPos values were rewritten (CWalletDB::ReorderTransactions)
+    void MarkOrderDirty() { fTxIndexed = false; }
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
@@ -179,6 +252,10 @@ public:
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsScanning() const { return fScanningWallet; }
+    // Fraction of the current (or last) rescan's block range already processed
+    double GetRescanProgress() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     uint64 GetBalance() const;
@@ -400,6 +477,7 @@ public:
     mutable uint64 nImmatureCreditCached;
     mutable uint64 nAvailableCreditCached;
     mutable uint64 nChangeCached;
+    int nIndexHeight;   // key of this transaction in CWallet::mapTxByHeight, -1 if none
 
     CWalletTx()
     {
@@ -444,6 +522,7 @@ public:
         nAvailableCreditCached = 0;
         nChangeCached = 0;
         nOrderPos = -1;
+        nIndexHeight = -1;
     }
 
     IMPLEMENT_SERIALIZE